@@ -0,0 +1,175 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <ctime>
+#include "../common/compression.h"
+
+using namespace std;
+
+// Wire-compression benchmark: for each codec built in, measure ratio,
+// encode/decode throughput and CPU cost on a text-like corpus (a file given
+// on the command line, or synthetic log lines) and on random bytes, which the
+// entropy check should pass through raw. The link columns show the raw
+// MB/s a transfer would reach when the codec runs pipelined with the network.
+//
+// Usage: ./codecbench [<file>] [--threads <n>] [--mb <corpus size>]
+
+const int REPEATS = 3;
+const double LINK_MBPS[] = {100.0 / 8, 1000.0 / 8, 10000.0 / 8}; // 100 Mbit, 1 Gbit, 10 Gbit in MB/s
+
+struct Timing {
+    double wallSeconds;
+    double cpuSeconds;
+};
+
+double cpuNow() {
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Best of REPEATS runs, so one noisy run does not skew the table
+template <typename F>
+Timing measure(F body) {
+    Timing best{1e30, 1e30};
+    for (int i = 0; i < REPEATS; i++) {
+        double cpuStart = cpuNow();
+        auto wallStart = chrono::steady_clock::now();
+        body();
+        double wall = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+        double cpu = cpuNow() - cpuStart;
+        if (wall < best.wallSeconds) {
+            best = Timing{wall, cpu};
+        }
+    }
+    return best;
+}
+
+// Log lines with the repetition typical of our text workloads
+vector<char> syntheticLogs(size_t size) {
+    const char* levels[] = {"INFO", "WARN", "ERROR", "DEBUG"};
+    const char* words[] = {"request", "served", "node", "coordinator", "upload", "download", "checksum",
+                           "replica", "latency", "bytes", "client", "session", "part", "range"};
+    mt19937 rng(42);
+    auto pick = [&](unsigned n) { return (unsigned)(rng() % n); };
+    string text;
+    text.reserve(size + 256);
+    while (text.size() < size) {
+        char line[256];
+        int n = snprintf(line, sizeof(line), "2026-10-18T12:%02u:%02u.%03uZ %s [%s] %s %s %s id=%u size=%u\n",
+                         pick(60), pick(60), pick(1000), levels[pick(4)], words[pick(14)],
+                         words[pick(14)], words[pick(14)], words[pick(14)], pick(100000), pick(1048576));
+        text.append(line, n);
+    }
+    return vector<char>(text.begin(), text.begin() + size);
+}
+
+vector<char> randomBytes(size_t size) {
+    mt19937_64 rng(7);
+    vector<char> data(size);
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t value = rng();
+        memcpy(data.data() + i, &value, 8);
+    }
+    return data;
+}
+
+// Share of frames the encoder sent uncompressed
+double rawFrameShare(const vector<char>& wire) {
+    size_t frames = 0, raw = 0, pos = 0;
+    while (pos + FRAME_HEADER_SIZE <= wire.size()) {
+        Codec codec;
+        uint32_t rawLength, length;
+        if (!parseFrameHeader(wire.data() + pos, codec, rawLength, length)) {
+            break;
+        }
+        frames++;
+        raw += (codec == Codec::None);
+        pos += FRAME_HEADER_SIZE + length;
+    }
+    return frames ? 100.0 * raw / frames : 0;
+}
+
+void benchCorpus(const string& name, const vector<char>& data, unsigned threads) {
+    double mb = data.size() / 1e6;
+    vector<Codec> codecs = availableCodecs();
+    codecs.insert(codecs.begin(), Codec::None);
+    
+    for (Codec codec : codecs) {
+        vector<char> wire;
+        Timing encode = measure([&] { wire = encodeFrames(codec, data.data(), data.size(), threads); });
+        
+        vector<char> decoded(data.size());
+        bool ok = true;
+        Timing decode = measure([&] {
+            ok = (codec == Codec::None) ? true : decodeFrames(wire.data(), wire.size(), decoded.data(), decoded.size());
+        });
+        if (codec != Codec::None && (!ok || decoded != data)) {
+            cerr << "Round trip failed for " << codecName(codec) << " on " << name << "\n";
+            exit(1);
+        }
+        
+        double ratio = (double)data.size() / wire.size();
+        double encodeRate = mb / encode.wallSeconds;
+        double decodeRate = codec == Codec::None ? 1e9 : mb / decode.wallSeconds;
+        cout << left << setw(8) << name << setw(6) << codecName(codec) << right << fixed
+             << setw(7) << setprecision(2) << ratio
+             << setw(10) << setprecision(0) << encodeRate
+             << setw(10) << setprecision(2) << encode.cpuSeconds / mb * 1000
+             << setw(10) << setprecision(0) << (codec == Codec::None ? 0 : decodeRate)
+             << setw(10) << setprecision(2) << (codec == Codec::None ? 0 : decode.cpuSeconds / mb * 1000)
+             << setw(8) << setprecision(0) << rawFrameShare(wire) << "%";
+        for (double link : LINK_MBPS) {
+            double effective = min(min(encodeRate, decodeRate), link * ratio);
+            cout << setw(10) << setprecision(0) << effective;
+        }
+        cout << "\n";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    string path;
+    unsigned threads = 1;
+    size_t corpusMb = 32;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        } else if (arg == "--mb" && i + 1 < argc) {
+            corpusMb = max(1, atoi(argv[++i]));
+        } else {
+            path = arg;
+        }
+    }
+    
+    vector<char> text;
+    string textName = "logs";
+    if (!path.empty()) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) {
+            cerr << "Cannot read " << path << "\n";
+            return 1;
+        }
+        text.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        textName = "file";
+    } else {
+        text = syntheticLogs(corpusMb * 1024 * 1024);
+    }
+    
+    if (availableCodecs().empty()) {
+        cout << "No codecs built in (compile with -DDFS_HAVE_LZ4 and/or -DDFS_HAVE_ZSTD)\n";
+    }
+    cout << "frame " << FRAME_RAW_SIZE / 1024 << " KiB, " << threads << " encode thread(s), "
+         << text.size() / (1024 * 1024) << " MiB corpus\n\n";
+    cout << left << setw(8) << "corpus" << setw(6) << "codec" << right << setw(7) << "ratio"
+         << setw(10) << "enc MB/s" << setw(10) << "enc ms/MB" << setw(10) << "dec MB/s" << setw(10) << "dec ms/MB"
+         << setw(9) << "raw" << setw(10) << "@100Mb" << setw(10) << "@1Gb" << setw(10) << "@10Gb" << "\n";
+    
+    benchCorpus(textName, text, threads);
+    benchCorpus("random", randomBytes(text.size()), threads);
+    return 0;
+}
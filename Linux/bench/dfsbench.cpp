@@ -0,0 +1,588 @@
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include "../common/checksum.h"
+#include "../common/compression.h"
+#include "../common/histogram.h"
+#include "../common/partition.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+// End-to-end benchmark: starts a local cluster (coordinator plus N nodes),
+// preloads a set of files, then runs a mix of uploads, downloads and lists
+// from concurrent clients speaking the DFS protocol directly (so process
+// start-up is not part of the latency). Reports throughput and latency
+// percentiles per operation as a table, and optionally as JSON for
+// regression tracking.
+//
+// Usage: ./dfsbench [--nodes <n>] [--coordinators <n>] [--followers <n>] [--ops <n>] [--concurrency <n>] [--files <n>]
+//                   [--mix <read>:<write>:<list>] [--sizes <distribution>]
+//                   [--json <file>] [--seed <n>] [--existing]
+//
+// Size distributions: fixed:<size>, uniform:<min>-<max>, lognormal:<median>:<sigma>
+// (sizes take K and M suffixes; uploads are capped at the coordinator's 10 MB
+// single-stream limit). With --coordinators above 1 the namespace is split
+// over that many partitioned coordinators, and requests are routed by path.
+// With --followers, each coordinator gets that many read-only followers and
+// downloads and lists go to a random one (falling back to the coordinator),
+// so read-heavy mixes show how metadata reads scale with followers.
+
+const int COORDINATOR_PORT = 9000;
+const int NODE_BASE_PORT = 9001;
+const long long MAX_UPLOAD_SIZE = 10 * 1024 * 1024;
+const long long CHUNK_SIZE = 256 * 1024; // resumable upload chunk, as the client sends them
+const int FOLLOWER_BASE_PORT = 8900;     // follower f of partition p listens on FOLLOWER_BASE_PORT - p * MAX_FOLLOWERS - f
+const int MAX_FOLLOWERS = 8;
+
+// Coordinators of the cluster under test, fetched once it is up
+PartitionMap partitions = PartitionMap::uniform(1);
+map<int, vector<int>> followers; // coordinator port → its followers
+
+enum Op { READ, WRITE, LIST, OP_COUNT };
+const char* OP_NAMES[OP_COUNT] = {"download", "upload", "list"};
+
+struct Config {
+    int nodes = 2;
+    int coordinators = 1;
+    int followers = 0;   // per coordinator
+    long long ops = 2000;
+    int concurrency = 8;
+    int files = 64;
+    int mix[OP_COUNT] = {70, 25, 5};
+    string sizes = "lognormal:64K:1.5";
+    string jsonPath;
+    unsigned seed = 1;
+    bool existing = false; // use a cluster that is already running
+};
+
+// Per-thread results, merged at the end
+struct Results {
+    Histogram latencyUs[OP_COUNT];
+    long long bytes[OP_COUNT] = {0, 0, 0};
+    long long errors[OP_COUNT] = {0, 0, 0};
+};
+
+// File sizes drawn from the configured distribution
+struct SizeDistribution {
+    string kind;
+    double a = 0, b = 0;
+    
+    static long long parseSize(const string& text) {
+        double value = atof(text.c_str());
+        char suffix = text.empty() ? 0 : (char)toupper(text.back());
+        if (suffix == 'K') {
+            value *= 1024;
+        } else if (suffix == 'M') {
+            value *= 1024 * 1024;
+        }
+        return (long long)value;
+    }
+    
+    bool parse(const string& spec) {
+        stringstream ss(spec);
+        string field;
+        vector<string> fields;
+        while (getline(ss, field, ':')) {
+            fields.push_back(field);
+        }
+        if (fields.empty()) {
+            return false;
+        }
+        kind = fields[0];
+        if (kind == "fixed" && fields.size() == 2) {
+            a = parseSize(fields[1]);
+        } else if (kind == "uniform" && fields.size() == 2 && fields[1].find('-') != string::npos) {
+            a = parseSize(fields[1].substr(0, fields[1].find('-')));
+            b = parseSize(fields[1].substr(fields[1].find('-') + 1));
+        } else if (kind == "lognormal" && fields.size() == 3) {
+            a = parseSize(fields[1]);
+            b = atof(fields[2].c_str());
+        } else {
+            return false;
+        }
+        return a > 0 && (kind != "uniform" || b >= a);
+    }
+    
+    long long sample(mt19937_64& rng) const {
+        double size = a;
+        if (kind == "uniform") {
+            size = uniform_real_distribution<double>(a, b)(rng);
+        } else if (kind == "lognormal") {
+            size = lognormal_distribution<double>(log(a), b)(rng);
+        }
+        return max(1LL, min(MAX_UPLOAD_SIZE, (long long)size));
+    }
+};
+
+unsigned long calculateChecksum(const char* data, long long size) {
+    return byteSum(data, size);
+}
+
+string recvLine(int sock) {
+    string line;
+    char c;
+    while (recv(sock, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            break;
+        }
+        line += c;
+    }
+    return line;
+}
+
+int connectToPort(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// One resumable upload, as the client sends it: UPLOAD, HAVE 0, then
+// checksummed chunks
+bool uploadOnce(const string& dfsPath, const char* data, long long size, const string& token) {
+    int sock = connectToPort(partitions.portFor(dfsPath));
+    if (sock == -1) {
+        return false;
+    }
+    string cmd = "UPLOAD " + dfsPath + " " + to_string(size) + " " + token + "\n";
+    send(sock, cmd.c_str(), cmd.size(), 0);
+    bool ok = recvLine(sock).find("HAVE 0") == 0;
+    for (long long offset = 0; ok && offset < size; offset += CHUNK_SIZE) {
+        long long chunk = min(CHUNK_SIZE, size - offset);
+        string header = to_string(chunk) + " " + to_string(calculateChecksum(data + offset, chunk)) + "\n";
+        ok = sendAll(sock, header.data(), header.size()) && sendAll(sock, data + offset, chunk);
+    }
+    ok = ok && recvLine(sock).find("STORED") == 0;
+    close(sock);
+    return ok;
+}
+
+// Where to send a read for the coordinator on port: a random follower, then
+// the coordinator itself
+vector<int> readPorts(int port) {
+    static thread_local mt19937 pick(random_device{}());
+    auto it = followers.find(port);
+    if (it == followers.end() || it->second.empty()) {
+        return {port};
+    }
+    return {it->second[pick() % it->second.size()], port};
+}
+
+// One single-stream download through the coordinator on port; returns the
+// bytes received, or -1
+long long downloadFrom(int port, const string& dfsPath, vector<char>& buffer) {
+    int sock = connectToPort(port);
+    if (sock == -1) {
+        return -1;
+    }
+    string cmd = "DOWNLOAD " + dfsPath + "\n";
+    send(sock, cmd.c_str(), cmd.size(), 0);
+    string reply = recvLine(sock);
+    if (reply.find("Node ") == 0) {
+        reply = recvLine(sock); // replica recovery notice
+    }
+    stringstream ss(reply);
+    string ok;
+    long long size = 0;
+    unsigned long checksum = 0;
+    ss >> ok >> size >> checksum;
+    if (ok != "OK" || size <= 0) {
+        close(sock);
+        return -1;
+    }
+    buffer.resize(size);
+    bool received = recvAll(sock, buffer.data(), size);
+    close(sock);
+    return received && calculateChecksum(buffer.data(), size) == checksum ? size : -1;
+}
+
+long long downloadOnce(const string& dfsPath, vector<char>& buffer) {
+    long long size = -1;
+    for (int port : readPorts(partitions.portFor(dfsPath))) {
+        if ((size = downloadFrom(port, dfsPath, buffer)) >= 0) {
+            break;
+        }
+    }
+    return size;
+}
+
+// LIST the coordinator on port; returns the reply size, or -1
+long long listFrom(int port) {
+    int sock = connectToPort(port);
+    if (sock == -1) {
+        return -1;
+    }
+    send(sock, "LIST\n", 5, 0);
+    string reply;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+        reply.append(buffer, n);
+    }
+    close(sock);
+    return reply.find("ERROR") == 0 ? -1 : (long long)reply.size();
+}
+
+// LIST every partition, as the client does
+long long listOnce() {
+    long long total = 0;
+    for (int port : partitions.ports) {
+        long long size = -1;
+        for (int readPort : readPorts(port)) {
+            if ((size = listFrom(readPort)) >= 0) {
+                break;
+            }
+        }
+        if (size < 0) {
+            return -1;
+        }
+        total += size;
+    }
+    return total;
+}
+
+// Wait up to 5 s for something to listen on port
+bool waitForPort(int port) {
+    for (int i = 0; i < 50; i++) {
+        int sock = connectToPort(port);
+        if (sock != -1) {
+            close(sock);
+            return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    return false;
+}
+
+// A cluster of coordinator and node processes started for the run
+struct Cluster {
+    vector<pid_t> pids;
+    string workDir;
+    
+    pid_t spawn(const vector<string>& args, const string& logPath) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            if (chdir(workDir.c_str()) != 0) {
+                _exit(127);
+            }
+            int log = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (log != -1) {
+                dup2(log, STDOUT_FILENO);
+                dup2(log, STDERR_FILENO);
+            }
+            vector<char*> argv;
+            for (const string& arg : args) {
+                argv.push_back((char*)arg.c_str());
+            }
+            argv.push_back(nullptr);
+            execv(argv[0], argv.data());
+            _exit(127);
+        }
+        if (pid > 0) {
+            pids.push_back(pid);
+        }
+        return pid;
+    }
+    
+    bool start(int nodes, int coordinators, int followersEach) {
+        int probe = connectToPort(COORDINATOR_PORT);
+        if (probe != -1) {
+            close(probe);
+            cerr << "A coordinator is already running on port " << COORDINATOR_PORT << " (use --existing)\n";
+            return false;
+        }
+        string binDir = fs::absolute(".").string();
+        workDir = fs::absolute("dfsbench-data").string();
+        error_code ec;
+        fs::remove_all(workDir, ec);
+        fs::create_directories(workDir);
+        
+        PartitionMap map = PartitionMap::uniform(coordinators);
+        for (int p = 0; p < coordinators; p++) {
+            vector<string> args = {binDir + "/coordinator"};
+            if (coordinators > 1) {
+                args.insert(args.end(), {"--partitions", to_string(coordinators), "--partition", to_string(p)});
+            }
+            spawn(args, coordinators > 1 ? "coordinator" + to_string(p) + ".log" : "coordinator.log");
+        }
+        for (int port : map.ports) {
+            if (!waitForPort(port)) {
+                cerr << "Coordinator on port " << port << " did not start (is ./coordinator built?)\n";
+                return false;
+            }
+        }
+        for (int p = 0; p < coordinators; p++) {
+            for (int f = 0; f < followersEach; f++) {
+                int port = FOLLOWER_BASE_PORT - p * MAX_FOLLOWERS - f;
+                spawn({binDir + "/coordinator", "--follow", to_string(map.ports[p]), "--port", to_string(port)},
+                      "follower" + to_string(p) + "-" + to_string(f) + ".log");
+                if (!waitForPort(port)) {
+                    cerr << "Follower on port " << port << " did not start\n";
+                    return false;
+                }
+            }
+        }
+        for (int id = 1; id <= nodes; id++) {
+            spawn({binDir + "/node", to_string(id)}, "node" + to_string(id) + ".log");
+        }
+        // Nodes register before they listen; wait until every node port answers
+        for (int id = 1; id <= nodes; id++) {
+            if (!waitForPort(NODE_BASE_PORT + id)) {
+                cerr << "Node " << id << " did not start\n";
+                return false;
+            }
+        }
+        return true;
+    }
+    
+    void stop() {
+        for (pid_t pid : pids) {
+            kill(pid, SIGTERM);
+        }
+        for (pid_t pid : pids) {
+            waitpid(pid, nullptr, 0);
+        }
+        pids.clear();
+        if (!workDir.empty()) {
+            error_code ec;
+            fs::remove_all(workDir, ec);
+        }
+    }
+};
+
+string filePath(int index) {
+    return "/bench/file" + to_string(index);
+}
+
+void worker(const Config& config, const SizeDistribution& sizes, const vector<char>& payload,
+            atomic<long long>& nextOp, int threadId, Results& results) {
+    mt19937_64 rng(config.seed * 1000003ULL + threadId);
+    int mixTotal = config.mix[READ] + config.mix[WRITE] + config.mix[LIST];
+    vector<char> buffer;
+    long long opIndex;
+    while ((opIndex = nextOp++) < config.ops) {
+        int pick = (int)(rng() % mixTotal);
+        Op op = pick < config.mix[READ] ? READ : (pick < config.mix[READ] + config.mix[WRITE] ? WRITE : LIST);
+        string path = filePath((int)(rng() % config.files));
+        
+        auto start = chrono::steady_clock::now();
+        long long bytes = -1;
+        if (op == READ) {
+            bytes = downloadOnce(path, buffer);
+        } else if (op == WRITE) {
+            long long size = sizes.sample(rng);
+            long long offset = (long long)(rng() % (payload.size() - size + 1));
+            string token = "bench-" + to_string(threadId) + "-" + to_string(opIndex);
+            bytes = uploadOnce(path, payload.data() + offset, size, token) ? size : -1;
+        } else {
+            bytes = listOnce();
+        }
+        auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+        
+        if (bytes < 0) {
+            results.errors[op]++;
+            continue;
+        }
+        results.latencyUs[op].record((uint64_t)elapsed);
+        results.bytes[op] += bytes;
+    }
+}
+
+string jsonStats(const Histogram& latency, long long bytes, long long errors, double seconds) {
+    stringstream json;
+    json << fixed << setprecision(3);
+    json << "{\"ops\": " << latency.count() << ", \"errors\": " << errors
+         << ", \"ops_per_sec\": " << latency.count() / seconds
+         << ", \"mb_per_sec\": " << bytes / 1048576.0 / seconds
+         << ", \"latency_ms\": {\"min\": " << latency.min() / 1000.0 << ", \"mean\": " << latency.mean() / 1000.0
+         << ", \"p50\": " << latency.percentile(0.50) / 1000.0 << ", \"p99\": " << latency.percentile(0.99) / 1000.0
+         << ", \"p999\": " << latency.percentile(0.999) / 1000.0 << ", \"max\": " << latency.max() / 1000.0 << "}}";
+    return json.str();
+}
+
+int main(int argc, char* argv[]) {
+    Config config;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        string value = i + 1 < argc ? argv[i + 1] : "";
+        if (arg == "--existing") {
+            config.existing = true;
+            continue;
+        }
+        if (value.empty()) {
+            cerr << "Missing value for " << arg << "\n";
+            return 1;
+        }
+        i++;
+        if (arg == "--nodes") {
+            config.nodes = atoi(value.c_str());
+        } else if (arg == "--coordinators") {
+            config.coordinators = atoi(value.c_str());
+        } else if (arg == "--followers") {
+            config.followers = atoi(value.c_str());
+        } else if (arg == "--ops") {
+            config.ops = atoll(value.c_str());
+        } else if (arg == "--concurrency") {
+            config.concurrency = atoi(value.c_str());
+        } else if (arg == "--files") {
+            config.files = atoi(value.c_str());
+        } else if (arg == "--mix") {
+            char sep;
+            stringstream ss(value);
+            if (!(ss >> config.mix[READ] >> sep >> config.mix[WRITE] >> sep >> config.mix[LIST])) {
+                cerr << "--mix expects <read>:<write>:<list>\n";
+                return 1;
+            }
+        } else if (arg == "--sizes") {
+            config.sizes = value;
+        } else if (arg == "--json") {
+            config.jsonPath = value;
+        } else if (arg == "--seed") {
+            config.seed = (unsigned)atoi(value.c_str());
+        } else {
+            cerr << "Unknown option " << arg << "\n";
+            return 1;
+        }
+    }
+    
+    SizeDistribution sizes;
+    if (!sizes.parse(config.sizes)) {
+        cerr << "Bad --sizes (fixed:<size>, uniform:<min>-<max>, lognormal:<median>:<sigma>)\n";
+        return 1;
+    }
+    if (config.nodes < 2 || config.coordinators < 1 || config.coordinators > MAX_PARTITIONS ||
+        config.followers < 0 || config.followers > MAX_FOLLOWERS || config.ops < 1 || config.concurrency < 1 || config.files < 1 ||
+        config.mix[READ] < 0 || config.mix[WRITE] < 0 || config.mix[LIST] < 0 ||
+        config.mix[READ] + config.mix[WRITE] + config.mix[LIST] == 0) {
+        cerr << "Invalid configuration (need at least 2 nodes, 1 to " << MAX_PARTITIONS << " coordinators, 0 to "
+             << MAX_FOLLOWERS << " followers each, 1 op, 1 client, 1 file and a non-empty mix)\n";
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    Cluster cluster;
+    if (!config.existing && !cluster.start(config.nodes, config.coordinators, config.followers)) {
+        cluster.stop();
+        return 1;
+    }
+    partitions = requestPartitionMap("127.0.0.1", COORDINATOR_PORT);
+    int followerCount = 0;
+    for (int port : partitions.ports) {
+        followers[port] = requestFollowers("127.0.0.1", port);
+        followerCount += followers[port].size();
+    }
+    
+    // Incompressible payload; each upload sends a slice of it
+    vector<char> payload(MAX_UPLOAD_SIZE * 2);
+    mt19937_64 dataRng(config.seed);
+    for (size_t i = 0; i + 8 <= payload.size(); i += 8) {
+        uint64_t word = dataRng();
+        memcpy(payload.data() + i, &word, 8);
+    }
+    
+    // Preload the working set so reads have something to fetch
+    mt19937_64 preloadRng(config.seed ^ 0x5eed);
+    for (int i = 0; i < config.files; i++) {
+        long long size = sizes.sample(preloadRng);
+        if (!uploadOnce(filePath(i), payload.data(), size, "preload-" + to_string(i))) {
+            cerr << "Preload upload failed for " << filePath(i) << "\n";
+            cluster.stop();
+            return 1;
+        }
+    }
+    
+    vector<Results> results(config.concurrency);
+    atomic<long long> nextOp{0};
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < config.concurrency; t++) {
+        threads.emplace_back(worker, cref(config), cref(sizes), cref(payload), ref(nextOp), t, ref(results[t]));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cluster.stop();
+    
+    Results merged;
+    Histogram all;
+    long long allBytes = 0, allErrors = 0;
+    for (const Results& r : results) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            merged.latencyUs[op].merge(r.latencyUs[op]);
+            merged.bytes[op] += r.bytes[op];
+            merged.errors[op] += r.errors[op];
+        }
+    }
+    for (int op = 0; op < OP_COUNT; op++) {
+        all.merge(merged.latencyUs[op]);
+        allBytes += merged.bytes[op];
+        allErrors += merged.errors[op];
+    }
+    
+    cout << config.nodes << " nodes, " << partitions.count() << " coordinators, " << followerCount << " followers, " << config.concurrency << " clients, " << config.ops << " ops, "
+         << config.files << " files, mix " << config.mix[READ] << ":" << config.mix[WRITE] << ":" << config.mix[LIST]
+         << " (read:write:list), sizes " << config.sizes << ", " << fixed << setprecision(2) << seconds << " s\n\n";
+    cout << left << setw(10) << "op" << right << setw(8) << "ops" << setw(8) << "errors" << setw(10) << "ops/s"
+         << setw(10) << "MB/s" << setw(10) << "p50 ms" << setw(10) << "p99 ms" << setw(10) << "p999 ms"
+         << setw(10) << "max ms" << "\n";
+    auto row = [&](const string& name, const Histogram& latency, long long bytes, long long errors) {
+        cout << left << setw(10) << name << right << setw(8) << latency.count() << setw(8) << errors
+             << setw(10) << setprecision(1) << latency.count() / seconds
+             << setw(10) << setprecision(2) << bytes / 1048576.0 / seconds
+             << setw(10) << setprecision(3) << latency.percentile(0.50) / 1000.0
+             << setw(10) << latency.percentile(0.99) / 1000.0
+             << setw(10) << latency.percentile(0.999) / 1000.0
+             << setw(10) << latency.max() / 1000.0 << "\n";
+    };
+    for (int op = 0; op < OP_COUNT; op++) {
+        row(OP_NAMES[op], merged.latencyUs[op], merged.bytes[op], merged.errors[op]);
+    }
+    row("total", all, allBytes, allErrors);
+    
+    if (!config.jsonPath.empty()) {
+        ofstream json(config.jsonPath);
+        json << "{\n  \"config\": {\"nodes\": " << config.nodes << ", \"coordinators\": " << partitions.count() << ", \"followers\": " << followerCount << ", \"concurrency\": " << config.concurrency
+             << ", \"ops\": " << config.ops << ", \"files\": " << config.files << ", \"mix\": [" << config.mix[READ]
+             << ", " << config.mix[WRITE] << ", " << config.mix[LIST] << "], \"sizes\": \"" << config.sizes
+             << "\", \"seed\": " << config.seed << "},\n";
+        json << "  \"seconds\": " << fixed << setprecision(3) << seconds << ",\n  \"results\": {\n";
+        for (int op = 0; op < OP_COUNT; op++) {
+            json << "    \"" << OP_NAMES[op] << "\": " << jsonStats(merged.latencyUs[op], merged.bytes[op], merged.errors[op], seconds) << ",\n";
+        }
+        json << "    \"total\": " << jsonStats(all, allBytes, allErrors, seconds) << "\n  }\n}\n";
+        if (!json) {
+            cerr << "Cannot write " << config.jsonPath << "\n";
+            return 1;
+        }
+        cout << "\nJSON written to " << config.jsonPath << "\n";
+    }
+    return allErrors > 0 ? 2 : 0;
+}
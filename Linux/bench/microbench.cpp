@@ -0,0 +1,377 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <chrono>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "../common/checksum.h"
+#include "../common/compression.h"
+
+using namespace std;
+
+// Microbenchmarks for the per-request kernels inside the binaries: the
+// checksum, request-line parsing, fileTable lookups and the buffers that
+// STORE and GET allocate. Each kernel is a copy of the code it measures
+// (the binaries are single translation units), so keep them in sync when
+// the originals change. Reports cycles per op and per byte (TSC, which runs
+// at a constant rate on current x86 rather than the core clock) and heap
+// allocations per op.
+//
+// Usage: ./microbench [--filter <substring>] [--ms <time per benchmark>]
+
+const int REPEATS = 3;
+const int CHECKSUM_BLOCK_SIZE = 64 * 1024;
+
+// Every operator new in the process is counted, so allocations per op
+// include whatever the standard library allocates on the kernel's behalf
+unsigned long long allocationCount = 0;
+
+void* operator new(size_t size) {
+    allocationCount++;
+    if (void* p = malloc(size ? size : 1)) {
+        return p;
+    }
+    throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char* TICK_UNIT = "cycles";
+
+inline uint64_t ticks() {
+    return __rdtsc();
+}
+#else
+const char* TICK_UNIT = "ns";
+
+inline uint64_t ticks() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+#endif
+
+// Keep the compiler from discarding a result or eliding an allocation
+template <typename T>
+inline void keep(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// ---- Kernels, as in the binaries ----
+
+// The byte-at-a-time loop the binaries used before common/checksum.h, kept
+// as the baseline for the vectorized one
+unsigned long scalarChecksum(const char* data, int size) {
+    unsigned long sum = 0;
+    for (int i = 0; i < size; i++) {
+        sum += (unsigned char)data[i];
+    }
+    return sum;
+}
+
+// node.cpp / coordinator.cpp
+unsigned long calculateChecksum(const char* data, int size) {
+    return byteSum(data, size);
+}
+
+// node.cpp: the checksum handleStore verifies, kept per block for ranged reads
+void computeBlockSums(const char* data, int size, vector<unsigned long>& blockSums, unsigned long& checksum) {
+    blockSums.clear();
+    blockByteSums(data, size, CHECKSUM_BLOCK_SIZE, blockSums);
+    checksum = 0;
+    for (unsigned long blockSum : blockSums) {
+        checksum += blockSum;
+    }
+}
+
+// coordinator.cpp
+struct FileEntry {
+    string filename;
+    int node1;
+    int node2;
+    unsigned long checksum;
+    long long size;
+    int version;
+    vector<string> blockHashes;
+};
+
+// The coordinator's dispatch tests each command in turn
+const char* COORDINATOR_COMMANDS[] = {"REGISTER", "UPLOAD", "DEDUP_PUT", "DELTA_PUT", "DOWNLOAD", "MPU_BEGIN",
+                                      "MPU_PART", "MPU_COMPLETE", "MPU_STATUS", "MPU_ABORT", "LOCATE", "LIST"};
+
+int dispatchIndex(const string& cmd) {
+    int index = 0;
+    for (const char* command : COORDINATOR_COMMANDS) {
+        if (cmd.find(command) == 0) {
+            return index;
+        }
+        index++;
+    }
+    return -1;
+}
+
+// ---- Harness ----
+
+struct Benchmark {
+    string name;
+    long long bytes; // bytes processed per op, 0 when per-byte cost means nothing
+    function<void()> body;
+    function<void()> setup = [] {}; // run once before timing, only if the benchmark is selected
+};
+
+struct Result {
+    long long iterations;
+    double ticksPerOp;
+    double nsPerOp;
+    double allocationsPerOp;
+};
+
+// Grow the iteration count until a run takes the time budget, then report
+// the best of REPEATS runs
+Result run(const Benchmark& bench, double budgetMs) {
+    bench.setup();
+    bench.body(); // warm caches and lazily built state
+    long long iterations = 1;
+    while (true) {
+        auto start = chrono::steady_clock::now();
+        for (long long i = 0; i < iterations; i++) {
+            bench.body();
+        }
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (ms >= budgetMs / REPEATS || iterations >= (1LL << 40)) {
+            break;
+        }
+        iterations = ms < 1 ? iterations * 10 : (long long)(iterations * (budgetMs / REPEATS) / ms) + 1;
+    }
+    
+    Result best{iterations, 1e30, 1e30, 0};
+    for (int r = 0; r < REPEATS; r++) {
+        unsigned long long allocationsBefore = allocationCount;
+        auto start = chrono::steady_clock::now();
+        uint64_t tickStart = ticks();
+        for (long long i = 0; i < iterations; i++) {
+            bench.body();
+        }
+        uint64_t tickEnd = ticks();
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        double allocations = (double)(allocationCount - allocationsBefore) / iterations;
+        if ((double)(tickEnd - tickStart) / iterations < best.ticksPerOp) {
+            best = Result{iterations, (double)(tickEnd - tickStart) / iterations, ns / iterations, allocations};
+        }
+    }
+    return best;
+}
+
+string sizeLabel(long long size) {
+    if (size >= 1024 * 1024 && size % (1024 * 1024) == 0) {
+        return to_string(size / (1024 * 1024)) + "M";
+    }
+    if (size >= 1024 && size % 1024 == 0) {
+        return to_string(size / 1024) + "K";
+    }
+    return to_string(size);
+}
+
+vector<char> randomBytes(size_t size) {
+    mt19937_64 rng(7);
+    vector<char> data(size);
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t value = rng();
+        memcpy(data.data() + i, &value, 8);
+    }
+    return data;
+}
+
+// A fileTable of the given size and lookup keys in random order
+struct Table {
+    map<string, FileEntry> files;
+    vector<string> hits;
+    vector<string> misses;
+    size_t next = 0;
+    
+    void fill(int entries) {
+        if (!files.empty()) {
+            return;
+        }
+        mt19937 rng(11);
+        for (int i = 0; i < entries; i++) {
+            string path = "/projects/team" + to_string(i % 97) + "/data/file" + to_string(i) + ".bin";
+            files[path] = FileEntry{path.substr(path.rfind('/') + 1), i % 4 + 1, (i + 1) % 4 + 1,
+                                    (unsigned long)rng(), (long long)(rng() % 10000000), 1, {}};
+            hits.push_back(path);
+            misses.push_back("/projects/team" + to_string(i % 97) + "/data/missing" + to_string(i) + ".bin");
+        }
+        shuffle(hits.begin(), hits.end(), rng);
+    }
+    
+    size_t nextIndex() {
+        size_t index = next;
+        next = next + 1 == hits.size() ? 0 : next + 1;
+        return index;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    string filter;
+    double budgetMs = 300;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--ms" && i + 1 < argc) {
+            budgetMs = max(1.0, atof(argv[++i]));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--filter <substring>] [--ms <time per benchmark>]\n";
+            return 1;
+        }
+    }
+    
+    const vector<long long> sizes = {64, 4 * 1024, 64 * 1024, 1024 * 1024, 16 * 1024 * 1024};
+    vector<char> data = randomBytes(sizes.back());
+    vector<Benchmark> benches;
+    
+    // Checksum over cache-resident to memory-sized inputs
+    for (long long size : sizes) {
+        benches.push_back({"checksum/" + sizeLabel(size), size, [&data, size] {
+            keep(calculateChecksum(data.data(), (int)size));
+        }});
+    }
+    for (long long size : sizes) {
+        benches.push_back({"checksum-scalar/" + sizeLabel(size), size, [&data, size] {
+            keep(scalarChecksum(data.data(), (int)size));
+        }});
+    }
+    for (long long size : sizes) {
+        if (size < CHECKSUM_BLOCK_SIZE) {
+            continue;
+        }
+        benches.push_back({"blocksums/" + sizeLabel(size), size, [&data, size] {
+            vector<unsigned long> blockSums;
+            unsigned long checksum;
+            computeBlockSums(data.data(), (int)size, blockSums, checksum);
+            keep(checksum);
+        }});
+    }
+    
+    // Request lines as they arrive at the node and the coordinator
+    const string storeLine = "STORE /projects/team7/data/file12345.bin 1048576 133693440 3 CODEC=zstd";
+    const string getLine = "GET /projects/team7/data/file12345.bin 65536 65536 CODECS=zstd,lz4";
+    const string downloadLine = "DOWNLOAD /projects/team7/data/file12345.bin 0 65536 CODECS=zstd,lz4";
+    const string listLine = "LIST";
+    benches.push_back({"parse/node-STORE", (long long)storeLine.size(), [&storeLine] {
+        stringstream ss(storeLine);
+        string command, dfsPath;
+        int fileSize = 0;
+        unsigned long checksum = 0;
+        int version = 0;
+        ss >> command >> dfsPath >> fileSize >> checksum >> version;
+        keep(fileSize);
+        keep(parseCodecReply(storeLine));
+    }});
+    benches.push_back({"parse/node-GET", (long long)getLine.size(), [&getLine] {
+        stringstream ss(getLine);
+        string command, dfsPath;
+        long long offset = 0, length = -1;
+        ss >> command >> dfsPath >> offset >> length;
+        keep(length);
+        vector<Codec> offered = parseCodecOffer(getLine);
+        keep(offered.size());
+    }});
+    benches.push_back({"parse/coord-DOWNLOAD", (long long)downloadLine.size(), [&downloadLine] {
+        keep(dispatchIndex(downloadLine));
+        stringstream ss(downloadLine);
+        string download, dfsPath;
+        long long offset = 0, length = -1;
+        ss >> download >> dfsPath >> offset >> length;
+        keep(length);
+        vector<Codec> offered = parseCodecOffer(downloadLine);
+        keep(offered.size());
+    }});
+    benches.push_back({"parse/coord-dispatch-LIST", (long long)listLine.size(), [&listLine] {
+        keep(dispatchIndex(listLine));
+    }});
+    
+    // fileTable lookups: a bare find, a miss, and handleLocate's find, then
+    // operator[] and a copy of the entry
+    for (int entries : {1000, 64000, 256000}) {
+        auto table = make_shared<Table>();
+        auto fill = [table, entries] { table->fill(entries); };
+        string label = entries % 1000 == 0 ? to_string(entries / 1000) + "k" : to_string(entries);
+        benches.push_back({"lookup/find/" + label, 0, [table] {
+            keep(table->files.find(table->hits[table->nextIndex()]) != table->files.end());
+        }, fill});
+        benches.push_back({"lookup/miss/" + label, 0, [table] {
+            keep(table->files.find(table->misses[table->nextIndex()]) != table->files.end());
+        }, fill});
+        benches.push_back({"lookup/locate/" + label, 0, [table] {
+            const string& dfsPath = table->hits[table->nextIndex()];
+            if (table->files.find(dfsPath) != table->files.end()) {
+                FileEntry entry = table->files[dfsPath];
+                keep(entry.size);
+            }
+        }, fill});
+    }
+    
+    // Buffers: handleStore allocates the whole object and fills it from the
+    // socket (every page is touched); handleGet builds its header with
+    // string concatenation and, for framed objects, a zeroed batch buffer
+    for (long long size : sizes) {
+        benches.push_back({"alloc/store/" + sizeLabel(size), size, [size] {
+            char* fileData = new char[size];
+            for (long long offset = 0; offset < size; offset += 4096) {
+                fileData[offset] = 1;
+            }
+            keep(fileData);
+            delete[] fileData;
+        }});
+    }
+    benches.push_back({"alloc/get-batch", (long long)(FRAME_RAW_SIZE * FRAME_BATCH), [] {
+        vector<char> batch(FRAME_RAW_SIZE * FRAME_BATCH);
+        keep(batch.data());
+    }});
+    benches.push_back({"alloc/get-header", 0, [] {
+        long long length = 1048576;
+        unsigned long checksum = 133693440;
+        string header = to_string(length) + "\n" + to_string(checksum) + "\n";
+        header += "CODEC=" + string(codecName(Codec::None)) + "\n";
+        keep(header.size());
+    }});
+    
+    cout << "time per benchmark " << budgetMs << " ms, best of " << REPEATS << ", " << TICK_UNIT << " from "
+         << (string(TICK_UNIT) == "cycles" ? "rdtsc" : "steady_clock") << "\n\n";
+    cout << left << setw(28) << "benchmark" << right << setw(10) << "bytes" << setw(14) << "iterations"
+         << setw(14) << (string(TICK_UNIT) + "/op") << setw(12) << (string(TICK_UNIT) + "/B")
+         << setw(12) << "ns/op" << setw(10) << "GB/s" << setw(12) << "allocs/op" << "\n";
+    for (const Benchmark& bench : benches) {
+        if (!filter.empty() && bench.name.find(filter) == string::npos) {
+            continue;
+        }
+        Result result = run(bench, budgetMs);
+        cout << left << setw(28) << bench.name << right << setw(10) << (bench.bytes ? sizeLabel(bench.bytes) : "-")
+             << setw(14) << result.iterations << fixed << setw(14) << setprecision(1) << result.ticksPerOp;
+        if (bench.bytes) {
+            cout << setw(12) << setprecision(3) << result.ticksPerOp / bench.bytes << setw(12) << setprecision(1)
+                 << result.nsPerOp << setw(10) << setprecision(2) << bench.bytes / result.nsPerOp;
+        } else {
+            cout << setw(12) << "-" << setw(12) << setprecision(1) << result.nsPerOp << setw(10) << "-";
+        }
+        cout << setw(12) << setprecision(2) << result.allocationsPerOp << "\n";
+    }
+    return 0;
+}
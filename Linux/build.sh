@@ -2,6 +2,7 @@
 
 # Build script for Linux DFS
 # Usage: ./build.sh
+# Optional compression codecs: LZ4=1 ZSTD=1 ./build.sh
 
 echo "Building Distributed File System for Linux..."
 echo ""
@@ -13,9 +14,21 @@ if ! command -v g++ &> /dev/null; then
     exit 1
 fi
 
+# Optional codecs
+CODEC_FLAGS=""
+CODEC_LIBS=""
+if [ "$LZ4" = "1" ]; then
+    CODEC_FLAGS="$CODEC_FLAGS -DDFS_HAVE_LZ4"
+    CODEC_LIBS="$CODEC_LIBS -llz4"
+fi
+if [ "$ZSTD" = "1" ]; then
+    CODEC_FLAGS="$CODEC_FLAGS -DDFS_HAVE_ZSTD"
+    CODEC_LIBS="$CODEC_LIBS -lzstd"
+fi
+
 # Build coordinator
 echo "Building coordinator..."
-g++ -std=c++17 coordinator/coordinator.cpp -o coordinator
+g++ -std=c++17 -pthread $CODEC_FLAGS coordinator/coordinator.cpp -o coordinator $CODEC_LIBS
 if [ $? -ne 0 ]; then
     echo "ERROR: Failed to build coordinator"
     exit 1
@@ -23,7 +36,7 @@ fi
 
 # Build node
 echo "Building node..."
-g++ -std=c++17 node/node.cpp -o node
+g++ -std=c++17 -pthread $CODEC_FLAGS node/node.cpp -o node $CODEC_LIBS
 if [ $? -ne 0 ]; then
     echo "ERROR: Failed to build node"
     exit 1
@@ -31,7 +44,7 @@ fi
 
 # Build client
 echo "Building client..."
-g++ -std=c++17 client/client.cpp -o client
+g++ -std=c++17 -pthread $CODEC_FLAGS client/client.cpp -o client $CODEC_LIBS
 if [ $? -ne 0 ]; then
     echo "ERROR: Failed to build client"
     exit 1
@@ -1,20 +1,83 @@
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <signal.h>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <filesystem>
+#include <fcntl.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <chrono>
+#include <iomanip>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include "../common/bufferpool.h"
+#include "../common/checksum.h"
+#include "../common/compression.h"
+#include "../common/dedup.h"
+#include "../common/delta.h"
+#include "../common/partition.h"
+#include "../common/trace.h"
+#include <sys/stat.h>
 
 using namespace std;
 namespace fs = std::filesystem;
 
 const int COORDINATOR_PORT = 9000;
+const int NODE_BASE_PORT = 9001;
+const long long STRIPE_THRESHOLD = 2 * 1024 * 1024; // smaller files use one stream via the coordinator
+const long long STRIPE_CHUNK_SIZE = 1024 * 1024;
+const int DEFAULT_MAX_STREAMS = 8;
+const long long STREAM_BUFFER_SIZE = 256 * 1024; // single-stream downloads write through a buffer this size
+const long long MULTIPART_THRESHOLD = 8 * 1024 * 1024; // larger uploads are sent in parts
+const long long MULTIPART_PART_SIZE = 4 * 1024 * 1024;
+const int DEFAULT_UPLOAD_STREAMS = 4;
+const int MAX_PART_ATTEMPTS = 3;
+const long long RESUME_CHUNK_SIZE = 256 * 1024; // unit of progress the coordinator acknowledges
+const int MAX_RESUME_ATTEMPTS = 5;
+const long long MAX_DELTA_SIZE = 10 * 1024 * 1024; // the coordinator's limit for one request
 
-// Connect to coordinator
-int connectToCoordinator() {
+// Codecs offered for transfers, in order of preference (--codec narrows it)
+vector<Codec> codecPreference = availableCodecs();
+
+// Trace of this run (--trace), which worker threads join; 0 when not tracing
+uint64_t clientTrace = 0;
+
+// Progress notes during a transfer; cat sends them to stderr so stdout
+// carries only file data
+ostream* statusOut = &cout;
+
+// Calculate checksum (vectorized, see common/checksum.h)
+unsigned long calculateChecksum(const char* data, long long size) {
+    return byteSum(data, size);
+}
+
+// Read one '\n'-terminated line so payload bytes that follow stay in the socket
+string recvLine(int sock) {
+    string line;
+    char c;
+    while (recv(sock, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            break;
+        }
+        line += c;
+    }
+    return line;
+}
+
+// Connect to a local DFS process
+int connectToPort(int port) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
         return -1;
@@ -22,7 +85,7 @@ int connectToCoordinator() {
     
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(COORDINATOR_PORT);
+    addr.sin_port = htons(port);
     inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
     
     if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
@@ -33,194 +96,1323 @@ int connectToCoordinator() {
     return sock;
 }
 
-// Upload file
-void uploadFile(const string& localPath, const string& dfsPath) {
-    if (!fs::exists(localPath)) {
-        cerr << "Error: Local file not found: " << localPath << "\n";
-        return;
+// Coordinators of the cluster, asked for once per run
+const PartitionMap& partitionMap() {
+    static PartitionMap map = requestPartitionMap("127.0.0.1", COORDINATOR_PORT);
+    return map;
+}
+
+// Connect to the coordinator that owns dfsPath
+int connectToCoordinator(const string& dfsPath) {
+    return connectToPort(partitionMap().portFor(dfsPath));
+}
+
+// Where to send a read (LOCATE, DOWNLOAD, LIST) meant for the coordinator
+// on port: one of its followers picked at random, then the coordinator
+// itself as the fallback. Followers are asked for once per run.
+vector<int> readPorts(int port) {
+    static mutex followersMutex;
+    static unordered_map<int, vector<int>> followers;
+    static mt19937 pick(random_device{}());
+    lock_guard<mutex> lock(followersMutex);
+    auto it = followers.find(port);
+    if (it == followers.end()) {
+        it = followers.emplace(port, requestFollowers("127.0.0.1", port)).first;
+    }
+    if (it->second.empty()) {
+        return {port};
+    }
+    return {it->second[pick() % it->second.size()], port};
+}
+
+// Send a request line, tagged with the trace id when tracing
+void sendRequest(int sock, const string& cmd) {
+    string line = traced(cmd);
+    send(sock, line.c_str(), line.size(), 0);
+}
+
+// Where a file lives, as reported by the coordinator's LOCATE command
+struct FileLocation {
+    long long size;
+    unsigned long checksum;
+    int version;
+    vector<int> nodes; // alive replicas
+};
+
+bool locateFile(const string& dfsPath, FileLocation& location, string& error) {
+    TraceSpan span("LOCATE");
+    string response;
+    for (int port : readPorts(partitionMap().portFor(dfsPath))) {
+        int sock = connectToPort(port);
+        if (sock == -1) {
+            error = "Cannot connect to coordinator";
+            continue;
+        }
+        
+        string cmd = "LOCATE " + dfsPath + "\n";
+        sendRequest(sock, cmd);
+        response = recvLine(sock);
+        close(sock);
+        if (response.find("OK") == 0) {
+            break;
+        }
+    }
+    
+    // "OK <size> <checksum> <version> <nodeId>..."
+    stringstream ss(response);
+    string ok;
+    ss >> ok >> location.size >> location.checksum >> location.version;
+    if (ok != "OK" || !ss) {
+        error = response.empty() ? error : response;
+        return false;
+    }
+    location.nodes.clear();
+    int nodeId;
+    while (ss >> nodeId) {
+        location.nodes.push_back(nodeId);
+    }
+    return !location.nodes.empty();
+}
+
+// Fetch [offset, offset + length) directly from a storage node and check it
+// against the range checksum the node reports
+bool fetchRange(int nodeId, const string& dfsPath, long long offset, long long length, vector<char>& buffer, unsigned long& checksum) {
+    TraceSpan span("GET range");
+    span.setArg("node", nodeId);
+    int sock = connectToPort(NODE_BASE_PORT + nodeId);
+    if (sock == -1) {
+        return false;
+    }
+    
+    string offer = codecOffer(codecPreference);
+    string cmd = "GET " + dfsPath + " " + to_string(offset) + " " + to_string(length) + offer + "\n";
+    sendRequest(sock, cmd);
+    
+    long long received = atoll(recvLine(sock).c_str());
+    checksum = strtoul(recvLine(sock).c_str(), NULL, 10);
+    if (received != length) {
+        close(sock);
+        return false;
+    }
+    Codec codec = offer.empty() ? Codec::None : parseCodecReply(recvLine(sock));
+    
+    buffer.resize(length);
+    if (!recvPayload(sock, codec, buffer.data(), length)) {
+        close(sock);
+        return false;
+    }
+    close(sock);
+    
+    return calculateChecksum(buffer.data(), length) == checksum;
+}
+
+// Shared state of one striped download
+struct StripedDownload {
+    string dfsPath;
+    FileLocation location;
+    int fd;
+    int metaFd;                     // .dfspart.meta, one line appended per verified chunk
+    long long chunkCount;
+    vector<long long> pendingChunks; // chunks not already on disk from an earlier run
+    
+    atomic<long long> nextChunk{0}; // index into pendingChunks
+    atomic<long long> chunksDone{0};
+    atomic<long long> bytesDone{0};
+    atomic<unsigned long> checksumSum{0};
+    atomic<int> streamLimit{0};
+    atomic<bool> failed{false};
+    
+    mutex retryMutex;
+    vector<long long> retryChunks;
+    vector<int> attempts;           // per chunk, guarded by retryMutex
+    vector<atomic<bool>>* healthy;  // per replica, cleared after an error
+};
+
+// One download stream. Stream i starts on replica i % replicas so the load is
+// spread over every copy; a failed chunk is requeued and tried elsewhere.
+void stripeWorker(StripedDownload* job, int streamIndex) {
+    currentTrace() = clientTrace;
+    const vector<int>& nodes = job->location.nodes;
+    size_t replica = streamIndex % nodes.size();
+    vector<char> buffer;
+    
+    while (!job->failed && streamIndex < job->streamLimit) {
+        long long chunk = -1;
+        {
+            lock_guard<mutex> lock(job->retryMutex);
+            if (!job->retryChunks.empty()) {
+                chunk = job->retryChunks.back();
+                job->retryChunks.pop_back();
+            }
+        }
+        if (chunk == -1) {
+            long long index = job->nextChunk++;
+            if (index >= (long long)job->pendingChunks.size()) {
+                return;
+            }
+            chunk = job->pendingChunks[index];
+        }
+        
+        // Skip replicas that already failed while any healthy one is left
+        for (size_t i = 0; i < nodes.size() && !(*job->healthy)[replica]; i++) {
+            replica = (replica + 1) % nodes.size();
+        }
+        
+        long long offset = chunk * STRIPE_CHUNK_SIZE;
+        long long length = min(STRIPE_CHUNK_SIZE, job->location.size - offset);
+        unsigned long checksum = 0;
+        bool ok = fetchRange(nodes[replica], job->dfsPath, offset, length, buffer, checksum);
+        
+        long long written = 0;
+        while (ok && written < length) {
+            ssize_t n = pwrite(job->fd, buffer.data() + written, length - written, offset + written);
+            if (n <= 0) {
+                job->failed = true;
+                return;
+            }
+            written += n;
+        }
+        
+        if (ok) {
+            job->checksumSum += checksum;
+            job->bytesDone += length;
+            job->chunksDone++;
+            string record = to_string(chunk) + " " + to_string(checksum) + "\n";
+            lock_guard<mutex> lock(job->retryMutex);
+            if (write(job->metaFd, record.c_str(), record.size()) != (ssize_t)record.size()) {
+                job->failed = true;
+            }
+            continue;
+        }
+        
+        (*job->healthy)[replica] = false;
+        replica = (replica + 1) % nodes.size();
+        lock_guard<mutex> lock(job->retryMutex);
+        if (++job->attempts[chunk] > (int)nodes.size() * 2) {
+            job->failed = true;
+            return;
+        }
+        job->retryChunks.push_back(chunk);
+    }
+}
+
+// Load the chunks an interrupted striped download already verified. The meta
+// file starts with "size checksum version chunkSize" and must match the file
+// being downloaded now; each following "chunk checksum" line is one chunk
+// already written to the .dfspart file.
+bool loadPartialDownload(const string& metaPath, const FileLocation& location, vector<bool>& done, unsigned long& checksumSum) {
+    ifstream metaFile(metaPath);
+    long long size = 0, chunkSize = 0;
+    unsigned long checksum = 0;
+    int version = 0;
+    if (!(metaFile >> size >> checksum >> version >> chunkSize) || size != location.size ||
+        checksum != location.checksum || version != location.version || chunkSize != STRIPE_CHUNK_SIZE) {
+        return false;
+    }
+    
+    long long chunk;
+    unsigned long chunkChecksum;
+    while (metaFile >> chunk >> chunkChecksum) {
+        if (chunk >= 0 && chunk < (long long)done.size() && !done[chunk]) {
+            done[chunk] = true;
+            checksumSum += chunkChecksum;
+        }
+    }
+    return true;
+}
+
+// Download a large file in STRIPE_CHUNK_SIZE ranges fetched concurrently from
+// every alive replica and written in place with pwrite. Streams start at one
+// per replica and are added while throughput keeps improving, up to maxStreams.
+// Data goes to <localPath>.dfspart and progress to <localPath>.dfspart.meta;
+// an interrupted download of the same version picks up from the verified
+// chunks, and the part file is renamed into place only once it is complete.
+bool downloadStriped(const string& dfsPath, const string& localPath, const FileLocation& location, int maxStreams) {
+    string partPath = localPath + ".dfspart";
+    string metaPath = partPath + ".meta";
+    long long chunkCount = (location.size + STRIPE_CHUNK_SIZE - 1) / STRIPE_CHUNK_SIZE;
+    
+    vector<bool> done(chunkCount, false);
+    unsigned long resumedChecksum = 0;
+    bool resuming = fs::exists(partPath) && loadPartialDownload(metaPath, location, done, resumedChecksum);
+    if (!resuming) {
+        done.assign(chunkCount, false);
+        resumedChecksum = 0;
+        ofstream metaFile(metaPath, ios::trunc);
+        metaFile << location.size << " " << location.checksum << " " << location.version << " "
+                 << STRIPE_CHUNK_SIZE << "\n";
+    }
+    
+    int fd = open(partPath.c_str(), O_WRONLY | O_CREAT | (resuming ? 0 : O_TRUNC), 0644);
+    int metaFd = open(metaPath.c_str(), O_WRONLY | O_APPEND);
+    if (fd == -1 || metaFd == -1 || ftruncate(fd, location.size) != 0) {
+        cerr << "Error: Cannot create local file: " << partPath << "\n";
+        if (fd != -1) {
+            close(fd);
+        }
+        if (metaFd != -1) {
+            close(metaFd);
+        }
+        return false;
+    }
+    
+    vector<atomic<bool>> healthy(location.nodes.size());
+    for (auto& flag : healthy) {
+        flag = true;
+    }
+    
+    StripedDownload job;
+    job.dfsPath = dfsPath;
+    job.location = location;
+    job.fd = fd;
+    job.metaFd = metaFd;
+    job.chunkCount = chunkCount;
+    for (long long chunk = 0; chunk < chunkCount; chunk++) {
+        if (!done[chunk]) {
+            job.pendingChunks.push_back(chunk);
+        }
+    }
+    job.chunksDone = chunkCount - (long long)job.pendingChunks.size();
+    job.checksumSum = resumedChecksum;
+    job.attempts.assign(job.chunkCount, 0);
+    job.healthy = &healthy;
+    if (job.chunksDone > 0) {
+        cout << "Resuming download of " << dfsPath << ": " << job.chunksDone << "/" << chunkCount
+             << " chunks already present\n";
+    }
+    
+    maxStreams = (int)min((long long)maxStreams, (long long)job.pendingChunks.size());
+    int streams = min((int)location.nodes.size(), maxStreams);
+    job.streamLimit = streams;
+    vector<thread> workers;
+    for (int i = 0; i < streams; i++) {
+        workers.emplace_back(stripeWorker, &job, i);
+    }
+    
+    // Additive increase while each added stream buys at least 10% more
+    // throughput; once it stops paying off, drop the last stream and hold
+    const auto interval = chrono::milliseconds(100);
+    bool growing = true;
+    double lastRate = 0;
+    long long lastBytes = 0;
+    while (!job.failed && job.chunksDone < job.chunkCount) {
+        this_thread::sleep_for(interval);
+        long long bytes = job.bytesDone;
+        double rate = (double)(bytes - lastBytes);
+        lastBytes = bytes;
+        if (!growing || rate == 0) {
+            continue;
+        }
+        if (rate > lastRate * 1.1 && streams < maxStreams) {
+            job.streamLimit = ++streams;
+            workers.emplace_back(stripeWorker, &job, streams - 1);
+        } else if (lastRate > 0 && rate < lastRate * 0.9 && streams > (int)location.nodes.size()) {
+            job.streamLimit = --streams;
+            growing = false;
+        } else if (lastRate > 0) {
+            growing = false;
+        }
+        lastRate = rate;
+    }
+    
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    close(fd);
+    close(metaFd);
+    
+    // An incomplete download keeps its part file for the next attempt
+    if (job.failed || job.chunksDone < job.chunkCount) {
+        cerr << "Striped download of " << dfsPath << " failed (" << job.chunksDone << "/" << job.chunkCount
+             << " chunks kept in " << partPath << "), retrying through coordinator\n";
+        return false;
+    }
+    
+    // Range checksums add up to the whole-file checksum; a mismatch means the
+    // saved progress cannot be trusted, so it is discarded
+    if (job.checksumSum != location.checksum) {
+        cerr << "Striped download of " << dfsPath << " failed checksum verification, retrying through coordinator\n";
+        fs::remove(partPath);
+        fs::remove(metaPath);
+        return false;
     }
     
-    // Read local file
-    ifstream inFile(localPath, ios::binary | ios::ate);
-    if (!inFile.is_open()) {
+    error_code renameError;
+    fs::rename(partPath, localPath, renameError);
+    if (renameError) {
+        cerr << "Error: Cannot create local file: " << localPath << "\n";
+        return false;
+    }
+    fs::remove(metaPath);
+    
+    cout << "File downloaded successfully: " << localPath << " (" << location.size << " bytes, "
+         << streams << " streams across " << location.nodes.size() << " replicas)\n";
+    return true;
+}
+
+// A local file mapped read-only for uploading. Pages come from the page
+// cache when the upload reaches them (MADV_SEQUENTIAL reads ahead), and
+// release() unmaps the pages already sent, so client memory stays flat
+// however large the file is.
+struct MappedFile {
+    int fd = -1;
+    const char* data = nullptr;
+    long long size = 0;
+    
+    bool open(const string& path) {
+        fd = ::open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            return false;
+        }
+        size = st.st_size;
+        if (size == 0) {
+            return true;
+        }
+        void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        madvise(mapped, size, MADV_SEQUENTIAL);
+        data = (const char*)mapped;
+        return true;
+    }
+    
+    // Drop the whole pages of [offset, offset + length) from this process;
+    // touching them again faults them back in from the page cache
+    void release(long long offset, long long length) {
+        long long page = sysconf(_SC_PAGESIZE);
+        long long start = (offset + page - 1) / page * page;
+        long long end = (offset + length == size) ? size : (offset + length) / page * page;
+        if (data && end > start) {
+            madvise((void*)(data + start), end - start, MADV_DONTNEED);
+        }
+    }
+    
+    ~MappedFile() {
+        if (data) {
+            munmap((void*)data, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+};
+
+// Send [offset, offset + length) of a file from the page cache to the socket
+bool sendFileRange(int sock, int fd, long long offset, long long length) {
+    off_t position = offset;
+    while (length > 0) {
+        ssize_t sent = sendfile(sock, fd, &position, length);
+        if (sent <= 0) {
+            return false;
+        }
+        length -= sent;
+    }
+    return true;
+}
+
+// Send one upload chunk whose checksum was just computed from the mapping:
+// uncompressed with sendfile, without copying it through this process, or
+// encoded straight from the mapping
+bool sendMappedRange(int sock, Codec codec, MappedFile& file, long long offset, long long length) {
+    bool sent = (codec == Codec::None) ? sendFileRange(sock, file.fd, offset, length)
+                                       : sendPayload(sock, codec, file.data + offset, length);
+    file.release(offset, length);
+    return sent;
+}
+
+// Shared state of one multipart upload
+struct MultipartUpload {
+    string dfsPath;         // routes the MPU_* commands to its partition
+    string uploadId;
+    MappedFile* file;
+    long long size;
+    int partCount;
+    Codec codec;
+    vector<bool> partDone;  // parts the coordinator already holds from an earlier run
+    atomic<int> nextPart{0};
+    atomic<bool> failed{false};
+    atomic<int> retries{0};
+};
+
+// Upload one part over its own coordinator connection
+bool uploadPart(MultipartUpload* job, int partNumber) {
+    TraceSpan span("MPU_PART");
+    span.setArg("part", partNumber);
+    long long offset = partNumber * MULTIPART_PART_SIZE;
+    long long partSize = min(MULTIPART_PART_SIZE, job->size - offset);
+    
+    int sock = connectToCoordinator(job->dfsPath);
+    if (sock == -1) {
+        return false;
+    }
+    
+    string cmd = "MPU_PART " + job->uploadId + " " + to_string(partNumber) + " " + to_string(partSize) + " " +
+                 to_string(calculateChecksum(job->file->data + offset, partSize)) + "\n";
+    sendRequest(sock, cmd);
+    
+    if (!sendMappedRange(sock, job->codec, *job->file, offset, partSize)) {
+        close(sock);
+        return false;
+    }
+    
+    string response = recvLine(sock);
+    close(sock);
+    return response.find("PART_OK") == 0;
+}
+
+// One upload stream: takes the next part and retries only that part, with
+// backoff, when it fails
+void multipartWorker(MultipartUpload* job) {
+    currentTrace() = clientTrace;
+    while (!job->failed) {
+        int partNumber = job->nextPart++;
+        if (partNumber >= job->partCount) {
+            return;
+        }
+        if (job->partDone[partNumber]) {
+            continue;
+        }
+        
+        bool ok = false;
+        for (int attempt = 0; attempt < MAX_PART_ATTEMPTS && !ok; attempt++) {
+            if (attempt > 0) {
+                job->retries++;
+                this_thread::sleep_for(chrono::milliseconds(200 << attempt));
+            }
+            ok = uploadPart(job, partNumber);
+        }
+        if (!ok) {
+            job->failed = true;
+        }
+    }
+}
+
+// Send a coordinator command about dfsPath that has a one-line reply
+string coordinatorRequest(const string& dfsPath, const string& cmd) {
+    int sock = connectToCoordinator(dfsPath);
+    if (sock == -1) {
+        return "ERROR: Cannot connect to coordinator";
+    }
+    sendRequest(sock, cmd);
+    string response = recvLine(sock);
+    close(sock);
+    return response;
+}
+
+// Identify an upload across client runs: the same local file (path, size and
+// modification time) going to the same DFS path yields the same token, so a
+// rerun after a failure can find the coordinator's unfinished session
+string resumeToken(const string& localPath, const string& dfsPath, long long fileSize) {
+    struct stat st;
+    long long mtime = stat(localPath.c_str(), &st) == 0 ? (long long)st.st_mtime : 0;
+    string key = fs::absolute(localPath).string() + "|" + to_string(fileSize) + "|" + to_string(mtime) + "|" + dfsPath;
+    
+    // 64-bit FNV-1a
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    stringstream ss;
+    ss << hex << hash;
+    return ss.str();
+}
+
+// Ask the coordinator which parts of a resumed upload it already holds and
+// keep only those whose checksum still matches the local file
+int loadUploadedParts(MultipartUpload& job) {
+    stringstream ss(coordinatorRequest(job.dfsPath, "MPU_STATUS " + job.uploadId + "\n"));
+    string tag, entry;
+    int partCount = 0;
+    ss >> tag >> partCount;
+    if (tag != "STATUS" || partCount != job.partCount) {
+        return 0;
+    }
+    
+    int reused = 0;
+    while (ss >> entry) {
+        size_t colon = entry.find(':');
+        if (colon == string::npos) {
+            continue;
+        }
+        int partNumber = atoi(entry.substr(0, colon).c_str());
+        unsigned long checksum = strtoul(entry.substr(colon + 1).c_str(), NULL, 10);
+        if (partNumber < 0 || partNumber >= job.partCount) {
+            continue;
+        }
+        
+        long long offset = partNumber * MULTIPART_PART_SIZE;
+        long long partSize = min(MULTIPART_PART_SIZE, job.size - offset);
+        if (calculateChecksum(job.file->data + offset, partSize) == checksum) {
+            job.partDone[partNumber] = true;
+            reused++;
+        }
+        job.file->release(offset, partSize);
+    }
+    return reused;
+}
+
+// Upload a large file as MULTIPART_PART_SIZE parts sent concurrently over
+// up to maxStreams connections. Parts are sent from a mapping of the file,
+// so memory use does not grow with the file size.
+// The coordinator publishes the file only after every part is confirmed.
+// A failed upload is left open on the coordinator: running the same upload
+// again resumes it and sends only the parts that are still missing.
+void uploadMultipart(const string& localPath, const string& dfsPath, long long fileSize, int maxStreams) {
+    MappedFile file;
+    if (!file.open(localPath) || file.size != fileSize) {
         cerr << "Error: Cannot read file: " << localPath << "\n";
         return;
     }
     
-    int fileSize = (int)inFile.tellg();
-    inFile.seekg(0, ios::beg);
+    string response = coordinatorRequest(dfsPath, "MPU_BEGIN " + dfsPath + " " + to_string(fileSize) + " " +
+                                         to_string(MULTIPART_PART_SIZE) + " " +
+                                         resumeToken(localPath, dfsPath, fileSize) +
+                                         codecOffer(codecPreference) + "\n");
+    stringstream ss(response);
+    string tag, resumed;
+    MultipartUpload job;
+    job.dfsPath = dfsPath;
+    ss >> tag >> job.uploadId >> resumed;
+    job.codec = parseCodecReply(response);
+    if (tag != "UPLOADID") {
+        cerr << "Upload failed: " << response << "\n";
+        return;
+    }
     
-    char* fileData = new char[fileSize];
-    inFile.read(fileData, fileSize);
-    inFile.close();
+    job.file = &file;
+    job.size = fileSize;
+    job.partCount = (int)((fileSize + MULTIPART_PART_SIZE - 1) / MULTIPART_PART_SIZE);
+    job.partDone.assign(job.partCount, false);
+    if (resumed == "RESUMED") {
+        int reused = loadUploadedParts(job);
+        cout << "Resuming upload " << job.uploadId << ": " << reused << "/" << job.partCount
+             << " parts already stored\n";
+    }
     
-    // Connect to coordinator
-    int sock = connectToCoordinator();
-    if (sock == -1) {
-        cerr << "Error: Cannot connect to coordinator\n";
-        delete[] fileData;
+    int streams = min(maxStreams, job.partCount);
+    vector<thread> workers;
+    for (int i = 0; i < streams; i++) {
+        workers.emplace_back(multipartWorker, &job);
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    
+    if (job.failed) {
+        cerr << "Upload failed: a part could not be stored after " << MAX_PART_ATTEMPTS << " attempts\n";
+        cerr << "Run the same upload again to resume it\n";
         return;
     }
     
-    // Send UPLOAD command
-    string cmd = "UPLOAD " + dfsPath + "\n";
-    send(sock, cmd.c_str(), cmd.size(), 0);
+    response = coordinatorRequest(job.dfsPath, "MPU_COMPLETE " + job.uploadId + "\n");
+    if (response.find("STORED") == 0) {
+        cout << "File uploaded successfully: " << dfsPath << " (" << job.partCount << " parts, "
+             << streams << " streams, " << job.retries << " retries)\n";
+        cout << response << "\n";
+    } else {
+        cerr << "Upload failed: " << response << "\n";
+    }
+}
+
+// Send one resumable UPLOAD session: the coordinator answers HAVE <offset>
+// and the rest of the file follows in RESUME_CHUNK_SIZE frames, each with
+// its own checksum. Returns the coordinator's final reply, or "" when the
+// connection was lost and the upload can be resumed.
+string sendResumableUpload(const string& dfsPath, MappedFile& file, const string& token) {
+    long long fileSize = file.size;
+    TraceSpan span("UPLOAD");
+    int sock = connectToCoordinator(dfsPath);
+    if (sock == -1) {
+        return "";
+    }
     
-    // Send file size
-    string sizeStr = to_string(fileSize) + "\n";
-    send(sock, sizeStr.c_str(), sizeStr.size(), 0);
+    string cmd = "UPLOAD " + dfsPath + " " + to_string(fileSize) + " " + token + codecOffer(codecPreference) + "\n";
+    sendRequest(sock, cmd);
     
-    // Send file data
-    int totalSent = 0;
-    while (totalSent < fileSize) {
-        int sent = send(sock, fileData + totalSent, fileSize - totalSent, 0);
-        if (sent <= 0) {
-            cerr << "Error: Failed to send file data\n";
-            delete[] fileData;
+    string reply = recvLine(sock);
+    if (reply.find("HAVE") != 0) {
+        close(sock);
+        return reply;
+    }
+    long long offset = atoll(reply.substr(5).c_str());
+    Codec codec = parseCodecReply(reply);
+    if (offset > 0) {
+        cout << "Resuming upload of " << dfsPath << " at byte " << offset << "\n";
+    }
+    
+    TraceSpan sendSpan("send");
+    sendSpan.setArg("bytes", fileSize - offset);
+    while (offset < fileSize) {
+        // The checksum pass faults the chunk in; sending it follows at once
+        long long chunkSize = min(RESUME_CHUNK_SIZE, fileSize - offset);
+        string header = to_string(chunkSize) + " " + to_string(calculateChecksum(file.data + offset, chunkSize)) + "\n";
+        if (send(sock, header.c_str(), header.size(), 0) <= 0) {
             close(sock);
-            return;
+            return "";
         }
-        totalSent += sent;
+        if (!sendMappedRange(sock, codec, file, offset, chunkSize)) {
+            close(sock);
+            return "";
+        }
+        offset += chunkSize;
+    }
+    sendSpan.end();
+    
+    TraceSpan waitSpan("wait for STORED");
+    reply = recvLine(sock);
+    close(sock);
+    return reply;
+}
+
+// Upload file
+void uploadFile(const string& localPath, const string& dfsPath, int maxStreams) {
+    if (!fs::exists(localPath)) {
+        cerr << "Error: Local file not found: " << localPath << "\n";
+        return;
     }
     
-    delete[] fileData;
+    long long localSize = (long long)fs::file_size(localPath);
+    if (localSize >= MULTIPART_THRESHOLD) {
+        uploadMultipart(localPath, dfsPath, localSize, maxStreams);
+        return;
+    }
     
-    // Receive response
-    char response[1024] = {0};
-    recv(sock, response, sizeof(response), 0);
+    // Map the local file; chunks are sent straight from the page cache
+    MappedFile file;
+    if (!file.open(localPath)) {
+        cerr << "Error: Cannot read file: " << localPath << "\n";
+        return;
+    }
+    
+    // Reconnect and continue from the coordinator's verified offset when the
+    // connection drops or a chunk arrives damaged
+    string token = resumeToken(localPath, dfsPath, file.size);
+    string resp;
+    for (int attempt = 0; attempt < MAX_RESUME_ATTEMPTS; attempt++) {
+        if (attempt > 0) {
+            this_thread::sleep_for(chrono::milliseconds(200 << attempt));
+        }
+        resp = sendResumableUpload(dfsPath, file, token);
+        bool retryable = resp.empty() || resp.find("Failed to receive") != string::npos ||
+                         resp.find("checksum mismatch") != string::npos ||
+                         resp.find("already in progress") != string::npos;
+        if (!retryable) {
+            break;
+        }
+    }
     
-    string resp(response);
     if (resp.find("STORED") == 0) {
         cout << "File uploaded successfully: " << dfsPath << "\n";
         cout << resp << "\n";
+    } else if (resp.empty()) {
+        cerr << "Upload failed: connection to coordinator lost; run the same upload again to resume it\n";
     } else {
         cerr << "Upload failed: " << resp << "\n";
     }
+}
+
+// Upload a file with block-level deduplication: hash it in DEDUP_BLOCK_SIZE
+// blocks, send the block list, and transfer only the blocks the cluster asks
+// for. Blocks already stored (by earlier versions, other files, or an upload
+// that failed part-way) are never sent again.
+void uploadDeduplicated(const string& localPath, const string& dfsPath) {
+    int fd = open(localPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        cerr << "Error: Cannot read file: " << localPath << "\n";
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    long long fileSize = st.st_size;
+    if (fileSize <= 0 || dedupBlockCount(fileSize) > MAX_DEDUP_BLOCKS) {
+        cerr << "Error: Cannot deduplicate a file of " << fileSize << " bytes\n";
+        close(fd);
+        return;
+    }
     
+    auto start = chrono::steady_clock::now();
+    vector<BlockRef> blocks(dedupBlockCount(fileSize));
+    vector<char> block(DEDUP_BLOCK_SIZE);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        long long blockSize = dedupBlockSize(fileSize, i);
+        if (pread(fd, block.data(), blockSize, i * DEDUP_BLOCK_SIZE) != blockSize) {
+            cerr << "Error: Cannot read file: " << localPath << "\n";
+            close(fd);
+            return;
+        }
+        blocks[i].hash = Sha256::hash(block.data(), blockSize);
+        blocks[i].checksum = calculateChecksum(block.data(), blockSize);
+    }
+    double hashSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    
+    int sock = connectToCoordinator(dfsPath);
+    if (sock == -1) {
+        cerr << "Error: Cannot connect to coordinator\n";
+        close(fd);
+        return;
+    }
+    string list = formatBlockList(blocks);
+    string cmd = "DEDUP_PUT " + dfsPath + " " + to_string(fileSize) + " " + to_string(list.size()) +
+                 codecOffer(codecPreference) + "\n";
+    sendRequest(sock, cmd);
+    sendAll(sock, list.data(), list.size());
+    
+    string reply = recvLine(sock);
+    if (reply.find("NEED") != 0) {
+        cerr << "Upload failed: " << reply << "\n";
+        close(sock);
+        close(fd);
+        return;
+    }
+    // A further NEED asks again for blocks a node lost before the file
+    // could pin them
+    long long sentBytes = 0;
+    int sentBlocks = 0;
+    while (reply.find("NEED") == 0) {
+        Codec codec = parseCodecReply(reply);
+        stringstream needed(recvLine(sock));
+        size_t index;
+        while (needed >> index) {
+            long long blockSize = index < blocks.size() ? dedupBlockSize(fileSize, index) : 0;
+            if (blockSize <= 0 || pread(fd, block.data(), blockSize, index * DEDUP_BLOCK_SIZE) != blockSize ||
+                !sendPayload(sock, codec, block.data(), blockSize)) {
+                break;
+            }
+            sentBytes += blockSize;
+            sentBlocks++;
+        }
+        reply = recvLine(sock);
+    }
+    close(fd);
     close(sock);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (reply.find("STORED") != 0) {
+        cerr << "Upload failed: " << reply << "\n";
+        cerr << "Blocks already sent are kept; run the same upload again to send the rest\n";
+        return;
+    }
+    
+    stringstream stored(reply);
+    string tag;
+    int node1, node2;
+    long long logicalBytes = 0, uniqueBytes = 0;
+    stored >> tag >> node1 >> node2 >> logicalBytes >> uniqueBytes;
+    cout << "File uploaded successfully: " << dfsPath << " (deduplicated)\n";
+    cout << fixed << setprecision(2);
+    cout << "Blocks: " << blocks.size() << " total, " << sentBlocks << " sent ("
+         << sentBytes / 1048576.0 << " of " << fileSize / 1048576.0 << " MB)\n";
+    cout << "Dedup ratio: ";
+    if (sentBytes > 0) {
+        cout << (double)fileSize / sentBytes << "x this upload, ";
+    } else {
+        cout << "every block already stored, ";
+    }
+    cout << (uniqueBytes > 0 ? (double)logicalBytes / uniqueBytes : 1.0) << "x across the cluster\n";
+    cout << "Ingest: " << fileSize / 1048576.0 / seconds << " MB/s (" << setprecision(0)
+         << hashSeconds * 1000 << " ms hashing, " << seconds * 1000 << " ms total)\n";
+    cout << "STORED " << node1 << " " << node2 << "\n";
 }
 
-// Download file
-void downloadFile(const string& dfsPath, const string& localPath) {
-    int sock = connectToCoordinator();
+// Fetch the chunk signature of the stored version of a file from one of its
+// replicas. The replica must still hold the version LOCATE reported.
+bool fetchSignature(const string& dfsPath, const FileLocation& location, vector<ChunkSig>& chunks, long long& signatureBytes, string& error) {
+    error = "no replica answered";
+    for (int nodeId : location.nodes) {
+        int sock = connectToPort(NODE_BASE_PORT + nodeId);
+        if (sock == -1) {
+            continue;
+        }
+        string cmd = "SIGNATURE " + dfsPath + "\n";
+        sendRequest(sock, cmd);
+        
+        // "SIG <version> <size> <signatureSize>", then the signature
+        stringstream header(recvLine(sock));
+        string tag;
+        int version = 0;
+        long long size = 0;
+        header >> tag >> version >> size >> signatureBytes;
+        if (tag != "SIG" || version != location.version || size != location.size || signatureBytes < 0) {
+            error = "replica " + to_string(nodeId) + " holds another version";
+            close(sock);
+            continue;
+        }
+        string signature(signatureBytes, '\0');
+        bool ok = recvAll(sock, &signature[0], signatureBytes) && parseSignature(signature, chunks);
+        close(sock);
+        if (ok) {
+            return true;
+        }
+        error = "bad signature from replica " + to_string(nodeId);
+    }
+    return false;
+}
+
+// Upload a new version of a file by sending only what changed: fetch the
+// stored version's chunk signature, cut the local file into chunks the same
+// way, and send copy instructions for chunks the old version already has
+// plus the bytes of the rest. Both replicas rebuild the file from their own
+// copy. Falls back to a full upload when there is no stored version to diff
+// against or the delta cannot be applied.
+void uploadDelta(const string& localPath, const string& dfsPath, int maxStreams) {
+    FileLocation location;
+    vector<ChunkSig> remote;
+    long long signatureBytes = 0;
+    string error;
+    if (!locateFile(dfsPath, location, error) || !fetchSignature(dfsPath, location, remote, signatureBytes, error)) {
+        cout << "No stored version to diff against (" << error << "); uploading the whole file\n";
+        uploadFile(localPath, dfsPath, maxStreams);
+        return;
+    }
+    
+    int fd = open(localPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        cerr << "Error: Cannot read file: " << localPath << "\n";
+        return;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    long long fileSize = st.st_size;
+    
+    unsigned long checksum = 0;
+    vector<ChunkSig> local;
+    bool readOk = chunkFile(fileSize, [&](long long offset, long long length, char* out) {
+        if (pread(fd, out, length, offset) != length) {
+            return false;
+        }
+        checksum += calculateChecksum(out, length);
+        return true;
+    }, local);
+    if (!readOk || fileSize <= 0) {
+        cerr << "Error: Cannot read file: " << localPath << "\n";
+        close(fd);
+        return;
+    }
+    
+    unordered_map<string, const ChunkSig*> oldChunks;
+    for (const ChunkSig& chunk : remote) {
+        oldChunks.emplace(chunk.hash, &chunk);
+    }
+    
+    // Runs of copies that are contiguous in the old version, and runs of
+    // literals, become one instruction each
+    string delta;
+    string literal;
+    long long copyOffset = 0, copyLength = 0;
+    int matched = 0;
+    auto flushCopy = [&] {
+        if (copyLength > 0) {
+            delta += "C " + to_string(copyOffset) + " " + to_string(copyLength) + "\n";
+            copyLength = 0;
+        }
+    };
+    auto flushLiteral = [&] {
+        if (!literal.empty()) {
+            delta += "L " + to_string(literal.size()) + "\n" + literal;
+            literal.clear();
+        }
+    };
+    for (const ChunkSig& chunk : local) {
+        auto it = oldChunks.find(chunk.hash);
+        if (it != oldChunks.end() && it->second->length == chunk.length) {
+            flushLiteral();
+            if (copyLength > 0 && copyOffset + copyLength == it->second->offset) {
+                copyLength += chunk.length;
+            } else {
+                flushCopy();
+                copyOffset = it->second->offset;
+                copyLength = chunk.length;
+            }
+            matched++;
+        } else {
+            flushCopy();
+            size_t start = literal.size();
+            literal.resize(start + chunk.length);
+            if (pread(fd, &literal[start], chunk.length, chunk.offset) != chunk.length) {
+                cerr << "Error: Cannot read file: " << localPath << "\n";
+                close(fd);
+                return;
+            }
+        }
+    }
+    flushCopy();
+    flushLiteral();
+    close(fd);
+    
+    if ((long long)delta.size() > MAX_DELTA_SIZE || (long long)delta.size() >= fileSize) {
+        cout << "Delta is not smaller than the file; uploading the whole file\n";
+        uploadFile(localPath, dfsPath, maxStreams);
+        return;
+    }
+    
+    int sock = connectToCoordinator(dfsPath);
     if (sock == -1) {
         cerr << "Error: Cannot connect to coordinator\n";
         return;
     }
+    string cmd = "DELTA_PUT " + dfsPath + " " + to_string(location.version) + " " + to_string(fileSize) + " " +
+                 to_string(checksum) + " " + to_string(delta.size()) + " " +
+                 to_string(calculateChecksum(delta.data(), delta.size())) + codecOffer(codecPreference) + "\n";
+    sendRequest(sock, cmd);
+    string reply = recvLine(sock);
+    if (reply.find("READY") == 0) {
+        sendPayload(sock, parseCodecReply(reply), delta.data(), delta.size());
+        reply = recvLine(sock);
+    }
+    close(sock);
+    
+    if (reply.find("STORED") != 0) {
+        cout << "Delta upload failed (" << reply << "); uploading the whole file\n";
+        uploadFile(localPath, dfsPath, maxStreams);
+        return;
+    }
+    
+    long long sent = (long long)delta.size() + signatureBytes;
+    cout << "File uploaded successfully: " << dfsPath << " (delta)\n";
+    cout << "Chunks: " << local.size() << " total, " << matched << " unchanged\n";
+    cout << "Sent " << sent << " bytes for a " << fileSize << " byte file (delta " << delta.size() << ", signature "
+         << signatureBytes << ", " << fixed << setprecision(2) << 100.0 * sent / fileSize << "%)\n";
+    cout << reply << "\n";
+}
+
+// Send DOWNLOAD to the coordinator on port and read the reply header.
+// Returns the socket positioned at the file data, or -1 with error set.
+int openDownloadAt(int port, const string& dfsPath, long long offset, long long length, long long& size, unsigned long& checksum, Codec& codec, string& error) {
+    int sock = connectToPort(port);
+    if (sock == -1) {
+        error = "Cannot connect to coordinator";
+        return -1;
+    }
     
     // Send DOWNLOAD command
-    string cmd = "DOWNLOAD " + dfsPath + "\n";
-    send(sock, cmd.c_str(), cmd.size(), 0);
+    string cmd = "DOWNLOAD " + dfsPath;
+    if (length >= 0) {
+        cmd += " " + to_string(offset) + " " + to_string(length);
+    }
+    cmd += codecOffer(codecPreference) + "\n";
+    sendRequest(sock, cmd);
     
     // Receive response header
-    char header[1024] = {0};
-    recv(sock, header, sizeof(header), 0);
-    
-    string headerStr(header);
+    string headerStr = recvLine(sock);
     
     // Check for recovery message
     if (headerStr.find("failed") != string::npos || headerStr.find("recovered") != string::npos) {
-        cout << headerStr << "\n";
+        *statusOut << headerStr << "\n";
         // Read next line for OK message
-        recv(sock, header, sizeof(header), 0);
-        headerStr = string(header);
-    }
-    
-    if (headerStr.find("ERROR") == 0) {
-        cerr << "Download failed: " << headerStr << "\n";
-        close(sock);
-        return;
+        headerStr = recvLine(sock);
     }
     
-    // Parse OK message: "OK <size> <checksum>"
+    // Parse OK message: "OK <size> <checksum> [CODEC=<codec>]"
     stringstream ss(headerStr);
-    string ok, sizeStr, checksumStr;
-    ss >> ok >> sizeStr >> checksumStr;
-    
-    if (ok != "OK") {
-        cerr << "Download failed: Invalid response\n";
+    string ok;
+    ss >> ok >> size >> checksum;
+    codec = parseCodecReply(headerStr);
+    if (ok != "OK" || size <= 0) {
+        error = headerStr.find("ERROR") == 0 ? headerStr : "Invalid response";
         close(sock);
-        return;
+        return -1;
+    }
+    return sock;
+}
+
+// DOWNLOAD from a follower of the owning coordinator when there is one,
+// falling back to the coordinator itself
+int openDownload(const string& dfsPath, long long offset, long long length, long long& size, unsigned long& checksum, Codec& codec, string& error) {
+    TraceSpan span("DOWNLOAD reply");
+    int sock = -1;
+    for (int port : readPorts(partitionMap().portFor(dfsPath))) {
+        sock = openDownloadAt(port, dfsPath, offset, length, size, checksum, codec, error);
+        if (sock != -1) {
+            break;
+        }
+    }
+    return sock;
+}
+
+// Write a whole buffer to a file descriptor (a file or stdout)
+bool writeFully(int fd, const char* data, long long size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+// Fetch [offset, offset + length) of a file (all of it when length < 0)
+// through the coordinator and write it to out as it arrives, summing the
+// checksum on the way. A dropped connection is resumed with a ranged
+// DOWNLOAD of the remainder. Returns false with error set on failure; the
+// bytes already written stay in out, so callers writing to a file write
+// to a temporary one.
+bool streamDownload(const string& dfsPath, long long offset, long long length, int out, long long& fileSize, string& error) {
+    unsigned long expectedChecksum = 0;
+    Codec codec = Codec::None;
+    int sock = openDownload(dfsPath, offset, length, fileSize, expectedChecksum, codec, error);
+    if (sock == -1) {
+        return false;
     }
     
-    int fileSize = atoi(sizeStr.c_str());
-    unsigned long expectedChecksum = strtoul(checksumStr.c_str(), NULL, 10);
-    
-    // Receive file data
-    char* fileData = new char[fileSize];
-    int totalReceived = 0;
-    
+    PooledBuffer buffer = bufferPool().acquire(STREAM_BUFFER_SIZE);
+    unsigned long checksum = 0;
+    long long totalReceived = 0;
+    int attempts = 0;
+    TraceSpan recvSpan("recv");
+    recvSpan.setArg("bytes", fileSize);
     while (totalReceived < fileSize) {
-        int received = recv(sock, fileData + totalReceived, fileSize - totalReceived, 0);
-        if (received <= 0) {
-            cerr << "Error: Failed to receive file data\n";
-            delete[] fileData;
-            close(sock);
-            return;
+        // Compressed data arrives one frame at a time, so progress is kept
+        // at frame boundaries
+        long long step = min((long long)buffer.size(), fileSize - totalReceived);
+        if (codec != Codec::None) {
+            step = min((long long)FRAME_RAW_SIZE, step);
+        }
+        ssize_t received = (codec == Codec::None)
+            ? recv(sock, buffer.data(), step, 0)
+            : (recvPayload(sock, codec, buffer.data(), step) ? step : -1);
+        if (received > 0) {
+            checksum += calculateChecksum(buffer.data(), received);
+            if (!writeFully(out, buffer.data(), received)) {
+                close(sock);
+                error = "Cannot write output: " + string(strerror(errno));
+                return false;
+            }
+            totalReceived += received;
+            continue;
         }
-        totalReceived += received;
+        
+        close(sock);
+        sock = -1;
+        while (sock == -1 && ++attempts < MAX_RESUME_ATTEMPTS) {
+            this_thread::sleep_for(chrono::milliseconds(200 << attempts));
+            long long remaining = 0;
+            unsigned long rangeChecksum = 0;
+            sock = openDownload(dfsPath, offset + totalReceived, fileSize - totalReceived, remaining, rangeChecksum, codec, error);
+            if (sock != -1 && remaining != fileSize - totalReceived) {
+                close(sock);
+                sock = -1;
+            }
+        }
+        if (sock == -1) {
+            error = "Failed to receive file data";
+            return false;
+        }
+        *statusOut << "Connection lost, resuming download at byte " << offset + totalReceived << "\n";
     }
     
     close(sock);
+    recvSpan.end();
     
-    // Verify checksum
-    unsigned long calculatedChecksum = 0;
-    for (int i = 0; i < fileSize; i++) {
-        calculatedChecksum += (unsigned char)fileData[i];
+    if (checksum != expectedChecksum) {
+        error = "Checksum mismatch - file may be corrupted";
+        return false;
+    }
+    return true;
+}
+
+// Download file. With length >= 0 only [offset, offset + length) is fetched
+// and written to localPath. Whole downloads of large files are striped over
+// up to maxStreams direct connections to the replicas; the rest stream into
+// <localPath>.dfstmp, which is renamed to localPath once the checksum matches.
+void downloadFile(const string& dfsPath, const string& localPath, long long offset, long long length, int maxStreams) {
+    if (length < 0 && maxStreams > 1) {
+        FileLocation location;
+        string error;
+        if (locateFile(dfsPath, location, error) && location.size >= STRIPE_THRESHOLD) {
+            fs::path parentDir = fs::path(localPath).parent_path();
+            if (!parentDir.empty()) {
+                fs::create_directories(parentDir);
+            }
+            if (downloadStriped(dfsPath, localPath, location, maxStreams)) {
+                return;
+            }
+        }
     }
     
-    if (calculatedChecksum != expectedChecksum) {
-        cerr << "Error: Checksum mismatch - file may be corrupted\n";
-        delete[] fileData;
+    fs::path parentDir = fs::path(localPath).parent_path();
+    if (!parentDir.empty()) {
+        fs::create_directories(parentDir);
+    }
+    string tmpPath = localPath + ".dfstmp";
+    int out = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1) {
+        cerr << "Error: Cannot create local file: " << tmpPath << "\n";
         return;
     }
     
-    // Save to local file
-    fs::create_directories(fs::path(localPath).parent_path());
-    ofstream outFile(localPath, ios::binary);
-    if (!outFile.is_open()) {
-        cerr << "Error: Cannot create local file: " << localPath << "\n";
-        delete[] fileData;
+    long long fileSize = 0;
+    string error;
+    bool ok = streamDownload(dfsPath, offset, length, out, fileSize, error);
+    if (close(out) != 0 && ok) {
+        ok = false;
+        error = "Cannot write local file: " + tmpPath;
+    }
+    if (!ok || rename(tmpPath.c_str(), localPath.c_str()) != 0) {
+        cerr << "Download failed: " << (ok ? "Cannot rename " + tmpPath : error) << "\n";
+        unlink(tmpPath.c_str());
         return;
     }
     
-    outFile.write(fileData, fileSize);
-    outFile.close();
-    delete[] fileData;
+    // A whole download that got here also supersedes any striped partial copy
+    if (length < 0) {
+        fs::remove(localPath + ".dfspart");
+        fs::remove(localPath + ".dfspart.meta");
+    }
     
     cout << "File downloaded successfully: " << localPath << " (" << fileSize << " bytes)\n";
 }
 
-// List files
-void listFiles() {
-    int sock = connectToCoordinator();
+// Write a file (or a range of it) to stdout as it arrives, for pipelines.
+// The data cannot be taken back, so a checksum mismatch is only reported
+// on stderr and in the exit status.
+bool catFile(const string& dfsPath, long long offset, long long length) {
+    statusOut = &cerr;
+    long long fileSize = 0;
+    string error;
+    if (!streamDownload(dfsPath, offset, length, STDOUT_FILENO, fileSize, error)) {
+        cerr << "cat failed: " << error << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Send a command to the coordinator on port and read its reply until the
+// connection closes
+bool requestToEnd(int port, const string& cmd, string& reply) {
+    int sock = connectToPort(port);
     if (sock == -1) {
-        cerr << "Error: Cannot connect to coordinator\n";
-        return;
+        return false;
     }
-    
-    // Send LIST command
-    string cmd = "LIST\n";
     send(sock, cmd.c_str(), cmd.size(), 0);
-    
-    // Receive response
-    char response[4096] = {0};
-    recv(sock, response, sizeof(response), 0);
+    char buffer[65536];
+    ssize_t n;
+    while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+        reply.append(buffer, n);
+    }
+    close(sock);
+    return true;
+}
+
+// List files, merged from every partition
+void listFiles() {
+    vector<string> files;
+    for (int port : partitionMap().ports) {
+        string response;
+        for (int readPort : readPorts(port)) {
+            response.clear();
+            if (requestToEnd(readPort, "LIST\n", response) && response.find("ERROR") != 0) {
+                break;
+            }
+        }
+        if (response.empty()) {
+            cerr << "Error: Cannot connect to coordinator on port " << port << "\n";
+            return;
+        }
+        if (response.find("ERROR") == 0) {
+            cerr << response << "\n";
+            return;
+        }
+        stringstream lines(response);
+        string line;
+        while (getline(lines, line)) {
+            if (!line.empty() && line != "No files stored") {
+                files.push_back(line);
+            }
+        }
+    }
+    sort(files.begin(), files.end());
     
     cout << "Files in DFS:\n";
-    cout << response;
-    
-    close(sock);
+    for (const string& file : files) {
+        cout << file << "\n";
+    }
+    if (files.empty()) {
+        cout << "No files stored\n";
+    }
+}
+
+// Start tracing this run: every request carries the new trace id
+void startTrace() {
+    clientTrace = newTraceId();
+    currentTrace() = clientTrace;
+}
+
+// Collect the run's spans from this process and, through the coordinators,
+// from every node, and write them as one Chrome trace file. The first
+// partition gathers the nodes' spans; the others send only their own.
+void writeTrace(const string& path) {
+    // The servers record a request's span just after sending the last byte
+    this_thread::sleep_for(chrono::milliseconds(100));
+    string events = chromeTraceEvents(clientTrace, "client");
+    const vector<int>& ports = partitionMap().ports;
+    for (size_t i = 0; i < ports.size(); i++) {
+        string reply;
+        string cmd = "TRACE " + formatTraceId(clientTrace) + (i > 0 ? " LOCAL" : "") + "\n";
+        if (requestToEnd(ports[i], cmd, reply)) {
+            appendTraceEvents(events, reply);
+        } else {
+            cerr << "Warning: cannot reach the coordinator on port " << ports[i] << ", trace is missing its spans\n";
+        }
+    }
+    ofstream traceFile(path, ios::trunc);
+    traceFile << chromeTraceDocument(events);
+    if (!traceFile) {
+        cerr << "Error: Cannot write trace file: " << path << "\n";
+        return;
+    }
+    cout << "Trace " << formatTraceId(clientTrace) << " written to " << path << "\n";
+}
+
+// Restrict transfers to one codec ("none" disables compression)
+bool selectCodec(const string& name) {
+    Codec codec;
+    if (!parseCodec(name, codec) || !codecAvailable(codec)) {
+        cerr << "Error: codec not available in this build: " << name << "\n";
+        return false;
+    }
+    codecPreference.clear();
+    if (codec != Codec::None) {
+        codecPreference.push_back(codec);
+    }
+    return true;
+}
+
+// --range <offset>:<length>
+bool parseRange(const string& range, long long& offset, long long& length) {
+    size_t colon = range.find(':');
+    if (colon == string::npos) {
+        cerr << "Error: --range expects <offset>:<length>\n";
+        return false;
+    }
+    offset = atoll(range.substr(0, colon).c_str());
+    length = atoll(range.substr(colon + 1).c_str());
+    if (offset < 0 || length <= 0) {
+        cerr << "Error: invalid range: " << range << "\n";
+        return false;
+    }
+    return true;
 }
 
 void printUsage() {
     cout << "Usage:\n";
-    cout << "  ./client upload <local_file> <dfs_path>\n";
-    cout << "  ./client download <dfs_path> <local_file>\n";
+    cout << "  ./client upload <local_file> <dfs_path> [--streams <n>] [--codec <lz4|zstd|none>] [--dedup | --delta]\n";
+    cout << "                  [--trace <trace.json>]\n";
+    cout << "  ./client download <dfs_path> <local_file> [--range <offset>:<length>] [--streams <n>] [--codec <lz4|zstd|none>]\n";
+    cout << "                  [--trace <trace.json>]\n";
+    cout << "  ./client cat <dfs_path> [--range <offset>:<length>] [--codec <lz4|zstd|none>]\n";
     cout << "  ./client list\n";
     cout << "\nExamples:\n";
     cout << "  ./client upload test.txt /docs/test.txt\n";
     cout << "  ./client download /docs/test.txt output.txt\n";
+    cout << "  ./client download /docs/test.txt part.txt --range 4096:1024\n";
+    cout << "  ./client upload logs.txt /logs/today.txt --codec zstd\n";
+    cout << "  ./client upload backup.tar /backups/monday.tar --dedup\n";
+    cout << "  ./client upload report.doc /docs/report.doc --delta\n";
+    cout << "  ./client download /docs/big.iso big.iso --trace trace.json\n";
+    cout << "  ./client cat /logs/today.txt | grep ERROR\n";
     cout << "  ./client list\n";
 }
 
@@ -232,13 +1424,57 @@ int main(int argc, char* argv[]) {
     
     string command = argv[1];
     
+    // A dropped connection should fail the send, not kill the client
+    signal(SIGPIPE, SIG_IGN);
+    string tracePath; // --trace: write this run's spans here
+    
     if (command == "upload") {
         if (argc < 4) {
             cerr << "Error: upload requires <local_file> and <dfs_path>\n";
             printUsage();
             return 1;
         }
-        uploadFile(argv[2], argv[3]);
+        int maxStreams = DEFAULT_UPLOAD_STREAMS;
+        bool dedup = false;
+        bool delta = false;
+        for (int i = 4; i < argc; i += 2) {
+            string option = argv[i];
+            if (option == "--dedup" || option == "--delta") {
+                // Flags take no value
+                dedup = dedup || option == "--dedup";
+                delta = delta || option == "--delta";
+                i--;
+            }
+            else if (i + 1 >= argc) {
+                break;
+            }
+            else if (option == "--streams") {
+                maxStreams = atoi(argv[i + 1]);
+                if (maxStreams < 1) {
+                    cerr << "Error: --streams must be at least 1\n";
+                    return 1;
+                }
+            }
+            else if (option == "--codec" && !selectCodec(argv[i + 1])) {
+                return 1;
+            }
+            else if (option == "--trace") {
+                tracePath = argv[i + 1];
+            }
+        }
+        if (!tracePath.empty()) {
+            startTrace();
+        }
+        {
+            TraceSpan span("upload");
+            if (dedup) {
+                uploadDeduplicated(argv[2], argv[3]);
+            } else if (delta) {
+                uploadDelta(argv[2], argv[3], maxStreams);
+            } else {
+                uploadFile(argv[2], argv[3], maxStreams);
+            }
+        }
     }
     else if (command == "download") {
         if (argc < 4) {
@@ -246,7 +1482,56 @@ int main(int argc, char* argv[]) {
             printUsage();
             return 1;
         }
-        downloadFile(argv[2], argv[3]);
+        long long offset = 0;
+        long long length = -1;
+        int maxStreams = DEFAULT_MAX_STREAMS;
+        for (int i = 4; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            if (option == "--range" && !parseRange(argv[i + 1], offset, length)) {
+                return 1;
+            }
+            else if (option == "--streams") {
+                maxStreams = atoi(argv[i + 1]);
+                if (maxStreams < 1) {
+                    cerr << "Error: --streams must be at least 1\n";
+                    return 1;
+                }
+            }
+            else if (option == "--codec" && !selectCodec(argv[i + 1])) {
+                return 1;
+            }
+            else if (option == "--trace") {
+                tracePath = argv[i + 1];
+            }
+        }
+        if (!tracePath.empty()) {
+            startTrace();
+        }
+        {
+            TraceSpan span("download");
+            downloadFile(argv[2], argv[3], offset, length, maxStreams);
+        }
+    }
+    else if (command == "cat") {
+        if (argc < 3) {
+            cerr << "Error: cat requires <dfs_path>\n";
+            printUsage();
+            return 1;
+        }
+        long long offset = 0;
+        long long length = -1;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            if (option == "--range" && !parseRange(argv[i + 1], offset, length)) {
+                return 1;
+            }
+            else if (option == "--codec" && !selectCodec(argv[i + 1])) {
+                return 1;
+            }
+        }
+        if (!catFile(argv[2], offset, length)) {
+            return 1;
+        }
     }
     else if (command == "list") {
         listFiles();
@@ -257,6 +1542,9 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    if (!tracePath.empty()) {
+        writeTrace(tracePath);
+    }
     return 0;
 }
 
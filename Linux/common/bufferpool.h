@@ -0,0 +1,321 @@
+#ifndef DFS_COMMON_BUFFERPOOL_H
+#define DFS_COMMON_BUFFERPOOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "stats.h"
+
+// Pooled payload buffers shared by coordinator, nodes and client.
+//
+// Request payloads used to live in a fresh new[] of the payload size, so
+// every request faulted in new pages and concurrent requests of mixed sizes
+// fragmented the heap. Buffers now come from size classes, powers of two
+// from 64 KB to 16 MB. Each buffer is page-aligned, which also suits
+// O_DIRECT. A released buffer goes to a small cache of its thread
+// (THREAD_CACHE_SLOTS per class up to 1 MB), then to a shared free list of
+// bounded size, and only then back to the system. Larger payloads are
+// allocated on their own and are never cached.
+//
+// The pool caps the bytes handed out at once. An acquire that would pass
+// the cap waits for other requests to release theirs, and gives up with an
+// empty buffer after BUFFER_WAIT_MS so callers can answer "busy" instead of
+// piling up. One buffer is always granted when none are out, so a single
+// request larger than the cap still proceeds.
+
+const size_t BUFFER_ALIGNMENT = 4096;
+const size_t SMALLEST_BUFFER_CLASS = 64 * 1024;
+const int BUFFER_CLASSES = 9;            // 64 KB, 128 KB, ... 16 MB
+const int THREAD_CACHED_CLASSES = 5;     // up to 1 MB
+const int THREAD_CACHE_SLOTS = 2;
+const int BUFFER_WAIT_MS = 10000;
+
+class BufferPool;
+
+// A buffer of at least size() bytes, returned to its pool on destruction
+class PooledBuffer {
+public:
+    PooledBuffer() = default;
+    PooledBuffer(BufferPool* pool, char* data, size_t size, size_t capacity, int sizeClass)
+        : pool(pool), bytes(data), length(size), capacityBytes(capacity), sizeClass(sizeClass) {}
+    
+    PooledBuffer(PooledBuffer&& other) noexcept {
+        *this = std::move(other);
+    }
+    
+    PooledBuffer& operator=(PooledBuffer&& other) noexcept;
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    
+    ~PooledBuffer() {
+        reset();
+    }
+    
+    char* data() const {
+        return bytes;
+    }
+    
+    size_t size() const {
+        return length;
+    }
+    
+    explicit operator bool() const {
+        return bytes != nullptr;
+    }
+    
+    void reset();
+
+private:
+    BufferPool* pool = nullptr;
+    char* bytes = nullptr;
+    size_t length = 0;
+    size_t capacityBytes = 0;
+    int sizeClass = -1; // -1: allocated on its own
+};
+
+class BufferPool {
+public:
+    BufferPool(size_t capacity, size_t idleLimit) : capacity(capacity), idleLimit(idleLimit) {}
+    
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+    
+    void setCapacity(size_t bytes) {
+        capacity = bytes;
+        std::lock_guard<std::mutex> lock(mtx);
+        released.notify_all();
+    }
+    
+    // A buffer of size bytes, or an empty one when the cap stayed reached
+    // for BUFFER_WAIT_MS
+    PooledBuffer acquire(size_t size) {
+        int sizeClass = classOf(size);
+        size_t bytes = sizeClass >= 0 ? classBytes(sizeClass) : roundUp(size);
+        acquires.fetch_add(1, std::memory_order_relaxed);
+        if (!reserve(bytes)) {
+            timeouts.fetch_add(1, std::memory_order_relaxed);
+            return PooledBuffer();
+        }
+        
+        char* data = sizeClass >= 0 ? takeCached(sizeClass) : nullptr;
+        if (!data) {
+            data = (char*)aligned_alloc(BUFFER_ALIGNMENT, bytes);
+            if (!data) {
+                unreserve(bytes);
+                return PooledBuffer();
+            }
+            allocations.fetch_add(1, std::memory_order_relaxed);
+        }
+        return PooledBuffer(this, data, size, bytes, sizeClass);
+    }
+    
+    // Stats line: key=value pairs, like the object cache's
+    std::string statsLine() const {
+        return "acquires=" + std::to_string(acquires.load()) +
+               " thread_hits=" + std::to_string(threadHits.load()) +
+               " pool_hits=" + std::to_string(poolHits.load()) +
+               " allocations=" + std::to_string(allocations.load()) +
+               " waits=" + std::to_string(waits.load()) +
+               " timeouts=" + std::to_string(timeouts.load()) +
+               " in_use=" + std::to_string(inUse.load()) +
+               " peak_in_use=" + std::to_string(peakInUse.load()) +
+               " cached=" + std::to_string(cachedBytes.load()) +
+               " capacity=" + std::to_string(capacity.load()) + "\n";
+    }
+    
+    void prometheus(std::string& out, const std::string& prefix) const {
+        prometheusMetric(out, prefix + "buffer_acquires_total", "counter", "Payload buffers requested.", acquires.load());
+        prometheusMetric(out, prefix + "buffer_thread_hits_total", "counter", "Buffers reused from a thread cache.", threadHits.load());
+        prometheusMetric(out, prefix + "buffer_pool_hits_total", "counter", "Buffers reused from the shared free list.", poolHits.load());
+        prometheusMetric(out, prefix + "buffer_allocations_total", "counter", "Buffers allocated from the system.", allocations.load());
+        prometheusMetric(out, prefix + "buffer_waits_total", "counter", "Requests that waited for the buffer cap.", waits.load());
+        prometheusMetric(out, prefix + "buffer_timeouts_total", "counter", "Requests refused at the buffer cap.", timeouts.load());
+        prometheusMetric(out, prefix + "buffer_in_use_bytes", "gauge", "Bytes of buffers handed out.", inUse.load());
+        prometheusMetric(out, prefix + "buffer_cached_bytes", "gauge", "Bytes of free buffers kept for reuse.", cachedBytes.load());
+        prometheusMetric(out, prefix + "buffer_capacity_bytes", "gauge", "Cap on bytes of buffers handed out.", capacity.load());
+    }
+    
+    static size_t classBytes(int sizeClass) {
+        return SMALLEST_BUFFER_CLASS << sizeClass;
+    }
+    
+    // Smallest class that holds size bytes, -1 when none does
+    static int classOf(size_t size) {
+        for (int i = 0; i < BUFFER_CLASSES; i++) {
+            if (size <= classBytes(i)) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+private:
+    friend class PooledBuffer;
+    
+    // Freed buffers a thread keeps for its next requests; handed to the
+    // shared free list when the thread exits
+    struct ThreadCache {
+        BufferPool* owner = nullptr;
+        char* slots[THREAD_CACHED_CLASSES][THREAD_CACHE_SLOTS] = {};
+        int counts[THREAD_CACHED_CLASSES] = {};
+        
+        ~ThreadCache() {
+            for (int i = 0; owner && i < THREAD_CACHED_CLASSES; i++) {
+                while (counts[i] > 0) {
+                    char* data = slots[i][--counts[i]];
+                    owner->cachedBytes.fetch_sub(classBytes(i), std::memory_order_relaxed);
+                    owner->putShared(i, data);
+                }
+            }
+        }
+    };
+    
+    ThreadCache& threadCache() {
+        static thread_local ThreadCache cache;
+        if (!cache.owner) {
+            cache.owner = this;
+        }
+        return cache;
+    }
+    
+    static size_t roundUp(size_t size) {
+        return (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+    }
+    
+    bool tryReserve(size_t bytes) {
+        size_t limit = capacity.load();
+        size_t current = inUse.load();
+        while (current == 0 || current + bytes <= limit) {
+            if (inUse.compare_exchange_weak(current, current + bytes)) {
+                size_t peak = peakInUse.load(std::memory_order_relaxed);
+                while (current + bytes > peak && !peakInUse.compare_exchange_weak(peak, current + bytes, std::memory_order_relaxed)) {
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Below the cap this is one compare-and-swap. Waiters register before
+    // they sleep and re-check once registered, and releases notify only when
+    // someone is registered, so a release cannot slip between the two.
+    bool reserve(size_t bytes) {
+        if (tryReserve(bytes)) {
+            return true;
+        }
+        waits.fetch_add(1, std::memory_order_relaxed);
+        std::unique_lock<std::mutex> lock(mtx);
+        waiting++;
+        bool granted = released.wait_for(lock, std::chrono::milliseconds(BUFFER_WAIT_MS), [&] { return tryReserve(bytes); });
+        waiting--;
+        return granted;
+    }
+    
+    void unreserve(size_t bytes) {
+        inUse.fetch_sub(bytes);
+        if (waiting.load() > 0) {
+            std::lock_guard<std::mutex> lock(mtx);
+            released.notify_all();
+        }
+    }
+    
+    char* takeCached(int sizeClass) {
+        if (sizeClass < THREAD_CACHED_CLASSES) {
+            ThreadCache& cache = threadCache();
+            if (cache.owner == this && cache.counts[sizeClass] > 0) {
+                threadHits.fetch_add(1, std::memory_order_relaxed);
+                cachedBytes.fetch_sub(classBytes(sizeClass), std::memory_order_relaxed);
+                return cache.slots[sizeClass][--cache.counts[sizeClass]];
+            }
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        if (freeLists[sizeClass].empty()) {
+            return nullptr;
+        }
+        char* data = freeLists[sizeClass].back();
+        freeLists[sizeClass].pop_back();
+        sharedBytes -= classBytes(sizeClass);
+        cachedBytes.fetch_sub(classBytes(sizeClass), std::memory_order_relaxed);
+        poolHits.fetch_add(1, std::memory_order_relaxed);
+        return data;
+    }
+    
+    void putShared(int sizeClass, char* data) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (sharedBytes + classBytes(sizeClass) > idleLimit) {
+            free(data);
+            return;
+        }
+        freeLists[sizeClass].push_back(data);
+        sharedBytes += classBytes(sizeClass);
+        cachedBytes.fetch_add(classBytes(sizeClass), std::memory_order_relaxed);
+    }
+    
+    void release(char* data, size_t bytes, int sizeClass) {
+        if (sizeClass < 0) {
+            free(data);
+        } else if (sizeClass < THREAD_CACHED_CLASSES && threadCache().owner == this &&
+                   threadCache().counts[sizeClass] < THREAD_CACHE_SLOTS) {
+            ThreadCache& cache = threadCache();
+            cache.slots[sizeClass][cache.counts[sizeClass]++] = data;
+            cachedBytes.fetch_add(bytes, std::memory_order_relaxed);
+        } else {
+            putShared(sizeClass, data);
+        }
+        unreserve(bytes);
+    }
+    
+    mutable std::mutex mtx;
+    std::condition_variable released;
+    std::atomic<int> waiting{0};
+    std::atomic<size_t> capacity;
+    size_t idleLimit;
+    std::vector<char*> freeLists[BUFFER_CLASSES];
+    size_t sharedBytes = 0;
+    
+    std::atomic<size_t> inUse{0};
+    std::atomic<size_t> peakInUse{0};
+    std::atomic<size_t> cachedBytes{0};
+    std::atomic<uint64_t> acquires{0};
+    std::atomic<uint64_t> threadHits{0};
+    std::atomic<uint64_t> poolHits{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> waits{0};
+    std::atomic<uint64_t> timeouts{0};
+};
+
+inline PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other) noexcept {
+    if (this != &other) {
+        reset();
+        pool = other.pool;
+        bytes = other.bytes;
+        length = other.length;
+        capacityBytes = other.capacityBytes;
+        sizeClass = other.sizeClass;
+        other.pool = nullptr;
+        other.bytes = nullptr;
+    }
+    return *this;
+}
+
+inline void PooledBuffer::reset() {
+    if (bytes) {
+        pool->release(bytes, capacityBytes, sizeClass);
+        bytes = nullptr;
+    }
+}
+
+// The process's pool: 1 GB of buffers out at once and 256 MB kept free by
+// default (--buffer-mb changes the cap on coordinator and nodes)
+inline BufferPool& bufferPool() {
+    static BufferPool pool(1024UL * 1024 * 1024, 256UL * 1024 * 1024);
+    return pool;
+}
+
+#endif
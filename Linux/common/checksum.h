@@ -0,0 +1,126 @@
+#ifndef DFS_COMMON_CHECKSUM_H
+#define DFS_COMMON_CHECKSUM_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// Vectorized byte-sum checksums.
+//
+// The DFS checksum of a buffer is the sum of its bytes, so it maps directly
+// onto the x86 "sum of absolute differences" instruction: PSADBW against
+// zero adds up 8 bytes per 64-bit lane. Every x86-64 CPU has the 16-byte
+// SSE2 form; the 32-byte AVX2 form is used when the CPU reports it. Other
+// architectures get the plain loop, which compilers vectorize well enough.
+//
+// blockByteSums() hashes up to CHECKSUM_LANES blocks in one pass, one
+// accumulator per block, the multi-buffer layout: the loads of independent
+// buffers interleave, so no accumulator waits on another's additions.
+// Results match the scalar loop exactly.
+
+const int CHECKSUM_LANES = 4;
+
+namespace checksum_detail {
+
+inline uint64_t scalarSum(const unsigned char* data, size_t size) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < size; i++) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+#if defined(__x86_64__)
+// Sum the first length bytes of count (up to CHECKSUM_LANES) buffers
+__attribute__((target("avx2"))) inline void sumBuffersAvx2(const unsigned char* const* buffers, int count, size_t length, uint64_t* sums) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc[CHECKSUM_LANES] = {zero, zero, zero, zero};
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        for (int b = 0; b < count; b++) {
+            __m256i bytes = _mm256_loadu_si256((const __m256i*)(buffers[b] + i));
+            acc[b] = _mm256_add_epi64(acc[b], _mm256_sad_epu8(bytes, zero));
+        }
+    }
+    for (int b = 0; b < count; b++) {
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, acc[b]);
+        sums[b] = lanes[0] + lanes[1] + lanes[2] + lanes[3] + scalarSum(buffers[b] + i, length - i);
+    }
+}
+
+inline void sumBuffersSse2(const unsigned char* const* buffers, int count, size_t length, uint64_t* sums) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc[CHECKSUM_LANES] = {zero, zero, zero, zero};
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        for (int b = 0; b < count; b++) {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(buffers[b] + i));
+            acc[b] = _mm_add_epi64(acc[b], _mm_sad_epu8(bytes, zero));
+        }
+    }
+    for (int b = 0; b < count; b++) {
+        uint64_t lanes[2];
+        _mm_storeu_si128((__m128i*)lanes, acc[b]);
+        sums[b] = lanes[0] + lanes[1] + scalarSum(buffers[b] + i, length - i);
+    }
+}
+
+inline bool haveAvx2() {
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    return avx2;
+}
+#endif
+
+inline void sumBuffers(const unsigned char* const* buffers, int count, size_t length, uint64_t* sums) {
+#if defined(__x86_64__)
+    if (haveAvx2()) {
+        sumBuffersAvx2(buffers, count, length, sums);
+    } else {
+        sumBuffersSse2(buffers, count, length, sums);
+    }
+#else
+    for (int b = 0; b < count; b++) {
+        sums[b] = scalarSum(buffers[b], length);
+    }
+#endif
+}
+
+} // namespace checksum_detail
+
+// Byte sum of size bytes
+inline unsigned long byteSum(const char* data, size_t size) {
+    const unsigned char* buffer = (const unsigned char*)data;
+    uint64_t sum;
+    checksum_detail::sumBuffers(&buffer, 1, size, &sum);
+    return (unsigned long)sum;
+}
+
+// Byte sum of each blockSize block of data (the last one may be short),
+// appended to sums
+inline void blockByteSums(const char* data, size_t size, size_t blockSize, std::vector<unsigned long>& sums) {
+    size_t fullBlocks = size / blockSize;
+    size_t block = 0;
+    while (block < fullBlocks) {
+        int count = (int)std::min<size_t>(CHECKSUM_LANES, fullBlocks - block);
+        const unsigned char* buffers[CHECKSUM_LANES];
+        uint64_t laneSums[CHECKSUM_LANES];
+        for (int b = 0; b < count; b++) {
+            buffers[b] = (const unsigned char*)data + (block + b) * blockSize;
+        }
+        checksum_detail::sumBuffers(buffers, count, blockSize, laneSums);
+        for (int b = 0; b < count; b++) {
+            sums.push_back((unsigned long)laneSums[b]);
+        }
+        block += count;
+    }
+    if (fullBlocks * blockSize < size) {
+        sums.push_back(byteSum(data + fullBlocks * blockSize, size - fullBlocks * blockSize));
+    }
+}
+
+#endif
@@ -0,0 +1,433 @@
+#ifndef DFS_COMMON_COMPRESSION_H
+#define DFS_COMMON_COMPRESSION_H
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "probes.h"
+
+#ifdef DFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef DFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Wire compression shared by client, coordinator and nodes.
+//
+// A transfer is compressed only when both ends agree on a codec: the side
+// that will receive data lists what it accepts with a CODECS=lz4,zstd token
+// on its request line and the other side answers CODEC=<name>. Codecs are
+// compiled in with -DDFS_HAVE_LZ4 / -DDFS_HAVE_ZSTD; a binary built without
+// them negotiates "none" and the payload stays the plain byte stream.
+//
+// A compressed payload is a sequence of frames, each covering at most
+// FRAME_RAW_SIZE bytes of the original data:
+//
+//     u8 codec | u32 rawLength | u32 wireLength | wireLength bytes
+//
+// (lengths in network byte order). Frames are independent, so they can be
+// encoded in parallel, streamed as they are produced, and decoded on their
+// own. A frame whose sampled entropy says it will not shrink, or that did
+// not shrink, is sent with codec none instead.
+
+enum class Codec : uint8_t {
+    None = 0,
+    LZ4 = 1,
+    Zstd = 2,
+};
+
+const size_t FRAME_RAW_SIZE = 64 * 1024;
+const size_t FRAME_HEADER_SIZE = 9;
+const size_t FRAME_BATCH = 32;          // frames encoded together before sending
+const int ZSTD_LEVEL = 3;
+const double INCOMPRESSIBLE_BITS = 7.5; // sampled entropy (bits/byte) above which a frame is sent raw
+
+inline const char* codecName(Codec codec) {
+    switch (codec) {
+        case Codec::LZ4: return "lz4";
+        case Codec::Zstd: return "zstd";
+        default: return "none";
+    }
+}
+
+inline bool parseCodec(const std::string& name, Codec& codec) {
+    if (name == "none") {
+        codec = Codec::None;
+    } else if (name == "lz4") {
+        codec = Codec::LZ4;
+    } else if (name == "zstd") {
+        codec = Codec::Zstd;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+inline bool codecAvailable(Codec codec) {
+    switch (codec) {
+        case Codec::None: return true;
+#ifdef DFS_HAVE_LZ4
+        case Codec::LZ4: return true;
+#endif
+#ifdef DFS_HAVE_ZSTD
+        case Codec::Zstd: return true;
+#endif
+        default: return false;
+    }
+}
+
+// Codecs built into this binary, in order of preference: LZ4 first for low
+// latency; zstd trades CPU for a better ratio on slow links
+inline std::vector<Codec> availableCodecs() {
+    std::vector<Codec> codecs;
+    for (Codec codec : {Codec::LZ4, Codec::Zstd}) {
+        if (codecAvailable(codec)) {
+            codecs.push_back(codec);
+        }
+    }
+    return codecs;
+}
+
+// " CODECS=lz4,zstd" for a request line, or "" when nothing is offered
+inline std::string codecOffer(const std::vector<Codec>& codecs) {
+    std::string offer;
+    for (Codec codec : codecs) {
+        if (codec != Codec::None) {
+            offer += (offer.empty() ? " CODECS=" : ",") + std::string(codecName(codec));
+        }
+    }
+    return offer;
+}
+
+// Find the value of a KEY=value token on a request or reply line
+inline bool findToken(const std::string& line, const std::string& key, std::string& value) {
+    size_t pos = 0;
+    while ((pos = line.find(key + "=", pos)) != std::string::npos) {
+        if (pos == 0 || line[pos - 1] == ' ') {
+            size_t start = pos + key.size() + 1;
+            size_t end = line.find_first_of(" \r\n", start);
+            value = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            return true;
+        }
+        pos++;
+    }
+    return false;
+}
+
+// Codecs listed in a CODECS= token, in the sender's order of preference
+inline std::vector<Codec> parseCodecOffer(const std::string& line) {
+    std::vector<Codec> codecs;
+    std::string list;
+    if (!findToken(line, "CODECS", list)) {
+        return codecs;
+    }
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t comma = list.find(',', start);
+        std::string name = list.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+        Codec codec;
+        if (parseCodec(name, codec) && codec != Codec::None) {
+            codecs.push_back(codec);
+        }
+        if (comma == std::string::npos) {
+            break;
+        }
+        start = comma + 1;
+    }
+    return codecs;
+}
+
+// Codec named by a CODEC= token (none when absent or unknown)
+inline Codec parseCodecReply(const std::string& line) {
+    std::string name;
+    Codec codec = Codec::None;
+    if (findToken(line, "CODEC", name) && parseCodec(name, codec) && codecAvailable(codec)) {
+        return codec;
+    }
+    return Codec::None;
+}
+
+// The first codec in the peer's offer that this binary supports
+inline Codec negotiateCodec(const std::vector<Codec>& offered) {
+    for (Codec codec : offered) {
+        if (codecAvailable(codec)) {
+            return codec;
+        }
+    }
+    return Codec::None;
+}
+
+// Keep only the codecs this binary supports, preserving order
+inline std::vector<Codec> supportedSubset(const std::vector<Codec>& offered) {
+    std::vector<Codec> codecs;
+    for (Codec codec : offered) {
+        if (codec != Codec::None && codecAvailable(codec)) {
+            codecs.push_back(codec);
+        }
+    }
+    return codecs;
+}
+
+// Estimate the Shannon entropy of a block from a strided sample. Already
+// compressed or encrypted data sits near 8 bits/byte and is not worth the
+// CPU; text and logs are typically well under 6.
+inline bool looksIncompressible(const char* data, size_t size) {
+    const size_t sampleRuns = 16;
+    const size_t runLength = 256;
+    if (size < sampleRuns * runLength) {
+        return false;
+    }
+    
+    unsigned counts[256] = {0};
+    size_t stride = size / sampleRuns;
+    for (size_t run = 0; run < sampleRuns; run++) {
+        const unsigned char* p = (const unsigned char*)data + run * stride;
+        for (size_t i = 0; i < runLength; i++) {
+            counts[p[i]]++;
+        }
+    }
+    
+    double total = (double)(sampleRuns * runLength);
+    double bits = 0;
+    for (unsigned count : counts) {
+        if (count) {
+            double p = count / total;
+            bits -= p * std::log2(p);
+        }
+    }
+    return bits > INCOMPRESSIBLE_BITS;
+}
+
+inline void putFrameHeader(char* header, Codec codec, uint32_t rawLength, uint32_t wireLength) {
+    header[0] = (char)codec;
+    uint32_t raw = htonl(rawLength);
+    uint32_t wire = htonl(wireLength);
+    memcpy(header + 1, &raw, 4);
+    memcpy(header + 5, &wire, 4);
+}
+
+// Parse a frame header; rejects lengths no valid frame can have
+inline bool parseFrameHeader(const char* header, Codec& codec, uint32_t& rawLength, uint32_t& wireLength) {
+    memcpy(&rawLength, header + 1, 4);
+    memcpy(&wireLength, header + 5, 4);
+    rawLength = ntohl(rawLength);
+    wireLength = ntohl(wireLength);
+    codec = (Codec)header[0];
+    return rawLength > 0 && rawLength <= FRAME_RAW_SIZE && wireLength <= 2 * FRAME_RAW_SIZE;
+}
+
+// Append one frame holding data[0, size) (size <= FRAME_RAW_SIZE) to out
+inline void appendFrame(Codec codec, const char* data, size_t size, std::vector<char>& out) {
+    size_t start = out.size();
+    if (codec != Codec::None && looksIncompressible(data, size)) {
+        codec = Codec::None;
+    }
+    
+    int wireLength = -1;
+#ifdef DFS_HAVE_LZ4
+    if (codec == Codec::LZ4) {
+        out.resize(start + FRAME_HEADER_SIZE + LZ4_compressBound((int)size));
+        wireLength = LZ4_compress_default(data, out.data() + start + FRAME_HEADER_SIZE, (int)size,
+                                          (int)(out.size() - start - FRAME_HEADER_SIZE));
+    }
+#endif
+#ifdef DFS_HAVE_ZSTD
+    if (codec == Codec::Zstd) {
+        // One context per thread: creating one per frame would dominate small frames
+        thread_local ZSTD_CCtx* context = ZSTD_createCCtx();
+        out.resize(start + FRAME_HEADER_SIZE + ZSTD_compressBound(size));
+        size_t n = ZSTD_compressCCtx(context, out.data() + start + FRAME_HEADER_SIZE,
+                                     out.size() - start - FRAME_HEADER_SIZE, data, size, ZSTD_LEVEL);
+        wireLength = ZSTD_isError(n) ? -1 : (int)n;
+    }
+#endif
+    
+    // Fall back to a raw frame when compression failed or did not pay off
+    if (wireLength <= 0 || (size_t)wireLength >= size) {
+        codec = Codec::None;
+        wireLength = (int)size;
+        out.resize(start + FRAME_HEADER_SIZE + size);
+        memcpy(out.data() + start + FRAME_HEADER_SIZE, data, size);
+    }
+    out.resize(start + FRAME_HEADER_SIZE + wireLength);
+    putFrameHeader(out.data() + start, codec, (uint32_t)size, (uint32_t)wireLength);
+}
+
+// Encode data as frames. Large inputs are split across threads, each
+// encoding a contiguous run of frames, and joined in order.
+inline std::vector<char> encodeFrames(Codec codec, const char* data, size_t size, unsigned threads = 0) {
+    size_t frames = (size + FRAME_RAW_SIZE - 1) / FRAME_RAW_SIZE;
+    if (threads == 0) {
+        threads = std::max(1u, std::min(4u, std::thread::hardware_concurrency()));
+    }
+    if (codec == Codec::None || frames < 4) {
+        threads = 1;
+    }
+    threads = (unsigned)std::min<size_t>(threads, std::max<size_t>(frames, 1));
+    
+    std::vector<std::vector<char>> pieces(threads);
+    auto encodeRange = [&](unsigned index) {
+        size_t first = frames * index / threads;
+        size_t last = frames * (index + 1) / threads;
+        for (size_t frame = first; frame < last; frame++) {
+            size_t offset = frame * FRAME_RAW_SIZE;
+            appendFrame(codec, data + offset, std::min(FRAME_RAW_SIZE, size - offset), pieces[index]);
+        }
+    };
+    
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; i++) {
+        workers.emplace_back(encodeRange, i);
+    }
+    encodeRange(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    
+    for (unsigned i = 1; i < threads; i++) {
+        pieces[0].insert(pieces[0].end(), pieces[i].begin(), pieces[i].end());
+    }
+    return std::move(pieces[0]);
+}
+
+// Decode one frame's payload into out, which has room for rawLength bytes
+inline bool decodeFrame(Codec codec, const char* wire, size_t wireLength, char* out, size_t rawLength) {
+    if (codec == Codec::None) {
+        if (wireLength != rawLength) {
+            return false;
+        }
+        memcpy(out, wire, rawLength);
+        return true;
+    }
+#ifdef DFS_HAVE_LZ4
+    if (codec == Codec::LZ4) {
+        return LZ4_decompress_safe(wire, out, (int)wireLength, (int)rawLength) == (int)rawLength;
+    }
+#endif
+#ifdef DFS_HAVE_ZSTD
+    if (codec == Codec::Zstd) {
+        thread_local ZSTD_DCtx* context = ZSTD_createDCtx();
+        size_t n = ZSTD_decompressDCtx(context, out, rawLength, wire, wireLength);
+        return !ZSTD_isError(n) && n == rawLength;
+    }
+#endif
+    return false;
+}
+
+// Decode a complete frame sequence into out[0, rawLength)
+inline bool decodeFrames(const char* wire, size_t wireLength, char* out, size_t rawLength) {
+    size_t in = 0, produced = 0;
+    while (produced < rawLength) {
+        if (wireLength - in < FRAME_HEADER_SIZE) {
+            return false;
+        }
+        Codec codec;
+        uint32_t raw, length;
+        if (!parseFrameHeader(wire + in, codec, raw, length)) {
+            return false;
+        }
+        in += FRAME_HEADER_SIZE;
+        if (raw > rawLength - produced || length > wireLength - in ||
+            !decodeFrame(codec, wire + in, length, out + produced, raw)) {
+            return false;
+        }
+        in += length;
+        produced += raw;
+    }
+    return in == wireLength;
+}
+
+inline bool sendAll(int sock, const char* data, size_t size) {
+    DFS_PROBE2(send__start, sock, size);
+    size_t totalSent = 0;
+    while (totalSent < size) {
+        ssize_t sent = send(sock, data + totalSent, size - totalSent, 0);
+        if (sent <= 0) {
+            DFS_PROBE3(send__done, sock, totalSent, 0);
+            return false;
+        }
+        totalSent += sent;
+    }
+    DFS_PROBE3(send__done, sock, totalSent, 1);
+    return true;
+}
+
+inline bool recvAll(int sock, char* data, size_t size) {
+    DFS_PROBE2(recv__start, sock, size);
+    size_t totalReceived = 0;
+    while (totalReceived < size) {
+        ssize_t received = recv(sock, data + totalReceived, size - totalReceived, 0);
+        if (received <= 0) {
+            DFS_PROBE3(recv__done, sock, totalReceived, 0);
+            return false;
+        }
+        totalReceived += received;
+    }
+    DFS_PROBE3(recv__done, sock, totalReceived, 1);
+    return true;
+}
+
+// Send size bytes of payload using the negotiated codec. Frames are encoded
+// FRAME_BATCH at a time so memory stays bounded and sending starts early.
+inline bool sendPayload(int sock, Codec codec, const char* data, size_t size) {
+    if (codec == Codec::None) {
+        return sendAll(sock, data, size);
+    }
+    const size_t batch = FRAME_RAW_SIZE * FRAME_BATCH;
+    for (size_t offset = 0; offset < size; offset += batch) {
+        std::vector<char> frames = encodeFrames(codec, data + offset, std::min(batch, size - offset));
+        if (!sendAll(sock, frames.data(), frames.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Receive rawLength bytes of payload sent with the negotiated codec into out.
+// When wire is given, the bytes exactly as received are appended to it, so a
+// relay can forward a compressed payload without encoding it again.
+inline bool recvPayload(int sock, Codec codec, char* out, size_t rawLength, std::vector<char>* wire = nullptr) {
+    if (codec == Codec::None) {
+        if (!recvAll(sock, out, rawLength)) {
+            return false;
+        }
+        if (wire) {
+            wire->insert(wire->end(), out, out + rawLength);
+        }
+        return true;
+    }
+    
+    std::vector<char> frame;
+    size_t produced = 0;
+    while (produced < rawLength) {
+        char header[FRAME_HEADER_SIZE];
+        if (!recvAll(sock, header, FRAME_HEADER_SIZE)) {
+            return false;
+        }
+        Codec frameCodec;
+        uint32_t raw, length;
+        if (!parseFrameHeader(header, frameCodec, raw, length) || raw > rawLength - produced) {
+            return false;
+        }
+        frame.resize(length);
+        if (!recvAll(sock, frame.data(), length) ||
+            !decodeFrame(frameCodec, frame.data(), length, out + produced, raw)) {
+            return false;
+        }
+        if (wire) {
+            wire->insert(wire->end(), header, header + FRAME_HEADER_SIZE);
+            wire->insert(wire->end(), frame.begin(), frame.end());
+        }
+        produced += raw;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef DFS_COMMON_DEDUP_H
+#define DFS_COMMON_DEDUP_H
+
+#include <sstream>
+#include <string>
+#include <vector>
+#include "sha256.h"
+
+// Content-addressed block deduplication shared by client, coordinator and
+// nodes.
+//
+// A deduplicated upload cuts the file into DEDUP_BLOCK_SIZE blocks (the last
+// one may be short) and names each block by the SHA-256 of its contents. The
+// upload is described by a block list, one line per block:
+//
+//     <sha256 hex> <checksum>
+//
+// Nodes keep every distinct block once under .blocks/ and store the file as
+// a manifest of block hashes, so only blocks the target nodes do not already
+// hold cross the network.
+
+const long long DEDUP_BLOCK_SIZE = 256 * 1024; // a multiple of the nodes' checksum block
+const long long MAX_DEDUP_BLOCKS = 65536;      // 16 GiB per deduplicated file
+
+struct BlockRef {
+    std::string hash;
+    unsigned long checksum;
+};
+
+inline long long dedupBlockCount(long long size) {
+    return (size + DEDUP_BLOCK_SIZE - 1) / DEDUP_BLOCK_SIZE;
+}
+
+inline long long dedupBlockSize(long long size, long long index) {
+    long long remaining = size - index * DEDUP_BLOCK_SIZE;
+    return remaining < DEDUP_BLOCK_SIZE ? remaining : DEDUP_BLOCK_SIZE;
+}
+
+// Block hashes arrive on request lines and name files: accept exactly 64
+// lowercase hex digits
+inline bool validBlockHash(const std::string& hash) {
+    if (hash.size() != 64) {
+        return false;
+    }
+    for (char c : hash) {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline std::string formatBlockList(const std::vector<BlockRef>& blocks) {
+    std::string text;
+    text.reserve(blocks.size() * 80);
+    for (const BlockRef& block : blocks) {
+        text += block.hash + " " + std::to_string(block.checksum) + "\n";
+    }
+    return text;
+}
+
+// Parse a block list for a file of the given size; false unless it names a
+// valid hash for every block
+inline bool parseBlockList(const std::string& text, long long size, std::vector<BlockRef>& blocks) {
+    long long count = dedupBlockCount(size);
+    if (size <= 0 || count > MAX_DEDUP_BLOCKS) {
+        return false;
+    }
+    blocks.clear();
+    std::istringstream in(text);
+    BlockRef block;
+    while (in >> block.hash >> block.checksum) {
+        if (!validBlockHash(block.hash) || (long long)blocks.size() == count) {
+            return false;
+        }
+        blocks.push_back(block);
+    }
+    return in.eof() && (long long)blocks.size() == count;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef DFS_COMMON_DELTA_H
+#define DFS_COMMON_DELTA_H
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "sha256.h"
+
+// Delta uploads (rsync-style) shared by client and nodes.
+//
+// Both sides cut a file into content-defined chunks: a gear rolling hash
+// runs over the bytes and a chunk ends where the hash matches a mask, so an
+// insert or delete only moves the boundaries next to it and every other
+// chunk keeps its contents and its hash. A node describes the version it
+// holds by a signature, one line per chunk:
+//
+//     <length> <strong hash>
+//
+// where the strong hash is the first 128 bits of the chunk's SHA-256. The
+// client cuts its new version the same way and sends a delta of
+//
+//     C <offset> <length>\n        copy bytes of the old version
+//     L <length>\n<bytes>          literal bytes
+//
+// so the bytes on the wire grow with the edit, not with the file.
+
+const size_t CDC_MIN_CHUNK = 4 * 1024;
+const size_t CDC_AVG_CHUNK = 16 * 1024;
+const size_t CDC_MAX_CHUNK = 64 * 1024;
+const size_t CDC_READ_SIZE = 4 * 1024 * 1024; // bytes read at a time while chunking
+
+// Normalized chunking (as in FastCDC): a harder mask up to the average size
+// and an easier one after it keep chunk sizes close to the average. The gear
+// hash shifts left, so its top bits depend on the most recent bytes.
+const uint64_t CDC_MASK_HARD = ~0ULL << (64 - 16);
+const uint64_t CDC_MASK_EASY = ~0ULL << (64 - 12);
+
+struct ChunkSig {
+    long long offset;
+    long long length;
+    std::string hash;
+};
+
+// 256 fixed pseudo-random words (splitmix64), identical in every binary
+inline const uint64_t* gearTable() {
+    static const std::vector<uint64_t> table = [] {
+        std::vector<uint64_t> words(256);
+        uint64_t state = 0x9e3779b97f4a7c15ULL;
+        for (uint64_t& word : words) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            word = z ^ (z >> 31);
+        }
+        return words;
+    }();
+    return table.data();
+}
+
+// Length of the chunk that starts at data, given size bytes of lookahead
+// (at least CDC_MAX_CHUNK unless the file ends sooner). The hash restarts at
+// every chunk and the first CDC_MIN_CHUNK bytes are skipped, since no cut
+// may fall there anyway.
+inline size_t cdcCut(const unsigned char* data, size_t size) {
+    if (size <= CDC_MIN_CHUNK) {
+        return size;
+    }
+    const uint64_t* gear = gearTable();
+    size_t end = size < CDC_MAX_CHUNK ? size : CDC_MAX_CHUNK;
+    size_t normal = end < CDC_AVG_CHUNK ? end : CDC_AVG_CHUNK;
+    uint64_t hash = 0;
+    size_t i = CDC_MIN_CHUNK;
+    for (; i < normal; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CDC_MASK_HARD) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; i++) {
+        hash = (hash << 1) + gear[data[i]];
+        if ((hash & CDC_MASK_EASY) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+inline std::string chunkHash(const char* data, size_t size) {
+    return Sha256::hash(data, size).substr(0, 32);
+}
+
+// Cut the size bytes that read(offset, length, out) returns into chunks,
+// reading CDC_READ_SIZE bytes at a time
+template <typename Read>
+bool chunkFile(long long size, Read read, std::vector<ChunkSig>& chunks) {
+    chunks.clear();
+    std::vector<char> buffer(CDC_READ_SIZE);
+    long long bufferStart = 0; // file offset of buffer[0]
+    size_t filled = 0;
+    size_t pos = 0;
+    while (bufferStart + (long long)pos < size) {
+        // Keep a whole maximum-size chunk of lookahead in the buffer
+        if (filled - pos < CDC_MAX_CHUNK && bufferStart + (long long)filled < size) {
+            memmove(buffer.data(), buffer.data() + pos, filled - pos);
+            bufferStart += pos;
+            filled -= pos;
+            pos = 0;
+            long long left = size - (bufferStart + (long long)filled);
+            size_t want = (long long)(buffer.size() - filled) < left ? buffer.size() - filled : (size_t)left;
+            if (!read(bufferStart + (long long)filled, (long long)want, buffer.data() + filled)) {
+                return false;
+            }
+            filled += want;
+        }
+        size_t length = cdcCut((const unsigned char*)buffer.data() + pos, filled - pos);
+        chunks.push_back(ChunkSig{bufferStart + (long long)pos, (long long)length, chunkHash(buffer.data() + pos, length)});
+        pos += length;
+    }
+    return true;
+}
+
+inline std::string formatSignature(const std::vector<ChunkSig>& chunks) {
+    std::string text;
+    text.reserve(chunks.size() * 40);
+    for (const ChunkSig& chunk : chunks) {
+        text += std::to_string(chunk.length) + " " + chunk.hash + "\n";
+    }
+    return text;
+}
+
+// Parse a signature back into chunks with their offsets in the old version
+inline bool parseSignature(const std::string& text, std::vector<ChunkSig>& chunks) {
+    chunks.clear();
+    std::istringstream in(text);
+    ChunkSig chunk;
+    long long offset = 0;
+    while (in >> chunk.length >> chunk.hash) {
+        if (chunk.length <= 0 || chunk.length > (long long)CDC_MAX_CHUNK || chunk.hash.size() != 32) {
+            return false;
+        }
+        chunk.offset = offset;
+        offset += chunk.length;
+        chunks.push_back(chunk);
+    }
+    return in.eof();
+}
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef DFS_COMMON_HISTOGRAM_H
+#define DFS_COMMON_HISTOGRAM_H
+
+#include <cstdint>
+#include <vector>
+
+// Log-linear histogram in the style of HdrHistogram: values below 2^SUB_BITS
+// get a bucket each, and every power of two above that is split into
+// 2^SUB_BITS equal buckets, so any recorded value is reported within
+// 1/2^SUB_BITS (about 3%) of its true value with a fixed, small table.
+class Histogram {
+public:
+    static const int SUB_BITS = 5;
+    static const int SUB_COUNT = 1 << SUB_BITS;
+    static const int BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+
+    Histogram() : counts(BUCKETS, 0) {}
+
+    static int bucketOf(uint64_t value) {
+        if (value < (uint64_t)SUB_COUNT) {
+            return (int)value;
+        }
+        int msb = 63 - __builtin_clzll(value);
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + (int)((value >> shift) - SUB_COUNT);
+    }
+
+    // Largest value that falls in a bucket
+    static uint64_t bucketHigh(int bucket) {
+        if (bucket < SUB_COUNT) {
+            return (uint64_t)bucket;
+        }
+        int shift = bucket / SUB_COUNT - 1;
+        uint64_t base = (uint64_t)(bucket % SUB_COUNT + SUB_COUNT) << shift;
+        return base + ((1ULL << shift) - 1);
+    }
+
+    void record(uint64_t value) {
+        record(value, 1);
+    }
+    
+    // Record count occurrences of value at once
+    void record(uint64_t value, uint64_t count) {
+        if (count == 0) {
+            return;
+        }
+        counts[bucketOf(value)] += count;
+        if (total == 0 || value < minValue) {
+            minValue = value;
+        }
+        if (value > maxValue) {
+            maxValue = value;
+        }
+        total += count;
+        sum += value * count;
+    }
+
+    void merge(const Histogram& other) {
+        for (int i = 0; i < BUCKETS; i++) {
+            counts[i] += other.counts[i];
+        }
+        if (other.total > 0 && (total == 0 || other.minValue < minValue)) {
+            minValue = other.minValue;
+        }
+        if (other.maxValue > maxValue) {
+            maxValue = other.maxValue;
+        }
+        total += other.total;
+        sum += other.sum;
+    }
+
+    // Value at quantile q (0..1), reported as the top of its bucket but never
+    // above the largest value recorded
+    uint64_t percentile(double q) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(q * total + 0.5);
+        if (rank < 1) {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                uint64_t high = bucketHigh(i);
+                return high < maxValue ? high : maxValue;
+            }
+        }
+        return maxValue;
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t min() const {
+        return minValue;
+    }
+
+    uint64_t max() const {
+        return maxValue;
+    }
+
+    double mean() const {
+        return total ? (double)sum / total : 0;
+    }
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t minValue = 0;
+    uint64_t maxValue = 0;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef DFS_COMMON_KEEPALIVE_H
+#define DFS_COMMON_KEEPALIVE_H
+
+#include <poll.h>
+#include <string>
+#include "compression.h"
+
+// Persistent connections for clients that issue many requests.
+//
+// A request line with a KEEPALIVE=1 token asks the server to leave the
+// connection open once the reply is complete. The server honours it only
+// for commands whose replies are self-delimiting (a line, or a header that
+// gives the payload length) and only when the request succeeded, so no
+// unread payload can be left in the socket. Any error closes the connection
+// as before. An open connection that carries no new request line within
+// KEEPALIVE_IDLE_MS is closed by the server.
+
+const int KEEPALIVE_IDLE_MS = 30000;
+
+inline bool keepAliveRequested(const std::string& line) {
+    std::string value;
+    return findToken(line, "KEEPALIVE", value) && value == "1";
+}
+
+// Wait until the peer sends something (or closes); false on timeout
+inline bool waitReadable(int sock, int timeoutMs) {
+    pollfd waiting{sock, POLLIN, 0};
+    return poll(&waiting, 1, timeoutMs) == 1;
+}
+
+#endif
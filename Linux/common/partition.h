@@ -0,0 +1,144 @@
+#ifndef DFS_COMMON_PARTITION_H
+#define DFS_COMMON_PARTITION_H
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Namespace partitioning across several coordinators.
+//
+// Each coordinator owns the paths whose hash falls in its partition and keeps
+// only their metadata. The map is static: a cluster of N coordinators is
+// started with --partitions N, and partition p listens on
+// PARTITION_BASE_PORT - p, so partition 0 is the usual coordinator port and
+// the others sit below it, clear of the node ports. Any coordinator answers
+// PARTITIONS with the whole map:
+//
+//     PARTITIONS <count> <port of partition 0> <port of partition 1> ...
+//
+// Clients and nodes fetch it once from the coordinator on the base port and
+// then route each request by path: UPLOAD, DEDUP_PUT, DELTA_PUT, DOWNLOAD,
+// LOCATE and MPU_BEGIN go to the path's partition, the other MPU_* commands
+// follow the MPU_BEGIN that created the upload, LIST is asked of every
+// partition and merged, and nodes REGISTER with all of them. A coordinator
+// refuses a path it does not own with "ERROR: Wrong partition ...". A
+// coordinator that does not know PARTITIONS counts as a map of one.
+
+const int PARTITION_BASE_PORT = 9000;
+const int MAX_PARTITIONS = 64;
+
+class PartitionMap {
+public:
+    // A map of count partitions on the default ports
+    static PartitionMap uniform(int count) {
+        PartitionMap map;
+        for (int p = 0; p < count; p++) {
+            map.ports.push_back(PARTITION_BASE_PORT - p);
+        }
+        return map;
+    }
+    
+    // Parse a PARTITIONS reply; false leaves map unchanged
+    static bool parse(const std::string& line, PartitionMap& map) {
+        std::stringstream ss(line);
+        std::string tag;
+        int count = 0;
+        if (!(ss >> tag >> count) || tag != "PARTITIONS" || count < 1 || count > MAX_PARTITIONS) {
+            return false;
+        }
+        PartitionMap parsed;
+        int port;
+        while ((int)parsed.ports.size() < count && ss >> port) {
+            parsed.ports.push_back(port);
+        }
+        if ((int)parsed.ports.size() != count) {
+            return false;
+        }
+        map = parsed;
+        return true;
+    }
+    
+    std::string line() const {
+        std::string out = "PARTITIONS " + std::to_string(ports.size());
+        for (int port : ports) {
+            out += " " + std::to_string(port);
+        }
+        return out + "\n";
+    }
+    
+    int count() const {
+        return (int)ports.size();
+    }
+    
+    // FNV-1a of the path; stable across processes and builds
+    int partitionOf(const std::string& dfsPath) const {
+        uint64_t hash = 1469598103934665603ULL;
+        for (unsigned char c : dfsPath) {
+            hash = (hash ^ c) * 1099511628211ULL;
+        }
+        return (int)(hash % ports.size());
+    }
+    
+    int portFor(const std::string& dfsPath) const {
+        return ports[partitionOf(dfsPath)];
+    }
+    
+    std::vector<int> ports; // partition → coordinator port
+};
+
+// Send a one-line request to a coordinator and return its one-line reply,
+// "" when it cannot be reached
+inline std::string requestCoordinatorLine(const std::string& host, int port, const std::string& request) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return "";
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    std::string reply;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0 &&
+        send(sock, request.c_str(), request.size(), 0) == (ssize_t)request.size()) {
+        char c;
+        while (recv(sock, &c, 1, 0) == 1 && c != '\n') {
+            reply += c;
+        }
+    }
+    close(sock);
+    return reply;
+}
+
+// Ask the coordinator on seedPort for the map. A coordinator that is down
+// or predates partitioning yields the single-coordinator map.
+inline PartitionMap requestPartitionMap(const std::string& host, int seedPort) {
+    PartitionMap map;
+    map.ports.push_back(seedPort);
+    PartitionMap::parse(requestCoordinatorLine(host, seedPort, "PARTITIONS\n"), map);
+    return map;
+}
+
+// Ports of the read-only followers of the coordinator on port (see
+// coordinator/metadata_log.h); empty when it has none or is unreachable.
+// Clients send LOCATE, DOWNLOAD and LIST to a follower and fall back to the
+// primary on any ERROR reply, which covers a follower that is stale, down,
+// or has not yet seen a file that was just written.
+inline std::vector<int> requestFollowers(const std::string& host, int port) {
+    std::stringstream ss(requestCoordinatorLine(host, port, "FOLLOWERS\n"));
+    std::vector<int> ports;
+    std::string tag;
+    int follower;
+    if (ss >> tag && tag == "FOLLOWERS") {
+        while (ss >> follower) {
+            ports.push_back(follower);
+        }
+    }
+    return ports;
+}
+
+#endif
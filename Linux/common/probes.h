@@ -0,0 +1,54 @@
+#ifndef DFS_COMMON_PROBES_H
+#define DFS_COMMON_PROBES_H
+
+// Static probe points (USDT) on the request and I/O hot paths.
+//
+// Built against <sys/sdt.h> (systemtap-sdt-dev on Debian and Ubuntu,
+// systemtap-sdt-devel on Fedora), every DFS_PROBEn compiles to a single nop
+// plus a note in the ELF file that says where the arguments live. Nothing
+// runs until a tracer such as bpftrace attaches to a running process, so
+// the daemons never need a rebuild or restart to be traced. Without the
+// header, or with -DDFS_NO_PROBES, the macros expand to nothing and their
+// arguments are not evaluated.
+//
+// Every probe belongs to the provider "dfs". Probes named x__start and
+// x__done bracket one phase on one thread; the scripts in tools/bpftrace
+// pair them by thread id. The "__" shows as "-" in `readelf -n` output.
+
+#if !defined(DFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define DFS_PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef DFS_PROBES_ENABLED
+#define DFS_PROBE0(name) DTRACE_PROBE(dfs, name)
+#define DFS_PROBE1(name, a) DTRACE_PROBE1(dfs, name, a)
+#define DFS_PROBE2(name, a, b) DTRACE_PROBE2(dfs, name, a, b)
+#define DFS_PROBE3(name, a, b, c) DTRACE_PROBE3(dfs, name, a, b, c)
+#else
+#define DFS_PROBE0(name) do {} while (0)
+#define DFS_PROBE1(name, a) do {} while (0)
+#define DFS_PROBE2(name, a, b) do {} while (0)
+#define DFS_PROBE3(name, a, b, c) do {} while (0)
+#endif
+
+// Runs a probe (or anything else) when the scope ends, so a handler with
+// many returns fires its __done probe once on every path
+template <typename F>
+class ProbeOnExit {
+public:
+    explicit ProbeOnExit(F fire) : fire(fire) {}
+    ProbeOnExit(const ProbeOnExit&) = delete;
+    ProbeOnExit& operator=(const ProbeOnExit&) = delete;
+    
+    ~ProbeOnExit() {
+        fire();
+    }
+
+private:
+    F fire;
+};
+
+#endif
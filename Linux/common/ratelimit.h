@@ -0,0 +1,58 @@
+#ifndef DFS_COMMON_RATELIMIT_H
+#define DFS_COMMON_RATELIMIT_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+// Token bucket for background work that must not crowd out requests: the
+// scrubber's reads on a node, the coordinator's rebalancing copies. Callers
+// take bytes before they move them and sleep while the bucket is empty. At
+// most one second of budget accumulates while idle, so a pause is not
+// followed by a burst. A rate of 0 means unlimited.
+class RateLimiter {
+public:
+    explicit RateLimiter(double bytesPerSecond) : rate(bytesPerSecond) {}
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    void setRate(double bytesPerSecond) {
+        rate = bytesPerSecond;
+    }
+
+    double bytesPerSecond() const {
+        return rate.load();
+    }
+
+    // Block until bytes may be moved
+    void acquire(double bytes) {
+        std::chrono::duration<double> wait;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            double limit = rate.load();
+            if (limit <= 0) {
+                return;
+            }
+            auto now = std::chrono::steady_clock::now();
+            std::chrono::duration<double> idle = now - last;
+            last = now;
+            tokens = std::min(limit, tokens + idle.count() * limit) - bytes;
+            // The debt is paid by sleeping; concurrent callers queue behind it
+            wait = std::chrono::duration<double>(tokens < 0 ? -tokens / limit : 0);
+        }
+        if (wait.count() > 0) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+
+private:
+    std::mutex mtx;
+    std::atomic<double> rate;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+};
+
+#endif
@@ -0,0 +1,226 @@
+#ifndef DFS_COMMON_STATS_H
+#define DFS_COMMON_STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "histogram.h"
+
+// Per-operation request statistics for coordinator and nodes, served by the
+// STATS command.
+//
+// Every request type has counters for requests, errors and payload bytes in
+// each direction, plus a latency histogram in microseconds with the bucket
+// layout of Histogram. Recording one request is a few relaxed atomic adds,
+// with no lock, so it can run on every request. A STATS reader sees every
+// counter exactly. It may not see the counters of one request all at once.
+
+// Histogram that many threads record into without a lock
+class AtomicHistogram {
+public:
+    AtomicHistogram() : counts(new std::atomic<uint64_t>[Histogram::BUCKETS]()) {}
+    
+    void record(uint64_t value) {
+        counts[Histogram::bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sumValue.fetch_add(value, std::memory_order_relaxed);
+        uint64_t seen = maxValue.load(std::memory_order_relaxed);
+        while (value > seen && !maxValue.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+        }
+    }
+    
+    // Copy for percentiles; values are placed at the top of their bucket
+    Histogram snapshot() const {
+        Histogram copy;
+        for (int i = 0; i < Histogram::BUCKETS; i++) {
+            copy.record(Histogram::bucketHigh(i), counts[i].load(std::memory_order_relaxed));
+        }
+        return copy;
+    }
+    
+    // Number of values below 2^bit for each bit in [firstBit, lastBit], in
+    // one pass (bucket edges fall on every power of two)
+    std::vector<uint64_t> countsBelowPowers(int firstBit, int lastBit) const {
+        std::vector<uint64_t> below;
+        uint64_t seen = 0;
+        int i = 0;
+        for (int bit = firstBit; bit <= lastBit; bit++) {
+            for (; i < Histogram::BUCKETS && Histogram::bucketHigh(i) < (1ULL << bit); i++) {
+                seen += counts[i].load(std::memory_order_relaxed);
+            }
+            below.push_back(seen);
+        }
+        return below;
+    }
+    
+    uint64_t count() const {
+        return total.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t sum() const {
+        return sumValue.load(std::memory_order_relaxed);
+    }
+    
+    uint64_t max() const {
+        return maxValue.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::unique_ptr<std::atomic<uint64_t>[]> counts;
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> sumValue{0};
+    std::atomic<uint64_t> maxValue{0};
+};
+
+struct OpStats {
+    std::string name;
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> bytesIn{0};  // payload received from the peer
+    std::atomic<uint64_t> bytesOut{0}; // payload sent to the peer
+    AtomicHistogram latencyUs;
+};
+
+// What the handler of the current request moved and whether it failed. The
+// dispatcher resets it for each request and records it with the request.
+struct RequestTally {
+    uint64_t bytesIn = 0;
+    uint64_t bytesOut = 0;
+    bool failed = false;
+};
+
+inline RequestTally& requestTally() {
+    static thread_local RequestTally tally;
+    return tally;
+}
+
+class RequestStats {
+public:
+    // The operations are fixed at startup, so recording needs no lock; a
+    // request that matches none of them counts under OTHER
+    explicit RequestStats(const std::vector<std::string>& names) : started(std::chrono::steady_clock::now()) {
+        for (const std::string& name : names) {
+            ops.emplace_back();
+            ops.back().name = name;
+        }
+        ops.emplace_back();
+        ops.back().name = "OTHER";
+    }
+    
+    OpStats& op(const std::string& name) {
+        for (OpStats& stats : ops) {
+            if (stats.name == name) {
+                return stats;
+            }
+        }
+        return ops.back();
+    }
+    
+    void record(OpStats& stats, std::chrono::steady_clock::time_point start, const RequestTally& tally) {
+        uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        stats.requests.fetch_add(1, std::memory_order_relaxed);
+        if (tally.failed) {
+            stats.errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        stats.bytesIn.fetch_add(tally.bytesIn, std::memory_order_relaxed);
+        stats.bytesOut.fetch_add(tally.bytesOut, std::memory_order_relaxed);
+        stats.latencyUs.record(micros);
+    }
+    
+    double uptimeSeconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    }
+    
+    // One line per operation that has served requests, for people:
+    //     <op> requests=<n> errors=<n> bytes_in=<n> bytes_out=<n> p50_us=<n> ...
+    std::string text() const {
+        std::string out = "uptime_seconds=" + std::to_string((long long)uptimeSeconds()) + "\n";
+        for (const OpStats& stats : ops) {
+            uint64_t requests = stats.requests.load(std::memory_order_relaxed);
+            if (requests == 0) {
+                continue;
+            }
+            // The snapshot only knows buckets, so cap at the exact maximum
+            Histogram latency = stats.latencyUs.snapshot();
+            uint64_t maxUs = stats.latencyUs.max();
+            auto percentile = [&](double q) { return std::to_string(std::min(latency.percentile(q), maxUs)); };
+            out += stats.name + " requests=" + std::to_string(requests) +
+                   " errors=" + std::to_string(stats.errors.load(std::memory_order_relaxed)) +
+                   " bytes_in=" + std::to_string(stats.bytesIn.load(std::memory_order_relaxed)) +
+                   " bytes_out=" + std::to_string(stats.bytesOut.load(std::memory_order_relaxed)) +
+                   " mean_us=" + std::to_string(stats.latencyUs.count() ? stats.latencyUs.sum() / stats.latencyUs.count() : 0) +
+                   " p50_us=" + percentile(0.50) +
+                   " p90_us=" + percentile(0.90) +
+                   " p99_us=" + percentile(0.99) +
+                   " p999_us=" + percentile(0.999) +
+                   " max_us=" + std::to_string(maxUs) + "\n";
+        }
+        return out;
+    }
+    
+    // Prometheus text exposition format (version 0.0.4). Metric names start
+    // with prefix. Latency buckets are powers of two from 16 us to about 33 s.
+    // Histogram series appear once an operation has served a request.
+    std::string prometheus(const std::string& prefix) const {
+        std::string out;
+        out.reserve(16 * 1024);
+        auto counter = [&](const std::string& name, const std::string& help, std::atomic<uint64_t> OpStats::*field) {
+            out += "# HELP " + prefix + name + " " + help + "\n# TYPE " + prefix + name + " counter\n";
+            for (const OpStats& stats : ops) {
+                out += prefix + name + "{op=\"" + stats.name + "\"} " +
+                       std::to_string((stats.*field).load(std::memory_order_relaxed)) + "\n";
+            }
+        };
+        counter("requests_total", "Requests served, by command.", &OpStats::requests);
+        counter("errors_total", "Requests answered with an error, by command.", &OpStats::errors);
+        counter("received_bytes_total", "Payload bytes received, by command.", &OpStats::bytesIn);
+        counter("sent_bytes_total", "Payload bytes sent, by command.", &OpStats::bytesOut);
+        
+        std::string name = prefix + "request_duration_seconds";
+        out += "# HELP " + name + " Time to serve a request, by command.\n# TYPE " + name + " histogram\n";
+        for (const OpStats& stats : ops) {
+            uint64_t count = stats.latencyUs.count();
+            if (count == 0) {
+                continue;
+            }
+            std::string label = "{op=\"" + stats.name + "\",le=\"";
+            std::vector<uint64_t> below = stats.latencyUs.countsBelowPowers(4, 25);
+            for (int bit = 4; bit <= 25; bit++) {
+                char le[32];
+                snprintf(le, sizeof(le), "%.9g", (double)(1ULL << bit) / 1e6);
+                out += name + "_bucket" + label + le + "\"} " + std::to_string(below[bit - 4]) + "\n";
+            }
+            out += name + "_bucket" + label + "+Inf\"} " + std::to_string(count) + "\n";
+            char sum[32];
+            snprintf(sum, sizeof(sum), "%.6f", stats.latencyUs.sum() / 1e6);
+            out += name + "_sum{op=\"" + stats.name + "\"} " + sum + "\n";
+            out += name + "_count{op=\"" + stats.name + "\"} " + std::to_string(count) + "\n";
+        }
+        
+        char uptime[32];
+        snprintf(uptime, sizeof(uptime), "%.3f", uptimeSeconds());
+        out += "# HELP " + prefix + "uptime_seconds Seconds since the process started.\n# TYPE " + prefix +
+               "uptime_seconds gauge\n" + prefix + "uptime_seconds " + uptime + "\n";
+        return out;
+    }
+
+private:
+    std::deque<OpStats> ops; // a deque: OpStats holds atomics and cannot move
+    std::chrono::steady_clock::time_point started;
+};
+
+// Append one gauge or counter in Prometheus text format
+inline void prometheusMetric(std::string& out, const std::string& name, const std::string& type,
+                             const std::string& help, double value) {
+    char text[32];
+    snprintf(text, sizeof(text), "%.17g", value);
+    out += "# HELP " + name + " " + help + "\n# TYPE " + name + " " + type + "\n" + name + " " + text + "\n";
+}
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef DFS_COMMON_TRACE_H
+#define DFS_COMMON_TRACE_H
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "compression.h"
+
+// Request tracing shared by client, coordinator and nodes.
+//
+// A client run with --trace picks a 64-bit trace id. It adds TRACE=<16 hex
+// digits> to every request line, and the coordinator passes the token on to
+// the nodes it calls for that request. While a thread serves a traced
+// request it records timed spans (a name, a start, a duration and one
+// optional number) into a fixed ring buffer in its process. Requests
+// without the token record nothing.
+//
+// TRACE <id> on a node returns that trace's spans as Chrome trace-event
+// JSON objects. On the coordinator it also gathers them from every node.
+// The client adds its own spans and writes one file that chrome://tracing
+// or Perfetto shows as a waterfall. Timestamps are wall-clock microseconds,
+// so spans from different hosts line up as well as their clocks do.
+
+struct SpanRecord {
+    uint64_t traceId;
+    uint64_t startUs;
+    uint64_t durationUs;
+    const char* name;    // string with static storage (a literal, or a name that lives as long as the process)
+    const char* argName; // nullptr when the span carries no number
+    long long arg;
+    uint32_t tid;
+};
+
+// Fixed-size ring of the most recent spans. Writers claim a slot with one
+// atomic increment and publish it with a sequence number (a seqlock), so
+// recording never blocks. Readers skip slots that are being rewritten.
+class SpanRing {
+public:
+    static const size_t CAPACITY = 16384;
+    
+    SpanRing() : slots(new Slot[CAPACITY]) {}
+    
+    void record(const SpanRecord& span) {
+        uint64_t ticket = next.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[ticket % CAPACITY];
+        slot.sequence.store(2 * ticket + 1, std::memory_order_relaxed); // odd while writing
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.traceId.store(span.traceId, std::memory_order_relaxed);
+        slot.startUs.store(span.startUs, std::memory_order_relaxed);
+        slot.durationUs.store(span.durationUs, std::memory_order_relaxed);
+        slot.name.store(span.name, std::memory_order_relaxed);
+        slot.argName.store(span.argName, std::memory_order_relaxed);
+        slot.arg.store(span.arg, std::memory_order_relaxed);
+        slot.tid.store(span.tid, std::memory_order_relaxed);
+        slot.sequence.store(2 * ticket + 2, std::memory_order_release);
+    }
+    
+    // Spans of one trace still in the ring
+    std::vector<SpanRecord> collect(uint64_t traceId) const {
+        std::vector<SpanRecord> spans;
+        for (size_t i = 0; i < CAPACITY; i++) {
+            const Slot& slot = slots[i];
+            uint64_t before = slot.sequence.load(std::memory_order_acquire);
+            if (before == 0 || (before & 1) || slot.traceId.load(std::memory_order_relaxed) != traceId) {
+                continue;
+            }
+            SpanRecord span{slot.traceId.load(std::memory_order_relaxed), slot.startUs.load(std::memory_order_relaxed),
+                            slot.durationUs.load(std::memory_order_relaxed), slot.name.load(std::memory_order_relaxed),
+                            slot.argName.load(std::memory_order_relaxed), slot.arg.load(std::memory_order_relaxed),
+                            slot.tid.load(std::memory_order_relaxed)};
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == before && span.traceId == traceId) {
+                spans.push_back(span);
+            }
+        }
+        return spans;
+    }
+
+private:
+    struct Slot {
+        std::atomic<uint64_t> sequence{0};
+        std::atomic<uint64_t> traceId{0};
+        std::atomic<uint64_t> startUs{0};
+        std::atomic<uint64_t> durationUs{0};
+        std::atomic<const char*> name{nullptr};
+        std::atomic<const char*> argName{nullptr};
+        std::atomic<long long> arg{0};
+        std::atomic<uint32_t> tid{0};
+    };
+    
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> next{0};
+};
+
+inline SpanRing& spanRing() {
+    static SpanRing ring;
+    return ring;
+}
+
+// Trace of the request this thread is serving, 0 when it is not traced
+inline uint64_t& currentTrace() {
+    static thread_local uint64_t traceId = 0;
+    return traceId;
+}
+
+inline uint32_t traceThreadId() {
+    static thread_local uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    return tid;
+}
+
+inline uint64_t traceNowUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline uint64_t newTraceId() {
+    std::random_device device;
+    uint64_t id = 0;
+    while (id == 0) {
+        id = ((uint64_t)device() << 32) | device();
+    }
+    return id;
+}
+
+inline std::string formatTraceId(uint64_t traceId) {
+    char text[17];
+    snprintf(text, sizeof(text), "%016llx", (unsigned long long)traceId);
+    return text;
+}
+
+// Trace id in a TRACE= token of a request line (0 when absent or malformed)
+inline uint64_t parseTraceToken(const std::string& line) {
+    std::string value;
+    if (!findToken(line, "TRACE", value) || value.empty() || value.size() > 16 ||
+        value.find_first_not_of("0123456789abcdef") != std::string::npos) {
+        return 0;
+    }
+    return strtoull(value.c_str(), nullptr, 16);
+}
+
+// " TRACE=<id>" for the current trace, or nothing
+inline std::string traceToken() {
+    return currentTrace() ? " TRACE=" + formatTraceId(currentTrace()) : "";
+}
+
+// A request line ending in '\n' with the current trace token added
+inline std::string traced(const std::string& line) {
+    if (!currentTrace() || line.empty() || line.back() != '\n') {
+        return line;
+    }
+    return line.substr(0, line.size() - 1) + traceToken() + "\n";
+}
+
+// Times a scope and records it when the thread is serving a traced request
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : traceId(currentTrace()), name(name) {
+        if (traceId) {
+            startUs = traceNowUs();
+        }
+    }
+    
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+    
+    // Attach one number (bytes, node id, ...) to the span
+    void setArg(const char* key, long long value) {
+        argName = key;
+        arg = value;
+    }
+    
+    // Record now instead of at the end of the scope
+    void end() {
+        if (traceId) {
+            spanRing().record(SpanRecord{traceId, startUs, traceNowUs() - startUs, name, argName, arg, traceThreadId()});
+            traceId = 0;
+        }
+    }
+    
+    ~TraceSpan() {
+        end();
+    }
+
+private:
+    uint64_t traceId;
+    const char* name;
+    uint64_t startUs = 0;
+    const char* argName = nullptr;
+    long long arg = 0;
+};
+
+// Chrome trace-event JSON objects for this process's spans of one trace,
+// separated by commas so the output of several processes can be joined.
+// Names are protocol commands and literals, so they need no escaping.
+inline std::string chromeTraceEvents(uint64_t traceId, const std::string& processName) {
+    std::vector<SpanRecord> spans = spanRing().collect(traceId);
+    if (spans.empty()) {
+        return "";
+    }
+    long pid = (long)getpid();
+    std::string out = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+                      ",\"args\":{\"name\":\"" + processName + "\"}}";
+    for (const SpanRecord& span : spans) {
+        out += ",\n{\"name\":\"" + std::string(span.name) + "\",\"ph\":\"X\",\"pid\":" + std::to_string(pid) +
+               ",\"tid\":" + std::to_string(span.tid) + ",\"ts\":" + std::to_string(span.startUs) +
+               ",\"dur\":" + std::to_string(span.durationUs) + ",\"args\":{\"trace\":\"" + formatTraceId(span.traceId) + "\"";
+        if (span.argName) {
+            out += ",\"" + std::string(span.argName) + "\":" + std::to_string(span.arg);
+        }
+        out += "}}";
+    }
+    return out;
+}
+
+// Join event lists from chromeTraceEvents, skipping empty ones
+inline void appendTraceEvents(std::string& events, const std::string& more) {
+    if (more.empty()) {
+        return;
+    }
+    if (!events.empty()) {
+        events += ",\n";
+    }
+    events += more;
+}
+
+inline std::string chromeTraceDocument(const std::string& events) {
+    return "{\"traceEvents\":[\n" + events + "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+#endif
@@ -10,6 +10,25 @@
 #include <sstream>
 #include <fstream>
 #include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <set>
+#include <random>
+#include "../common/bufferpool.h"
+#include "../common/checksum.h"
+#include "../common/compression.h"
+#include "../common/dedup.h"
+#include "../common/keepalive.h"
+#include "../common/partition.h"
+#include "../common/probes.h"
+#include "../common/ratelimit.h"
+#include "../common/stats.h"
+#include "../common/trace.h"
+#include "metadata_log.h"
 
 using namespace std;
 
@@ -18,22 +37,117 @@ struct FileEntry {
     int node1;
     int node2;
     unsigned long checksum;
+    long long size;
+    int version; // bumped on every overwrite, stored by nodes alongside the data
+    vector<string> blockHashes; // deduplicated files: content address of each DEDUP_BLOCK_SIZE block
+};
+
+// A resumable single-stream upload: the verified prefix survives a dropped
+// connection until the client reconnects with the same token. It is staged
+// in a pool buffer, so unfinished uploads count against the buffer cap.
+struct PendingUpload {
+    string dfsPath;
+    PooledBuffer data;
+    long long verified; // bytes received and checksummed so far
+    time_t lastActive;
+    bool busy;          // a connection is currently feeding it
+};
+
+// A multipart upload in progress: parts are staged on both target nodes and
+// the file only appears in fileTable once every part is confirmed
+struct UploadSession {
+    string dfsPath;
+    string token;       // client's resume token, lets a restarted client find the session
+    time_t lastActive;
+    long long size;
+    long long partSize;
+    int partCount;
+    int node1;
+    int node2;
+    Codec codec;        // negotiated for the part payloads the client sends
+    vector<bool> partDone;
+    vector<unsigned long> partChecksums;
 };
 
 map<string, FileEntry> fileTable; // DFS path → FileEntry
 map<int, pid_t> nodePids; // nodeId → process ID
 map<int, bool> nodeAlive; // nodeId → alive status
+map<int, vector<Codec>> nodeCodecs; // nodeId → codecs it accepts, from REGISTER
+map<string, int> versionCounters; // DFS path → last version handed out
+map<string, UploadSession> uploadSessions; // upload ID → session
+map<string, PendingUpload> pendingUploads; // resume token → partial upload
+set<pair<string, int>> repairing; // (DFS path, node) copies being rewritten
+set<int> decommissioning; // nodes being drained (DECOMMISSION); they get no new files
+mutex tableMutex; // guards all of the above; never held across network I/O
+atomic<unsigned long> uploadCounter{0};
+RequestStats requestStats({"REGISTER", "UPLOAD", "DEDUP_PUT", "DELTA_PUT", "DOWNLOAD", "MPU_BEGIN", "MPU_PART",
+                           "MPU_COMPLETE", "MPU_STATUS", "MPU_ABORT", "LOCATE", "LIST", "STATS", "TRACE", "PARTITIONS",
+                           "FOLLOW", "FOLLOWERS", "PROMOTE", "CORRUPT", "DECOMMISSION"});
+PartitionMap partitions = PartitionMap::uniform(1); // fixed at startup (--partitions)
+int partitionId = 0;                                // the partition this coordinator owns
+long long leaseMs = 10000; // how long a client may reuse a LOCATE reply (--lease-ms, 0: not at all)
+
+// Replication to read-only follower coordinators
+MetadataLog metadataLog(65536);      // fileTable and node list changes, appended under tableMutex
+atomic<uint64_t> logEpoch{0};        // names this log; a restarted primary starts a new one
+atomic<bool> following{false};       // true on a follower until PROMOTE
+int primaryPort = 0;                 // the coordinator a follower replays (--follow)
+int listenPort = 0;
+atomic<long long> lastPrimaryContact{0}; // steady-clock ms of the last line from the primary
+long long maxLagMs = 1000;           // a follower refuses reads when further behind (--max-lag-ms)
+int followSock = -1;                 // a follower's stream from the primary, for PROMOTE to cut
+mutex followMutex;                   // guards followSock
+map<int, int> followers;             // follower port → open FOLLOW streams
+mutex followersMutex;                // guards followers
 
-const int COORDINATOR_PORT = 9000;
 const int NODE_BASE_PORT = 9001;
+const int MAX_FILE_SIZE = 10 * 1024 * 1024; // single-stream uploads and each multipart part
+const int MAX_PARTS = 10000;
+const int MAX_PENDING_UPLOADS = 64;
+const time_t UPLOAD_SESSION_TTL = 3600; // seconds an idle unfinished upload is kept
+const int FOLLOW_HEARTBEAT_MS = 250;    // an idle FOLLOW stream still sends a line this often
+const int FOLLOW_RETRY_MS = 200;
+const long long COPY_PART_SIZE = 4 * 1024 * 1024; // bytes per PULLPART when copying a replica between nodes
+const int BALANCE_YIELD_MS = 500;                 // longest a background copy waits for foreground transfers
+const size_t MAX_PLANNED_MOVES = 256;             // moves per balancer round
+const int MANIFEST_ATTEMPTS = 3;                  // STOREMANIFEST tries when nodes lose blocks meanwhile
+
+// Rebalancing (see balanceLoop)
+RateLimiter balanceLimiter(0);  // --balance-mbps; 0 leaves live nodes as they are
+RateLimiter drainLimiter(0);    // --drain-mbps for decommissioned nodes; 0 is unthrottled
+double balanceThreshold = 0.10; // --balance-threshold: allowed distance from the mean, as a fraction of it
+int balanceStreams = 2;         // --balance-streams: moves in flight at once
+int balanceIntervalSec = 60;    // --balance-interval: seconds between rounds
+bool balanceKick = false;       // start the next round now (DECOMMISSION)
+mutex balanceMutex;             // guards balanceKick
+condition_variable balanceWake;
+atomic<int> foregroundTransfers{0}; // client uploads and downloads in progress here
+atomic<long long> movesDone{0};
+atomic<long long> movesFailed{0};
+atomic<long long> moveBytes{0};
 
-// Simple checksum function
+// Replica repairs (see repairReplica)
+atomic<long long> repairsStarted{0};
+atomic<long long> repairsDone{0};
+atomic<long long> repairsFailed{0};
+atomic<long long> repairBytes{0};
+
+// Simple checksum function (vectorized, see common/checksum.h)
 unsigned long calculateChecksum(const char* data, int size) {
-    unsigned long sum = 0;
-    for (int i = 0; i < size; i++) {
-        sum += (unsigned char)data[i];
+    return byteSum(data, size);
+}
+
+// Read one '\n'-terminated line so payload bytes that follow stay in the socket
+string recvLine(int sock) {
+    string line;
+    char c;
+    while (recv(sock, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            break;
+        }
+        line += c;
     }
-    return sum;
+    return line;
 }
 
 // Check if a process is alive (Linux: use kill(pid, 0))
@@ -52,50 +166,106 @@ bool isNodeAlive(int nodeId) {
 
 // Update node status
 void updateNodeStatus() {
+    TraceSpan span("updateNodeStatus");
+    lock_guard<mutex> lock(tableMutex);
     for (auto& pair : nodePids) {
         nodeAlive[pair.first] = isNodeAlive(pair.first);
     }
 }
 
-// Forward declaration
-bool sendFileToNode(int nodeId, const string& dfsPath, const char* data, int size, unsigned long checksum);
-
-// Handle UPLOAD command
-string handleUpload(int clientSock, const string& dfsPath) {
+// Find all alive nodes that take new files (supports unlimited nodes)
+vector<int> getAliveNodes() {
     updateNodeStatus();
-    
-    // Find all alive nodes (supports unlimited nodes)
+    lock_guard<mutex> lock(tableMutex);
     vector<int> availableNodes;
     for (auto& pair : nodeAlive) {
-        if (pair.second) {
+        if (pair.second && !decommissioning.count(pair.first)) {
             availableNodes.push_back(pair.first);
         }
     }
-    
-    if (availableNodes.size() < 2) {
-        return "ERROR: Not enough alive nodes (need at least 2, found " + to_string(availableNodes.size()) + ")";
+    return availableNodes;
+}
+
+// Hand out the next version of a path. Reserved up front so concurrent
+// writers of the same path never stamp their data with the same version.
+int reserveVersion(const string& dfsPath) {
+    lock_guard<mutex> lock(tableMutex);
+    return ++versionCounters[dfsPath];
+}
+
+// Metadata log records, one line per change:
+//     FILE <path> <node1> <node2> <checksum> <size> <version> <hash,hash,...|->
+//     NODE <nodeId> <pid> [CODECS=...] [DRAIN=1]
+string encodeEntry(const FileEntry& entry) {
+    string hashes;
+    for (const string& hash : entry.blockHashes) {
+        hashes += (hashes.empty() ? "" : ",") + hash;
     }
-    
-    // Receive file data
-    char sizeBuf[16] = {0};
-    recv(clientSock, sizeBuf, sizeof(sizeBuf), 0);
-    int fileSize = atoi(sizeBuf);
-    
-    if (fileSize <= 0 || fileSize > 10 * 1024 * 1024) { // Max 10MB
-        return "ERROR: Invalid file size";
+    return "FILE " + entry.filename + " " + to_string(entry.node1) + " " + to_string(entry.node2) + " " +
+           to_string(entry.checksum) + " " + to_string(entry.size) + " " + to_string(entry.version) + " " +
+           (hashes.empty() ? "-" : hashes);
+}
+
+// Caller holds tableMutex
+string encodeNode(int nodeId) {
+    return "NODE " + to_string(nodeId) + " " + to_string(nodePids[nodeId]) + codecOffer(nodeCodecs[nodeId]) +
+           (decommissioning.count(nodeId) ? " DRAIN=1" : "");
+}
+
+// Make a file's new metadata visible and log it for followers. Caller holds
+// tableMutex, so the log is in the order the table changed.
+void publishEntry(const FileEntry& entry) {
+    fileTable[entry.filename] = entry;
+    metadataLog.append(encodeEntry(entry));
+}
+
+// Replay one log record into the tables (a follower). Caller holds tableMutex.
+bool applyRecord(const string& record) {
+    stringstream ss(record);
+    string kind;
+    ss >> kind;
+    if (kind == "FILE") {
+        FileEntry entry;
+        string hashes;
+        if (!(ss >> entry.filename >> entry.node1 >> entry.node2 >> entry.checksum >> entry.size >> entry.version >> hashes)) {
+            return false;
+        }
+        stringstream list(hashes);
+        string hash;
+        while (hashes != "-" && getline(list, hash, ',')) {
+            entry.blockHashes.push_back(hash);
+        }
+        fileTable[entry.filename] = entry;
+        // A promoted follower must not hand out a version already used
+        versionCounters[entry.filename] = max(versionCounters[entry.filename], entry.version);
+        return true;
     }
-    
-    char* fileData = new char[fileSize];
-    int totalReceived = 0;
-    while (totalReceived < fileSize) {
-        int received = recv(clientSock, fileData + totalReceived, fileSize - totalReceived, 0);
-        if (received <= 0) {
-            delete[] fileData;
-            return "ERROR: Failed to receive file data";
+    if (kind == "NODE") {
+        int nodeId;
+        pid_t pid;
+        if (!(ss >> nodeId >> pid)) {
+            return false;
         }
-        totalReceived += received;
+        nodePids[nodeId] = pid;
+        nodeAlive[nodeId] = true;
+        nodeCodecs[nodeId] = parseCodecOffer(record);
+        string drain;
+        if (findToken(record, "DRAIN", drain)) {
+            decommissioning.insert(nodeId);
+        } else {
+            decommissioning.erase(nodeId);
+        }
+        return true;
     }
-    
+    return false;
+}
+
+// Forward declarations
+void expireUploadSessions();
+bool sendFileToNode(int nodeId, const string& dfsPath, const char* data, int size, unsigned long checksum, int version);
+
+// Replicate a fully received file on the first two alive nodes and publish it
+string storeOnNodes(const string& dfsPath, const char* fileData, int fileSize, const vector<int>& availableNodes) {
     // Calculate checksum
     unsigned long checksum = calculateChecksum(fileData, fileSize);
     
@@ -104,10 +274,10 @@ string handleUpload(int clientSock, const string& dfsPath) {
     int node1 = availableNodes[0];
     int node2 = availableNodes[1];
     
-    bool node1Success = sendFileToNode(node1, dfsPath, fileData, fileSize, checksum);
-    bool node2Success = sendFileToNode(node2, dfsPath, fileData, fileSize, checksum);
+    int version = reserveVersion(dfsPath);
     
-    delete[] fileData;
+    bool node1Success = sendFileToNode(node1, dfsPath, fileData, fileSize, checksum, version);
+    bool node2Success = sendFileToNode(node2, dfsPath, fileData, fileSize, checksum, version);
     
     if (!node1Success || !node2Success) {
         return "ERROR: Failed to store file on nodes";
@@ -119,261 +289,2097 @@ string handleUpload(int clientSock, const string& dfsPath) {
     entry.node1 = node1;
     entry.node2 = node2;
     entry.checksum = checksum;
-    fileTable[dfsPath] = entry;
+    entry.size = fileSize;
+    entry.version = version;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        publishEntry(entry);
+    }
     
     return "STORED " + to_string(node1) + " " + to_string(node2);
 }
 
-// Send file to a storage node
-bool sendFileToNode(int nodeId, const string& dfsPath, const char* data, int size, unsigned long checksum) {
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == -1) {
-        return false;
+// Handle UPLOAD command
+string handleUpload(int clientSock, const string& dfsPath) {
+    vector<int> availableNodes = getAliveNodes();
+    
+    if (availableNodes.size() < 2) {
+        return "ERROR: Not enough alive nodes (need at least 2, found " + to_string(availableNodes.size()) + ")";
     }
     
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(NODE_BASE_PORT + nodeId);
-    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    // Receive file data
+    int fileSize = atoi(recvLine(clientSock).c_str());
     
-    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
-        close(sock);
-        return false;
+    if (fileSize <= 0 || fileSize > MAX_FILE_SIZE) {
+        return "ERROR: Invalid file size";
     }
     
-    // Send STORE command
-    string cmd = "STORE " + dfsPath + " " + to_string(size) + " " + to_string(checksum) + "\n";
-    send(sock, cmd.c_str(), cmd.size(), 0);
-    
-    // Send file data
-    int totalSent = 0;
-    while (totalSent < size) {
-        int sent = send(sock, data + totalSent, size - totalSent, 0);
-        if (sent <= 0) {
-            close(sock);
-            return false;
+    PooledBuffer buffer = bufferPool().acquire(fileSize);
+    if (!buffer) {
+        return "ERROR: Server busy";
+    }
+    char* fileData = buffer.data();
+    int totalReceived = 0;
+    TraceSpan recvSpan("recv from client");
+    recvSpan.setArg("bytes", fileSize);
+    DFS_PROBE2(recv__start, clientSock, fileSize);
+    while (totalReceived < fileSize) {
+        int received = recv(clientSock, fileData + totalReceived, fileSize - totalReceived, 0);
+        if (received <= 0) {
+            DFS_PROBE3(recv__done, clientSock, totalReceived, 0);
+            return "ERROR: Failed to receive file data";
         }
-        totalSent += sent;
+        totalReceived += received;
     }
+    DFS_PROBE3(recv__done, clientSock, totalReceived, 1);
+    recvSpan.end();
+    requestTally().bytesIn = fileSize;
     
-    // Wait for confirmation
-    char response[256] = {0};
-    recv(sock, response, sizeof(response), 0);
-    
-    close(sock);
-    return string(response).find("OK") != string::npos;
+    return storeOnNodes(dfsPath, fileData, fileSize, availableNodes);
 }
 
-// Handle DOWNLOAD command
-string handleDownload(int clientSock, const string& dfsPath) {
-    updateNodeStatus();
+// Drop resumable uploads nobody has touched for a while. Caller holds tableMutex.
+void expirePendingUploads() {
+    time_t now = time(nullptr);
+    for (auto it = pendingUploads.begin(); it != pendingUploads.end();) {
+        if (!it->second.busy && now - it->second.lastActive > UPLOAD_SESSION_TTL) {
+            it = pendingUploads.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Handle resumable UPLOAD <dfsPath> <size> <token>. The coordinator answers
+// HAVE <offset> with how many bytes of this upload it already holds, and the
+// client sends the rest as "<length> <checksum>" framed chunks. Each chunk is
+// verified before it counts, so after a dropped connection the client can
+// reconnect with the same token and continue from the last verified chunk.
+string handleResumableUpload(int clientSock, const string& dfsPath, long long fileSize, const string& token, const vector<Codec>& offered) {
+    vector<int> availableNodes = getAliveNodes();
     
-    if (fileTable.find(dfsPath) == fileTable.end()) {
-        return "ERROR: File not found";
+    if (availableNodes.size() < 2) {
+        return "ERROR: Not enough alive nodes (need at least 2, found " + to_string(availableNodes.size()) + ")";
+    }
+    if (fileSize <= 0 || fileSize > MAX_FILE_SIZE || token.empty()) {
+        return "ERROR: Invalid file size";
     }
     
-    FileEntry entry = fileTable[dfsPath];
+    PendingUpload* upload;
+    bool created = false;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        expirePendingUploads();
+        auto it = pendingUploads.find(token);
+        if (it != pendingUploads.end() && it->second.busy) {
+            return "ERROR: Upload already in progress";
+        }
+        if (it == pendingUploads.end() || it->second.dfsPath != dfsPath || (long long)it->second.data.size() != fileSize) {
+            if (it == pendingUploads.end() && pendingUploads.size() >= MAX_PENDING_UPLOADS) {
+                return "ERROR: Too many unfinished uploads";
+            }
+            PendingUpload fresh;
+            fresh.dfsPath = dfsPath;
+            fresh.verified = 0;
+            pendingUploads[token] = move(fresh);
+            created = true;
+        }
+        upload = &pendingUploads[token];
+        upload->busy = true;
+        upload->lastActive = time(nullptr);
+    }
     
-    // Try node1 first
-    bool node1Alive = nodeAlive[entry.node1];
-    bool node2Alive = nodeAlive[entry.node2];
+    // Waiting for the buffer cap can take a while, so the staging buffer is
+    // taken outside the lock; the busy session is not touched meanwhile
+    if (created) {
+        PooledBuffer data = bufferPool().acquire((size_t)fileSize);
+        lock_guard<mutex> lock(tableMutex);
+        if (!data) {
+            pendingUploads.erase(token);
+            return "ERROR: Server busy";
+        }
+        upload->data = move(data);
+    }
     
-    int nodeToUse = -1;
-    string recoveryMsg = "";
+    Codec codec = negotiateCodec(offered);
+    string have = "HAVE " + to_string(upload->verified);
+    if (!offered.empty()) {
+        have += " CODEC=" + string(codecName(codec));
+    }
+    have += "\n";
+    send(clientSock, have.c_str(), have.size(), 0);
     
-    if (node1Alive) {
-        nodeToUse = entry.node1;
-    } else if (node2Alive) {
-        nodeToUse = entry.node2;
-        recoveryMsg = "Node " + to_string(entry.node1) + " failed, recovered using replica";
+    // Only this connection touches the session while it is marked busy
+    string error;
+    TraceSpan recvSpan("recv from client");
+    recvSpan.setArg("bytes", fileSize - upload->verified);
+    while (upload->verified < fileSize) {
+        stringstream header(recvLine(clientSock));
+        long long chunkSize = 0;
+        unsigned long chunkChecksum = 0;
+        if (!(header >> chunkSize >> chunkChecksum) || chunkSize <= 0 || chunkSize > fileSize - upload->verified) {
+            error = "ERROR: Failed to receive file data";
+            break;
+        }
+        
+        char* chunk = upload->data.data() + upload->verified;
+        if (!recvPayload(clientSock, codec, chunk, chunkSize)) {
+            error = "ERROR: Failed to receive file data";
+            break;
+        }
+        requestTally().bytesIn += chunkSize;
+        if (calculateChecksum(chunk, chunkSize) != chunkChecksum) {
+            error = "ERROR: Chunk checksum mismatch";
+            break;
+        }
+        upload->verified += chunkSize;
+    }
+    recvSpan.end();
+    
+    if (!error.empty()) {
+        lock_guard<mutex> lock(tableMutex);
+        upload->busy = false;
+        upload->lastActive = time(nullptr);
+        return error;
+    }
+    
+    string result = storeOnNodes(dfsPath, upload->data.data(), fileSize, availableNodes);
+    
+    lock_guard<mutex> lock(tableMutex);
+    if (result.find("STORED") == 0) {
+        pendingUploads.erase(token);
     } else {
-        return "ERROR: Both nodes are down";
+        upload->busy = false;
+        upload->lastActive = time(nullptr);
+    }
+    return result;
+}
+
+// Connect to a node or coordinator port on this host
+int connectToPort(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
     }
     
-    // Retrieve file from node
-    int nodeSock = socket(AF_INET, SOCK_STREAM, 0);
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(NODE_BASE_PORT + nodeToUse);
+    addr.sin_port = htons(port);
     inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
     
-    if (connect(nodeSock, (sockaddr*)&addr, sizeof(addr)) != 0) {
-        close(nodeSock);
-        return "ERROR: Cannot connect to node";
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(sock);
+        return -1;
     }
-    
-    // Send GET command
-    string cmd = "GET " + dfsPath + "\n";
-    send(nodeSock, cmd.c_str(), cmd.size(), 0);
-    
-    // Receive file size
-    char sizeBuf[16] = {0};
-    recv(nodeSock, sizeBuf, sizeof(sizeBuf), 0);
-    int fileSize = atoi(sizeBuf);
-    
-    if (fileSize <= 0) {
-        close(nodeSock);
-        return "ERROR: Invalid file size from node";
+    return sock;
+}
+
+// Connect to a storage node
+int connectToNode(int nodeId) {
+    return connectToPort(NODE_BASE_PORT + nodeId);
+}
+
+// Send a command line plus optional payload to a node and return its
+// one-line reply ("" if the node could not be reached). The payload is
+// compressed with the best codec the node registered.
+string requestFromNode(int nodeId, const string& cmd, const char* data, long long size) {
+    TraceSpan span("node request");
+    span.setArg("node", nodeId);
+    int sock = connectToNode(nodeId);
+    if (sock == -1) {
+        return "";
     }
     
-    // Receive checksum
-    char checksumBuf[32] = {0};
-    recv(nodeSock, checksumBuf, sizeof(checksumBuf), 0);
-    unsigned long receivedChecksum = strtoul(checksumBuf, NULL, 10);
+    Codec codec = Codec::None;
+    if (size > 0) {
+        lock_guard<mutex> lock(tableMutex);
+        codec = negotiateCodec(nodeCodecs[nodeId]);
+    }
+    string line = traced(cmd);
+    if (codec != Codec::None) {
+        line.insert(line.size() - 1, " CODEC=" + string(codecName(codec)));
+    }
+    send(sock, line.c_str(), line.size(), 0);
     
-    // Receive file data
-    char* fileData = new char[fileSize];
-    int totalReceived = 0;
-    while (totalReceived < fileSize) {
-        int received = recv(nodeSock, fileData + totalReceived, fileSize - totalReceived, 0);
-        if (received <= 0) {
-            delete[] fileData;
-            close(nodeSock);
-            return "ERROR: Failed to receive file data";
-        }
-        totalReceived += received;
+    // Send file data
+    if (!sendPayload(sock, codec, data, size)) {
+        close(sock);
+        return "";
     }
     
-    close(nodeSock);
+    // Wait for confirmation
+    string response = recvLine(sock);
     
-    // Verify checksum
-    unsigned long calculatedChecksum = calculateChecksum(fileData, fileSize);
-    if (calculatedChecksum != receivedChecksum) {
-        delete[] fileData;
-        return "ERROR: Checksum mismatch - data corruption detected";
+    close(sock);
+    return response;
+}
+
+// Send a command line plus optional payload to a node and wait for its OK
+bool sendToNode(int nodeId, const string& cmd, const char* data, long long size) {
+    return requestFromNode(nodeId, cmd, data, size).find("OK") == 0;
+}
+
+// Send file to a storage node
+bool sendFileToNode(int nodeId, const string& dfsPath, const char* data, int size, unsigned long checksum, int version) {
+    string cmd = "STORE " + dfsPath + " " + to_string(size) + " " + to_string(checksum) + " " + to_string(version) + "\n";
+    return sendToNode(nodeId, cmd, data, size);
+}
+
+// Wait, up to BALANCE_YIELD_MS, for the downloads and uploads passing
+// through this coordinator to finish, so background copies take the gaps
+// between them. Reads that clients send to the nodes directly are not seen.
+void yieldToForeground() {
+    for (int waited = 0; foregroundTransfers.load() > 0 && waited < BALANCE_YIELD_MS; waited += 10) {
+        this_thread::sleep_for(chrono::milliseconds(10));
     }
-    
-    // Send to client
-    string response = "OK " + to_string(fileSize) + " " + to_string(calculatedChecksum) + "\n";
-    if (!recoveryMsg.empty()) {
-        response = recoveryMsg + "\n" + response;
+}
+
+// Copy version of a file (size bytes, checksum) from node from to node to:
+// to pulls it part by part (PULLPART), node to node, and publishes it with a
+// COMMIT that checks the whole file. With replaceVersion > 0, to installs it
+// only over that version (repairs). When a limiter is given, each part is
+// paced by it and yields to foreground transfers first. On failure the
+// staged parts are dropped.
+bool copyReplica(const string& dfsPath, int version, long long size, unsigned long checksum, int from, int to,
+                 int replaceVersion, RateLimiter* limiter) {
+    string uploadId = string(replaceVersion > 0 ? "repair-" : "move-") + to_string(getpid()) + "-" + to_string(uploadCounter++);
+    bool ok = size > 0;
+    for (long long offset = 0; ok && offset < size; offset += COPY_PART_SIZE) {
+        long long length = min(COPY_PART_SIZE, size - offset);
+        if (limiter) {
+            yieldToForeground();
+            limiter->acquire(length);
+        }
+        string cmd = "PULLPART " + uploadId + " " + to_string(from) + " " + dfsPath + " " + to_string(version) + " " +
+                     to_string(offset) + " " + to_string(length) + "\n";
+        ok = sendToNode(to, cmd, nullptr, 0);
     }
-    send(clientSock, response.c_str(), response.size(), 0);
-    
-    // Send file data
-    int totalSent = 0;
-    while (totalSent < fileSize) {
-        int sent = send(clientSock, fileData + totalSent, fileSize - totalSent, 0);
-        if (sent <= 0) {
-            delete[] fileData;
-            return "ERROR: Failed to send file to client";
+    string commit = "COMMIT " + uploadId + " " + dfsPath + " " + to_string(size) + " " + to_string(checksum) + " " + to_string(version) +
+                    (replaceVersion > 0 ? " IFVERSION=" + to_string(replaceVersion) : "") + "\n";
+    ok = ok && sendToNode(to, commit, nullptr, 0);
+    if (!ok) {
+        sendToNode(to, "ABORT " + uploadId + "\n", nullptr, 0);
+    }
+    return ok;
+}
+
+// Rewrite badNode's copy of version of a file from the other replica, under
+// the same version; the node refuses it if the file was overwritten in the
+// meantime. Runs on its own thread; see scheduleRepair.
+void repairReplica(string dfsPath, int badNode, int version) {
+    updateNodeStatus();
+    FileEntry entry;
+    bool goodAlive = false;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = fileTable.find(dfsPath);
+        if (it != fileTable.end() && it->second.version == version) {
+            entry = it->second;
+            goodAlive = nodeAlive[entry.node1 == badNode ? entry.node2 : entry.node1];
         }
-        totalSent += sent;
     }
     
-    delete[] fileData;
-    return "SUCCESS";
+    int goodNode = entry.node1 == badNode ? entry.node2 : entry.node1;
+    bool ok = goodAlive && copyReplica(dfsPath, version, entry.size, entry.checksum, goodNode, badNode, version, nullptr);
+    repairBytes += ok ? entry.size : 0;
+    (ok ? repairsDone : repairsFailed)++;
+    cout << (ok ? "Repaired " : "Could not repair ") << dfsPath << " (version " << version << ") on node " << badNode
+         << (ok ? " from node " + to_string(goodNode) : "") << "\n";
+    lock_guard<mutex> lock(tableMutex);
+    repairing.erase({dfsPath, badNode});
 }
 
-// Handle LIST command
-string handleList() {
-    string result = "";
+// Start rewriting badNode's copy of a file unless a repair of it is already
+// running. Returns false when the report does not match the file table: the
+// file is gone, was overwritten since, or is not stored on badNode.
+bool scheduleRepair(const string& dfsPath, int badNode, int version) {
+    lock_guard<mutex> lock(tableMutex);
+    auto it = fileTable.find(dfsPath);
+    if (it == fileTable.end() || it->second.version != version ||
+        (it->second.node1 != badNode && it->second.node2 != badNode)) {
+        return false;
+    }
+    if (repairing.insert({dfsPath, badNode}).second) {
+        repairsStarted++;
+        thread(repairReplica, dfsPath, badNode, version).detach();
+    }
+    return true;
+}
+
+// Handle CORRUPT <nodeId> <path> <version>: a node's scrubber found its copy
+// of a file damaged
+string handleCorrupt(int nodeId, const string& dfsPath, int version) {
+    if (!scheduleRepair(dfsPath, nodeId, version)) {
+        return "ERROR: No such replica\n";
+    }
+    cout << "Node " << nodeId << " reports " << dfsPath << " (version " << version << ") corrupt, repairing\n";
+    return "OK\n";
+}
+
+// One replica to move: the copy of version of a file on from goes to to
+struct Move {
+    string dfsPath;
+    int version;
+    long long size;
+    unsigned long checksum;
+    int from;
+    int source; // node the data is read from: from, or the other replica when from is down
+    int to;
+    bool drain; // from is being decommissioned
+};
+
+// Bytes of replicas each registered node holds, according to the file
+// table. A node keeps each deduplicated block once, so a deduplicated file
+// only adds the blocks no other file on the node has. nodeBlocks, when
+// given, gets how many files on each node use each block. Caller holds
+// tableMutex.
+map<int, long long> nodeUsage(map<int, map<string, int>>* nodeBlocks = nullptr) {
+    map<int, long long> usage;
+    for (auto& pair : nodePids) {
+        usage[pair.first] = 0;
+    }
+    map<int, map<string, int>> blocks;
     for (auto& pair : fileTable) {
-        result += pair.first + "\n";
+        const FileEntry& entry = pair.second;
+        for (int node : {entry.node1, entry.node2}) {
+            if (entry.blockHashes.empty()) {
+                usage[node] += entry.size;
+                continue;
+            }
+            set<string> seen;
+            for (size_t i = 0; i < entry.blockHashes.size(); i++) {
+                if (seen.insert(entry.blockHashes[i]).second && blocks[node][entry.blockHashes[i]]++ == 0) {
+                    usage[node] += dedupBlockSize(entry.size, i);
+                }
+            }
+        }
     }
-    if (result.empty()) {
-        result = "No files stored\n";
+    if (nodeBlocks) {
+        *nodeBlocks = move(blocks);
     }
-    return result;
+    return usage;
 }
 
-// Handle REGISTER command (nodes register themselves)
-string handleRegister(int clientSock) {
-    char buffer[256] = {0};
-    recv(clientSock, buffer, sizeof(buffer), 0);
-    
-    stringstream ss(buffer);
-    string cmd;
-    int nodeId;
-    pid_t pid;
-    
-    ss >> cmd >> nodeId >> pid;
-    
-    nodePids[nodeId] = pid;
-    nodeAlive[nodeId] = true;
-    
-    return "REGISTERED " + to_string(nodeId);
+// Bytes node frees by dropping its replica of a file, by nodeUsage's
+// accounting: a deduplicated file frees only the blocks no other file there
+// uses. The file's uses are taken out of nodeBlocks. Caller holds tableMutex.
+long long dropReplica(const FileEntry& entry, int node, map<int, map<string, int>>& nodeBlocks) {
+    if (entry.blockHashes.empty()) {
+        return entry.size;
+    }
+    long long freed = 0;
+    set<string> seen;
+    for (size_t i = 0; i < entry.blockHashes.size(); i++) {
+        if (seen.insert(entry.blockHashes[i]).second && --nodeBlocks[node][entry.blockHashes[i]] == 0) {
+            freed += dedupBlockSize(entry.size, i);
+        }
+    }
+    return freed;
 }
 
-int main() {
-    int server = socket(AF_INET, SOCK_STREAM, 0);
-    if (server == -1) {
-        cerr << "Socket creation failed\n";
-        return 1;
+// Plan the next round of moves, at most MAX_PLANNED_MOVES. Every replica on
+// a decommissioned node goes first, each to the least used live node that
+// does not hold the file. Then, when balance is set, files are moved from
+// the most to the least used live node until every node is within
+// balanceThreshold of the mean. Each move takes the largest file that
+// narrows the gap between the two, so the spread shrinks with every step
+// and planning ends. Deduplicated files are left out of balancing: a move
+// copies the file's bytes, which would cost more space than it frees while
+// its blocks are shared. Caller holds tableMutex.
+vector<Move> planMoves(bool balance) {
+    map<int, map<string, int>> nodeBlocks;
+    map<int, long long> usage = nodeUsage(&nodeBlocks);
+    vector<int> targets;
+    for (auto& pair : nodeAlive) {
+        if (pair.second && !decommissioning.count(pair.first)) {
+            targets.push_back(pair.first);
+        }
     }
+    vector<Move> moves;
+    set<string> planned;
     
-    // Set socket option to reuse address
-    int opt = 1;
-    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-    
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(COORDINATOR_PORT);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    for (auto& pair : fileTable) {
+        const FileEntry& entry = pair.second;
+        for (int from : {entry.node1, entry.node2}) {
+            int other = from == entry.node1 ? entry.node2 : entry.node1;
+            int source = nodeAlive[from] ? from : other;
+            if (!decommissioning.count(from) || !nodeAlive[source] || planned.count(entry.filename) ||
+                moves.size() >= MAX_PLANNED_MOVES) {
+                continue;
+            }
+            int to = -1;
+            for (int node : targets) {
+                if (node != other && (to == -1 || usage[node] < usage[to])) {
+                    to = node;
+                }
+            }
+            if (to != -1) {
+                moves.push_back({entry.filename, entry.version, entry.size, entry.checksum, from, source, to, true});
+                planned.insert(entry.filename);
+                usage[from] -= dropReplica(entry, from, nodeBlocks);
+                usage[to] += entry.size; // arrives as a plain copy
+            }
+        }
+    }
+    if (!balance || targets.size() < 2) {
+        return moves;
+    }
     
-    if (bind(server, (sockaddr*)&addr, sizeof(addr)) != 0) {
-        cerr << "Bind failed\n";
-        close(server);
-        return 1;
+    // Files on each live node that balancing may move, largest first
+    map<int, vector<const FileEntry*>> held;
+    for (auto& pair : fileTable) {
+        for (int node : {pair.second.node1, pair.second.node2}) {
+            if (pair.second.blockHashes.empty() && find(targets.begin(), targets.end(), node) != targets.end()) {
+                held[node].push_back(&pair.second);
+            }
+        }
+    }
+    for (auto& pair : held) {
+        sort(pair.second.begin(), pair.second.end(), [](const FileEntry* a, const FileEntry* b) { return a->size > b->size; });
+    }
+    long long total = 0;
+    for (int node : targets) {
+        total += usage[node];
     }
+    double mean = (double)total / targets.size();
+    double slack = mean * balanceThreshold;
     
-    if (listen(server, 5) != 0) {
-        cerr << "Listen failed\n";
-        close(server);
-        return 1;
+    while (moves.size() < MAX_PLANNED_MOVES) {
+        auto byUsage = [&usage](int a, int b) { return usage[a] < usage[b]; };
+        int high = *max_element(targets.begin(), targets.end(), byUsage);
+        int low = *min_element(targets.begin(), targets.end(), byUsage);
+        if (usage[high] - mean <= slack && mean - usage[low] <= slack) {
+            break;
+        }
+        long long gap = usage[high] - usage[low];
+        const FileEntry* pick = nullptr;
+        for (const FileEntry* entry : held[high]) {
+            if (entry->size < gap && entry->node1 != low && entry->node2 != low && !planned.count(entry->filename)) {
+                pick = entry;
+                break;
+            }
+        }
+        if (!pick) {
+            break;
+        }
+        moves.push_back({pick->filename, pick->version, pick->size, pick->checksum, high, high, low, false});
+        planned.insert(pick->filename);
+        usage[high] -= pick->size;
+        usage[low] += pick->size;
+    }
+    return moves;
+}
+
+// Carry out a move: copy the replica, point the file at its new node if it
+// has not changed in the meantime, and drop the old copy once the leases
+// clients may hold on its location have run out. A copy that lost the race
+// with an overwrite is dropped at once. A deduplicated file being drained
+// arrives as a plain copy, so its entry stops listing blocks, like a
+// patched file's.
+bool runMove(const Move& move) {
+    bool copied = copyReplica(move.dfsPath, move.version, move.size, move.checksum, move.source, move.to, 0,
+                              move.drain ? &drainLimiter : &balanceLimiter);
+    bool moved = false;
+    bool fromAlive = false;
+    if (copied) {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = fileTable.find(move.dfsPath);
+        if (it != fileTable.end() && it->second.version == move.version && it->second.node1 != move.to &&
+            it->second.node2 != move.to && (it->second.node1 == move.from || it->second.node2 == move.from)) {
+            FileEntry entry = it->second;
+            (entry.node1 == move.from ? entry.node1 : entry.node2) = move.to;
+            entry.blockHashes.clear();
+            publishEntry(entry);
+            moved = true;
+        }
+        fromAlive = nodeAlive[move.from];
     }
     
-    cout << "Coordinator running on port " << COORDINATOR_PORT << "...\n";
-    cout << "Waiting for nodes and clients...\n";
+    string drop = "DELETE " + move.dfsPath + " IFVERSION=" + to_string(move.version) + "\n";
+    if (copied && !moved) {
+        sendToNode(move.to, drop, nullptr, 0);
+    }
+    if (moved && fromAlive) {
+        int from = move.from;
+        thread([from, drop] {
+            this_thread::sleep_for(chrono::milliseconds(leaseMs));
+            sendToNode(from, drop, nullptr, 0);
+        }).detach();
+    }
     
+    (moved ? movesDone : movesFailed)++;
+    moveBytes += moved ? move.size : 0;
+    return moved;
+}
+
+// Balancer thread: every balanceIntervalSec, or at once after DECOMMISSION,
+// plan a round of moves and run them balanceStreams at a time. While a round
+// made progress draining, or was cut off at MAX_PLANNED_MOVES, the next one
+// follows without a pause. Followers only start once promoted.
+void balanceLoop() {
+    bool more = false;
     while (true) {
-        sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-        int client = accept(server, (sockaddr*)&clientAddr, &clientLen);
-        if (client == -1) {
+        if (!more) {
+            unique_lock<mutex> lock(balanceMutex);
+            balanceWake.wait_for(lock, chrono::seconds(balanceIntervalSec), [] { return balanceKick; });
+            balanceKick = false;
+        }
+        more = false;
+        if (following) {
             continue;
         }
-        
-        char buffer[1024] = {0};
-        int received = recv(client, buffer, sizeof(buffer) - 1, 0);
-        if (received <= 0) {
-            close(client);
+        updateNodeStatus();
+        vector<Move> moves;
+        {
+            lock_guard<mutex> lock(tableMutex);
+            moves = planMoves(balanceLimiter.bytesPerSecond() > 0);
+        }
+        if (moves.empty()) {
             continue;
         }
         
-        string cmd(buffer);
-        string response;
-        
-        if (cmd.find("REGISTER") == 0) {
-            response = handleRegister(client);
-            send(client, response.c_str(), response.size(), 0);
+        atomic<size_t> next{0};
+        atomic<size_t> done{0};
+        vector<thread> workers;
+        for (int i = 0; i < balanceStreams; i++) {
+            workers.emplace_back([&] {
+                for (size_t m = next++; m < moves.size(); m = next++) {
+                    done += runMove(moves[m]) ? 1 : 0;
+                }
+            });
         }
-        else if (cmd.find("UPLOAD") == 0) {
-            stringstream ss(cmd);
-            string upload, dfsPath;
-            ss >> upload >> dfsPath;
-            response = handleUpload(client, dfsPath);
-            send(client, response.c_str(), response.size(), 0);
+        for (thread& worker : workers) {
+            worker.join();
         }
-        else if (cmd.find("DOWNLOAD") == 0) {
-            stringstream ss(cmd);
-            string download, dfsPath;
-            ss >> download >> dfsPath;
-            handleDownload(client, dfsPath);
-        }
-        else if (cmd.find("LIST") == 0) {
-            response = handleList();
-            send(client, response.c_str(), response.size(), 0);
+        bool draining = any_of(moves.begin(), moves.end(), [](const Move& move) { return move.drain; });
+        more = done > 0 && (draining || moves.size() == MAX_PLANNED_MOVES);
+        cout << "Balancer: moved " << done << " of " << moves.size() << " planned replicas\n";
+    }
+}
+
+// Stats line: per-node usage and the balancer's progress
+string balanceLine() {
+    string usageList, drainList;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        for (auto& pair : nodeUsage()) {
+            usageList += (usageList.empty() ? "" : ",") + to_string(pair.first) + ":" + to_string(pair.second);
         }
-        else {
-            response = "ERROR: Unknown command";
-            send(client, response.c_str(), response.size(), 0);
+        for (int node : decommissioning) {
+            drainList += (drainList.empty() ? "" : ",") + to_string(node);
         }
-        
-        close(client);
     }
-    
-    close(server);
-    return 0;
+    return "balance moves=" + to_string(movesDone.load()) + " failed=" + to_string(movesFailed.load()) +
+           " bytes=" + to_string(moveBytes.load()) + " usage=" + (usageList.empty() ? "-" : usageList) +
+           " draining=" + (drainList.empty() ? "-" : drainList) + "\n";
 }
 
+// Handle DECOMMISSION <nodeId> [CANCEL]: stop placing files on a node and
+// move every replica it holds to the others, or take it back into service
+string handleDecommission(int nodeId, bool cancel) {
+    long long replicas = 0;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        if (!nodePids.count(nodeId)) {
+            return "ERROR: Unknown node\n";
+        }
+        if (cancel) {
+            decommissioning.erase(nodeId);
+        } else {
+            decommissioning.insert(nodeId);
+        }
+        metadataLog.append(encodeNode(nodeId));
+        replicas = count_if(fileTable.begin(), fileTable.end(), [nodeId](const pair<const string, FileEntry>& file) {
+            return file.second.node1 == nodeId || file.second.node2 == nodeId;
+        });
+    }
+    if (cancel) {
+        return "OK node " + to_string(nodeId) + " back in service\n";
+    }
+    {
+        lock_guard<mutex> lock(balanceMutex);
+        balanceKick = true;
+    }
+    balanceWake.notify_one();
+    cout << "Decommissioning node " << nodeId << ": draining " << replicas << " replicas\n";
+    return "OK draining " + to_string(replicas) + " replicas from node " + to_string(nodeId) + "\n";
+}
+
+// Handle MPU_BEGIN command: open a multipart upload of a file of totalSize
+// bytes split into partSize parts, and pick the two nodes that will hold it.
+// With a token, an unfinished session for the same file is handed back
+// instead, so a restarted client can continue it (see MPU_STATUS).
+string handleMultipartBegin(const string& dfsPath, long long totalSize, long long partSize, const string& token, const vector<Codec>& offered) {
+    if (dfsPath.empty() || totalSize <= 0 || partSize <= 0 || partSize > MAX_FILE_SIZE) {
+        return "ERROR: Invalid multipart upload\n";
+    }
+    long long partCount = (totalSize + partSize - 1) / partSize;
+    if (partCount > MAX_PARTS) {
+        return "ERROR: Too many parts (max " + to_string(MAX_PARTS) + ")\n";
+    }
+    
+    Codec codec = negotiateCodec(offered);
+    string codecReply = offered.empty() ? "" : " CODEC=" + string(codecName(codec));
+    
+    expireUploadSessions();
+    if (!token.empty()) {
+        lock_guard<mutex> lock(tableMutex);
+        for (auto& pair : uploadSessions) {
+            UploadSession& existing = pair.second;
+            if (existing.token == token && existing.dfsPath == dfsPath && existing.size == totalSize && existing.partSize == partSize) {
+                existing.lastActive = time(nullptr);
+                existing.codec = codec;
+                return "UPLOADID " + pair.first + " RESUMED" + codecReply + "\n";
+            }
+        }
+    }
+    
+    vector<int> availableNodes = getAliveNodes();
+    if (availableNodes.size() < 2) {
+        return "ERROR: Not enough alive nodes (need at least 2, found " + to_string(availableNodes.size()) + ")\n";
+    }
+    
+    UploadSession session;
+    session.dfsPath = dfsPath;
+    session.token = token;
+    session.lastActive = time(nullptr);
+    session.size = totalSize;
+    session.partSize = partSize;
+    session.partCount = (int)partCount;
+    session.node1 = availableNodes[0];
+    session.node2 = availableNodes[1];
+    session.codec = codec;
+    session.partDone.assign(partCount, false);
+    session.partChecksums.assign(partCount, 0);
+    
+    string uploadId = to_string(getpid()) + "-" + to_string(uploadCounter++);
+    {
+        lock_guard<mutex> lock(tableMutex);
+        uploadSessions[uploadId] = session;
+    }
+    return "UPLOADID " + uploadId + codecReply + "\n";
+}
+
+// Handle MPU_STATUS command: which parts the coordinator already holds,
+// with their verified checksums, as "STATUS <partCount> <part>:<checksum>..."
+string handleMultipartStatus(const string& uploadId) {
+    lock_guard<mutex> lock(tableMutex);
+    auto it = uploadSessions.find(uploadId);
+    if (it == uploadSessions.end()) {
+        return "ERROR: Unknown upload\n";
+    }
+    UploadSession& session = it->second;
+    session.lastActive = time(nullptr);
+    string result = "STATUS " + to_string(session.partCount);
+    for (int i = 0; i < session.partCount; i++) {
+        if (session.partDone[i]) {
+            result += " " + to_string(i) + ":" + to_string(session.partChecksums[i]);
+        }
+    }
+    return result + "\n";
+}
+
+// Handle MPU_PART command: receive and verify one part, then stage it on
+// both nodes. Parts of one upload can arrive concurrently on separate
+// connections and be retried individually.
+string handleMultipartPart(int clientSock, const string& uploadId, int partNumber, int partSize, unsigned long checksum) {
+    long long offset;
+    int node1, node2;
+    Codec codec;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = uploadSessions.find(uploadId);
+        if (it == uploadSessions.end()) {
+            return "ERROR: Unknown upload\n";
+        }
+        UploadSession& session = it->second;
+        if (partNumber < 0 || partNumber >= session.partCount) {
+            return "ERROR: Invalid part number\n";
+        }
+        offset = partNumber * session.partSize;
+        if (partSize != min(session.partSize, session.size - offset)) {
+            return "ERROR: Invalid part size\n";
+        }
+        node1 = session.node1;
+        node2 = session.node2;
+        codec = session.codec;
+    }
+    
+    PooledBuffer partData = bufferPool().acquire(partSize);
+    if (!partData) {
+        return "ERROR: Server busy\n";
+    }
+    if (!recvPayload(clientSock, codec, partData.data(), partSize)) {
+        return "ERROR: Failed to receive part data\n";
+    }
+    requestTally().bytesIn = partSize;
+    
+    if (calculateChecksum(partData.data(), partSize) != checksum) {
+        return "ERROR: Checksum mismatch\n";
+    }
+    
+    string cmd = "PUTPART " + uploadId + " " + to_string(offset) + " " + to_string(partSize) + " " + to_string(checksum) + "\n";
+    if (!sendToNode(node1, cmd, partData.data(), partSize) || !sendToNode(node2, cmd, partData.data(), partSize)) {
+        return "ERROR: Failed to store part on nodes\n";
+    }
+    
+    lock_guard<mutex> lock(tableMutex);
+    auto it = uploadSessions.find(uploadId);
+    if (it == uploadSessions.end()) {
+        return "ERROR: Unknown upload\n";
+    }
+    it->second.partDone[partNumber] = true;
+    it->second.partChecksums[partNumber] = checksum;
+    it->second.lastActive = time(nullptr);
+    return "PART_OK " + to_string(partNumber) + "\n";
+}
+
+// Handle MPU_COMPLETE command: once every part is confirmed, have both nodes
+// publish the staged file and only then make it visible in fileTable
+string handleMultipartComplete(const string& uploadId) {
+    UploadSession session;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = uploadSessions.find(uploadId);
+        if (it == uploadSessions.end()) {
+            return "ERROR: Unknown upload\n";
+        }
+        session = it->second;
+    }
+    
+    unsigned long checksum = 0;
+    for (int i = 0; i < session.partCount; i++) {
+        if (!session.partDone[i]) {
+            return "ERROR: Part " + to_string(i) + " missing\n";
+        }
+        checksum += session.partChecksums[i];
+    }
+    
+    int version = reserveVersion(session.dfsPath);
+    string cmd = "COMMIT " + uploadId + " " + session.dfsPath + " " + to_string(session.size) + " " +
+                 to_string(checksum) + " " + to_string(version) + "\n";
+    if (!sendToNode(session.node1, cmd, nullptr, 0) || !sendToNode(session.node2, cmd, nullptr, 0)) {
+        return "ERROR: Failed to commit file on nodes\n";
+    }
+    
+    FileEntry entry;
+    entry.filename = session.dfsPath;
+    entry.node1 = session.node1;
+    entry.node2 = session.node2;
+    entry.checksum = checksum;
+    entry.size = session.size;
+    entry.version = version;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        publishEntry(entry);
+        uploadSessions.erase(uploadId);
+    }
+    
+    return "STORED " + to_string(session.node1) + " " + to_string(session.node2) + "\n";
+}
+
+// Handle MPU_ABORT command: forget the upload and drop staged parts
+string handleMultipartAbort(const string& uploadId) {
+    UploadSession session;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = uploadSessions.find(uploadId);
+        if (it == uploadSessions.end()) {
+            return "ERROR: Unknown upload\n";
+        }
+        session = it->second;
+        uploadSessions.erase(it);
+    }
+    
+    string cmd = "ABORT " + uploadId + "\n";
+    sendToNode(session.node1, cmd, nullptr, 0);
+    sendToNode(session.node2, cmd, nullptr, 0);
+    return "ABORTED\n";
+}
+
+// Abort multipart uploads that have been idle longer than UPLOAD_SESSION_TTL
+void expireUploadSessions() {
+    vector<string> expired;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        time_t now = time(nullptr);
+        for (auto& pair : uploadSessions) {
+            if (now - pair.second.lastActive > UPLOAD_SESSION_TTL) {
+                expired.push_back(pair.first);
+            }
+        }
+    }
+    for (const string& uploadId : expired) {
+        handleMultipartAbort(uploadId);
+    }
+}
+
+// Logical size of all deduplicated files and the size of the distinct
+// blocks behind them. Caller holds tableMutex.
+void dedupTotals(long long& logicalBytes, long long& uniqueBytes) {
+    logicalBytes = 0;
+    uniqueBytes = 0;
+    set<string> seen;
+    for (auto& pair : fileTable) {
+        const FileEntry& entry = pair.second;
+        if (entry.blockHashes.empty()) {
+            continue;
+        }
+        logicalBytes += entry.size;
+        for (size_t i = 0; i < entry.blockHashes.size(); i++) {
+            if (seen.insert(entry.blockHashes[i]).second) {
+                uniqueBytes += dedupBlockSize(entry.size, i);
+            }
+        }
+    }
+}
+
+// Indices of the blocks either node lacks (have[n][i] is '0'); a block
+// repeated within the file is only asked for once
+vector<size_t> neededBlocks(const vector<BlockRef>& blocks, const string have[2]) {
+    vector<size_t> needed;
+    set<string> requested;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if ((have[0][i] == '0' || have[1][i] == '0') && requested.insert(blocks[i].hash).second) {
+            needed.push_back(i);
+        }
+    }
+    return needed;
+}
+
+// Ask the client for the blocks at needed: "NEED <count> [CODEC=x]" and a
+// line of their indices. Each block is checked against its checksum here
+// (the nodes check the hash) and stored on the nodes whose have[n] marks it
+// missing, which then mark it held. Returns "" or the error for the client.
+string collectBlocks(int clientSock, const vector<size_t>& needed, const vector<BlockRef>& blocks, long long fileSize,
+                     const int nodes[2], string have[2], Codec codec, bool announceCodec) {
+    string reply = "NEED " + to_string(needed.size());
+    if (announceCodec) {
+        reply += " CODEC=" + string(codecName(codec));
+    }
+    reply += "\n";
+    for (size_t i = 0; i < needed.size(); i++) {
+        reply += (i > 0 ? " " : "") + to_string(needed[i]);
+    }
+    reply += "\n";
+    send(clientSock, reply.c_str(), reply.size(), 0);
+    
+    vector<char> block(DEDUP_BLOCK_SIZE);
+    for (size_t index : needed) {
+        long long blockSize = dedupBlockSize(fileSize, index);
+        if (!recvPayload(clientSock, codec, block.data(), blockSize)) {
+            return "ERROR: Failed to receive block data\n";
+        }
+        requestTally().bytesIn += blockSize;
+        if (calculateChecksum(block.data(), blockSize) != blocks[index].checksum) {
+            return "ERROR: Checksum mismatch in block " + to_string(index) + "\n";
+        }
+        string cmd = "PUTBLOCK " + blocks[index].hash + " " + to_string(blockSize) + "\n";
+        for (int n = 0; n < 2; n++) {
+            if (have[n][index] == '0' && !sendToNode(nodes[n], cmd, block.data(), blockSize)) {
+                return "ERROR: Failed to store block on node " + to_string(nodes[n]) + "\n";
+            }
+            have[n][index] = '1';
+        }
+    }
+    return "";
+}
+
+// Handle DEDUP_PUT <dfsPath> <size> <listSize>: a deduplicated upload. The
+// client sends the file's block list; both target nodes are asked which of
+// those blocks they already hold, and the coordinator answers
+// "NEED <count> [CODEC=x]" and a line with the indices of the blocks still
+// missing. Only those blocks follow. Each is checked against its checksum
+// here (the nodes check the hash) and stored on whichever node lacks it,
+// then both nodes publish the file as a manifest of the blocks. A block a
+// node reported as held can be deleted before the manifest pins it (its
+// last file removed meanwhile); the node then names the missing blocks, and
+// the client is sent another NEED for them.
+//
+// Blocks stored before a failure stay on the nodes, so running the same
+// upload again only sends what is still missing.
+string handleDedupUpload(int clientSock, const string& dfsPath, long long fileSize, long long listSize, const vector<Codec>& offered) {
+    if (dfsPath.empty() || fileSize <= 0 || listSize <= 0 || listSize > MAX_DEDUP_BLOCKS * 96) {
+        return "ERROR: Invalid deduplicated upload\n";
+    }
+    string list(listSize, '\0');
+    vector<BlockRef> blocks;
+    if (!recvAll(clientSock, &list[0], listSize) || !parseBlockList(list, fileSize, blocks)) {
+        return "ERROR: Invalid block list\n";
+    }
+    requestTally().bytesIn = listSize;
+    
+    vector<int> availableNodes = getAliveNodes();
+    if (availableNodes.size() < 2) {
+        return "ERROR: Not enough alive nodes (need at least 2, found " + to_string(availableNodes.size()) + ")\n";
+    }
+    int nodes[2] = {availableNodes[0], availableNodes[1]};
+    
+    // have[n][i] is '1' when nodes[n] already stores block i
+    string have[2];
+    for (int n = 0; n < 2; n++) {
+        string reply = requestFromNode(nodes[n], "HAVEBLOCKS " + to_string(listSize) + "\n", list.data(), listSize);
+        if (reply.find("HAVE ") != 0 || reply.size() != 5 + blocks.size()) {
+            return "ERROR: Cannot query blocks on node " + to_string(nodes[n]) + "\n";
+        }
+        have[n] = reply.substr(5);
+    }
+    
+    Codec codec = negotiateCodec(offered);
+    string error = collectBlocks(clientSock, neededBlocks(blocks, have), blocks, fileSize, nodes, have, codec, !offered.empty());
+    if (!error.empty()) {
+        return error;
+    }
+    
+    unsigned long checksum = 0;
+    FileEntry entry;
+    for (const BlockRef& ref : blocks) {
+        checksum += ref.checksum;
+        entry.blockHashes.push_back(ref.hash);
+    }
+    int version = reserveVersion(dfsPath);
+    string cmd = "STOREMANIFEST " + dfsPath + " " + to_string(fileSize) + " " + to_string(checksum) + " " +
+                 to_string(version) + " " + to_string(listSize) + "\n";
+    const string missingPrefix = "ERROR: Missing blocks";
+    bool stored[2] = {false, false};
+    for (int attempt = 1; !stored[0] || !stored[1]; attempt++) {
+        for (int n = 0; n < 2; n++) {
+            have[n].assign(blocks.size(), '1');
+            if (stored[n]) {
+                continue;
+            }
+            string reply = requestFromNode(nodes[n], cmd, list.data(), listSize);
+            stored[n] = reply.find("OK") == 0;
+            if (!stored[n] && (reply.find(missingPrefix) != 0 || attempt == MANIFEST_ATTEMPTS)) {
+                return "ERROR: Failed to store file on nodes\n";
+            }
+            stringstream missing(stored[n] ? "" : reply.substr(missingPrefix.size()));
+            size_t index;
+            while (missing >> index) {
+                if (index < blocks.size()) {
+                    have[n][index] = '0';
+                }
+            }
+        }
+        if (!stored[0] || !stored[1]) {
+            error = collectBlocks(clientSock, neededBlocks(blocks, have), blocks, fileSize, nodes, have, codec, !offered.empty());
+            if (!error.empty()) {
+                return error;
+            }
+        }
+    }
+    
+    entry.filename = dfsPath;
+    entry.node1 = nodes[0];
+    entry.node2 = nodes[1];
+    entry.checksum = checksum;
+    entry.size = fileSize;
+    entry.version = version;
+    long long logicalBytes, uniqueBytes;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        publishEntry(entry);
+        dedupTotals(logicalBytes, uniqueBytes);
+    }
+    
+    // Cluster-wide totals let the client report the overall dedup ratio
+    return "STORED " + to_string(nodes[0]) + " " + to_string(nodes[1]) + " " + to_string(logicalBytes) + " " +
+           to_string(uniqueBytes) + "\n";
+}
+
+// Handle DELTA_PUT <dfsPath> <baseVersion> <size> <checksum> <deltaSize>
+// <deltaChecksum>: a delta upload against the version the client took its
+// signature from. The coordinator answers READY [CODEC=x], receives and
+// verifies the delta, and has both replicas rebuild the new version from
+// their copy of the base (PATCH). Fails if the file changed in the meantime,
+// in which case the client falls back to a full upload.
+string handleDeltaUpload(int clientSock, const string& dfsPath, int baseVersion, long long fileSize, unsigned long checksum, long long deltaSize, unsigned long deltaChecksum, const vector<Codec>& offered) {
+    if (fileSize <= 0 || deltaSize <= 0 || deltaSize > MAX_FILE_SIZE) {
+        return "ERROR: Invalid delta upload\n";
+    }
+    
+    updateNodeStatus();
+    FileEntry entry;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        auto it = fileTable.find(dfsPath);
+        if (it == fileTable.end()) {
+            return "ERROR: File not found\n";
+        }
+        entry = it->second;
+        if (entry.version != baseVersion) {
+            return "ERROR: Base version changed\n";
+        }
+        if (!nodeAlive[entry.node1] || !nodeAlive[entry.node2]) {
+            return "ERROR: A replica is down\n";
+        }
+    }
+    
+    Codec codec = negotiateCodec(offered);
+    string ready = "READY";
+    if (!offered.empty()) {
+        ready += " CODEC=" + string(codecName(codec));
+    }
+    ready += "\n";
+    send(clientSock, ready.c_str(), ready.size(), 0);
+    
+    vector<char> delta(deltaSize);
+    if (!recvPayload(clientSock, codec, delta.data(), deltaSize)) {
+        return "ERROR: Failed to receive delta\n";
+    }
+    requestTally().bytesIn = deltaSize;
+    if (calculateChecksum(delta.data(), deltaSize) != deltaChecksum) {
+        return "ERROR: Delta checksum mismatch\n";
+    }
+    
+    int version = reserveVersion(dfsPath);
+    string cmd = "PATCH " + dfsPath + " " + to_string(baseVersion) + " " + to_string(fileSize) + " " +
+                 to_string(checksum) + " " + to_string(version) + " " + to_string(deltaSize) + "\n";
+    if (!sendToNode(entry.node1, cmd, delta.data(), deltaSize) || !sendToNode(entry.node2, cmd, delta.data(), deltaSize)) {
+        return "ERROR: Failed to patch file on nodes\n";
+    }
+    
+    entry.checksum = checksum;
+    entry.size = fileSize;
+    entry.version = version;
+    entry.blockHashes.clear();
+    {
+        lock_guard<mutex> lock(tableMutex);
+        publishEntry(entry);
+    }
+    return "STORED " + to_string(entry.node1) + " " + to_string(entry.node2) + "\n";
+}
+
+// Downloads are relayed a window at a time, each window a GET of its own
+// range checked against the checksum the node serves for it before any of
+// it reaches the client. A window a replica fails to serve, or serves
+// corrupt, is read from the other replica at the same offset, so read-repair
+// stays invisible to the client whatever the object's size, and a download
+// never holds more than one window of memory.
+const size_t RELAY_WINDOW = FRAME_RAW_SIZE * FRAME_BATCH;
+
+// A connection to one replica carrying a download's GETs (KEEPALIVE=1), with
+// the header of the last reply
+struct ReplicaStream {
+    int sock = -1;
+    long long size = 0;
+    unsigned long checksum = 0; // what the node serves for the bytes sent
+    Codec codec = Codec::None;
+};
+
+// Read one window of a download from a replica: send the GET line (over the
+// stream's connection when it has one), read the header and the data into
+// window, decoded (length bytes, or whatever fits when length < 0), keeping the frames as received in wire when compressed so
+// they can be forwarded unchanged. The connection is closed on any failure;
+// corrupt is set when the data did not match the node's checksum. Returns
+// "" on success or the error for the client.
+string readWindow(int nodeId, const string& cmd, bool compressed, long long length, ReplicaStream& stream,
+                  PooledBuffer& window, vector<char>& wire, bool& corrupt) {
+    corrupt = false;
+    if (stream.sock == -1) {
+        TraceSpan connectSpan("connect node");
+        connectSpan.setArg("node", nodeId);
+        stream.sock = connectToNode(nodeId);
+        if (stream.sock == -1) {
+            return "ERROR: Cannot connect to node";
+        }
+    }
+    
+    TraceSpan waitSpan("wait for node");
+    send(stream.sock, cmd.c_str(), cmd.size(), 0);
+    
+    // Receive size, checksum (served from the node's stored metadata; for a
+    // range it covers only the bytes sent, so verifying it needs nothing
+    // else) and codec
+    string error;
+    stream.size = strtoll(recvLine(stream.sock).c_str(), NULL, 10);
+    waitSpan.end();
+    if (length < 0 ? stream.size <= 0 || stream.size > (long long)window.size() : stream.size != length) {
+        error = "ERROR: Invalid file size from node";
+    } else {
+        stream.checksum = strtoul(recvLine(stream.sock).c_str(), NULL, 10);
+        stream.codec = compressed ? parseCodecReply(recvLine(stream.sock)) : Codec::None;
+        
+        TraceSpan recvSpan("recv from node");
+        recvSpan.setArg("bytes", stream.size);
+        wire.clear();
+        if (!recvPayload(stream.sock, stream.codec, window.data(), stream.size, stream.codec == Codec::None ? nullptr : &wire)) {
+            error = "ERROR: Failed to receive file data";
+        } else if (calculateChecksum(window.data(), (int)stream.size) != stream.checksum) {
+            corrupt = true;
+            error = "ERROR: Checksum mismatch - data corruption detected";
+        }
+    }
+    if (!error.empty()) {
+        close(stream.sock);
+        stream.sock = -1;
+    }
+    return error;
+}
+
+// Have a replica that served data failing its checksum rewritten. A
+// follower cannot change the cluster, so it passes the report to its primary.
+void requestRepair(const string& dfsPath, int badNode, int version) {
+    if (!following) {
+        scheduleRepair(dfsPath, badNode, version);
+        return;
+    }
+    string report = "CORRUPT " + to_string(badNode) + " " + dfsPath + " " + to_string(version) + "\n";
+    thread([report] { requestCoordinatorLine("127.0.0.1", primaryPort, report); }).detach();
+}
+
+// Handle DOWNLOAD command. length < 0 downloads the whole file; otherwise
+// only [offset, offset + length) is fetched from the nodes and forwarded.
+// Node1 is read first and its replica when it is down or a window of its
+// data fails the checksum; a copy already being repaired goes last. A copy
+// that failed is rewritten from the other in the background (read-repair),
+// so corruption costs the client one extra window read, not an error.
+// replied is set once the OK line is out, after which errors cannot be sent.
+string handleDownload(int clientSock, const string& dfsPath, long long offset, long long length, const vector<Codec>& offered, bool& replied) {
+    updateNodeStatus();
+    
+    FileEntry entry;
+    bool node1Alive, node2Alive, node1Repairing;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        if (fileTable.find(dfsPath) == fileTable.end()) {
+            return "ERROR: File not found";
+        }
+        entry = fileTable[dfsPath];
+        node1Alive = nodeAlive[entry.node1];
+        node2Alive = nodeAlive[entry.node2];
+        node1Repairing = repairing.count({dfsPath, entry.node1}) > 0;
+    }
+    
+    // Clamp ranges that run past the end, like a short read would
+    bool whole = length < 0;
+    if (whole) {
+        offset = 0;
+        length = entry.size;
+    } else {
+        if (offset < 0 || offset >= entry.size || length == 0) {
+            return "ERROR: Invalid range";
+        }
+        length = min(length, entry.size - offset);
+    }
+    
+    // Try node1 first
+    vector<int> replicas;
+    string recoveryMsg = "";
+    
+    if (node1Alive) {
+        replicas.push_back(entry.node1);
+    } else {
+        recoveryMsg = "Node " + to_string(entry.node1) + " failed, recovered using replica";
+    }
+    if (node2Alive) {
+        replicas.insert(node1Repairing ? replicas.begin() : replicas.end(), entry.node2);
+    }
+    if (replicas.empty()) {
+        return "ERROR: Both nodes are down";
+    }
+    
+    PooledBuffer window = bufferPool().acquire((size_t)min<long long>(length, RELAY_WINDOW));
+    if (!window) {
+        return "ERROR: Server busy";
+    }
+    
+    // The OK line carries the checksum of everything that follows. A single
+    // window's comes with it; for more, every window is read at the version
+    // in the file table, whose checksum covers the whole file, and a range's
+    // is asked of a replica up front.
+    bool windowed = length > (long long)RELAY_WINDOW;
+    unsigned long checksum = entry.checksum;
+    if (windowed && !whole) {
+        string cmd = "RANGESUM " + dfsPath + " " + to_string(offset) + " " + to_string(length) + " VERSION=" +
+                     to_string(entry.version) + "\n";
+        string reply;
+        for (int nodeId : replicas) {
+            reply = requestFromNode(nodeId, cmd, nullptr, 0);
+            if (reply.find("SUM ") == 0) {
+                break;
+            }
+        }
+        if (reply.find("SUM ") != 0) {
+            return "ERROR: Cannot read file checksum from nodes";
+        }
+        checksum = strtoul(reply.c_str() + 4, NULL, 10);
+    }
+    
+    // The node compresses with a codec the client also accepts, so the frames
+    // can be verified here and forwarded unchanged. Windows after the first
+    // ask for the codec it chose; a node that answers with another has its
+    // data re-framed here.
+    vector<Codec> relayCodecs = supportedSubset(offered);
+    Codec codec = Codec::None;
+    vector<ReplicaStream> streams(replicas.size());
+    vector<char> wire;
+    size_t current = 0;
+    long long relayed = 0;
+    string error;
+    while (relayed < length) {
+        // A whole file read in one GET is taken at whatever size the node
+        // holds, as an overwrite may have landed since the table was read
+        long long chunk = (whole && !windowed) ? -1 : min<long long>(length - relayed, RELAY_WINDOW);
+        vector<Codec> offer = relayed == 0 ? relayCodecs : vector<Codec>();
+        if (relayed > 0 && codec != Codec::None) {
+            offer.push_back(codec);
+        }
+        string cmd = "GET " + dfsPath;
+        if (!whole || windowed) {
+            cmd += " " + to_string(offset + relayed) + " " + to_string(chunk);
+        }
+        cmd += codecOffer(offer);
+        if (windowed) {
+            cmd += " VERSION=" + to_string(entry.version) + " KEEPALIVE=1";
+        }
+        cmd += traceToken() + "\n";
+        
+        // This window from the replica that served the last one, else the other
+        size_t tried = 0;
+        for (; tried < replicas.size(); tried++) {
+            size_t r = (current + tried) % replicas.size();
+            bool corrupt = false;
+            error = readWindow(replicas[r], cmd, !offer.empty(), chunk, streams[r], window, wire, corrupt);
+            if (corrupt) {
+                cerr << "Node " << replicas[r] << " served corrupt data for " << dfsPath << ", repairing\n";
+                requestRepair(dfsPath, replicas[r], entry.version);
+            }
+            if (error.empty()) {
+                current = r;
+                break;
+            }
+            if (relayed == 0 && tried + 1 < replicas.size()) {
+                recoveryMsg = "Node " + to_string(replicas[r]) + (corrupt ? " failed checksum verification" : " failed") +
+                              ", recovered using replica";
+            } else if (relayed > 0) {
+                cerr << "Node " << replicas[r] << " failed serving " << dfsPath << " at offset " << offset + relayed << "\n";
+            }
+        }
+        if (tried == replicas.size()) {
+            break;
+        }
+        const ReplicaStream& stream = streams[current];
+        if (chunk < 0) {
+            chunk = length = stream.size;
+        }
+        
+        // Send to client
+        if (relayed == 0) {
+            codec = stream.codec;
+            if (!windowed) {
+                checksum = stream.checksum;
+            }
+            string response = "OK " + to_string(length) + " " + to_string(checksum);
+            if (!offered.empty()) {
+                response += " CODEC=" + string(codecName(codec));
+            }
+            response += "\n";
+            if (!recoveryMsg.empty()) {
+                response = recoveryMsg + "\n" + response;
+            }
+            send(clientSock, response.c_str(), response.size(), 0);
+            replied = true;
+        }
+        
+        // Send the data (the node's frames as received when compressed)
+        TraceSpan sendSpan("send to client");
+        sendSpan.setArg("bytes", chunk);
+        bool sent;
+        if (stream.codec != codec) {
+            sent = sendPayload(clientSock, codec, window.data(), chunk);
+        } else if (codec == Codec::None) {
+            sent = sendAll(clientSock, window.data(), chunk);
+        } else {
+            sent = sendAll(clientSock, wire.data(), wire.size());
+        }
+        if (!sent) {
+            error = "ERROR: Failed to send file to client";
+            break;
+        }
+        relayed += chunk;
+        requestTally().bytesOut = relayed;
+    }
+    for (ReplicaStream& stream : streams) {
+        if (stream.sock != -1) {
+            close(stream.sock);
+        }
+    }
+    return relayed == length ? "SUCCESS" : error;
+}
+
+// Handle LIST command
+string handleList() {
+    lock_guard<mutex> lock(tableMutex);
+    string result = "";
+    for (auto& pair : fileTable) {
+        result += pair.first + "\n";
+    }
+    if (result.empty()) {
+        result = "No files stored\n";
+    }
+    return result;
+}
+
+// Handle LOCATE command: report size, checksum, version and the alive
+// replicas of a file so clients can read from the nodes directly. The
+// LEASE= token grants the client leaseMs to reuse the reply without asking
+// again. Reads under a lease name the version, so a node holding another
+// version refuses them and an overwrite in place is noticed at once; an
+// overwrite that lands on other nodes, or a replica that dies, is noticed
+// when a node fails the read or the lease runs out.
+string handleLocate(const string& dfsPath) {
+    updateNodeStatus();
+    lock_guard<mutex> lock(tableMutex);
+    
+    if (fileTable.find(dfsPath) == fileTable.end()) {
+        return "ERROR: File not found\n";
+    }
+    
+    FileEntry entry = fileTable[dfsPath];
+    string replicas = "";
+    for (int nodeId : {entry.node1, entry.node2}) {
+        if (nodeAlive[nodeId]) {
+            replicas += " " + to_string(nodeId);
+        }
+    }
+    if (replicas.empty()) {
+        return "ERROR: Both nodes are down\n";
+    }
+    
+    string lease = leaseMs > 0 ? " LEASE=" + to_string(leaseMs) : "";
+    return "OK " + to_string(entry.size) + " " + to_string(entry.checksum) + " " +
+           to_string(entry.version) + replicas + lease + "\n";
+}
+
+// Handle REGISTER command (nodes register themselves)
+string handleRegister(const string& line) {
+    stringstream ss(line);
+    string cmd;
+    int nodeId;
+    pid_t pid;
+    
+    ss >> cmd >> nodeId >> pid;
+    
+    lock_guard<mutex> lock(tableMutex);
+    nodePids[nodeId] = pid;
+    nodeAlive[nodeId] = true;
+    nodeCodecs[nodeId] = parseCodecOffer(line);
+    metadataLog.append(encodeNode(nodeId));
+    
+    return "REGISTERED " + to_string(nodeId);
+}
+
+// Handle TRACE <id> [LOCAL]: the spans of one trace recorded here and, unless
+// LOCAL, on every registered node, as Chrome trace events. Clients of a
+// partitioned cluster ask the other partitions for LOCAL spans only, so the
+// nodes' spans are gathered once.
+string handleTrace(const string& id, bool local) {
+    uint64_t traceId = parseTraceToken("TRACE=" + id);
+    string processName = partitions.count() > 1 ? "coordinator " + to_string(partitionId) : "coordinator";
+    string events = chromeTraceEvents(traceId, processName);
+    if (traceId == 0 || local) {
+        return events;
+    }
+    vector<int> nodes;
+    {
+        lock_guard<mutex> lock(tableMutex);
+        for (auto& pair : nodePids) {
+            nodes.push_back(pair.first);
+        }
+    }
+    for (int nodeId : nodes) {
+        int sock = connectToNode(nodeId);
+        if (sock == -1) {
+            continue;
+        }
+        string cmd = "TRACE " + id + "\n";
+        send(sock, cmd.c_str(), cmd.size(), 0);
+        string reply;
+        char buffer[65536];
+        ssize_t n;
+        while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+            reply.append(buffer, n);
+        }
+        close(sock);
+        appendTraceEvents(events, reply);
+    }
+    return events;
+}
+
+long long steadyMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// How far a follower may be behind its primary: the time since the last
+// line on the FOLLOW stream, which carries every change as it is made and a
+// heartbeat when there is none
+long long replicationLagMs() {
+    return steadyMs() - lastPrimaryContact.load();
+}
+
+int followerCount() {
+    lock_guard<mutex> lock(followersMutex);
+    return (int)followers.size();
+}
+
+// Stats line: this coordinator's side of replication
+string replicationLine() {
+    string line = "replication role=" + string(following ? "follower" : "primary") +
+                  " epoch=" + to_string(logEpoch.load()) + " seq=" + to_string(metadataLog.lastSeq());
+    if (following) {
+        line += " primary=" + to_string(primaryPort) + " lag_ms=" + to_string(replicationLagMs());
+    } else {
+        line += " followers=" + to_string(followerCount());
+    }
+    return line + "\n";
+}
+
+// Stats line: replica repairs
+string repairLine() {
+    return "repair started=" + to_string(repairsStarted.load()) + " done=" + to_string(repairsDone.load()) +
+           " failed=" + to_string(repairsFailed.load()) + " bytes=" + to_string(repairBytes.load()) + "\n";
+}
+
+// Handle STATS [prometheus]: request statistics plus table sizes, the
+// payload buffer pool, replication and repairs
+string handleStats(const string& format) {
+    if (format != "prometheus") {
+        return requestStats.text() + "buffers " + bufferPool().statsLine() + replicationLine() + repairLine() + balanceLine();
+    }
+    string out = requestStats.prometheus("dfs_coordinator_");
+    bufferPool().prometheus(out, "dfs_coordinator_");
+    prometheusMetric(out, "dfs_coordinator_log_seq", "gauge", "Last metadata log record applied.", metadataLog.lastSeq());
+    prometheusMetric(out, "dfs_coordinator_followers", "gauge", "Follower coordinators streaming the log.", followerCount());
+    prometheusMetric(out, "dfs_coordinator_replication_lag_ms", "gauge", "Milliseconds since the primary was last heard from (followers).",
+                     following ? replicationLagMs() : 0);
+    prometheusMetric(out, "dfs_coordinator_repairs_done_total", "counter", "Damaged replicas rewritten.", repairsDone.load());
+    prometheusMetric(out, "dfs_coordinator_repairs_failed_total", "counter", "Replica repairs that did not finish.", repairsFailed.load());
+    prometheusMetric(out, "dfs_coordinator_repair_bytes_total", "counter", "Bytes copied by replica repairs.", repairBytes.load());
+    prometheusMetric(out, "dfs_coordinator_moves_done_total", "counter", "Replicas moved by the balancer.", movesDone.load());
+    prometheusMetric(out, "dfs_coordinator_moves_failed_total", "counter", "Balancer moves that did not finish.", movesFailed.load());
+    prometheusMetric(out, "dfs_coordinator_move_bytes_total", "counter", "Bytes moved by the balancer.", moveBytes.load());
+    lock_guard<mutex> lock(tableMutex);
+    long alive = count_if(nodeAlive.begin(), nodeAlive.end(), [](const pair<const int, bool>& node) { return node.second; });
+    prometheusMetric(out, "dfs_coordinator_files", "gauge", "Files in the file table.", fileTable.size());
+    prometheusMetric(out, "dfs_coordinator_nodes_registered", "gauge", "Nodes that have registered.", nodePids.size());
+    prometheusMetric(out, "dfs_coordinator_nodes_alive", "gauge", "Registered nodes last seen alive.", alive);
+    prometheusMetric(out, "dfs_coordinator_nodes_draining", "gauge", "Nodes being decommissioned.", decommissioning.size());
+    prometheusMetric(out, "dfs_coordinator_multipart_uploads", "gauge", "Multipart uploads in progress.", uploadSessions.size());
+    prometheusMetric(out, "dfs_coordinator_pending_uploads", "gauge", "Resumable uploads in progress.", pendingUploads.size());
+    return out;
+}
+
+// Handle FOLLOW <epoch> <afterSeq> <port>: stream the metadata log to the
+// follower coordinator on port. A follower that is on this log and whose
+// next records are still kept gets "TAIL <epoch>"; any other gets
+// "SNAPSHOT <epoch> <seq> <count>" and count records rebuilding the tables
+// as of record seq. Then every new record follows as "<seq> <record>", and
+// "<seq> HEARTBEAT" when FOLLOW_HEARTBEAT_MS pass without one. The stream
+// ends when the follower goes away or falls out of the kept records.
+void handleFollow(int client, uint64_t epoch, uint64_t afterSeq, int port) {
+    vector<pair<uint64_t, string>> records;
+    string out;
+    uint64_t seq = afterSeq;
+    if (epoch != 0 && epoch == logEpoch.load() && afterSeq <= metadataLog.lastSeq() && metadataLog.readAfter(afterSeq, records, 0)) {
+        out = "TAIL " + to_string(epoch) + "\n";
+    } else {
+        string snapshot;
+        size_t count = 0;
+        {
+            lock_guard<mutex> lock(tableMutex);
+            seq = metadataLog.lastSeq();
+            for (auto& pair : nodePids) {
+                snapshot += encodeNode(pair.first) + "\n";
+                count++;
+            }
+            for (auto& pair : fileTable) {
+                snapshot += encodeEntry(pair.second) + "\n";
+                count++;
+            }
+        }
+        out = "SNAPSHOT " + to_string(logEpoch.load()) + " " + to_string(seq) + " " + to_string(count) + "\n" + snapshot;
+    }
+    
+    {
+        lock_guard<mutex> lock(followersMutex);
+        followers[port]++;
+    }
+    while (true) {
+        for (auto& record : records) {
+            out += to_string(record.first) + " " + record.second + "\n";
+            seq = record.first;
+        }
+        if (out.empty()) {
+            out = to_string(seq) + " HEARTBEAT\n";
+        }
+        if (!sendAll(client, out.data(), out.size())) {
+            break;
+        }
+        out.clear();
+        records.clear();
+        if (!metadataLog.readAfter(seq, records, FOLLOW_HEARTBEAT_MS)) {
+            break; // the follower reconnects and gets a snapshot
+        }
+    }
+    lock_guard<mutex> lock(followersMutex);
+    if (--followers[port] == 0) {
+        followers.erase(port);
+    }
+}
+
+// Handle FOLLOWERS: the ports of the followers streaming this log, so
+// clients can spread reads over them
+string handleFollowers() {
+    lock_guard<mutex> lock(followersMutex);
+    string reply = "FOLLOWERS";
+    for (auto& pair : followers) {
+        reply += " " + to_string(pair.first);
+    }
+    return reply + "\n";
+}
+
+// Buffered line reads for the FOLLOW stream, which can carry a large
+// snapshot of short lines
+struct LineReader {
+    explicit LineReader(int sock) : sock(sock) {}
+    
+    
+    bool next(string& line) {
+        while (true) {
+            size_t end = buffer.find('\n', pos);
+            if (end != string::npos) {
+                line = buffer.substr(pos, end - pos);
+                pos = end + 1;
+                return true;
+            }
+            buffer.erase(0, pos);
+            pos = 0;
+            char chunk[65536];
+            ssize_t n = recv(sock, chunk, sizeof(chunk), 0);
+            if (n <= 0) {
+                return false;
+            }
+            buffer.append(chunk, n);
+        }
+    }
+    
+    int sock;
+    string buffer;
+    size_t pos = 0;
+};
+
+// Follower: replay one FOLLOW stream until it drops or PROMOTE cuts it
+void replayStream(int sock) {
+    LineReader reader(sock);
+    string line;
+    if (!reader.next(line)) {
+        return;
+    }
+    lastPrimaryContact = steadyMs();
+    stringstream header(line);
+    string tag;
+    uint64_t epoch = 0, seq = 0;
+    size_t count = 0;
+    header >> tag >> epoch;
+    if (tag == "SNAPSHOT") {
+        header >> seq >> count;
+        // Receive the whole snapshot before replacing anything, so a stream
+        // that drops halfway leaves the previous tables in place
+        vector<string> records(count);
+        for (size_t i = 0; i < count; i++) {
+            if (!reader.next(records[i])) {
+                return;
+            }
+        }
+        lock_guard<mutex> lock(tableMutex);
+        fileTable.clear();
+        nodePids.clear();
+        nodeAlive.clear();
+        nodeCodecs.clear();
+        versionCounters.clear();
+        decommissioning.clear();
+        for (const string& record : records) {
+            applyRecord(record);
+        }
+        metadataLog.resetTo(seq);
+        logEpoch = epoch;
+        cout << "Loaded snapshot of " << fileTable.size() << " files at record " << seq << " from port " << primaryPort << "\n";
+    } else if (tag != "TAIL" || epoch != logEpoch.load()) {
+        return;
+    }
+    lastPrimaryContact = steadyMs();
+    
+    while (following && reader.next(line)) {
+        lastPrimaryContact = steadyMs();
+        size_t space = line.find(' ');
+        string record = line.substr(space + 1);
+        if (space == string::npos || record == "HEARTBEAT") {
+            continue;
+        }
+        lock_guard<mutex> lock(tableMutex);
+        if (applyRecord(record)) {
+            metadataLog.appendAt(stoull(line.substr(0, space)), record);
+        }
+    }
+}
+
+// Follower thread: keep a FOLLOW stream open to the primary, reconnecting
+// after FOLLOW_RETRY_MS whenever it drops. A primary that restarted has a
+// new epoch and sends a fresh snapshot.
+void followPrimary() {
+    while (following) {
+        int sock = connectToPort(primaryPort);
+        if (sock != -1) {
+            {
+                lock_guard<mutex> lock(followMutex);
+                followSock = sock;
+            }
+            string cmd = "FOLLOW " + to_string(logEpoch.load()) + " " + to_string(metadataLog.lastSeq()) + " " +
+                         to_string(listenPort) + "\n";
+            if (following && send(sock, cmd.c_str(), cmd.size(), 0) == (ssize_t)cmd.size()) {
+                replayStream(sock);
+            }
+            {
+                lock_guard<mutex> lock(followMutex);
+                followSock = -1;
+            }
+            close(sock);
+        }
+        this_thread::sleep_for(chrono::milliseconds(FOLLOW_RETRY_MS));
+    }
+}
+
+// Commands a follower serves from its replica of the tables; everything
+// else changes metadata and is refused
+const set<string> FOLLOWER_COMMANDS = {"LOCATE", "DOWNLOAD", "LIST", "STATS", "TRACE", "PARTITIONS", "FOLLOWERS", "PROMOTE"};
+const set<string> FOLLOWER_READS = {"LOCATE", "DOWNLOAD", "LIST"};
+
+// The refusal for a command a follower will not serve, or "" when it will:
+// writes belong to the primary, and reads are refused once the follower is
+// more than maxLagMs behind
+string followerRefusal(const string& command) {
+    if (!following) {
+        return "";
+    }
+    if (!FOLLOWER_COMMANDS.count(command)) {
+        return "ERROR: Read-only follower, primary is on port " + to_string(primaryPort) + "\n";
+    }
+    long long lag = replicationLagMs();
+    if (FOLLOWER_READS.count(command) && lag > maxLagMs) {
+        return "ERROR: Follower is stale, " + to_string(lag) + " ms behind the primary on port " + to_string(primaryPort) + "\n";
+    }
+    return "";
+}
+
+int openListener(int port);
+void acceptClients(int server);
+
+// Handle PROMOTE: stop following and serve writes from the replicated
+// tables. The promoted coordinator also listens on the old primary's port
+// when it can bind it, so clients and nodes that only know that port find
+// it. Promotion is manual: a follower never promotes itself, which would
+// risk two primaries when only the link between them failed.
+string handlePromote() {
+    if (!following.exchange(false)) {
+        return "ERROR: Not a follower\n";
+    }
+    {
+        lock_guard<mutex> lock(followMutex);
+        if (followSock != -1) {
+            shutdown(followSock, SHUT_RDWR);
+        }
+    }
+    string reply = "PROMOTED " + to_string(metadataLog.lastSeq());
+    int server = openListener(primaryPort);
+    if (server != -1) {
+        thread(acceptClients, server).detach();
+        reply += " " + to_string(primaryPort);
+    }
+    cout << "Promoted to primary at record " << metadataLog.lastSeq() << "\n";
+    return reply + "\n";
+}
+
+// Commands whose second token is the DFS path they work on
+const set<string> PATH_COMMANDS = {"UPLOAD", "DEDUP_PUT", "DELTA_PUT", "DOWNLOAD", "MPU_BEGIN", "LOCATE"};
+
+// The refusal for a path command sent to a coordinator that does not own
+// the path, or "" when it does
+string wrongPartition(const string& command, const string& cmd) {
+    if (partitions.count() == 1 || !PATH_COMMANDS.count(command)) {
+        return "";
+    }
+    stringstream ss(cmd);
+    string name, dfsPath;
+    ss >> name >> dfsPath;
+    int owner = partitions.partitionOf(dfsPath);
+    if (owner == partitionId) {
+        return "";
+    }
+    return "ERROR: Wrong partition, " + dfsPath + " belongs to partition " + to_string(owner) + " on port " +
+           to_string(partitions.ports[owner]) + "\n";
+}
+
+// Client transfers that background copies make way for (see yieldToForeground)
+const set<string> FOREGROUND_COMMANDS = {"UPLOAD", "DEDUP_PUT", "DELTA_PUT", "DOWNLOAD", "MPU_PART", "MPU_COMPLETE"};
+
+// Commands whose replies are self-delimiting, so their connection can carry
+// another request when the client sends KEEPALIVE=1
+const set<string> KEEPALIVE_COMMANDS = {"LOCATE", "DOWNLOAD", "MPU_BEGIN", "MPU_PART", "MPU_COMPLETE", "MPU_STATUS", "MPU_ABORT"};
+
+// Serve one request line. Returns true when the connection may carry the
+// next request.
+bool serveRequest(int client, const string& cmd) {
+    // Time and count the request under its command, and trace it when the
+    // line carries a TRACE= token
+    auto start = chrono::steady_clock::now();
+    OpStats& op = requestStats.op(cmd.substr(0, cmd.find(' ')));
+    requestTally() = RequestTally();
+    currentTrace() = parseTraceToken(cmd);
+    TraceSpan requestSpan(op.name.c_str());
+    bool foreground = FOREGROUND_COMMANDS.count(op.name) > 0;
+    if (foreground) {
+        foregroundTransfers++;
+    }
+    
+    string response = followerRefusal(op.name);
+    if (response.empty()) {
+        response = wrongPartition(op.name, cmd);
+    }
+    
+    if (!response.empty()) {
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("REGISTER") == 0) {
+        response = handleRegister(cmd);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("UPLOAD") == 0) {
+        // UPLOAD <dfsPath>, or resumable UPLOAD <dfsPath> <size> <token> [CODECS=...]
+        stringstream ss(cmd);
+        string upload, dfsPath, token;
+        long long fileSize = 0;
+        ss >> upload >> dfsPath;
+        DFS_PROBE1(upload__start, dfsPath.c_str());
+        if (ss >> fileSize >> token) {
+            response = handleResumableUpload(client, dfsPath, fileSize, token, parseCodecOffer(cmd));
+        } else {
+            response = handleUpload(client, dfsPath);
+        }
+        DFS_PROBE3(upload__done, dfsPath.c_str(), requestTally().bytesIn, response.find("ERROR") != 0);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("DEDUP_PUT") == 0) {
+        // DEDUP_PUT <dfsPath> <size> <listSize> [CODECS=...], then the block list
+        stringstream ss(cmd);
+        string put, dfsPath;
+        long long fileSize = 0, listSize = 0;
+        ss >> put >> dfsPath >> fileSize >> listSize;
+        response = handleDedupUpload(client, dfsPath, fileSize, listSize, parseCodecOffer(cmd));
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("DELTA_PUT") == 0) {
+        // DELTA_PUT <dfsPath> <baseVersion> <size> <checksum> <deltaSize> <deltaChecksum> [CODECS=...]
+        stringstream ss(cmd);
+        string put, dfsPath;
+        int baseVersion = 0;
+        long long fileSize = 0, deltaSize = 0;
+        unsigned long checksum = 0, deltaChecksum = 0;
+        ss >> put >> dfsPath >> baseVersion >> fileSize >> checksum >> deltaSize >> deltaChecksum;
+        response = handleDeltaUpload(client, dfsPath, baseVersion, fileSize, checksum, deltaSize, deltaChecksum, parseCodecOffer(cmd));
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("DOWNLOAD") == 0) {
+        stringstream ss(cmd);
+        string download, dfsPath;
+        long long offset = 0;
+        long long length = -1;
+        ss >> download >> dfsPath;
+        if (ss >> offset >> length) {
+            length = max(length, 0LL); // negative lengths are rejected as empty ranges
+        } else {
+            offset = 0;
+            length = -1;
+        }
+        DFS_PROBE3(download__start, dfsPath.c_str(), offset, length);
+        bool replied = false;
+        response = handleDownload(client, dfsPath, offset, length, parseCodecOffer(cmd), replied);
+        DFS_PROBE3(download__done, dfsPath.c_str(), requestTally().bytesOut, response.find("ERROR") != 0);
+        if (response.find("ERROR") == 0 && !replied) {
+            response += "\n";
+            send(client, response.c_str(), response.size(), 0);
+        }
+    }
+    else if (cmd.find("MPU_BEGIN") == 0) {
+        // MPU_BEGIN <dfsPath> <totalSize> <partSize> [<token>] [CODECS=...] [TRACE=...]
+        stringstream ss(cmd);
+        string begin, dfsPath, token;
+        long long totalSize = 0, partSize = 0;
+        ss >> begin >> dfsPath >> totalSize >> partSize >> token;
+        if (token.find('=') != string::npos) {
+            token.clear();
+        }
+        response = handleMultipartBegin(dfsPath, totalSize, partSize, token, parseCodecOffer(cmd));
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("MPU_PART") == 0) {
+        // MPU_PART <uploadId> <partNumber> <size> <checksum>, then the part data
+        stringstream ss(cmd);
+        string part, uploadId;
+        int partNumber = -1, partSize = 0;
+        unsigned long checksum = 0;
+        ss >> part >> uploadId >> partNumber >> partSize >> checksum;
+        response = handleMultipartPart(client, uploadId, partNumber, partSize, checksum);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("MPU_COMPLETE") == 0) {
+        stringstream ss(cmd);
+        string complete, uploadId;
+        ss >> complete >> uploadId;
+        response = handleMultipartComplete(uploadId);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("MPU_STATUS") == 0) {
+        stringstream ss(cmd);
+        string status, uploadId;
+        ss >> status >> uploadId;
+        response = handleMultipartStatus(uploadId);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("MPU_ABORT") == 0) {
+        stringstream ss(cmd);
+        string abort, uploadId;
+        ss >> abort >> uploadId;
+        response = handleMultipartAbort(uploadId);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("LOCATE") == 0) {
+        stringstream ss(cmd);
+        string locate, dfsPath;
+        ss >> locate >> dfsPath;
+        response = handleLocate(dfsPath);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("CORRUPT") == 0) {
+        // CORRUPT <nodeId> <dfsPath> <version>: a scrubber's report
+        stringstream ss(cmd);
+        string corrupt, dfsPath;
+        int nodeId = 0, version = 0;
+        ss >> corrupt >> nodeId >> dfsPath >> version;
+        response = handleCorrupt(nodeId, dfsPath, version);
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("DECOMMISSION") == 0) {
+        // DECOMMISSION <nodeId> [CANCEL]
+        stringstream ss(cmd);
+        string decommission, cancel;
+        int nodeId = 0;
+        ss >> decommission >> nodeId >> cancel;
+        response = handleDecommission(nodeId, cancel == "CANCEL");
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("LIST") == 0) {
+        response = handleList();
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("TRACE") == 0) {
+        stringstream ss(cmd);
+        string trace, id, scope;
+        ss >> trace >> id >> scope;
+        response = handleTrace(id, scope == "LOCAL");
+        sendAll(client, response.data(), response.size());
+    }
+    else if (cmd.find("PARTITIONS") == 0) {
+        response = partitions.line();
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("FOLLOWERS") == 0) {
+        response = handleFollowers();
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("FOLLOW") == 0) {
+        // FOLLOW <epoch> <afterSeq> <port>: a follower coordinator's log stream
+        stringstream ss(cmd);
+        string follow;
+        uint64_t epoch = 0, afterSeq = 0;
+        int port = 0;
+        ss >> follow >> epoch >> afterSeq >> port;
+        handleFollow(client, epoch, afterSeq, port);
+    }
+    else if (cmd.find("PROMOTE") == 0) {
+        response = handlePromote();
+        send(client, response.c_str(), response.size(), 0);
+    }
+    else if (cmd.find("STATS") == 0) {
+        stringstream ss(cmd);
+        string stats, format;
+        ss >> stats >> format;
+        response = handleStats(format);
+        sendAll(client, response.data(), response.size());
+    }
+    else {
+        response = "ERROR: Unknown command";
+        send(client, response.c_str(), response.size(), 0);
+    }
+    
+    if (foreground) {
+        foregroundTransfers--;
+    }
+    if (response.find("ERROR") == 0) {
+        requestTally().failed = true;
+    }
+    requestSpan.end();
+    requestStats.record(op, start, requestTally());
+    return keepAliveRequested(cmd) && !requestTally().failed && KEEPALIVE_COMMANDS.count(op.name);
+}
+
+// Serve one connection; each runs on its own thread so slow transfers (and
+// the parallel parts of a multipart upload) do not queue behind each other
+void handleClient(int client) {
+    string cmd = recvLine(client);
+    while (!cmd.empty() && serveRequest(client, cmd) && waitReadable(client, KEEPALIVE_IDLE_MS)) {
+        cmd = recvLine(client);
+    }
+    close(client);
+}
+
+// Listen on port, or -1
+int openListener(int port) {
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    if (server == -1) {
+        return -1;
+    }
+    
+    // Set socket option to reuse address
+    int opt = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = INADDR_ANY;
+    
+    if (bind(server, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, SOMAXCONN) != 0) {
+        close(server);
+        return -1;
+    }
+    return server;
+}
+
+void acceptClients(int server) {
+    while (true) {
+        sockaddr_in clientAddr;
+        socklen_t clientLen = sizeof(clientAddr);
+        int client = accept(server, (sockaddr*)&clientAddr, &clientLen);
+        if (client == -1) {
+            continue;
+        }
+        
+        thread(handleClient, client).detach();
+    }
+}
+
+int main(int argc, char* argv[]) {
+    // A client that disconnects mid-upload must not take the coordinator down
+    signal(SIGPIPE, SIG_IGN);
+    
+    int partitionCount = 1;
+    for (int i = 1; i + 1 < argc; i++) {
+        if (string(argv[i]) == "--partitions") {
+            // --partitions <count> --partition <id>: own one hash partition
+            // of the namespace
+            partitionCount = atoi(argv[++i]);
+        }
+        else if (string(argv[i]) == "--partition") {
+            partitionId = atoi(argv[++i]);
+        }
+        else if (string(argv[i]) == "--follow") {
+            // --follow <primaryPort> --port <port>: a read-only follower
+            // replaying the primary's metadata log
+            primaryPort = atoi(argv[++i]);
+            following = true;
+        }
+        else if (string(argv[i]) == "--port") {
+            listenPort = atoi(argv[++i]);
+        }
+        else if (string(argv[i]) == "--max-lag-ms") {
+            maxLagMs = atoll(argv[++i]);
+        }
+        else if (string(argv[i]) == "--lease-ms") {
+            // How long clients may cache a file's location
+            leaseMs = max(0LL, atoll(argv[++i]));
+        }
+        else if (string(argv[i]) == "--balance-mbps") {
+            // Bandwidth for moving replicas between live nodes; 0 turns
+            // balancing off (decommissioned nodes are drained regardless)
+            balanceLimiter.setRate(max(0.0, atof(argv[++i])) * 1024 * 1024);
+        }
+        else if (string(argv[i]) == "--drain-mbps") {
+            drainLimiter.setRate(max(0.0, atof(argv[++i])) * 1024 * 1024);
+        }
+        else if (string(argv[i]) == "--balance-threshold") {
+            balanceThreshold = max(0.0, atof(argv[++i]));
+        }
+        else if (string(argv[i]) == "--balance-streams") {
+            balanceStreams = max(1, atoi(argv[++i]));
+        }
+        else if (string(argv[i]) == "--balance-interval") {
+            balanceIntervalSec = max(1, atoi(argv[++i]));
+        }
+        else if (string(argv[i]) == "--buffer-mb") {
+            // Cap on payload buffers held by requests at once
+            long bufferMb = atol(argv[++i]);
+            if (bufferMb <= 0) {
+                cerr << "Invalid buffer size\n";
+                return 1;
+            }
+            bufferPool().setCapacity((size_t)bufferMb * 1024 * 1024);
+        }
+    }
+    if (partitionCount < 1 || partitionCount > MAX_PARTITIONS || partitionId < 0 || partitionId >= partitionCount) {
+        cerr << "Invalid partition (need 0 <= --partition < --partitions <= " << MAX_PARTITIONS << ")\n";
+        return 1;
+    }
+    if (following) {
+        // A follower serves the primary's partition under the primary's map
+        if (primaryPort <= 0 || listenPort <= 0 || listenPort == primaryPort) {
+            cerr << "A follower needs --follow <primary port> and its own --port\n";
+            return 1;
+        }
+        partitions = requestPartitionMap("127.0.0.1", primaryPort);
+        auto owned = find(partitions.ports.begin(), partitions.ports.end(), primaryPort);
+        partitionId = owned == partitions.ports.end() ? 0 : (int)(owned - partitions.ports.begin());
+    } else {
+        partitions = PartitionMap::uniform(partitionCount);
+        random_device device;
+        while (logEpoch.load() == 0) {
+            logEpoch = ((uint64_t)device() << 32) | device();
+        }
+    }
+    int port = listenPort > 0 ? listenPort : partitions.ports[partitionId];
+    listenPort = port;
+    
+    int server = openListener(port);
+    if (server == -1) {
+        cerr << "Cannot listen on port " << port << "\n";
+        return 1;
+    }
+    
+    cout << "Coordinator running on port " << port << "...\n";
+    if (partitions.count() > 1) {
+        cout << "Owning partition " << partitionId << " of " << partitions.count() << "\n";
+    }
+    if (following) {
+        cout << "Following the primary on port " << primaryPort << " (read-only)\n";
+        thread(followPrimary).detach();
+    }
+    if (balanceLimiter.bytesPerSecond() > 0) {
+        cout << "Balancing nodes to within " << balanceThreshold * 100 << "% of the mean at "
+             << balanceLimiter.bytesPerSecond() / (1024 * 1024) << " MB/s\n";
+    }
+    thread(balanceLoop).detach();
+    cout << "Waiting for nodes and clients...\n";
+    
+    acceptClients(server);
+    return 0;
+}
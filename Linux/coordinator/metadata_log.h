@@ -0,0 +1,92 @@
+#ifndef DFS_COORDINATOR_METADATA_LOG_H
+#define DFS_COORDINATOR_METADATA_LOG_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// The coordinator's metadata changes in the order they were made, for
+// follower coordinators to replay.
+//
+// Every change to the file table or the node list is appended as one text
+// record under a sequence number that grows by one per record. The log keeps
+// the most recent records only; a follower that asks for records that have
+// already been dropped starts over from a snapshot of the tables instead.
+// Records are opaque here: the coordinator encodes and applies them.
+class MetadataLog {
+public:
+    explicit MetadataLog(size_t capacity) : capacity(capacity) {}
+
+    MetadataLog(const MetadataLog&) = delete;
+    MetadataLog& operator=(const MetadataLog&) = delete;
+
+    uint64_t append(const std::string& record) {
+        std::lock_guard<std::mutex> lock(mtx);
+        return appendLocked(nextSeq, record);
+    }
+
+    // Append a record replayed from another log under its own number
+    void appendAt(uint64_t seq, const std::string& record) {
+        std::lock_guard<std::mutex> lock(mtx);
+        appendLocked(seq, record);
+    }
+
+    // Forget everything up to and including seq (a follower that just loaded
+    // a snapshot taken at seq)
+    void resetTo(uint64_t seq) {
+        std::lock_guard<std::mutex> lock(mtx);
+        records.clear();
+        nextSeq = seq + 1;
+        firstSeq = nextSeq;
+    }
+
+    uint64_t lastSeq() const {
+        std::lock_guard<std::mutex> lock(mtx);
+        return nextSeq - 1;
+    }
+
+    // Records numbered after seq, waiting up to timeoutMs for the first one.
+    // False when records after seq have already been dropped.
+    bool readAfter(uint64_t seq, std::vector<std::pair<uint64_t, std::string>>& out, int timeoutMs) {
+        std::unique_lock<std::mutex> lock(mtx);
+        appended.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] { return nextSeq - 1 > seq; });
+        if (seq + 1 < firstSeq) {
+            return false;
+        }
+        for (uint64_t s = seq + 1; s < nextSeq; s++) {
+            out.emplace_back(s, records[s - firstSeq]);
+        }
+        return true;
+    }
+
+private:
+    uint64_t appendLocked(uint64_t seq, const std::string& record) {
+        if (seq != nextSeq) {
+            // A gap (the source log restarted): keep only what follows it
+            records.clear();
+            firstSeq = seq;
+        }
+        records.push_back(record);
+        nextSeq = seq + 1;
+        while (records.size() > capacity) {
+            records.pop_front();
+            firstSeq++;
+        }
+        appended.notify_all();
+        return seq;
+    }
+
+    mutable std::mutex mtx;
+    std::condition_variable appended;
+    std::deque<std::string> records; // records[i] has number firstSeq + i
+    uint64_t firstSeq = 1;
+    uint64_t nextSeq = 1;
+    size_t capacity;
+};
+
+#endif
@@ -0,0 +1,1441 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include "dfs.h"
+#include "../common/checksum.h"
+#include "../common/compression.h"
+#include "../common/keepalive.h"
+#include "../common/partition.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+namespace dfs {
+
+const int MAX_PARTS = 10000;      // the coordinator's limit for one multipart upload
+const int MAX_PART_ATTEMPTS = 3;
+const string STALE_VERSION = "ERROR: Stale version"; // a node's reply to a GET naming an old version
+const size_t READ_SIZE = 64 * 1024;
+
+static unsigned long calculateChecksum(const char* data, long long size) {
+    return byteSum(data, size);
+}
+
+// Parts of at least partSize bytes, few enough for the coordinator
+static long long choosePartSize(long long fileSize, long long partSize) {
+    return max(partSize, (fileSize + MAX_PARTS - 1) / MAX_PARTS);
+}
+
+// One connection to the coordinator or a node. Only the loop thread uses it.
+struct Connection {
+    int fd = -1;
+    int port = 0;
+    bool connecting = false;
+    bool failed = false;     // I/O error
+    bool peerClosed = false; // EOF
+    bool idle = false;       // parked in the pool
+    bool pumping = false;
+    uint32_t events = 0;     // registered with epoll, 0 when not registered
+    chrono::steady_clock::time_point idleSince;
+    string out;
+    size_t outPos = 0;
+    string in;
+    size_t inPos = 0;
+    function<void(bool connected)> onConnect;
+    // Completes a pending read when enough input has arrived or the
+    // connection broke; returns false to keep waiting
+    function<bool()> waiter;
+    
+    bool broken() const {
+        return failed || peerClosed;
+    }
+    
+    size_t buffered() const {
+        return in.size() - inPos;
+    }
+    
+    string take(size_t size) {
+        string data = in.substr(inPos, size);
+        inPos += size;
+        if (inPos == in.size()) {
+            in.clear();
+            inPos = 0;
+        }
+        return data;
+    }
+};
+
+using ConnectionHandler = function<void(Connection* conn, const string& error)>;
+
+// A multipart upload after MPU_BEGIN
+struct Upload {
+    string dfsPath;
+    string uploadId;
+    Codec codec = Codec::None;
+    long long size = 0;
+    long long partSize = 0;
+    int partCount = 0;
+};
+
+class Client::Impl {
+public:
+    explicit Impl(const Options& options);
+    ~Impl();
+    
+    // Run operation on the loop thread and hand its result to a future.
+    // operation calls its completion exactly once, also on the loop thread.
+    template <typename T>
+    future<T> start(function<void(function<void(T)>)> operation) {
+        auto promise = make_shared<std::promise<T>>();
+        future<T> result = promise->get_future();
+        {
+            lock_guard<mutex> lock(mtx);
+            pending++;
+        }
+        post([this, promise, operation]() {
+            operation([this, promise](T value) {
+                promise->set_value(move(value));
+                lock_guard<mutex> lock(mtx);
+                pending--;
+                idleCondition.notify_all();
+            });
+        });
+        return result;
+    }
+    
+    // Operations; each runs on the loop thread
+    void listFiles(function<void(Result<vector<string>>)> done);
+    void locate(const string& dfsPath, function<void(Result<FileInfo>)> done);
+    void readLocated(const string& dfsPath, function<void(const FileInfo& info, function<void(Status)> finished)> read,
+                     function<void(Status)> done, bool retried = false);
+    void forgetLocation(const string& dfsPath) {
+        locations.erase(dfsPath);
+    }
+    void fetch(const string& dfsPath, const FileInfo& info, long long offset, long long length,
+               function<bool(long long offset, const string& data)> sink, function<void(Status)> done);
+    void beginUpload(const string& dfsPath, long long size, function<void(Result<shared_ptr<Upload>>)> done);
+    void sendParts(shared_ptr<Upload> upload, function<bool(long long offset, long long size, string& data)> source,
+                   function<void(Status)> done);
+    void sendPart(shared_ptr<Upload> upload, int partNumber, shared_ptr<string> data, int attempt, function<void(Status)> done);
+    void completeUpload(shared_ptr<Upload> upload, function<void(Status)> done);
+    void abortUpload(shared_ptr<Upload> upload);
+    
+    Options options;
+    vector<Codec> offered;   // codecs offered for downloads
+    PartitionMap partitions; // coordinators, asked for once at construction
+    map<int, vector<int>> followers; // coordinator port → its read-only followers, asked for at construction
+
+private:
+    struct Peer {
+        int open = 0;
+        vector<Connection*> idle;
+        deque<ConnectionHandler> waiting;
+    };
+    
+    struct Fetch;
+    struct PartUpload;
+    
+    // A LOCATE reply reused until its lease runs out
+    struct CachedLocation {
+        FileInfo info;
+        chrono::steady_clock::time_point expires;
+    };
+    
+    void post(function<void()> task);
+    void after(int ms, function<void()> task);
+    void run();
+    
+    // Connection pool
+    void acquire(int port, ConnectionHandler handler);
+    void release(Connection* conn, bool reusable);
+    void connectTo(int port, ConnectionHandler handler);
+    void serveWaiting(int port);
+    void closeConnection(Connection* conn);
+    void sweepIdle();
+    
+    // Non-blocking I/O
+    void updateEvents(Connection* conn);
+    void handleEvents(Connection* conn, uint32_t events);
+    void readInput(Connection* conn);
+    void flush(Connection* conn);
+    void pump(Connection* conn);
+    void send(Connection* conn, const string& data);
+    void readLine(Connection* conn, function<void(bool ok, string line)> done);
+    void readBytes(Connection* conn, size_t size, function<void(bool ok, string data)> done);
+    void readToEnd(Connection* conn, function<void(string data)> done);
+    void readPayload(Connection* conn, Codec codec, size_t rawLength, function<void(bool ok, string data)> done);
+    void readFrames(Connection* conn, size_t rawLength, shared_ptr<string> out, function<void(bool ok, string data)> done);
+    
+    // Requests
+    int coordinatorFor(const string& dfsPath) const {
+        return partitions.portFor(dfsPath);
+    }
+    // A follower to send a read for the coordinator on port to, or port
+    // itself when it has none
+    int readPort(int port) {
+        const vector<int>& ports = followers[port];
+        return ports.empty() ? port : ports[nextFollower++ % ports.size()];
+    }
+    void listPartition(int port, int primary, function<void(Result<vector<string>>)> done);
+    void locateAt(int port, const string& dfsPath, function<void(Result<FileInfo>)> done);
+    bool cachedLocation(const string& dfsPath, FileInfo& info);
+    void cacheLocation(const string& dfsPath, const FileInfo& info, long long leaseMs);
+    void lineRequest(int port, const string& request, function<void(bool ok, const string& reply)> done);
+    void getRange(int nodeId, const string& dfsPath, int version, long long offset, long long length, function<void(Result<string>)> done);
+    void fetchNext(shared_ptr<Fetch> job);
+    void fetchChunk(shared_ptr<Fetch> job, long long offset, long long length, size_t replica);
+    void sendNextParts(shared_ptr<PartUpload> job);
+    
+    int epollFd = -1;
+    int wakeFd = -1;
+    thread loop;
+    
+    mutex mtx; // guards posted, pending and stopping
+    condition_variable idleCondition;
+    vector<function<void()>> posted;
+    int pending = 0;
+    bool stopping = false;
+    
+    // Loop thread only
+    map<int, Peer> peers; // by port
+    unordered_map<string, CachedLocation> locations; // by path
+    size_t nextFollower = 0;
+    multimap<chrono::steady_clock::time_point, function<void()>> timers;
+    vector<Connection*> closed; // deleted once the current batch of events is handled
+};
+
+Client::Impl::Impl(const Options& options)
+    : options(options), partitions(requestPartitionMap(options.host, options.coordinatorPort)) {
+    if (options.compress) {
+        offered = availableCodecs();
+    }
+    for (int port : partitions.ports) {
+        followers[port] = requestFollowers(options.host, port);
+    }
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event{};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &event);
+    loop = thread([this]() { run(); });
+}
+
+Client::Impl::~Impl() {
+    {
+        unique_lock<mutex> lock(mtx);
+        idleCondition.wait(lock, [this]() { return pending == 0; });
+        stopping = true;
+    }
+    uint64_t one = 1;
+    write(wakeFd, &one, sizeof(one));
+    loop.join();
+    for (auto& pair : peers) {
+        for (Connection* conn : pair.second.idle) {
+            close(conn->fd);
+            delete conn;
+        }
+    }
+    for (Connection* conn : closed) {
+        delete conn;
+    }
+    close(wakeFd);
+    close(epollFd);
+}
+
+void Client::Impl::post(function<void()> task) {
+    {
+        lock_guard<mutex> lock(mtx);
+        posted.push_back(move(task));
+    }
+    uint64_t one = 1;
+    write(wakeFd, &one, sizeof(one));
+}
+
+void Client::Impl::after(int ms, function<void()> task) {
+    timers.emplace(chrono::steady_clock::now() + chrono::milliseconds(ms), move(task));
+}
+
+void Client::Impl::run() {
+    epoll_event events[64];
+    while (true) {
+        // Wake at least once a second to close connections idle for too long
+        int timeout = 1000;
+        if (!timers.empty()) {
+            auto wait = chrono::duration_cast<chrono::milliseconds>(timers.begin()->first - chrono::steady_clock::now());
+            timeout = (int)max(0LL, min((long long)timeout, (long long)wait.count() + 1));
+        }
+        int count = epoll_wait(epollFd, events, 64, timeout);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == nullptr) {
+                uint64_t value;
+                read(wakeFd, &value, sizeof(value));
+            } else {
+                handleEvents((Connection*)events[i].data.ptr, events[i].events);
+            }
+        }
+        
+        vector<function<void()>> tasks;
+        bool stop;
+        {
+            lock_guard<mutex> lock(mtx);
+            tasks.swap(posted);
+            stop = stopping;
+        }
+        for (auto& task : tasks) {
+            task();
+        }
+        
+        auto now = chrono::steady_clock::now();
+        while (!timers.empty() && timers.begin()->first <= now) {
+            function<void()> task = move(timers.begin()->second);
+            timers.erase(timers.begin());
+            task();
+        }
+        
+        sweepIdle();
+        for (Connection* conn : closed) {
+            delete conn;
+        }
+        closed.clear();
+        if (stop) {
+            return;
+        }
+    }
+}
+
+// Hand handler a connection to port: an idle pooled one, a new one, or the
+// next one released when the peer already has maxConnectionsPerPeer open
+void Client::Impl::acquire(int port, ConnectionHandler handler) {
+    Peer& peer = peers[port];
+    while (!peer.idle.empty()) {
+        Connection* conn = peer.idle.back();
+        peer.idle.pop_back();
+        conn->idle = false;
+        char probe;
+        ssize_t n = recv(conn->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            handler(conn, "");
+            return;
+        }
+        closeConnection(conn); // closed by the server while idle
+    }
+    if (peer.open < options.maxConnectionsPerPeer) {
+        connectTo(port, handler);
+        return;
+    }
+    peer.waiting.push_back(move(handler));
+}
+
+// Return a connection after a request. Only a connection whose reply was
+// read completely goes back to the pool.
+void Client::Impl::release(Connection* conn, bool reusable) {
+    conn->waiter = nullptr;
+    int port = conn->port;
+    Peer& peer = peers[port];
+    if (!reusable || conn->broken() || conn->buffered() > 0 || conn->outPos < conn->out.size()) {
+        closeConnection(conn);
+        serveWaiting(port);
+        return;
+    }
+    if (!peer.waiting.empty()) {
+        ConnectionHandler handler = move(peer.waiting.front());
+        peer.waiting.pop_front();
+        handler(conn, "");
+        return;
+    }
+    if ((int)peer.idle.size() >= options.maxIdlePerPeer) {
+        closeConnection(conn);
+        return;
+    }
+    conn->idle = true;
+    conn->idleSince = chrono::steady_clock::now();
+    peer.idle.push_back(conn);
+}
+
+void Client::Impl::connectTo(int port, ConnectionHandler handler) {
+    string error = "Cannot connect to port " + to_string(port);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, options.host.c_str(), &addr.sin_addr) != 1) {
+        handler(nullptr, "Invalid host: " + options.host);
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        handler(nullptr, error);
+        return;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (sockaddr*)&addr, sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        handler(nullptr, error);
+        return;
+    }
+    
+    Connection* conn = new Connection();
+    conn->fd = fd;
+    conn->port = port;
+    conn->connecting = true;
+    conn->onConnect = [this, conn, handler, error](bool connected) {
+        if (!connected) {
+            closeConnection(conn);
+            handler(nullptr, error);
+            serveWaiting(conn->port);
+            return;
+        }
+        handler(conn, "");
+    };
+    peers[port].open++;
+    updateEvents(conn);
+}
+
+// Open connections for waiting requests while the peer has room
+void Client::Impl::serveWaiting(int port) {
+    Peer& peer = peers[port];
+    while (!peer.waiting.empty() && peer.open < options.maxConnectionsPerPeer) {
+        ConnectionHandler handler = move(peer.waiting.front());
+        peer.waiting.pop_front();
+        connectTo(port, handler);
+    }
+}
+
+void Client::Impl::closeConnection(Connection* conn) {
+    if (conn->fd == -1) {
+        return;
+    }
+    Peer& peer = peers[conn->port];
+    if (conn->idle) {
+        peer.idle.erase(find(peer.idle.begin(), peer.idle.end(), conn));
+        conn->idle = false;
+    }
+    if (conn->events) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->waiter = nullptr;
+    conn->onConnect = nullptr;
+    peer.open--;
+    closed.push_back(conn);
+}
+
+void Client::Impl::sweepIdle() {
+    auto cutoff = chrono::steady_clock::now() - chrono::milliseconds(options.idleTimeoutMs);
+    for (auto& pair : peers) {
+        vector<Connection*> expired;
+        for (Connection* conn : pair.second.idle) {
+            if (conn->idleSince < cutoff) {
+                expired.push_back(conn);
+            }
+        }
+        for (Connection* conn : expired) {
+            closeConnection(conn);
+        }
+    }
+}
+
+// Watch for input until the peer closes, and for output while some is pending
+void Client::Impl::updateEvents(Connection* conn) {
+    uint32_t wanted = 0;
+    if (!conn->broken()) {
+        wanted = EPOLLIN | EPOLLRDHUP;
+        if (conn->connecting || conn->outPos < conn->out.size()) {
+            wanted |= EPOLLOUT;
+        }
+    }
+    if (wanted == conn->events) {
+        return;
+    }
+    epoll_event event{};
+    event.events = wanted;
+    event.data.ptr = conn;
+    if (wanted == 0) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, nullptr);
+    } else {
+        epoll_ctl(epollFd, conn->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, conn->fd, &event);
+    }
+    conn->events = wanted;
+}
+
+void Client::Impl::handleEvents(Connection* conn, uint32_t events) {
+    if (conn->fd == -1) {
+        return; // closed earlier in this batch
+    }
+    if (conn->connecting) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error == 0 && !(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        conn->connecting = false;
+        conn->failed = error != 0 || (events & (EPOLLERR | EPOLLHUP));
+        updateEvents(conn);
+        function<void(bool)> onConnect = move(conn->onConnect);
+        conn->onConnect = nullptr;
+        onConnect(!conn->failed);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        readInput(conn);
+    }
+    if (conn->fd != -1 && (events & EPOLLOUT)) {
+        flush(conn);
+    }
+}
+
+void Client::Impl::readInput(Connection* conn) {
+    while (!conn->broken()) {
+        size_t used = conn->in.size();
+        conn->in.resize(used + READ_SIZE);
+        ssize_t n = recv(conn->fd, &conn->in[used], READ_SIZE, 0);
+        conn->in.resize(used + max((ssize_t)0, n));
+        if (n > 0) {
+            continue;
+        }
+        if (n == 0) {
+            conn->peerClosed = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            conn->failed = true;
+        } else {
+            break;
+        }
+    }
+    if (conn->broken()) {
+        updateEvents(conn);
+    }
+    if (conn->idle) {
+        closeConnection(conn); // nothing is expected on an idle connection
+        return;
+    }
+    pump(conn);
+}
+
+void Client::Impl::flush(Connection* conn) {
+    while (conn->outPos < conn->out.size()) {
+        ssize_t n = ::send(conn->fd, conn->out.data() + conn->outPos, conn->out.size() - conn->outPos, MSG_NOSIGNAL);
+        if (n > 0) {
+            conn->outPos += n;
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        }
+        conn->failed = true;
+        updateEvents(conn);
+        pump(conn);
+        return;
+    }
+    if (conn->outPos == conn->out.size()) {
+        conn->out.clear();
+        conn->outPos = 0;
+    }
+    updateEvents(conn);
+}
+
+// Let the pending read finish if it can. The waiter's callback may start the
+// next read, which is then tried in the same loop rather than recursively.
+void Client::Impl::pump(Connection* conn) {
+    if (conn->pumping) {
+        return;
+    }
+    conn->pumping = true;
+    while (conn->waiter) {
+        function<bool()> waiter = move(conn->waiter);
+        conn->waiter = nullptr;
+        if (!waiter()) {
+            if (!conn->waiter) {
+                conn->waiter = move(waiter);
+            }
+            break;
+        }
+    }
+    conn->pumping = false;
+}
+
+void Client::Impl::send(Connection* conn, const string& data) {
+    conn->out += data;
+    flush(conn);
+}
+
+void Client::Impl::readLine(Connection* conn, function<void(bool ok, string line)> done) {
+    conn->waiter = [conn, done]() {
+        size_t newline = conn->in.find('\n', conn->inPos);
+        if (newline != string::npos) {
+            string line = conn->take(newline - conn->inPos + 1);
+            line.pop_back();
+            done(true, move(line));
+            return true;
+        }
+        if (conn->broken()) {
+            done(false, "");
+            return true;
+        }
+        return false;
+    };
+    pump(conn);
+}
+
+void Client::Impl::readBytes(Connection* conn, size_t size, function<void(bool ok, string data)> done) {
+    conn->waiter = [conn, size, done]() {
+        if (conn->buffered() >= size) {
+            done(true, conn->take(size));
+            return true;
+        }
+        if (conn->broken()) {
+            done(false, "");
+            return true;
+        }
+        return false;
+    };
+    pump(conn);
+}
+
+void Client::Impl::readToEnd(Connection* conn, function<void(string data)> done) {
+    conn->waiter = [conn, done]() {
+        if (!conn->broken()) {
+            return false;
+        }
+        done(conn->take(conn->buffered()));
+        return true;
+    };
+    pump(conn);
+}
+
+// Read rawLength bytes of payload in the negotiated codec
+void Client::Impl::readPayload(Connection* conn, Codec codec, size_t rawLength, function<void(bool ok, string data)> done) {
+    if (codec == Codec::None) {
+        readBytes(conn, rawLength, done);
+        return;
+    }
+    auto out = make_shared<string>();
+    out->reserve(rawLength);
+    readFrames(conn, rawLength, out, done);
+}
+
+// Read frames until out holds rawLength decoded bytes
+void Client::Impl::readFrames(Connection* conn, size_t rawLength, shared_ptr<string> out, function<void(bool ok, string data)> done) {
+    if (out->size() == rawLength) {
+        done(true, move(*out));
+        return;
+    }
+    readBytes(conn, FRAME_HEADER_SIZE, [this, conn, rawLength, out, done](bool ok, string header) {
+        Codec codec;
+        uint32_t raw, length;
+        if (!ok || !parseFrameHeader(header.data(), codec, raw, length) || raw > rawLength - out->size()) {
+            done(false, "");
+            return;
+        }
+        readBytes(conn, length, [this, conn, rawLength, out, done, codec, raw](bool ok, string frame) {
+            size_t produced = out->size();
+            out->resize(produced + raw);
+            if (!ok || !decodeFrame(codec, frame.data(), frame.size(), &(*out)[produced], raw)) {
+                done(false, "");
+                return;
+            }
+            readFrames(conn, rawLength, out, done);
+        });
+    });
+}
+
+// Send a request (a line, maybe followed by payload) and read a one-line
+// reply. The connection is pooled again unless the reply is an error, after
+// which the server closes it.
+void Client::Impl::lineRequest(int port, const string& request, function<void(bool ok, const string& reply)> done) {
+    acquire(port, [this, port, request, done](Connection* conn, const string& error) {
+        if (!conn) {
+            done(false, error);
+            return;
+        }
+        send(conn, request);
+        readLine(conn, [this, conn, port, done](bool ok, string reply) {
+            release(conn, ok && reply.find("ERROR") != 0);
+            if (!ok) {
+                done(false, "Connection to port " + to_string(port) + " lost");
+                return;
+            }
+            done(true, reply);
+        });
+    });
+}
+
+// LIST every partition at once and merge the names
+void Client::Impl::listFiles(function<void(Result<vector<string>>)> done) {
+    auto merged = make_shared<Result<vector<string>>>();
+    auto remaining = make_shared<int>(partitions.count());
+    for (int port : partitions.ports) {
+        listPartition(readPort(port), port, [merged, remaining, done](Result<vector<string>> result) {
+            if (!result.ok() && merged->ok()) {
+                merged->error = result.error;
+            }
+            merged->value.insert(merged->value.end(), result.value.begin(), result.value.end());
+            if (--*remaining > 0) {
+                return;
+            }
+            if (!merged->ok()) {
+                merged->value.clear();
+            }
+            sort(merged->value.begin(), merged->value.end());
+            done(move(*merged));
+        });
+    }
+}
+
+// LIST the coordinator on port, then its primary when port is a follower
+// that cannot answer
+void Client::Impl::listPartition(int port, int primary, function<void(Result<vector<string>>)> done) {
+    acquire(port, [this, port, primary, done](Connection* conn, const string& error) {
+        Result<vector<string>> result;
+        if (!conn) {
+            if (port != primary) {
+                listPartition(primary, primary, done);
+                return;
+            }
+            result.error = error;
+            done(result);
+            return;
+        }
+        // LIST replies until the connection closes, so it is never pooled
+        send(conn, "LIST\n");
+        readToEnd(conn, [this, conn, port, primary, done](string body) {
+            release(conn, false);
+            Result<vector<string>> result;
+            if (body.find("ERROR") == 0 && port != primary) {
+                listPartition(primary, primary, done);
+                return;
+            }
+            if (body.find("ERROR") == 0) {
+                result.error = body.substr(0, body.find('\n'));
+            } else if (body != "No files stored\n") {
+                stringstream lines(body);
+                string line;
+                while (getline(lines, line)) {
+                    if (!line.empty()) {
+                        result.value.push_back(line);
+                    }
+                }
+            }
+            done(result);
+        });
+    });
+}
+
+// LOCATE, answered from the cache while the coordinator's lease lasts
+void Client::Impl::locate(const string& dfsPath, function<void(Result<FileInfo>)> done) {
+    Result<FileInfo> cached;
+    if (cachedLocation(dfsPath, cached.value)) {
+        done(cached);
+        return;
+    }
+    locateAt(readPort(coordinatorFor(dfsPath)), dfsPath, done);
+}
+
+bool Client::Impl::cachedLocation(const string& dfsPath, FileInfo& info) {
+    auto it = locations.find(dfsPath);
+    if (it == locations.end()) {
+        return false;
+    }
+    if (it->second.expires <= chrono::steady_clock::now()) {
+        locations.erase(it);
+        return false;
+    }
+    info = it->second.info;
+    return true;
+}
+
+void Client::Impl::cacheLocation(const string& dfsPath, const FileInfo& info, long long leaseMs) {
+    if (leaseMs <= 0 || options.locationCacheSize <= 0) {
+        return;
+    }
+    auto now = chrono::steady_clock::now();
+    if ((int)locations.size() >= options.locationCacheSize) {
+        for (auto it = locations.begin(); it != locations.end();) {
+            it = it->second.expires <= now ? locations.erase(it) : next(it);
+        }
+        if ((int)locations.size() >= options.locationCacheSize) {
+            locations.erase(locations.begin());
+        }
+    }
+    locations[dfsPath] = CachedLocation{info, now + chrono::milliseconds(leaseMs)};
+}
+
+// Locate a file and read it. Reads name the located version, so a node that
+// holds another one refuses them; a read that fails on a cached location
+// (the file was overwritten or moved, or its replicas died) or on a stale
+// version drops the entry and runs once more from a fresh LOCATE.
+void Client::Impl::readLocated(const string& dfsPath, function<void(const FileInfo& info, function<void(Status)> finished)> read,
+                               function<void(Status)> done, bool retried) {
+    FileInfo info;
+    bool cached = cachedLocation(dfsPath, info);
+    locate(dfsPath, [this, dfsPath, read, done, retried, cached](Result<FileInfo> located) {
+        if (!located.ok()) {
+            done(Status{located.error});
+            return;
+        }
+        read(located.value, [this, dfsPath, read, done, retried, cached](Status status) {
+            if (!status.ok() && !retried && (cached || status.error.find(STALE_VERSION) == 0)) {
+                forgetLocation(dfsPath);
+                readLocated(dfsPath, read, done, true);
+                return;
+            }
+            done(status);
+        });
+    });
+}
+
+// LOCATE at the coordinator on port. A follower that fails (stale, down, or
+// behind a file just written) is retried at the owning coordinator.
+void Client::Impl::locateAt(int port, const string& dfsPath, function<void(Result<FileInfo>)> done) {
+    lineRequest(port, "LOCATE " + dfsPath + " KEEPALIVE=1\n", [this, port, dfsPath, done](bool ok, const string& reply) {
+        // "OK <size> <checksum> <version> <nodeId>... [LEASE=<ms>]"
+        Result<FileInfo> result;
+        stringstream ss(reply);
+        string tag;
+        ss >> tag >> result.value.size >> result.value.checksum >> result.value.version;
+        int nodeId;
+        while (ok && ss >> nodeId) {
+            result.value.nodes.push_back(nodeId);
+        }
+        if (!ok || tag != "OK" || result.value.nodes.empty()) {
+            if (port != coordinatorFor(dfsPath)) {
+                locateAt(coordinatorFor(dfsPath), dfsPath, done);
+                return;
+            }
+            result.error = reply.empty() ? "Invalid response" : reply;
+        } else {
+            string lease;
+            cacheLocation(dfsPath, result.value, findToken(reply, "LEASE", lease) ? atoll(lease.c_str()) : 0);
+        }
+        done(result);
+    });
+}
+
+// GET [offset, offset + length) from one node and check it against the range
+// checksum in the node's reply header
+void Client::Impl::getRange(int nodeId, const string& dfsPath, int version, long long offset, long long length, function<void(Result<string>)> done) {
+    acquire(options.nodeBasePort + nodeId, [this, nodeId, dfsPath, version, offset, length, done](Connection* conn, const string& error) {
+        if (!conn) {
+            done(Result<string>{"", error});
+            return;
+        }
+        auto fail = [this, conn, nodeId, done](bool reusable, const string& error) {
+            release(conn, reusable);
+            done(Result<string>{"", error.empty() ? "Connection to node " + to_string(nodeId) + " lost" : error});
+        };
+        send(conn, "GET " + dfsPath + " " + to_string(offset) + " " + to_string(length) + " KEEPALIVE=1" +
+                   codecOffer(offered) + (version > 0 ? " VERSION=" + to_string(version) : "") + "\n");
+        
+        // "<length>\n<checksum>\n[CODEC=<codec>\n]" then the data
+        readLine(conn, [this, conn, length, done, fail](bool ok, string lengthLine) {
+            if (!ok || lengthLine.find("ERROR") == 0) {
+                fail(false, lengthLine);
+                return;
+            }
+            if (atoll(lengthLine.c_str()) != length) {
+                fail(false, "Invalid response");
+                return;
+            }
+            readLine(conn, [this, conn, length, done, fail](bool ok, string checksumLine) {
+                if (!ok) {
+                    fail(false, "");
+                    return;
+                }
+                unsigned long checksum = strtoul(checksumLine.c_str(), nullptr, 10);
+                auto body = [this, conn, length, checksum, done, fail](Codec codec) {
+                    readPayload(conn, codec, length, [this, conn, checksum, done, fail](bool ok, string data) {
+                        if (!ok) {
+                            fail(false, "");
+                            return;
+                        }
+                        if (calculateChecksum(data.data(), data.size()) != checksum) {
+                            fail(true, "Checksum mismatch - data corruption detected");
+                            return;
+                        }
+                        release(conn, true);
+                        done(Result<string>{move(data), ""});
+                    });
+                };
+                if (offered.empty()) {
+                    body(Codec::None);
+                    return;
+                }
+                readLine(conn, [body, fail](bool ok, string codecLine) {
+                    if (!ok) {
+                        fail(false, "");
+                        return;
+                    }
+                    body(parseCodecReply(codecLine));
+                });
+            });
+        });
+    });
+}
+
+// A located range read as chunkSize GETs, up to streams at a time. Every
+// verified chunk goes to sink, in completion order.
+struct Client::Impl::Fetch {
+    string dfsPath;
+    FileInfo info;
+    long long offset;
+    long long end;
+    long long next;
+    int inFlight = 0;
+    unsigned long checksum = 0;
+    string error;
+    function<bool(long long offset, const string& data)> sink;
+    function<void(Status)> done;
+};
+
+void Client::Impl::fetch(const string& dfsPath, const FileInfo& info, long long offset, long long length,
+                         function<bool(long long offset, const string& data)> sink, function<void(Status)> done) {
+    if (offset < 0 || offset > info.size || length < 0 || length > info.size - offset) {
+        done(Status{"ERROR: Invalid range"});
+        return;
+    }
+    auto job = make_shared<Fetch>();
+    job->dfsPath = dfsPath;
+    job->info = info;
+    job->offset = offset;
+    job->end = offset + length;
+    job->next = offset;
+    job->sink = sink;
+    job->done = done;
+    fetchNext(job);
+}
+
+void Client::Impl::fetchNext(shared_ptr<Fetch> job) {
+    while (job->error.empty() && job->inFlight < max(1, options.streams) && job->next < job->end) {
+        long long length = min(options.chunkSize, job->end - job->next);
+        job->inFlight++;
+        fetchChunk(job, job->next, length, 0);
+        job->next += length;
+    }
+    if (job->inFlight > 0 || !job->done) {
+        return;
+    }
+    // Checksums are byte sums, so the chunks of a whole file add up to its checksum
+    if (job->error.empty() && job->offset == 0 && job->end == job->info.size && job->checksum != job->info.checksum) {
+        job->error = "Checksum mismatch - data corruption detected";
+    }
+    function<void(Status)> done = move(job->done);
+    job->done = nullptr;
+    done(Status{job->error});
+}
+
+// Fetch one chunk, spreading chunks over the replicas and trying the others
+// when one fails
+void Client::Impl::fetchChunk(shared_ptr<Fetch> job, long long offset, long long length, size_t replica) {
+    const vector<int>& nodes = job->info.nodes;
+    int nodeId = nodes[(offset / options.chunkSize + replica) % nodes.size()];
+    getRange(nodeId, job->dfsPath, job->info.version, offset, length, [this, job, offset, length, replica](Result<string> chunk) {
+        if (!chunk.ok() && replica + 1 < job->info.nodes.size()) {
+            fetchChunk(job, offset, length, replica + 1);
+            return;
+        }
+        job->inFlight--;
+        if (!chunk.ok()) {
+            if (job->error.empty()) {
+                job->error = chunk.error;
+            }
+        } else if (job->error.empty()) {
+            job->checksum += calculateChecksum(chunk.value.data(), chunk.value.size());
+            if (!job->sink(offset, chunk.value)) {
+                job->error = "Cannot write local file";
+            }
+        }
+        fetchNext(job);
+    });
+}
+
+void Client::Impl::beginUpload(const string& dfsPath, long long size, function<void(Result<shared_ptr<Upload>>)> done) {
+    if (dfsPath.empty() || size <= 0) {
+        done(Result<shared_ptr<Upload>>{nullptr, "ERROR: Invalid multipart upload"});
+        return;
+    }
+    long long partSize = choosePartSize(size, options.partSize);
+    string request = "MPU_BEGIN " + dfsPath + " " + to_string(size) + " " + to_string(partSize) + " KEEPALIVE=1" +
+                     codecOffer(options.compress ? availableCodecs() : vector<Codec>()) + "\n";
+    lineRequest(coordinatorFor(dfsPath), request, [dfsPath, size, partSize, done](bool ok, const string& reply) {
+        // "UPLOADID <id> [CODEC=<codec>]"
+        stringstream ss(reply);
+        string tag;
+        auto upload = make_shared<Upload>();
+        ss >> tag >> upload->uploadId;
+        if (!ok || tag != "UPLOADID") {
+            done(Result<shared_ptr<Upload>>{nullptr, reply.empty() ? "Invalid response" : reply});
+            return;
+        }
+        upload->dfsPath = dfsPath;
+        upload->codec = parseCodecReply(reply);
+        upload->size = size;
+        upload->partSize = partSize;
+        upload->partCount = (int)((size + partSize - 1) / partSize);
+        done(Result<shared_ptr<Upload>>{upload, ""});
+    });
+}
+
+// Send one part, retrying it with backoff like the CLI does
+void Client::Impl::sendPart(shared_ptr<Upload> upload, int partNumber, shared_ptr<string> data, int attempt, function<void(Status)> done) {
+    string request = "MPU_PART " + upload->uploadId + " " + to_string(partNumber) + " " + to_string(data->size()) + " " +
+                     to_string(calculateChecksum(data->data(), data->size())) + " KEEPALIVE=1\n";
+    if (upload->codec == Codec::None) {
+        request += *data;
+    } else {
+        vector<char> frames = encodeFrames(upload->codec, data->data(), data->size(), 1);
+        request.append(frames.data(), frames.size());
+    }
+    lineRequest(coordinatorFor(upload->dfsPath), request, [this, upload, partNumber, data, attempt, done](bool ok, const string& reply) {
+        if (ok && reply.find("PART_OK") == 0) {
+            done(Status());
+            return;
+        }
+        if (attempt + 1 >= MAX_PART_ATTEMPTS) {
+            done(Status{reply.empty() ? "Part " + to_string(partNumber) + " failed" : reply});
+            return;
+        }
+        after(200 << (attempt + 1), [this, upload, partNumber, data, attempt, done]() {
+            sendPart(upload, partNumber, data, attempt + 1, done);
+        });
+    });
+}
+
+struct Client::Impl::PartUpload {
+    shared_ptr<Upload> upload;
+    function<bool(long long offset, long long size, string& data)> source;
+    int nextPart = 0;
+    int inFlight = 0;
+    string error;
+    function<void(Status)> done;
+};
+
+// Send every part of an upload, up to streams at a time, reading each from
+// source only when it is about to be sent
+void Client::Impl::sendParts(shared_ptr<Upload> upload, function<bool(long long offset, long long size, string& data)> source,
+                             function<void(Status)> done) {
+    auto job = make_shared<PartUpload>();
+    job->upload = upload;
+    job->source = source;
+    job->done = done;
+    sendNextParts(job);
+}
+
+void Client::Impl::sendNextParts(shared_ptr<PartUpload> job) {
+    Upload& upload = *job->upload;
+    while (job->error.empty() && job->inFlight < max(1, options.streams) && job->nextPart < upload.partCount) {
+        int partNumber = job->nextPart++;
+        long long offset = partNumber * upload.partSize;
+        auto data = make_shared<string>();
+        if (!job->source(offset, min(upload.partSize, upload.size - offset), *data)) {
+            job->error = "Cannot read local file";
+            break;
+        }
+        job->inFlight++;
+        sendPart(job->upload, partNumber, data, 0, [this, job](Status status) {
+            job->inFlight--;
+            if (!status.ok() && job->error.empty()) {
+                job->error = status.error;
+            }
+            sendNextParts(job);
+        });
+    }
+    if (job->inFlight > 0 || !job->done) {
+        return;
+    }
+    function<void(Status)> done = move(job->done);
+    job->done = nullptr;
+    done(Status{job->error});
+}
+
+void Client::Impl::completeUpload(shared_ptr<Upload> upload, function<void(Status)> done) {
+    lineRequest(coordinatorFor(upload->dfsPath), "MPU_COMPLETE " + upload->uploadId + " KEEPALIVE=1\n", [this, upload, done](bool ok, const string& reply) {
+        // This client's own reads see the new version at once
+        forgetLocation(upload->dfsPath);
+        done(Status{ok && reply.find("STORED") == 0 ? "" : (reply.empty() ? "Invalid response" : reply)});
+    });
+}
+
+// Drop a failed upload's staged parts instead of waiting for them to expire
+void Client::Impl::abortUpload(shared_ptr<Upload> upload) {
+    lineRequest(coordinatorFor(upload->dfsPath), "MPU_ABORT " + upload->uploadId + " KEEPALIVE=1\n", [](bool, const string&) {});
+}
+
+Client::Client(const Options& options) : impl(new Impl(options)) {}
+
+Client::~Client() = default;
+
+future<Result<vector<string>>> Client::listFiles() {
+    Impl* impl = this->impl.get();
+    return impl->start<Result<vector<string>>>([impl](function<void(Result<vector<string>>)> done) {
+        impl->listFiles(done);
+    });
+}
+
+future<Result<FileInfo>> Client::locate(const string& dfsPath) {
+    Impl* impl = this->impl.get();
+    return impl->start<Result<FileInfo>>([impl, dfsPath](function<void(Result<FileInfo>)> done) {
+        impl->locate(dfsPath, done);
+    });
+}
+
+future<Result<vector<char>>> Client::download(const string& dfsPath, long long offset, long long length) {
+    Impl* impl = this->impl.get();
+    return impl->start<Result<vector<char>>>([impl, dfsPath, offset, length](function<void(Result<vector<char>>)> done) {
+        auto buffer = make_shared<vector<char>>();
+        auto read = [impl, dfsPath, offset, length, buffer](const FileInfo& info, function<void(Status)> finished) {
+            long long wanted = length < 0 ? info.size - offset : length;
+            buffer->assign(max(0LL, wanted), 0);
+            auto sink = [buffer, offset](long long chunkOffset, const string& data) {
+                memcpy(buffer->data() + (chunkOffset - offset), data.data(), data.size());
+                return true;
+            };
+            impl->fetch(dfsPath, info, offset, wanted, sink, finished);
+        };
+        impl->readLocated(dfsPath, read, [buffer, done](Status status) {
+            done(Result<vector<char>>{status.ok() ? move(*buffer) : vector<char>(), status.error});
+        });
+    });
+}
+
+future<Status> Client::downloadFile(const string& dfsPath, const string& localPath) {
+    Impl* impl = this->impl.get();
+    return impl->start<Status>([impl, dfsPath, localPath](function<void(Status)> done) {
+        auto read = [impl, dfsPath, localPath](const FileInfo& info, function<void(Status)> finished) {
+            fs::path parentDir = fs::path(localPath).parent_path();
+            error_code ec;
+            if (!parentDir.empty()) {
+                fs::create_directories(parentDir, ec);
+            }
+            string tmpPath = localPath + ".dfstmp";
+            int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1) {
+                finished(Status{"Cannot create local file: " + localPath});
+                return;
+            }
+            // Chunks land at their offsets as they arrive
+            auto sink = [fd](long long offset, const string& data) {
+                size_t written = 0;
+                while (written < data.size()) {
+                    ssize_t n = pwrite(fd, data.data() + written, data.size() - written, offset + written);
+                    if (n <= 0) {
+                        return false;
+                    }
+                    written += n;
+                }
+                return true;
+            };
+            impl->fetch(dfsPath, info, 0, info.size, sink, [fd, tmpPath, localPath, finished](Status status) {
+                if (close(fd) != 0 && status.ok()) {
+                    status.error = "Cannot write local file: " + localPath;
+                }
+                if (status.ok() && rename(tmpPath.c_str(), localPath.c_str()) != 0) {
+                    status.error = "Cannot rename " + tmpPath + " to " + localPath;
+                }
+                if (!status.ok()) {
+                    unlink(tmpPath.c_str());
+                }
+                finished(status);
+            });
+        };
+        impl->readLocated(dfsPath, read, done);
+    });
+}
+
+future<Status> Client::upload(const string& dfsPath, vector<char> data) {
+    Impl* impl = this->impl.get();
+    auto buffer = make_shared<vector<char>>(move(data));
+    return impl->start<Status>([impl, dfsPath, buffer](function<void(Status)> done) {
+        impl->beginUpload(dfsPath, buffer->size(), [impl, buffer, done](Result<shared_ptr<Upload>> begun) {
+            if (!begun.ok()) {
+                done(Status{begun.error});
+                return;
+            }
+            shared_ptr<Upload> upload = begun.value;
+            auto source = [buffer](long long offset, long long size, string& part) {
+                part.assign(buffer->data() + offset, size);
+                return true;
+            };
+            impl->sendParts(upload, source, [impl, upload, done](Status status) {
+                if (!status.ok()) {
+                    impl->abortUpload(upload);
+                    done(status);
+                    return;
+                }
+                impl->completeUpload(upload, done);
+            });
+        });
+    });
+}
+
+future<Status> Client::uploadFile(const string& localPath, const string& dfsPath) {
+    Impl* impl = this->impl.get();
+    return impl->start<Status>([impl, localPath, dfsPath](function<void(Status)> done) {
+        int fd = open(localPath.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            done(Status{"Cannot read file: " + localPath});
+            return;
+        }
+        auto finish = [fd, done](Status status) {
+            close(fd);
+            done(status);
+        };
+        impl->beginUpload(dfsPath, st.st_size, [impl, fd, finish](Result<shared_ptr<Upload>> begun) {
+            if (!begun.ok()) {
+                finish(Status{begun.error});
+                return;
+            }
+            shared_ptr<Upload> upload = begun.value;
+            // Only the parts in flight are in memory
+            auto source = [fd](long long offset, long long size, string& part) {
+                part.resize(size);
+                return pread(fd, &part[0], size, offset) == size;
+            };
+            impl->sendParts(upload, source, [impl, upload, finish](Status status) {
+                if (!status.ok()) {
+                    impl->abortUpload(upload);
+                    finish(status);
+                    return;
+                }
+                impl->completeUpload(upload, finish);
+            });
+        });
+    });
+}
+
+unique_ptr<Reader> Client::openReader(const string& dfsPath) {
+    return unique_ptr<Reader>(new Reader(impl.get(), dfsPath));
+}
+
+unique_ptr<Writer> Client::openWriter(const string& dfsPath, long long size) {
+    return unique_ptr<Writer>(new Writer(impl.get(), dfsPath, size));
+}
+
+Reader::Reader(Client::Impl* impl, const string& dfsPath) : impl(impl), dfsPath(dfsPath) {}
+
+bool Reader::open() {
+    if (!opened) {
+        opened = true;
+        Client::Impl* impl = this->impl;
+        string dfsPath = this->dfsPath;
+        Result<FileInfo> located = impl->start<Result<FileInfo>>([impl, dfsPath](function<void(Result<FileInfo>)> done) {
+            impl->locate(dfsPath, done);
+        }).get();
+        info = located.value;
+        failure = located.error;
+    }
+    return failure.empty();
+}
+
+long long Reader::size() {
+    return open() ? info.size : -1;
+}
+
+// Keep up to streams chunk requests queued ahead of the caller
+void Reader::fill() {
+    while ((int)ahead.size() < max(1, impl->options.streams) && requested < info.size) {
+        long long offset = requested;
+        long long length = min(impl->options.chunkSize, info.size - offset);
+        Client::Impl* impl = this->impl;
+        string dfsPath = this->dfsPath;
+        FileInfo info = this->info;
+        ahead.push_back(impl->start<Result<vector<char>>>([impl, dfsPath, info, offset, length](function<void(Result<vector<char>>)> done) {
+            auto buffer = make_shared<vector<char>>();
+            auto sink = [buffer](long long, const string& data) {
+                buffer->assign(data.begin(), data.end());
+                return true;
+            };
+            impl->fetch(dfsPath, info, offset, length, sink, [buffer, done](Status status) {
+                done(Result<vector<char>>{move(*buffer), status.error});
+            });
+        }));
+        requested += length;
+    }
+}
+
+long long Reader::read(char* buffer, long long size) {
+    if (!open()) {
+        return -1;
+    }
+    if (chunkPos == chunk.size()) {
+        fill();
+        if (ahead.empty()) {
+            if (checksum != info.checksum) {
+                failure = "Checksum mismatch - data corruption detected";
+                return -1;
+            }
+            return 0;
+        }
+        Result<vector<char>> next = ahead.front().get();
+        ahead.pop_front();
+        if (!next.ok() && chunk.empty() && !relocated) {
+            // Nothing handed out yet: the location may have come from the
+            // cache and be out of date, so locate once more and start over
+            Client::Impl* impl = this->impl;
+            string dfsPath = this->dfsPath;
+            impl->start<Status>([impl, dfsPath](function<void(Status)> done) {
+                impl->forgetLocation(dfsPath);
+                done(Status());
+            }).get();
+            relocated = true;
+            opened = false;
+            ahead.clear();
+            requested = 0;
+            return read(buffer, size);
+        }
+        if (!next.ok()) {
+            failure = next.error;
+            ahead.clear();
+            requested = info.size;
+            return -1;
+        }
+        chunk = move(next.value);
+        chunkPos = 0;
+        checksum += calculateChecksum(chunk.data(), chunk.size());
+        fill();
+    }
+    long long count = min(size, (long long)(chunk.size() - chunkPos));
+    memcpy(buffer, chunk.data() + chunkPos, count);
+    chunkPos += count;
+    return count;
+}
+
+Writer::Writer(Client::Impl* impl, const string& dfsPath, long long size) : impl(impl), dfsPath(dfsPath), totalSize(size) {}
+
+Writer::~Writer() {
+    if (upload && !closed) {
+        Client::Impl* impl = this->impl;
+        shared_ptr<Upload> upload = this->upload;
+        while (!inFlight.empty()) {
+            waitOldest();
+        }
+        impl->start<Status>([impl, upload](function<void(Status)> done) {
+            impl->abortUpload(upload);
+            done(Status());
+        });
+    }
+}
+
+bool Writer::begin() {
+    if (upload || !failure.empty()) {
+        return failure.empty();
+    }
+    Client::Impl* impl = this->impl;
+    string dfsPath = this->dfsPath;
+    long long size = totalSize;
+    Result<shared_ptr<Upload>> begun = impl->start<Result<shared_ptr<Upload>>>(
+        [impl, dfsPath, size](function<void(Result<shared_ptr<Upload>>)> done) {
+            impl->beginUpload(dfsPath, size, done);
+        }).get();
+    upload = begun.value;
+    failure = begun.error;
+    if (upload) {
+        part.reserve(upload->partSize);
+    }
+    return failure.empty();
+}
+
+// Queue the buffered part for sending
+void Writer::sendPart() {
+    Client::Impl* impl = this->impl;
+    shared_ptr<Upload> upload = this->upload;
+    int partNumber = nextPart++;
+    auto data = make_shared<string>(part.data(), part.size());
+    part.clear();
+    inFlight.push_back(impl->start<Status>([impl, upload, partNumber, data](function<void(Status)> done) {
+        impl->sendPart(upload, partNumber, data, 0, done);
+    }));
+}
+
+bool Writer::waitOldest() {
+    Status status = inFlight.front().get();
+    inFlight.pop_front();
+    if (!status.ok() && failure.empty()) {
+        failure = status.error;
+    }
+    return failure.empty();
+}
+
+Status Writer::write(const char* data, long long size) {
+    if (closed) {
+        return Status{"Writer is closed"};
+    }
+    if (!begin()) {
+        return Status{failure};
+    }
+    if (size > totalSize - written) {
+        return Status{"Write past the declared size of " + to_string(totalSize) + " bytes"};
+    }
+    while (size > 0) {
+        long long count = min(size, upload->partSize - (long long)part.size());
+        part.insert(part.end(), data, data + count);
+        data += count;
+        size -= count;
+        written += count;
+        if ((long long)part.size() == upload->partSize) {
+            sendPart();
+            while ((int)inFlight.size() >= max(1, impl->options.streams)) {
+                if (!waitOldest()) {
+                    return Status{failure};
+                }
+            }
+        }
+    }
+    return Status{failure};
+}
+
+Status Writer::close() {
+    if (closed) {
+        return Status{failure};
+    }
+    if (!begin()) {
+        closed = true;
+        return Status{failure};
+    }
+    if (written != totalSize) {
+        failure = "Only " + to_string(written) + " of " + to_string(totalSize) + " bytes written";
+        return Status{failure};
+    }
+    if (!part.empty()) {
+        sendPart();
+    }
+    while (!inFlight.empty()) {
+        waitOldest();
+    }
+    if (!failure.empty()) {
+        return Status{failure};
+    }
+    Client::Impl* impl = this->impl;
+    shared_ptr<Upload> upload = this->upload;
+    Status status = impl->start<Status>([impl, upload](function<void(Status)> done) {
+        impl->completeUpload(upload, done);
+    }).get();
+    failure = status.error;
+    closed = status.ok();
+    return status;
+}
+
+} // namespace dfs
@@ -0,0 +1,183 @@
+#ifndef DFS_LIBDFS_DFS_H
+#define DFS_LIBDFS_DFS_H
+
+#include <deque>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+// libdfs: an in-process client for services that talk to the DFS.
+//
+// Every operation returns a std::future at once and runs on the client's
+// event loop, a single thread that drives non-blocking sockets with epoll,
+// so one Client can have thousands of operations in flight. Requests carry
+// KEEPALIVE=1 and the loop keeps connections to the coordinator and to each
+// node open in a pool, so back-to-back requests skip the TCP handshake.
+//
+// Reads go to the replicas directly: the coordinator is asked once where a
+// file lives (LOCATE) and the data is fetched in chunks with ranged GETs,
+// several at a time, each checked against the checksum the node reports.
+// LOCATE replies are cached for as long as the coordinator's lease allows,
+// so repeated reads of a hot file go to the nodes alone. Each GET names the
+// located version; a node holding another version refuses it, and a read
+// that fails on a cached location is retried once after a fresh LOCATE.
+// The client's own uploads drop the entry for their path.
+// Writes are multipart uploads (MPU_BEGIN, MPU_PART, MPU_COMPLETE) with a
+// few parts in flight. Reader and Writer stream a file through a bounded
+// window of chunks or parts, so neither needs the whole file in memory.
+//
+// With several coordinators (see common/partition.h) the Client asks for
+// the partition map once, when it is constructed, and sends each request to
+// the coordinator that owns its path; listFiles() merges every partition.
+// Coordinators with read-only followers (see coordinator/metadata_log.h)
+// have their LOCATE and LIST sent to a follower, and to the coordinator
+// itself when the follower cannot answer.
+//
+// Futures never throw for DFS errors; the error string is set instead, in
+// the form the servers use ("ERROR: ..." or a description).
+
+namespace dfs {
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int coordinatorPort = 9000;            // asked for the partition map; see common/partition.h
+    int nodeBasePort = 9001;               // node N listens on nodeBasePort + N
+    int maxConnectionsPerPeer = 64;        // operations beyond this wait for a connection
+    int maxIdlePerPeer = 16;               // connections kept open between requests
+    int idleTimeoutMs = 10000;             // below the servers' KEEPALIVE_IDLE_MS
+    long long chunkSize = 1024 * 1024;     // bytes per GET
+    long long partSize = 4 * 1024 * 1024;  // bytes per MPU_PART
+    int streams = 4;                       // chunks or parts of one file in flight
+    bool compress = true;                  // offer the codecs built into the library
+    int locationCacheSize = 4096;          // LOCATE replies reused while their lease lasts; 0 disables
+};
+
+struct Status {
+    std::string error; // empty on success
+    
+    bool ok() const {
+        return error.empty();
+    }
+};
+
+template <typename T>
+struct Result {
+    T value{};
+    std::string error;
+    
+    bool ok() const {
+        return error.empty();
+    }
+};
+
+// Where a file lives, as reported by LOCATE
+struct FileInfo {
+    long long size = 0;
+    unsigned long checksum = 0;
+    int version = 0;
+    std::vector<int> nodes; // alive replicas
+};
+
+class Reader;
+class Writer;
+struct Upload;
+
+class Client {
+public:
+    explicit Client(const Options& options = Options());
+    ~Client(); // waits for the operations in flight
+    
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+    
+    std::future<Result<std::vector<std::string>>> listFiles();
+    std::future<Result<FileInfo>> locate(const std::string& dfsPath);
+    
+    // [offset, offset + length) of a file; length -1 reads to the end
+    std::future<Result<std::vector<char>>> download(const std::string& dfsPath, long long offset = 0, long long length = -1);
+    std::future<Status> upload(const std::string& dfsPath, std::vector<char> data);
+    
+    // Files on local disk. Downloads go to <localPath>.dfstmp and are renamed
+    // into place once every chunk has been verified.
+    std::future<Status> downloadFile(const std::string& dfsPath, const std::string& localPath);
+    std::future<Status> uploadFile(const std::string& localPath, const std::string& dfsPath);
+    
+    // Streaming access; errors surface on the first read or write. Readers
+    // and writers must not outlive their Client.
+    std::unique_ptr<Reader> openReader(const std::string& dfsPath);
+    std::unique_ptr<Writer> openWriter(const std::string& dfsPath, long long size);
+    
+    class Impl;
+
+private:
+    std::unique_ptr<Impl> impl;
+};
+
+// Sequential reader that keeps up to Options::streams chunks in flight
+// ahead of the caller
+class Reader {
+public:
+    Reader(Client::Impl* impl, const std::string& dfsPath);
+    
+    // Copy up to size bytes into buffer. Returns the number copied, 0 at the
+    // end of the file, or -1 on error (see error()).
+    long long read(char* buffer, long long size);
+    
+    long long size(); // -1 when the file cannot be located
+    
+    const std::string& error() const {
+        return failure;
+    }
+
+private:
+    bool open();
+    void fill();
+    
+    Client::Impl* impl;
+    std::string dfsPath;
+    bool opened = false;
+    FileInfo info;
+    long long requested = 0; // bytes asked for so far
+    std::deque<std::future<Result<std::vector<char>>>> ahead;
+    std::vector<char> chunk;
+    size_t chunkPos = 0;
+    unsigned long checksum = 0;
+    bool relocated = false; // located again after the first chunk failed
+    std::string failure;
+};
+
+// Writer for a file of a known size. Data is cut into parts that are sent
+// while the caller keeps writing; write() blocks while Options::streams
+// parts are in flight. The file appears in the DFS only after close().
+class Writer {
+public:
+    Writer(Client::Impl* impl, const std::string& dfsPath, long long size);
+    ~Writer(); // aborts the upload unless close() succeeded
+    
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+    
+    Status write(const char* data, long long size);
+    Status close();
+
+private:
+    bool begin();
+    void sendPart();
+    bool waitOldest();
+    
+    Client::Impl* impl;
+    std::string dfsPath;
+    long long totalSize;
+    long long written = 0;
+    bool closed = false;
+    std::shared_ptr<Upload> upload; // set once MPU_BEGIN succeeded
+    int nextPart = 0;
+    std::vector<char> part;
+    std::deque<std::future<Status>> inFlight;
+    std::string failure;
+};
+
+} // namespace dfs
+
+#endif
@@ -2,33 +2,613 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <signal.h>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
 #include <filesystem>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include "object_cache.h"
+#include "../common/bufferpool.h"
+#include "../common/checksum.h"
+#include "../common/compression.h"
+#include "../common/dedup.h"
+#include "../common/delta.h"
+#include "../common/keepalive.h"
+#include "../common/partition.h"
+#include "../common/probes.h"
+#include "../common/ratelimit.h"
+#include "../common/stats.h"
+#include "../common/trace.h"
 
 using namespace std;
 namespace fs = std::filesystem;
 
 const int COORDINATOR_PORT = 9000;
 const int NODE_BASE_PORT = 9001;
+const int CHECKSUM_BLOCK_SIZE = 64 * 1024; // granularity of stored block checksums
+const char FRAMED_MAGIC[8] = {'D', 'F', 'S', 'F', 'R', 'M', '1', '\n'}; // first bytes of a compressed object
+const char MANIFEST_MAGIC[8] = {'D', 'F', 'S', 'M', 'A', 'N', '1', '\n'}; // first bytes of a deduplicated object
+
+// Compressed objects keep one frame per checksum block, so a block can be
+// located through the index and decoded on its own
+static_assert(FRAME_RAW_SIZE == CHECKSUM_BLOCK_SIZE, "frames must line up with checksum blocks");
+
+// Deduplicated blocks carry the checksums of their pieces, so a manifest's
+// checksum blocks are assembled without reading the data
+static_assert(DEDUP_BLOCK_SIZE % CHECKSUM_BLOCK_SIZE == 0, "dedup blocks must hold whole checksum blocks");
 
 string storageFolder;
 int nodeId;
+ObjectCache* objectCache = nullptr;
+Codec storeCodec = Codec::None; // compression at rest (--compress), none keeps plain files
+atomic<unsigned long> tempCounter{0};
+map<string, int> blockRefs; // dedup block hash → manifests referencing it
+mutex blockMutex;           // guards blockRefs and the swap of a manifest into place
+RequestStats requestStats({"STORE", "GET", "PUTPART", "PULLPART", "COMMIT", "DELETE", "ABORT", "HAVEBLOCKS", "PUTBLOCK",
+                           "STOREMANIFEST", "SIGNATURE", "RANGESUM", "PATCH", "CACHESTATS", "STATS", "TRACE"});
+PartitionMap partitions = PartitionMap::uniform(1); // coordinators, fetched at startup
+
+// Background scrubbing (--scrub-mbps, 0 leaves it off)
+RateLimiter scrubLimiter(0);
+int scrubIntervalSec = 24 * 3600; // pause between passes (--scrub-interval)
+atomic<long long> scrubPasses{0};
+atomic<long long> scrubObjects{0};
+atomic<long long> scrubBytes{0};
+atomic<long long> scrubCorrupt{0};
+
+// Per-object metadata persisted next to the data so reads need not rehash it
+struct ObjectMeta {
+    long long size;
+    unsigned long checksum;
+    int version;
+    vector<unsigned long> blockSums; // checksum of each CHECKSUM_BLOCK_SIZE block
+    
+    // Set only for objects stored compressed: the data file is FRAMED_MAGIC
+    // followed by one frame per block, and frameOffsets[i] is where block i's
+    // frame starts in it
+    Codec storedCodec = Codec::None;
+    long long storedSize = 0;
+    vector<long long> frameOffsets;
+    
+    // Set only for deduplicated objects: the data file is a manifest
+    // (storedSize bytes) and block i of the object is stored under
+    // .blocks/ as blockHashes[i]
+    vector<string> blockHashes;
+    
+    bool framed() const {
+        return !frameOffsets.empty();
+    }
+    
+    bool deduplicated() const {
+        return !blockHashes.empty();
+    }
+    
+    long long bytesOnDisk() const {
+        return (framed() || deduplicated()) ? storedSize : size;
+    }
+};
 
-// Calculate checksum
+// Calculate checksum (vectorized, see common/checksum.h)
 unsigned long calculateChecksum(const char* data, int size) {
+    return byteSum(data, size);
+}
+
+// Fill in the per-block checksums of an in-memory object. The checksum is a
+// byte sum, so the object checksum is simply the sum of its block checksums.
+void computeBlockSums(const char* data, int size, ObjectMeta& meta) {
+    meta.blockSums.clear();
+    blockByteSums(data, size, CHECKSUM_BLOCK_SIZE, meta.blockSums);
+    meta.checksum = 0;
+    for (unsigned long blockSum : meta.blockSums) {
+        meta.checksum += blockSum;
+    }
+}
+
+// Same as above for meta.size bytes of an open file, read CHECKSUM_LANES
+// blocks at a time so they are hashed side by side
+bool computeBlockSums(int fd, ObjectMeta& meta) {
+    meta.blockSums.clear();
+    meta.checksum = 0;
+    vector<char> batch(CHECKSUM_BLOCK_SIZE * CHECKSUM_LANES);
+    for (long long offset = 0; offset < meta.size; offset += batch.size()) {
+        long long batchLen = min((long long)batch.size(), meta.size - offset);
+        if (pread(fd, batch.data(), batchLen, offset) != batchLen) {
+            return false;
+        }
+        blockByteSums(batch.data(), batchLen, CHECKSUM_BLOCK_SIZE, meta.blockSums);
+    }
+    for (unsigned long blockSum : meta.blockSums) {
+        meta.checksum += blockSum;
+    }
+    return true;
+}
+
+// Checksum of [offset, offset + length) assembled from the stored block
+// checksums. Only the partial blocks at either edge of the range are hashed,
+// through edgeSum(offset, length), so verifying a range never reads the rest
+// of the object.
+template <typename EdgeSum>
+unsigned long rangeChecksum(const ObjectMeta& meta, long long offset, long long length, EdgeSum edgeSum) {
     unsigned long sum = 0;
-    for (int i = 0; i < size; i++) {
-        sum += (unsigned char)data[i];
+    long long pos = offset;
+    long long end = offset + length;
+    while (pos < end) {
+        long long block = pos / CHECKSUM_BLOCK_SIZE;
+        long long blockStart = block * CHECKSUM_BLOCK_SIZE;
+        long long blockEnd = min(blockStart + CHECKSUM_BLOCK_SIZE, meta.size);
+        long long pieceEnd = min(end, blockEnd);
+        if (pos == blockStart && pieceEnd == blockEnd) {
+            sum += meta.blockSums[block];
+        } else {
+            sum += edgeSum(pos, pieceEnd - pos);
+        }
+        pos = pieceEnd;
     }
     return sum;
 }
 
+// Read one '\n'-terminated line so payload bytes that follow stay in the socket
+string recvLine(int sock) {
+    string line;
+    char c;
+    while (recv(sock, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            break;
+        }
+        line += c;
+    }
+    return line;
+}
+
+// Reply with an error and count the request as failed
+void sendError(int sock, const string& message) {
+    requestTally().failed = true;
+    send(sock, message.c_str(), message.size(), 0);
+}
+
+string cleanPath(const string& dfsPath) {
+    string clean = dfsPath;
+    while (!clean.empty() && clean[0] == '/') {
+        clean = clean.substr(1);
+    }
+    return clean;
+}
+
+// Directories of the storage folder that hold the node's own records rather
+// than DFS files
+const set<string> RESERVED_DIRS = {".meta", ".blocks", ".staging"};
+
+// Whether a DFS path stays inside the storage folder and clear of the
+// reserved directories, so /.meta/... cannot overwrite metadata
+bool validPath(const string& dfsPath) {
+    string clean = cleanPath(dfsPath);
+    if (clean.empty()) {
+        return false;
+    }
+    stringstream parts(clean);
+    string part;
+    bool first = true;
+    while (getline(parts, part, '/')) {
+        if (part == "." || part == ".." || (first && RESERVED_DIRS.count(part))) {
+            return false;
+        }
+        first = false;
+    }
+    return true;
+}
+
+fs::path getFilePath(const string& dfsPath) {
+    return fs::path(storageFolder) / cleanPath(dfsPath);
+}
+
+// Metadata lives in a parallel tree so it never collides with DFS paths
+fs::path getMetaPath(const string& dfsPath) {
+    return fs::path(storageFolder) / ".meta" / cleanPath(dfsPath);
+}
+
+bool readObjectMeta(const string& dfsPath, ObjectMeta& meta) {
+    ifstream metaFile(getMetaPath(dfsPath));
+    if (!metaFile.is_open()) {
+        return false;
+    }
+    if (!(metaFile >> meta.size >> meta.checksum >> meta.version)) {
+        return false;
+    }
+    
+    // Block checksums are optional: records written before ranged reads
+    // existed have none, and callers that need them rebuild the record. A
+    // count that does not fit the size marks a damaged record; it is refused
+    // before anything is allocated for it, and the record is rebuilt too.
+    meta.blockSums.clear();
+    size_t blockCount;
+    if (meta.size >= 0 && metaFile >> blockCount &&
+        blockCount == (size_t)((meta.size + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE)) {
+        unsigned long sum;
+        while (meta.blockSums.size() < blockCount && metaFile >> sum) {
+            meta.blockSums.push_back(sum);
+        }
+        if (meta.blockSums.size() != blockCount) {
+            meta.blockSums.clear();
+        }
+    }
+    
+    // Compressed objects add "frames <codec> <storedSize> <count> <offsets...>",
+    // deduplicated ones "blocks <storedSize> <count> <hashes...>"
+    meta.frameOffsets.clear();
+    meta.blockHashes.clear();
+    meta.storedCodec = Codec::None;
+    string tag;
+    if (!meta.blockSums.empty() && metaFile >> tag) {
+        string codec;
+        size_t count;
+        bool intact = true;
+        if (tag == "frames") {
+            intact = metaFile >> codec >> meta.storedSize >> count && count == meta.blockSums.size() &&
+                     parseCodec(codec, meta.storedCodec);
+            long long frameOffset;
+            while (intact && meta.frameOffsets.size() < count && metaFile >> frameOffset) {
+                meta.frameOffsets.push_back(frameOffset);
+            }
+            intact = intact && meta.frameOffsets.size() == count;
+        } else if (tag == "blocks") {
+            intact = metaFile >> meta.storedSize >> count && (long long)count == dedupBlockCount(meta.size);
+            string hash;
+            while (intact && meta.blockHashes.size() < count && metaFile >> hash) {
+                meta.blockHashes.push_back(hash);
+            }
+            intact = intact && meta.blockHashes.size() == count;
+        }
+        if (!intact) {
+            meta.blockSums.clear();
+            meta.frameOffsets.clear();
+            meta.blockHashes.clear();
+            meta.storedCodec = Codec::None;
+        }
+    }
+    return true;
+}
+
+// Unique sibling path for write-then-rename; connections run concurrently
+fs::path getTempPath(const fs::path& target) {
+    fs::path tmpPath = target;
+    tmpPath += ".tmp" + to_string(tempCounter++);
+    return tmpPath;
+}
+
+bool writeObjectMeta(const string& dfsPath, const ObjectMeta& meta) {
+    fs::path metaPath = getMetaPath(dfsPath);
+    fs::create_directories(metaPath.parent_path());
+    
+    // Write to a temp file and rename so readers never see a torn record
+    fs::path tmpPath = getTempPath(metaPath);
+    {
+        ofstream metaFile(tmpPath);
+        if (!metaFile.is_open()) {
+            return false;
+        }
+        metaFile << meta.size << " " << meta.checksum << " " << meta.version << "\n";
+        metaFile << meta.blockSums.size();
+        for (unsigned long blockSum : meta.blockSums) {
+            metaFile << " " << blockSum;
+        }
+        metaFile << "\n";
+        if (meta.framed()) {
+            metaFile << "frames " << codecName(meta.storedCodec) << " " << meta.storedSize << " " << meta.frameOffsets.size();
+            for (long long frameOffset : meta.frameOffsets) {
+                metaFile << " " << frameOffset;
+            }
+            metaFile << "\n";
+        }
+        if (meta.deduplicated()) {
+            metaFile << "blocks " << meta.storedSize << " " << meta.blockHashes.size();
+            for (const string& hash : meta.blockHashes) {
+                metaFile << " " << hash;
+            }
+            metaFile << "\n";
+        }
+        if (!metaFile) {
+            return false;
+        }
+    }
+    
+    error_code ec;
+    fs::rename(tmpPath, metaPath, ec);
+    return !ec;
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    DFS_PROBE2(write__start, fd, size);
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, data + written, size - written);
+        if (n <= 0) {
+            DFS_PROBE3(write__done, fd, written, 0);
+            return false;
+        }
+        written += n;
+    }
+    DFS_PROBE3(write__done, fd, written, 1);
+    return true;
+}
+
+// Start a compressed data file: write the magic and reset the frame index
+bool beginFramedFile(int fd, Codec codec, ObjectMeta& meta) {
+    meta.storedCodec = codec;
+    meta.storedSize = sizeof(FRAMED_MAGIC);
+    meta.frameOffsets.clear();
+    return writeAll(fd, FRAMED_MAGIC, sizeof(FRAMED_MAGIC));
+}
+
+// Append encoded frames to a compressed data file and index them. Every
+// frame must cover exactly one block; frames that do not (e.g. from a peer
+// using another frame size) are refused so the caller can re-encode.
+bool appendFrames(int fd, const vector<char>& frames, ObjectMeta& meta) {
+    vector<long long> offsets;
+    size_t pos = 0;
+    while (pos < frames.size()) {
+        Codec codec;
+        uint32_t rawLength, wireLength;
+        if (frames.size() - pos < FRAME_HEADER_SIZE || !parseFrameHeader(frames.data() + pos, codec, rawLength, wireLength) ||
+            wireLength > frames.size() - pos - FRAME_HEADER_SIZE) {
+            return false;
+        }
+        long long block = (long long)(meta.frameOffsets.size() + offsets.size());
+        long long blockLength = min((long long)CHECKSUM_BLOCK_SIZE, meta.size - block * CHECKSUM_BLOCK_SIZE);
+        if ((long long)rawLength != blockLength) {
+            return false;
+        }
+        offsets.push_back(meta.storedSize + (long long)pos);
+        pos += FRAME_HEADER_SIZE + wireLength;
+    }
+    
+    if (!writeAll(fd, frames.data(), frames.size())) {
+        return false;
+    }
+    meta.frameOffsets.insert(meta.frameOffsets.end(), offsets.begin(), offsets.end());
+    meta.storedSize += (long long)frames.size();
+    return true;
+}
+
+// Rebuild size, checksums and frame index of a compressed object by walking
+// its frames (used when the metadata record is missing)
+bool scanFramedFile(int fd, long long fileSize, ObjectMeta& meta) {
+    char magic[sizeof(FRAMED_MAGIC)];
+    if (fileSize < (long long)sizeof(magic) || pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, FRAMED_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+    
+    ObjectMeta scanned;
+    scanned.size = 0;
+    scanned.checksum = 0;
+    scanned.version = meta.version;
+    scanned.storedSize = fileSize;
+    vector<char> frame;
+    vector<char> block(CHECKSUM_BLOCK_SIZE);
+    long long pos = sizeof(FRAMED_MAGIC);
+    while (pos < fileSize) {
+        char header[FRAME_HEADER_SIZE];
+        Codec codec;
+        uint32_t rawLength, wireLength;
+        if (pread(fd, header, FRAME_HEADER_SIZE, pos) != (ssize_t)FRAME_HEADER_SIZE ||
+            !parseFrameHeader(header, codec, rawLength, wireLength)) {
+            return false;
+        }
+        // Only the last block may be short
+        if (!scanned.frameOffsets.empty() && scanned.size % CHECKSUM_BLOCK_SIZE != 0) {
+            return false;
+        }
+        frame.resize(wireLength);
+        if (pread(fd, frame.data(), wireLength, pos + FRAME_HEADER_SIZE) != (ssize_t)wireLength ||
+            !decodeFrame(codec, frame.data(), wireLength, block.data(), rawLength)) {
+            return false;
+        }
+        if (codec != Codec::None) {
+            scanned.storedCodec = codec;
+        }
+        unsigned long blockSum = calculateChecksum(block.data(), rawLength);
+        scanned.blockSums.push_back(blockSum);
+        scanned.checksum += blockSum;
+        scanned.frameOffsets.push_back(pos);
+        scanned.size += rawLength;
+        pos += FRAME_HEADER_SIZE + wireLength;
+    }
+    if (scanned.frameOffsets.empty()) {
+        return false;
+    }
+    
+    meta = scanned;
+    return true;
+}
+
+// Deduplicated blocks live in storage/nodeN/.blocks/<first two hex digits>/<hash>,
+// with the checksum of each CHECKSUM_BLOCK_SIZE piece of the block in <hash>.sums
+fs::path getBlockPath(const string& hash) {
+    return fs::path(storageFolder) / ".blocks" / hash.substr(0, 2) / hash;
+}
+
+fs::path getBlockSumsPath(const string& hash) {
+    fs::path sumsPath = getBlockPath(hash);
+    sumsPath += ".sums";
+    return sumsPath;
+}
+
+bool blockPresent(const string& hash) {
+    error_code ec;
+    return fs::exists(getBlockPath(hash), ec) && fs::exists(getBlockSumsPath(hash), ec);
+}
+
+// Piece checksums of a stored block of blockSize bytes; false if the block
+// is missing or has another size
+bool readBlockSums(const string& hash, long long blockSize, vector<unsigned long>& sums) {
+    error_code ec;
+    if ((long long)fs::file_size(getBlockPath(hash), ec) != blockSize || ec) {
+        return false;
+    }
+    ifstream sumsFile(getBlockSumsPath(hash));
+    size_t expected = (blockSize + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+    sums.assign(expected, 0);
+    for (size_t i = 0; i < expected; i++) {
+        if (!(sumsFile >> sums[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Text of a manifest: MANIFEST_MAGIC, the object size, then its block list
+string manifestText(long long size, const vector<BlockRef>& blocks) {
+    return string(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) + to_string(size) + "\n" + formatBlockList(blocks);
+}
+
+// Parse the manifest stored in a data file; false if it is not one
+bool readManifest(int fd, long long fileSize, long long& size, vector<BlockRef>& blocks) {
+    char magic[sizeof(MANIFEST_MAGIC)];
+    if (fileSize < (long long)sizeof(magic) || pread(fd, magic, sizeof(magic), 0) != (ssize_t)sizeof(magic) ||
+        memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) != 0) {
+        return false;
+    }
+    string text(fileSize - sizeof(magic), '\0');
+    if (pread(fd, &text[0], text.size(), sizeof(magic)) != (ssize_t)text.size()) {
+        return false;
+    }
+    size_t newline = text.find('\n');
+    if (newline == string::npos) {
+        return false;
+    }
+    size = atoll(text.substr(0, newline).c_str());
+    return parseBlockList(text.substr(newline + 1), size, blocks);
+}
+
+bool readManifest(const fs::path& path, long long& size, vector<BlockRef>& blocks) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && readManifest(fd, st.st_size, size, blocks);
+    close(fd);
+    return ok;
+}
+
+// Indices of the blocks of a list this node does not hold, as the
+// "ERROR: Missing blocks <index>..." reply to STOREMANIFEST, or "" when it
+// holds them all
+string missingBlocksError(const vector<BlockRef>& blocks) {
+    string indices;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!blockPresent(blocks[i].hash)) {
+            indices += " " + to_string(i);
+        }
+    }
+    return indices.empty() ? "" : "ERROR: Missing blocks" + indices + "\n";
+}
+
+// Build the metadata of a deduplicated object from its blocks' piece
+// checksums; false if a block is missing
+bool manifestMeta(long long size, const vector<BlockRef>& blocks, ObjectMeta& meta) {
+    meta.size = size;
+    meta.checksum = 0;
+    meta.blockSums.clear();
+    meta.blockHashes.clear();
+    vector<unsigned long> sums;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (!readBlockSums(blocks[i].hash, dedupBlockSize(size, i), sums)) {
+            return false;
+        }
+        for (unsigned long sum : sums) {
+            meta.blockSums.push_back(sum);
+            meta.checksum += sum;
+        }
+        meta.blockHashes.push_back(blocks[i].hash);
+    }
+    return true;
+}
+
+// Rebuild the metadata of a deduplicated object from its manifest (used when
+// the metadata record is missing)
+bool scanManifestFile(int fd, long long fileSize, ObjectMeta& meta) {
+    long long size;
+    vector<BlockRef> blocks;
+    if (!readManifest(fd, fileSize, size, blocks) || !manifestMeta(size, blocks, meta)) {
+        return false;
+    }
+    meta.storedSize = fileSize;
+    return true;
+}
+
+// Drop one reference to each block, deleting blocks no manifest uses any
+// more. Caller holds blockMutex.
+void releaseBlocks(const vector<string>& hashes) {
+    for (const string& hash : hashes) {
+        auto it = blockRefs.find(hash);
+        if (it == blockRefs.end() || --it->second > 0) {
+            continue;
+        }
+        blockRefs.erase(it);
+        error_code ec;
+        fs::remove(getBlockPath(hash), ec);
+        fs::remove(getBlockSumsPath(hash), ec);
+    }
+}
+
+// Reference counts are derived from the manifests on disk rather than kept
+// in a file of their own, so they cannot drift from the objects they count.
+// Blocks nothing refers to (left by uploads that never committed) go away.
+void loadBlockRefs() {
+    error_code ec;
+    fs::path root(storageFolder);
+    for (auto it = fs::recursive_directory_iterator(root, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        string name = it->path().filename().string();
+        if (it->is_directory() && it.depth() == 0 && RESERVED_DIRS.count(name)) {
+            it.disable_recursion_pending();
+            continue;
+        }
+        long long size;
+        vector<BlockRef> blocks;
+        if (it->is_regular_file() && readManifest(it->path(), size, blocks)) {
+            for (const BlockRef& block : blocks) {
+                blockRefs[block.hash]++;
+            }
+        }
+    }
+    
+    long long kept = 0;
+    vector<fs::path> unreferenced;
+    for (auto it = fs::recursive_directory_iterator(root / ".blocks", ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+        string name = it->path().filename().string();
+        if (!it->is_regular_file()) {
+            continue;
+        }
+        string hash = name.substr(0, name.find('.'));
+        if (validBlockHash(hash) && blockRefs.count(hash) && (name == hash || it->path().extension() == ".sums")) {
+            kept += (name == hash);
+        } else {
+            unreferenced.push_back(it->path());
+        }
+    }
+    for (const fs::path& path : unreferenced) {
+        fs::remove(path, ec);
+    }
+    long long removed = 0;
+    for (const fs::path& path : unreferenced) {
+        removed += (path.extension() != ".sums");
+    }
+    cout << "Block store: " << kept << " blocks in use, " << removed << " unreferenced removed\n";
+}
+
 // Register with coordinator
-bool registerWithCoordinator() {
+bool registerWithCoordinator(int port) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) {
         return false;
@@ -36,7 +616,7 @@ bool registerWithCoordinator() {
     
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
-    addr.sin_port = htons(COORDINATOR_PORT);
+    addr.sin_port = htons(port);
     inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
     
     if (connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
@@ -45,7 +625,15 @@ bool registerWithCoordinator() {
     }
     
     pid_t pid = getpid();
-    string cmd = "REGISTER " + to_string(nodeId) + " " + to_string(pid) + "\n";
+    
+    // List the at-rest codec first so the coordinator sends frames this node
+    // can store as received
+    vector<Codec> accepted = availableCodecs();
+    if (storeCodec != Codec::None) {
+        accepted.erase(find(accepted.begin(), accepted.end(), storeCodec));
+        accepted.insert(accepted.begin(), storeCodec);
+    }
+    string cmd = "REGISTER " + to_string(nodeId) + " " + to_string(pid) + codecOffer(accepted) + "\n";
     send(sock, cmd.c_str(), cmd.size(), 0);
     
     char response[256] = {0};
@@ -55,101 +643,1373 @@ bool registerWithCoordinator() {
     return string(response).find("REGISTERED") != string::npos;
 }
 
+// Atomically replace dfsPath with the fully written file at tmpPath and
+// record its metadata. With replaceVersion > 0 the object is installed only
+// over that version: a repair must not undo an overwrite that landed while
+// it was copying.
+bool installObject(const fs::path& tmpPath, const string& dfsPath, const ObjectMeta& meta, int replaceVersion = 0) {
+    fs::path filePath = getFilePath(dfsPath);
+    fs::create_directories(filePath.parent_path());
+    
+    {
+        // A manifest pins its blocks: take the new object's references before
+        // it becomes visible and drop the replaced object's once it is gone
+        lock_guard<mutex> lock(blockMutex);
+        ObjectMeta current;
+        if (replaceVersion > 0 && (!readObjectMeta(dfsPath, current) || current.version != replaceVersion)) {
+            error_code ec;
+            fs::remove(tmpPath, ec);
+            return false;
+        }
+        // A block can be released and deleted after the caller checked it;
+        // only a reference taken under this lock keeps it
+        for (const string& hash : meta.blockHashes) {
+            if (!blockPresent(hash)) {
+                error_code ec;
+                fs::remove(tmpPath, ec);
+                return false;
+            }
+        }
+        long long oldSize;
+        vector<BlockRef> oldBlocks;
+        vector<string> replaced;
+        if (readManifest(filePath, oldSize, oldBlocks)) {
+            for (const BlockRef& block : oldBlocks) {
+                replaced.push_back(block.hash);
+            }
+        }
+        for (const string& hash : meta.blockHashes) {
+            blockRefs[hash]++;
+        }
+        
+        // Drop the old metadata first: a crash before the new record is written
+        // leaves no metadata, which handleGet rebuilds, rather than a stale one
+        error_code ec;
+        fs::remove(getMetaPath(dfsPath), ec);
+        
+        fs::rename(tmpPath, filePath, ec);
+        if (ec) {
+            releaseBlocks(meta.blockHashes);
+            fs::remove(tmpPath, ec);
+            return false;
+        }
+        releaseBlocks(replaced);
+    }
+    
+    // Persist the checksums verified by the caller so GET can serve them directly
+    if (!writeObjectMeta(dfsPath, meta)) {
+        cerr << "Warning: could not write metadata for " << dfsPath << "\n";
+    }
+    objectCache->invalidate(dfsPath);
+    return true;
+}
+
 // Handle STORE command
-void handleStore(int clientSock, const string& dfsPath, int fileSize, unsigned long expectedChecksum) {
-    // Receive file data
-    char* fileData = new char[fileSize];
-    int totalReceived = 0;
-    
-    while (totalReceived < fileSize) {
-        int received = recv(clientSock, fileData + totalReceived, fileSize - totalReceived, 0);
-        if (received <= 0) {
-            delete[] fileData;
-            send(clientSock, "ERROR: Failed to receive file\n", 31, 0);
+void handleStore(int clientSock, const string& dfsPath, int fileSize, unsigned long expectedChecksum, int version, Codec codec) {
+    DFS_PROBE3(store__start, dfsPath.c_str(), fileSize, version);
+    ProbeOnExit storeDone([&] { DFS_PROBE3(store__done, dfsPath.c_str(), fileSize, !requestTally().failed); });
+    if (fileSize <= 0) {
+        sendError(clientSock, "ERROR: Invalid file size\n");
+        return;
+    }
+    
+    // Receive file data. Compressed frames are kept as received when this
+    // node stores objects compressed, so they are written without re-encoding.
+    PooledBuffer buffer = bufferPool().acquire(fileSize);
+    if (!buffer) {
+        sendError(clientSock, "ERROR: Server busy\n");
+        return;
+    }
+    char* fileData = buffer.data();
+    vector<char> wire;
+    bool keepWire = storeCodec != Codec::None && codec != Codec::None;
+    TraceSpan recvSpan("recv");
+    recvSpan.setArg("bytes", fileSize);
+    if (!recvPayload(clientSock, codec, fileData, fileSize, keepWire ? &wire : nullptr)) {
+        sendError(clientSock, "ERROR: Failed to receive file\n");
+        return;
+    }
+    recvSpan.end();
+    requestTally().bytesIn = fileSize;
+    
+    // Verify checksum (computed per block so ranged reads can reuse the sums)
+    ObjectMeta meta;
+    meta.size = fileSize;
+    meta.version = version;
+    TraceSpan checksumSpan("checksum");
+    computeBlockSums(fileData, fileSize, meta);
+    checksumSpan.end();
+    if (meta.checksum != expectedChecksum) {
+        sendError(clientSock, "ERROR: Checksum mismatch\n");
+        return;
+    }
+    
+    // Save file (temp + rename, so a concurrent GET sees old or new, never half)
+    fs::path filePath = getFilePath(dfsPath);
+    fs::create_directories(filePath.parent_path());
+    fs::path tmpPath = getTempPath(filePath);
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        sendError(clientSock, "ERROR: Cannot create file\n");
+        return;
+    }
+    
+    TraceSpan writeSpan("write");
+    bool written;
+    if (storeCodec == Codec::None) {
+        written = writeAll(fd, fileData, fileSize);
+    } else if (keepWire && beginFramedFile(fd, codec, meta) && appendFrames(fd, wire, meta)) {
+        written = true;
+    } else {
+        // Not received compressed (or framed differently): encode it here
+        written = ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0 && beginFramedFile(fd, storeCodec, meta) &&
+                  appendFrames(fd, encodeFrames(storeCodec, fileData, fileSize), meta);
+    }
+    close(fd);
+    buffer.reset();
+    writeSpan.setArg("bytes", meta.bytesOnDisk());
+    writeSpan.end();
+    TraceSpan installSpan("install");
+    bool installed = written && installObject(tmpPath, dfsPath, meta);
+    installSpan.end();
+    if (!installed) {
+        error_code ec;
+        fs::remove(tmpPath, ec);
+        sendError(clientSock, "ERROR: Cannot create file\n");
+        return;
+    }
+    
+    send(clientSock, "OK\n", 3, 0);
+    cout << "Stored file: " << dfsPath << " (" << fileSize << " bytes";
+    if (meta.framed()) {
+        cout << ", " << meta.storedSize << " on disk";
+    }
+    cout << ")\n";
+}
+
+// An object opened for reading: the descriptor pins the data that was
+// current when it was opened, and meta is guaranteed to describe that data
+struct OpenObject {
+    int fd;
+    ObjectMeta meta;
+};
+
+// Open an object and load matching metadata. Serve the checksums recorded at
+// store time; objects written before metadata existed (or whose record was
+// lost) are hashed once, block by block, and the record is backfilled.
+bool openObject(const string& dfsPath, OpenObject& object, string& error) {
+    fs::path filePath = getFilePath(dfsPath);
+    
+    // A STORE renames a new file into place; if that happens between opening
+    // the data and reading the metadata, the inode check notices and retries
+    for (int attempt = 0; attempt < 3; attempt++) {
+        int fd = open(filePath.c_str(), O_RDONLY);
+        if (fd == -1) {
+            error = (errno == ENOENT) ? "ERROR: File not found\n" : "ERROR: Cannot read file\n";
+            return false;
+        }
+        
+        struct stat before;
+        fstat(fd, &before);
+        
+        ObjectMeta meta;
+        bool haveMeta = readObjectMeta(dfsPath, meta) && meta.bytesOnDisk() == before.st_size && !meta.blockSums.empty();
+        
+        struct stat after;
+        if (stat(filePath.c_str(), &after) != 0 || after.st_ino != before.st_ino) {
+            close(fd);
+            continue;
+        }
+        
+        if (!haveMeta) {
+            int oldVersion = (readObjectMeta(dfsPath, meta) ? meta.version : 0);
+            meta = ObjectMeta();
+            meta.size = before.st_size;
+            meta.version = oldVersion;
+            if (!scanManifestFile(fd, before.st_size, meta) && !scanFramedFile(fd, before.st_size, meta) &&
+                !computeBlockSums(fd, meta)) {
+                close(fd);
+                error = "ERROR: Cannot read file\n";
+                return false;
+            }
+            
+            if (stat(filePath.c_str(), &after) == 0 && after.st_ino == before.st_ino) {
+                writeObjectMeta(dfsPath, meta);
+                cout << "Rebuilt metadata: " << dfsPath << "\n";
+            }
+        }
+        
+        object.fd = fd;
+        object.meta = meta;
+        return true;
+    }
+    
+    error = "ERROR: File is being overwritten\n";
+    return false;
+}
+
+bool preadAll(int fd, char* out, long long length, long long offset) {
+    long long total = 0;
+    while (total < length) {
+        ssize_t n = pread(fd, out + total, length - total, offset + total);
+        if (n <= 0) {
+            return false;
+        }
+        total += n;
+    }
+    return true;
+}
+
+// Read [offset, offset + length) of an object's data into out. Compressed
+// objects decode only the frames of the blocks the range touches, and
+// deduplicated ones read only the blocks it touches.
+bool readObjectRange(const OpenObject& opened, long long offset, long long length, char* out) {
+    const ObjectMeta& meta = opened.meta;
+    if (meta.deduplicated()) {
+        long long end = offset + length;
+        for (long long index = offset / DEDUP_BLOCK_SIZE; index * DEDUP_BLOCK_SIZE < end; index++) {
+            long long blockStart = index * DEDUP_BLOCK_SIZE;
+            long long pieceStart = max(offset, blockStart);
+            long long pieceEnd = min(end, blockStart + DEDUP_BLOCK_SIZE);
+            int fd = open(getBlockPath(meta.blockHashes[index]).c_str(), O_RDONLY);
+            if (fd == -1) {
+                return false;
+            }
+            bool ok = preadAll(fd, out + (pieceStart - offset), pieceEnd - pieceStart, pieceStart - blockStart);
+            close(fd);
+            if (!ok) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if (!meta.framed()) {
+        return preadAll(opened.fd, out, length, offset);
+    }
+    
+    vector<char> frame;
+    vector<char> block(CHECKSUM_BLOCK_SIZE);
+    long long end = offset + length;
+    for (long long index = offset / CHECKSUM_BLOCK_SIZE; index * CHECKSUM_BLOCK_SIZE < end; index++) {
+        long long frameStart = meta.frameOffsets[index];
+        long long frameEnd = (index + 1 < (long long)meta.frameOffsets.size()) ? meta.frameOffsets[index + 1] : meta.storedSize;
+        frame.resize(frameEnd - frameStart);
+        Codec codec;
+        uint32_t rawLength, wireLength;
+        if (frame.size() < FRAME_HEADER_SIZE ||
+            pread(opened.fd, frame.data(), frame.size(), frameStart) != (ssize_t)frame.size() ||
+            !parseFrameHeader(frame.data(), codec, rawLength, wireLength) ||
+            wireLength != frame.size() - FRAME_HEADER_SIZE) {
+            return false;
+        }
+        
+        // Whole blocks decode straight into the output
+        long long blockStart = index * CHECKSUM_BLOCK_SIZE;
+        long long pieceStart = max(offset, blockStart);
+        long long pieceEnd = min(end, blockStart + (long long)rawLength);
+        bool whole = (pieceStart == blockStart && pieceEnd == blockStart + (long long)rawLength);
+        char* target = whole ? out + (blockStart - offset) : block.data();
+        if (!decodeFrame(codec, frame.data() + FRAME_HEADER_SIZE, wireLength, target, rawLength)) {
+            return false;
+        }
+        if (!whole) {
+            memcpy(out + (pieceStart - offset), block.data() + (pieceStart - blockStart), pieceEnd - pieceStart);
+        }
+    }
+    return true;
+}
+
+// Read a whole object into a shareable buffer for the cache
+CachedObjectPtr loadObject(OpenObject& opened) {
+    auto object = make_shared<CachedObject>();
+    object->data.resize(opened.meta.size);
+    if (!readObjectRange(opened, 0, opened.meta.size, object->data.data())) {
+        return nullptr;
+    }
+    object->checksum = opened.meta.checksum;
+    object->version = opened.meta.version;
+    object->blockSums = opened.meta.blockSums;
+    return object;
+}
+
+// Handle GET command. length < 0 means the whole object; otherwise only
+// [offset, offset + length) is sent, with the checksum of just that range.
+// When the reader offered codecs, a CODEC= line follows the checksum and
+// the data is sent as compressed frames. A reader working from a cached
+// location names the version it expects (expectedVersion > 0) and is told
+// "ERROR: Stale version <stored>" when this node holds another one.
+void handleGet(int clientSock, const string& dfsPath, long long offset, long long length, const vector<Codec>& offered, int expectedVersion) {
+    DFS_PROBE3(get__start, dfsPath.c_str(), offset, length);
+    ProbeOnExit getDone([&] { DFS_PROBE3(get__done, dfsPath.c_str(), requestTally().bytesOut, !requestTally().failed); });
+    // Hot objects are served from the cache; concurrent readers share the
+    // same buffer, which stays alive until the last of them finishes sending
+    CachedObjectPtr object = objectCache->get(dfsPath);
+    OpenObject opened{-1, {}};
+    if (!object) {
+        unsigned long readEpoch = objectCache->epoch();
+        string error;
+        TraceSpan openSpan("open");
+        if (!openObject(dfsPath, opened, error)) {
+            sendError(clientSock, error);
             return;
         }
-        totalReceived += received;
+        openSpan.end();
+        
+        // Whole-object reads warm the cache; ranged reads and objects the
+        // cache would not admit are sent straight from disk
+        if (length < 0 && objectCache->admits(opened.meta.size)) {
+            TraceSpan loadSpan("cache load");
+            object = loadObject(opened);
+            if (object) {
+                objectCache->put(dfsPath, object, readEpoch);
+                close(opened.fd);
+                opened.fd = -1;
+            }
+        }
+    }
+    
+    ObjectMeta meta;
+    if (object) {
+        meta.size = object->data.size();
+        meta.checksum = object->checksum;
+        meta.version = object->version;
+        meta.blockSums = object->blockSums;
+    } else {
+        meta = opened.meta;
+    }
+    
+    if (expectedVersion > 0 && meta.version != expectedVersion) {
+        if (opened.fd != -1) {
+            close(opened.fd);
+        }
+        sendError(clientSock, "ERROR: Stale version " + to_string(meta.version) + "\n");
+        return;
     }
     
-    // Verify checksum
-    unsigned long calculatedChecksum = calculateChecksum(fileData, fileSize);
-    if (calculatedChecksum != expectedChecksum) {
-        delete[] fileData;
-        send(clientSock, "ERROR: Checksum mismatch\n", 25, 0);
+    if (length < 0) {
+        offset = 0;
+        length = meta.size;
+    }
+    if (offset < 0 || offset > meta.size || length > meta.size - offset) {
+        if (opened.fd != -1) {
+            close(opened.fd);
+        }
+        sendError(clientSock, "ERROR: Invalid range\n");
         return;
     }
     
-    // Save file
-    fs::path filePath = fs::path(storageFolder) / dfsPath;
-    fs::create_directories(filePath.parent_path());
+    unsigned long checksum = meta.checksum;
+    if (length != meta.size) {
+        checksum = rangeChecksum(meta, offset, length, [&](long long edgeOffset, long long edgeLength) {
+            if (object) {
+                return calculateChecksum(object->data.data() + edgeOffset, (int)edgeLength);
+            }
+            vector<char> edge(edgeLength);
+            if (!readObjectRange(opened, edgeOffset, edgeLength, edge.data())) {
+                return 0UL;
+            }
+            return calculateChecksum(edge.data(), (int)edgeLength);
+        });
+    }
+    
+    // Send length and checksum of what follows
+    // Prefer the codec the object is stored in, so its frames can go out as-is
+    Codec codec = negotiateCodec(offered);
+    if (meta.framed() && find(offered.begin(), offered.end(), meta.storedCodec) != offered.end()) {
+        codec = meta.storedCodec;
+    }
+    string header = to_string(length) + "\n" + to_string(checksum) + "\n";
+    if (!offered.empty()) {
+        header += "CODEC=" + string(codecName(codec)) + "\n";
+    }
+    send(clientSock, header.c_str(), header.size(), 0);
+    
+    // Send file data
+    TraceSpan sendSpan(object ? "send cached" : "send");
+    sendSpan.setArg("bytes", length);
+    if (object) {
+        if (!sendPayload(clientSock, codec, object->data.data() + offset, length)) {
+            requestTally().failed = true;
+            return;
+        }
+    } else if (meta.framed() && codec == meta.storedCodec && offset % CHECKSUM_BLOCK_SIZE == 0 &&
+               ((offset + length) % CHECKSUM_BLOCK_SIZE == 0 || offset + length == meta.size)) {
+        // Block-aligned read of an object stored in the negotiated codec: the
+        // stored frames are exactly what goes on the wire, so send them as-is
+        long long firstBlock = offset / CHECKSUM_BLOCK_SIZE;
+        long long endBlock = (offset + length + CHECKSUM_BLOCK_SIZE - 1) / CHECKSUM_BLOCK_SIZE;
+        off_t fileOffset = meta.frameOffsets[firstBlock];
+        long long remaining = ((endBlock < (long long)meta.frameOffsets.size()) ? meta.frameOffsets[endBlock] : meta.storedSize) - fileOffset;
+        DFS_PROBE2(sendfile__start, clientSock, remaining);
+        while (remaining > 0) {
+            ssize_t sent = sendfile(clientSock, opened.fd, &fileOffset, remaining);
+            if (sent <= 0) {
+                requestTally().failed = true;
+                break;
+            }
+            remaining -= sent;
+        }
+        DFS_PROBE3(sendfile__done, clientSock, fileOffset - meta.frameOffsets[firstBlock], remaining == 0);
+        close(opened.fd);
+    } else if (codec != Codec::None || meta.framed() || meta.deduplicated()) {
+        // Otherwise (re)encode from the data a batch of frames at a time
+        PooledBuffer batch = bufferPool().acquire(FRAME_RAW_SIZE * FRAME_BATCH);
+        if (!batch) {
+            requestTally().failed = true;
+            close(opened.fd);
+            return;
+        }
+        long long sentBytes = 0;
+        while (sentBytes < length) {
+            long long chunk = min((long long)batch.size(), length - sentBytes);
+            if (!readObjectRange(opened, offset + sentBytes, chunk, batch.data()) ||
+                !sendPayload(clientSock, codec, batch.data(), chunk)) {
+                requestTally().failed = true;
+                close(opened.fd);
+                return;
+            }
+            sentBytes += chunk;
+        }
+        close(opened.fd);
+    } else {
+        // Zero-copy from the page cache straight into the socket
+        off_t fileOffset = offset;
+        long long remaining = length;
+        DFS_PROBE2(sendfile__start, clientSock, remaining);
+        while (remaining > 0) {
+            ssize_t sent = sendfile(clientSock, opened.fd, &fileOffset, remaining);
+            if (sent <= 0) {
+                DFS_PROBE3(sendfile__done, clientSock, length - remaining, 0);
+                requestTally().failed = true;
+                close(opened.fd);
+                return;
+            }
+            remaining -= sent;
+        }
+        DFS_PROBE3(sendfile__done, clientSock, length, 1);
+        close(opened.fd);
+    }
+    
+    requestTally().bytesOut = length;
+    cout << "Sent file: " << dfsPath << " (" << length << " bytes";
+    if (length != meta.size) {
+        cout << " at offset " << offset;
+    }
+    cout << ")\n";
+}
+
+// Multipart uploads are assembled in storage/nodeN/.staging/<uploadId>
+// until the coordinator commits them
+bool validUploadId(const string& uploadId) {
+    if (uploadId.empty()) {
+        return false;
+    }
+    for (char c : uploadId) {
+        if (!isalnum((unsigned char)c) && c != '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+fs::path getStagingPath(const string& uploadId) {
+    return fs::path(storageFolder) / ".staging" / uploadId;
+}
+
+// Write one verified part at its offset in an upload's staging file.
+// Returns "" or the error for the sender.
+string stagePart(const string& uploadId, long long offset, const char* data, int partSize) {
+    fs::path stagingPath = getStagingPath(uploadId);
+    fs::create_directories(stagingPath.parent_path());
+    int fd = open(stagingPath.c_str(), O_WRONLY | O_CREAT, 0644);
+    if (fd == -1) {
+        return "ERROR: Cannot create file\n";
+    }
+    
+    int written = 0;
+    DFS_PROBE2(write__start, fd, partSize);
+    while (written < partSize) {
+        ssize_t n = pwrite(fd, data + written, partSize - written, offset + written);
+        if (n <= 0) {
+            DFS_PROBE3(write__done, fd, written, 0);
+            close(fd);
+            return "ERROR: Cannot write part\n";
+        }
+        written += n;
+    }
+    DFS_PROBE3(write__done, fd, written, 1);
+    close(fd);
+    return "";
+}
+
+// Handle PUTPART command: write one verified part of a multipart upload at
+// its offset in the staging file. Parts may arrive in any order.
+void handlePutPart(int clientSock, const string& uploadId, long long offset, int partSize, unsigned long expectedChecksum, Codec codec) {
+    if (!validUploadId(uploadId) || offset < 0 || partSize <= 0) {
+        sendError(clientSock, "ERROR: Invalid part\n");
+        return;
+    }
+    
+    PooledBuffer partData = bufferPool().acquire(partSize);
+    if (!partData) {
+        sendError(clientSock, "ERROR: Server busy\n");
+        return;
+    }
+    if (!recvPayload(clientSock, codec, partData.data(), partSize)) {
+        sendError(clientSock, "ERROR: Failed to receive part\n");
+        return;
+    }
+    requestTally().bytesIn = partSize;
     
-    ofstream outFile(filePath, ios::binary);
-    if (!outFile.is_open()) {
-        delete[] fileData;
-        send(clientSock, "ERROR: Cannot create file\n", 26, 0);
+    if (calculateChecksum(partData.data(), partSize) != expectedChecksum) {
+        sendError(clientSock, "ERROR: Checksum mismatch\n");
         return;
     }
     
-    outFile.write(fileData, fileSize);
-    outFile.close();
-    delete[] fileData;
+    string error = stagePart(uploadId, offset, partData.data(), partSize);
+    if (!error.empty()) {
+        sendError(clientSock, error);
+        return;
+    }
     
     send(clientSock, "OK\n", 3, 0);
-    cout << "Stored file: " << dfsPath << " (" << fileSize << " bytes)\n";
 }
 
-// Handle GET command
-void handleGet(int clientSock, const string& dfsPath) {
-    fs::path filePath = fs::path(storageFolder) / dfsPath;
+// Handle PULLPART command: stage [offset, offset + partSize) of version of a
+// file read straight from srcNode, checked against the checksum that node
+// serves. The coordinator copies replicas this way (repairs, rebalancing),
+// so the data goes from node to node, compressed when both have a codec,
+// and the final COMMIT checks the whole file.
+void handlePullPart(int clientSock, const string& uploadId, int srcNode, const string& dfsPath, int version, long long offset, int partSize) {
+    if (!validUploadId(uploadId) || srcNode < 1 || srcNode == nodeId || offset < 0 || partSize <= 0) {
+        sendError(clientSock, "ERROR: Invalid part\n");
+        return;
+    }
+    
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(NODE_BASE_PORT + srcNode);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (sock == -1 || connect(sock, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        if (sock != -1) {
+            close(sock);
+        }
+        sendError(clientSock, "ERROR: Cannot connect to node " + to_string(srcNode) + "\n");
+        return;
+    }
     
-    if (!fs::exists(filePath)) {
-        send(clientSock, "ERROR: File not found\n", 22, 0);
+    vector<Codec> codecs = availableCodecs();
+    string cmd = "GET " + dfsPath + " " + to_string(offset) + " " + to_string(partSize) + " VERSION=" + to_string(version) +
+                 codecOffer(codecs) + traceToken() + "\n";
+    send(sock, cmd.c_str(), cmd.size(), 0);
+    string sizeLine = recvLine(sock);
+    if (atoll(sizeLine.c_str()) != partSize) {
+        close(sock);
+        sendError(clientSock, sizeLine.find("ERROR") == 0 ? sizeLine + "\n" : "ERROR: Invalid size from node\n");
         return;
     }
+    unsigned long checksum = strtoul(recvLine(sock).c_str(), NULL, 10);
+    Codec codec = codecs.empty() ? Codec::None : parseCodecReply(recvLine(sock));
     
-    // Read file
-    ifstream inFile(filePath, ios::binary | ios::ate);
-    if (!inFile.is_open()) {
-        send(clientSock, "ERROR: Cannot read file\n", 24, 0);
+    PooledBuffer partData = bufferPool().acquire(partSize);
+    if (!partData) {
+        close(sock);
+        sendError(clientSock, "ERROR: Server busy\n");
+        return;
+    }
+    bool received = recvPayload(sock, codec, partData.data(), partSize);
+    close(sock);
+    if (!received || calculateChecksum(partData.data(), partSize) != checksum) {
+        sendError(clientSock, "ERROR: Failed to pull part\n");
         return;
     }
+    requestTally().bytesIn = partSize;
     
-    int fileSize = (int)inFile.tellg();
-    inFile.seekg(0, ios::beg);
+    string error = stagePart(uploadId, offset, partData.data(), partSize);
+    if (!error.empty()) {
+        sendError(clientSock, error);
+        return;
+    }
+    send(clientSock, "OK\n", 3, 0);
+}
+
+// Handle COMMIT command: check the assembled upload against the size and
+// checksum the coordinator confirmed part by part, then publish it in one
+// rename. Repairs pass replaceVersion (see installObject).
+void handleCommit(int clientSock, const string& uploadId, const string& dfsPath, long long size, unsigned long expectedChecksum, int version, int replaceVersion) {
+    if (!validUploadId(uploadId)) {
+        sendError(clientSock, "ERROR: Invalid upload\n");
+        return;
+    }
     
-    char* fileData = new char[fileSize];
-    inFile.read(fileData, fileSize);
-    inFile.close();
+    fs::path stagingPath = getStagingPath(uploadId);
+    int fd = open(stagingPath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        sendError(clientSock, "ERROR: Unknown upload\n");
+        return;
+    }
     
-    // Calculate checksum
-    unsigned long checksum = calculateChecksum(fileData, fileSize);
+    struct stat st;
+    fstat(fd, &st);
+    ObjectMeta meta;
+    meta.size = size;
+    meta.version = version;
+    bool ok = st.st_size == size && computeBlockSums(fd, meta) && meta.checksum == expectedChecksum;
+    if (ok) {
+        fdatasync(fd);
+    }
+    if (!ok) {
+        close(fd);
+        sendError(clientSock, "ERROR: Checksum mismatch\n");
+        return;
+    }
     
-    // Send file size
-    string sizeStr = to_string(fileSize) + "\n";
-    send(clientSock, sizeStr.c_str(), sizeStr.size(), 0);
+    // Compress the assembled upload a batch of frames at a time
+    fs::path installPath = stagingPath;
+    if (storeCodec != Codec::None) {
+        installPath = getTempPath(stagingPath);
+        int outFd = open(installPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        bool written = outFd != -1 && beginFramedFile(outFd, storeCodec, meta);
+        OpenObject staged{fd, meta};
+        staged.meta.frameOffsets.clear();
+        vector<char> batch(FRAME_RAW_SIZE * FRAME_BATCH);
+        for (long long offset = 0; written && offset < size; offset += batch.size()) {
+            long long chunk = min((long long)batch.size(), size - offset);
+            written = readObjectRange(staged, offset, chunk, batch.data()) &&
+                      appendFrames(outFd, encodeFrames(storeCodec, batch.data(), chunk), meta);
+        }
+        if (outFd != -1) {
+            written = written && fdatasync(outFd) == 0;
+            close(outFd);
+        }
+        if (!written) {
+            close(fd);
+            error_code ec;
+            fs::remove(installPath, ec);
+            sendError(clientSock, "ERROR: Cannot create file\n");
+            return;
+        }
+        error_code ec;
+        fs::remove(stagingPath, ec);
+    }
+    close(fd);
     
-    // Send checksum
-    string checksumStr = to_string(checksum) + "\n";
-    send(clientSock, checksumStr.c_str(), checksumStr.size(), 0);
+    if (!installObject(installPath, dfsPath, meta, replaceVersion)) {
+        sendError(clientSock, replaceVersion > 0 ? "ERROR: Stale version\n" : "ERROR: Cannot create file\n");
+        return;
+    }
     
-    // Send file data
-    int totalSent = 0;
-    while (totalSent < fileSize) {
-        int sent = send(clientSock, fileData + totalSent, fileSize - totalSent, 0);
-        if (sent <= 0) {
-            delete[] fileData;
+    send(clientSock, "OK\n", 3, 0);
+    cout << (replaceVersion > 0 ? "Repaired file: " : "Committed multipart file: ") << dfsPath << " (" << size << " bytes)\n";
+}
+
+// Handle DELETE command: drop a replica the coordinator has moved to
+// another node. With onlyVersion > 0 only that version is removed, so a
+// newer copy written since is kept.
+void handleDelete(int clientSock, const string& dfsPath, int onlyVersion) {
+    fs::path filePath = getFilePath(dfsPath);
+    {
+        lock_guard<mutex> lock(blockMutex);
+        ObjectMeta current;
+        if (onlyVersion > 0 && (!readObjectMeta(dfsPath, current) || current.version != onlyVersion)) {
+            sendError(clientSock, "ERROR: Stale version\n");
             return;
         }
-        totalSent += sent;
+        long long oldSize;
+        vector<BlockRef> oldBlocks;
+        vector<string> replaced;
+        if (readManifest(filePath, oldSize, oldBlocks)) {
+            for (const BlockRef& block : oldBlocks) {
+                replaced.push_back(block.hash);
+            }
+        }
+        
+        // Data first: a record without data reads as a missing file
+        error_code ec;
+        if (!fs::remove(filePath, ec)) {
+            sendError(clientSock, "ERROR: File not found\n");
+            return;
+        }
+        fs::remove(getMetaPath(dfsPath), ec);
+        releaseBlocks(replaced);
+    }
+    objectCache->invalidate(dfsPath);
+    
+    send(clientSock, "OK\n", 3, 0);
+    cout << "Deleted file: " << dfsPath << "\n";
+}
+
+// Handle ABORT command: discard a multipart upload's staged data
+void handleAbort(int clientSock, const string& uploadId) {
+    if (validUploadId(uploadId)) {
+        error_code ec;
+        fs::remove(getStagingPath(uploadId), ec);
+    }
+    send(clientSock, "OK\n", 3, 0);
+}
+
+// Handle HAVEBLOCKS command: answer "HAVE <flags>" with one 1/0 per entry of
+// the block list that follows, saying whether that block is stored here
+void handleHaveBlocks(int clientSock, long long listSize, Codec codec) {
+    if (listSize <= 0 || listSize > MAX_DEDUP_BLOCKS * 96) {
+        sendError(clientSock, "ERROR: Invalid block list\n");
+        return;
+    }
+    string list(listSize, '\0');
+    if (!recvPayload(clientSock, codec, &list[0], listSize)) {
+        sendError(clientSock, "ERROR: Failed to receive block list\n");
+        return;
+    }
+    requestTally().bytesIn = listSize;
+    
+    string reply = "HAVE ";
+    istringstream in(list);
+    BlockRef block;
+    while (in >> block.hash >> block.checksum) {
+        reply += (validBlockHash(block.hash) && blockPresent(block.hash)) ? '1' : '0';
+    }
+    reply += "\n";
+    send(clientSock, reply.c_str(), reply.size(), 0);
+}
+
+// Handle PUTBLOCK command: store one deduplicated block under its hash,
+// after checking the data really hashes to it. A block that is already
+// stored is left alone.
+void handlePutBlock(int clientSock, const string& hash, long long blockSize, Codec codec) {
+    if (!validBlockHash(hash) || blockSize <= 0 || blockSize > DEDUP_BLOCK_SIZE) {
+        sendError(clientSock, "ERROR: Invalid block\n");
+        return;
+    }
+    
+    vector<char> data(blockSize);
+    if (!recvPayload(clientSock, codec, data.data(), blockSize)) {
+        sendError(clientSock, "ERROR: Failed to receive block\n");
+        return;
+    }
+    requestTally().bytesIn = blockSize;
+    if (Sha256::hash(data.data(), blockSize) != hash) {
+        sendError(clientSock, "ERROR: Block hash mismatch\n");
+        return;
     }
     
-    delete[] fileData;
-    cout << "Sent file: " << dfsPath << " (" << fileSize << " bytes)\n";
+    // The sums go in first: a block file without them does not count as stored
+    fs::path blockPath = getBlockPath(hash);
+    if (!blockPresent(hash)) {
+        fs::create_directories(blockPath.parent_path());
+        fs::path sumsTmp = getTempPath(getBlockSumsPath(hash));
+        fs::path blockTmp = getTempPath(blockPath);
+        bool written;
+        {
+            ofstream sumsFile(sumsTmp);
+            for (long long offset = 0; offset < blockSize; offset += CHECKSUM_BLOCK_SIZE) {
+                sumsFile << calculateChecksum(data.data() + offset, (int)min((long long)CHECKSUM_BLOCK_SIZE, blockSize - offset)) << " ";
+            }
+            written = (bool)sumsFile;
+        }
+        int fd = open(blockTmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        written = written && fd != -1 && writeAll(fd, data.data(), blockSize);
+        if (fd != -1) {
+            close(fd);
+        }
+        error_code ec;
+        if (written) {
+            fs::rename(sumsTmp, getBlockSumsPath(hash), ec);
+        }
+        if (written && !ec) {
+            fs::rename(blockTmp, blockPath, ec);
+        }
+        if (!written || ec) {
+            fs::remove(sumsTmp, ec);
+            fs::remove(blockTmp, ec);
+            sendError(clientSock, "ERROR: Cannot store block\n");
+            return;
+        }
+    }
+    
+    send(clientSock, "OK\n", 3, 0);
+}
+
+// Handle STOREMANIFEST command: publish a deduplicated object whose blocks
+// are all stored here. The checksum is verified from the blocks' recorded
+// piece sums, so committing a file whose blocks were deduplicated reads none
+// of their data.
+void handleStoreManifest(int clientSock, const string& dfsPath, long long size, unsigned long expectedChecksum, int version, long long listSize, Codec codec) {
+    if (size <= 0 || listSize <= 0 || listSize > MAX_DEDUP_BLOCKS * 96) {
+        sendError(clientSock, "ERROR: Invalid block list\n");
+        return;
+    }
+    string list(listSize, '\0');
+    if (!recvPayload(clientSock, codec, &list[0], listSize)) {
+        sendError(clientSock, "ERROR: Failed to receive block list\n");
+        return;
+    }
+    requestTally().bytesIn = listSize;
+    vector<BlockRef> blocks;
+    if (!parseBlockList(list, size, blocks)) {
+        sendError(clientSock, "ERROR: Invalid block list\n");
+        return;
+    }
+    
+    // Blocks HAVEBLOCKS reported may have been deleted since (their last
+    // file removed); naming them lets the coordinator have them sent again
+    ObjectMeta meta;
+    meta.version = version;
+    if (!manifestMeta(size, blocks, meta)) {
+        string missing = missingBlocksError(blocks);
+        sendError(clientSock, missing.empty() ? "ERROR: Cannot read block checksums\n" : missing);
+        return;
+    }
+    if (meta.checksum != expectedChecksum) {
+        sendError(clientSock, "ERROR: Checksum mismatch\n");
+        return;
+    }
+    
+    string manifest = manifestText(size, blocks);
+    meta.storedSize = manifest.size();
+    fs::path filePath = getFilePath(dfsPath);
+    fs::create_directories(filePath.parent_path());
+    fs::path tmpPath = getTempPath(filePath);
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool written = fd != -1 && writeAll(fd, manifest.data(), manifest.size());
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!written || !installObject(tmpPath, dfsPath, meta)) {
+        error_code ec;
+        fs::remove(tmpPath, ec);
+        string missing = missingBlocksError(blocks);
+        sendError(clientSock, missing.empty() ? "ERROR: Cannot create file\n" : missing);
+        return;
+    }
+    
+    send(clientSock, "OK\n", 3, 0);
+    cout << "Stored deduplicated file: " << dfsPath << " (" << size << " bytes, " << blocks.size() << " blocks)\n";
+}
+
+// Handle SIGNATURE command: describe the stored version of an object by its
+// content-defined chunks, as "SIG <version> <size> <signatureSize>" followed
+// by the signature, so a client can send a delta against it
+void handleSignature(int clientSock, const string& dfsPath) {
+    OpenObject opened;
+    string error;
+    if (!openObject(dfsPath, opened, error)) {
+        sendError(clientSock, error);
+        return;
+    }
+    vector<ChunkSig> chunks;
+    bool ok = chunkFile(opened.meta.size, [&](long long offset, long long length, char* out) {
+        return readObjectRange(opened, offset, length, out);
+    }, chunks);
+    close(opened.fd);
+    if (!ok) {
+        sendError(clientSock, "ERROR: Cannot read file\n");
+        return;
+    }
+    
+    string signature = formatSignature(chunks);
+    string header = "SIG " + to_string(opened.meta.version) + " " + to_string(opened.meta.size) + " " +
+                    to_string(signature.size()) + "\n";
+    if (sendAll(clientSock, header.data(), header.size()) && sendAll(clientSock, signature.data(), signature.size())) {
+        requestTally().bytesOut = signature.size();
+    } else {
+        requestTally().failed = true;
+    }
+}
+
+// Handle RANGESUM command: "SUM <checksum>" of [offset, offset + length) of
+// the object, from the stored block checksums like a ranged GET's, without
+// sending the data. A coordinator relaying a large range in windows needs
+// the whole range's checksum before the first window goes out.
+void handleRangeSum(int clientSock, const string& dfsPath, long long offset, long long length, int expectedVersion) {
+    OpenObject opened;
+    string error;
+    if (!openObject(dfsPath, opened, error)) {
+        sendError(clientSock, error);
+        return;
+    }
+    const ObjectMeta& meta = opened.meta;
+    if (expectedVersion > 0 && meta.version != expectedVersion) {
+        close(opened.fd);
+        sendError(clientSock, "ERROR: Stale version " + to_string(meta.version) + "\n");
+        return;
+    }
+    if (offset < 0 || length <= 0 || offset > meta.size || length > meta.size - offset) {
+        close(opened.fd);
+        sendError(clientSock, "ERROR: Invalid range\n");
+        return;
+    }
+    
+    bool readable = true;
+    unsigned long checksum = rangeChecksum(meta, offset, length, [&](long long edgeOffset, long long edgeLength) {
+        vector<char> edge(edgeLength);
+        if (!readObjectRange(opened, edgeOffset, edgeLength, edge.data())) {
+            readable = false;
+            return 0UL;
+        }
+        return calculateChecksum(edge.data(), (int)edgeLength);
+    });
+    close(opened.fd);
+    if (!readable) {
+        sendError(clientSock, "ERROR: Cannot read file\n");
+        return;
+    }
+    string reply = "SUM " + to_string(checksum) + "\n";
+    send(clientSock, reply.c_str(), reply.size(), 0);
+}
+
+// Handle PATCH command: rebuild an object from the version this node holds
+// and a delta of copy and literal instructions (see delta.h), then publish
+// it like a STORE. Only the delta crossed the network; the copied ranges are
+// read from the local copy, so the result is checked against the checksum
+// of the whole new version before it replaces the old one.
+void handlePatch(int clientSock, const string& dfsPath, int baseVersion, long long size, unsigned long expectedChecksum, int version, long long deltaSize, Codec codec) {
+    if (size <= 0 || deltaSize <= 0) {
+        sendError(clientSock, "ERROR: Invalid delta\n");
+        return;
+    }
+    // The size comes off the request line; the pool's cap bounds it
+    PooledBuffer delta = bufferPool().acquire((size_t)deltaSize);
+    if (!delta) {
+        sendError(clientSock, "ERROR: Server busy\n");
+        return;
+    }
+    if (!recvPayload(clientSock, codec, delta.data(), deltaSize)) {
+        sendError(clientSock, "ERROR: Failed to receive delta\n");
+        return;
+    }
+    requestTally().bytesIn = deltaSize;
+    
+    OpenObject base;
+    string error;
+    if (!openObject(dfsPath, base, error)) {
+        sendError(clientSock, error);
+        return;
+    }
+    if (base.meta.version != baseVersion) {
+        close(base.fd);
+        sendError(clientSock, "ERROR: Base version mismatch\n");
+        return;
+    }
+    
+    fs::path filePath = getFilePath(dfsPath);
+    fs::path tmpPath = getTempPath(filePath);
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        close(base.fd);
+        sendError(clientSock, "ERROR: Cannot create file\n");
+        return;
+    }
+    
+    // The new version is written a batch at a time, in whole checksum
+    // blocks so block sums (and frames, when compressing) line up
+    ObjectMeta meta;
+    meta.size = size;
+    meta.version = version;
+    meta.checksum = 0;
+    bool written = storeCodec == Codec::None || beginFramedFile(fd, storeCodec, meta);
+    vector<char> pending;
+    long long produced = 0;
+    auto flush = [&](bool last) {
+        size_t ready = last ? pending.size() : pending.size() / CHECKSUM_BLOCK_SIZE * CHECKSUM_BLOCK_SIZE;
+        for (size_t offset = 0; offset < ready; offset += CHECKSUM_BLOCK_SIZE) {
+            unsigned long blockSum = calculateChecksum(pending.data() + offset, (int)min((size_t)CHECKSUM_BLOCK_SIZE, ready - offset));
+            meta.blockSums.push_back(blockSum);
+            meta.checksum += blockSum;
+        }
+        if (storeCodec == Codec::None) {
+            written = written && writeAll(fd, pending.data(), ready);
+        } else {
+            written = written && appendFrames(fd, encodeFrames(storeCodec, pending.data(), ready), meta);
+        }
+        pending.erase(pending.begin(), pending.begin() + ready);
+    };
+    auto emit = [&](const char* data, long long length) {
+        pending.insert(pending.end(), data, data + length);
+        produced += length;
+        if (pending.size() >= FRAME_RAW_SIZE * FRAME_BATCH) {
+            flush(false);
+        }
+    };
+    
+    size_t pos = 0;
+    vector<char> copy(FRAME_RAW_SIZE * FRAME_BATCH);
+    while (written && pos < delta.size()) {
+        size_t newline = string(delta.data() + pos, min(delta.size() - pos, (size_t)64)).find('\n');
+        if (newline == string::npos) {
+            written = false;
+            break;
+        }
+        stringstream instruction(string(delta.data() + pos, newline));
+        pos += newline + 1;
+        char op = 0;
+        long long offset = 0, length = 0;
+        instruction >> op;
+        if (op == 'C' && instruction >> offset >> length && offset >= 0 && length > 0 &&
+            length <= base.meta.size - offset && length <= size - produced) {
+            for (long long done = 0; written && done < length; done += copy.size()) {
+                long long piece = min((long long)copy.size(), length - done);
+                written = readObjectRange(base, offset + done, piece, copy.data());
+                if (written) {
+                    emit(copy.data(), piece);
+                }
+            }
+        } else if (op == 'L' && instruction >> length && length > 0 && length <= (long long)(delta.size() - pos) &&
+                   length <= size - produced) {
+            emit(delta.data() + pos, length);
+            pos += length;
+        } else {
+            written = false;
+        }
+    }
+    close(base.fd);
+    if (written && produced == size) {
+        flush(true);
+    }
+    close(fd);
+    
+    if (!written || produced != size || meta.checksum != expectedChecksum) {
+        error_code ec;
+        fs::remove(tmpPath, ec);
+        sendError(clientSock, (!written || produced != size) ? "ERROR: Invalid delta\n" : "ERROR: Checksum mismatch\n");
+        return;
+    }
+    if (!installObject(tmpPath, dfsPath, meta)) {
+        error_code ec;
+        fs::remove(tmpPath, ec);
+        sendError(clientSock, "ERROR: Cannot create file\n");
+        return;
+    }
+    
+    send(clientSock, "OK\n", 3, 0);
+    cout << "Patched file: " << dfsPath << " (" << size << " bytes from a " << deltaSize << " byte delta)\n";
+}
+
+const long long SCRUB_CHUNK_SIZE = 16 * CHECKSUM_BLOCK_SIZE; // bytes read and checked at a time
+
+// Read an object back from disk and check every block against the checksums
+// recorded when it was stored. The data file is opened directly rather than
+// through openObject, which would rebuild a record that does not match and
+// so hide the damage. Reads are paced by scrubLimiter and dropped from the
+// page cache behind them, so a pass neither crowds out requests nor evicts
+// their data. Returns false when the object is damaged, with the version
+// that was checked; an object that is replaced while it is read counts as
+// intact, since the new copy was verified when it was written.
+bool scrubObject(const string& dfsPath, int& version) {
+    fs::path filePath = getFilePath(dfsPath);
+    int fd = open(filePath.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return true;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    OpenObject object{fd, ObjectMeta()};
+    if (!readObjectMeta(dfsPath, object.meta) || object.meta.blockSums.empty()) {
+        // No checksums to compare against; openObject rebuilds the record
+        close(fd);
+        return true;
+    }
+    
+    bool intact = object.meta.bytesOnDisk() == st.st_size;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    vector<char> chunk(SCRUB_CHUNK_SIZE);
+    vector<unsigned long> sums;
+    for (long long offset = 0; intact && offset < object.meta.size; offset += SCRUB_CHUNK_SIZE) {
+        long long length = min(SCRUB_CHUNK_SIZE, object.meta.size - offset);
+        scrubLimiter.acquire(length);
+        sums.clear();
+        intact = readObjectRange(object, offset, length, chunk.data());
+        if (intact) {
+            blockByteSums(chunk.data(), length, CHECKSUM_BLOCK_SIZE, sums);
+            intact = equal(sums.begin(), sums.end(), object.meta.blockSums.begin() + offset / CHECKSUM_BLOCK_SIZE);
+        }
+        if (!object.meta.framed() && !object.meta.deduplicated()) {
+            posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+        }
+        scrubBytes += length;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+    version = object.meta.version;
+    if (intact) {
+        return true;
+    }
+    
+    // Rule out an overwrite in the middle of the read: the damaged file must
+    // still be in place under the same record
+    struct stat now;
+    ObjectMeta current;
+    return stat(filePath.c_str(), &now) != 0 || now.st_ino != st.st_ino ||
+           !readObjectMeta(dfsPath, current) || current.version != version;
+}
+
+// Report a damaged copy to the coordinator that owns the file, which
+// rewrites it from the other replica. Paths are stored without a leading
+// '/', which clients usually give, so that form is tried first.
+bool reportCorrupt(const string& storedPath, int version) {
+    for (const string& dfsPath : {"/" + storedPath, storedPath}) {
+        string report = "CORRUPT " + to_string(nodeId) + " " + dfsPath + " " + to_string(version) + "\n";
+        if (requestCoordinatorLine("127.0.0.1", partitions.portFor(dfsPath), report).find("OK") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Whether a metadata file name is a record still being written (getTempPath)
+bool isTempName(const string& name) {
+    size_t pos = name.rfind(".tmp");
+    return pos != string::npos && pos + 4 < name.size() &&
+           all_of(name.begin() + pos + 4, name.end(), [](char c) { return isdigit((unsigned char)c); });
+}
+
+// Scrubber thread: verify every object with a metadata record, in path
+// order, then rest for scrubIntervalSec
+void scrubLoop() {
+    fs::path metaRoot = fs::path(storageFolder) / ".meta";
+    while (true) {
+        vector<string> paths;
+        error_code ec;
+        for (fs::recursive_directory_iterator it(metaRoot, ec), end; !ec && it != end; it.increment(ec)) {
+            if (it->is_regular_file(ec) && !isTempName(it->path().filename().string())) {
+                paths.push_back(it->path().lexically_relative(metaRoot).string());
+            }
+        }
+        sort(paths.begin(), paths.end());
+        
+        long long corrupt = 0;
+        for (const string& path : paths) {
+            int version = 0;
+            scrubObjects++;
+            if (!scrubObject(path, version)) {
+                corrupt++;
+                scrubCorrupt++;
+                bool reported = reportCorrupt(path, version);
+                cerr << "Scrub: " << path << " (version " << version << ") is corrupt"
+                     << (reported ? ", repair requested\n" : ", coordinator does not know it\n");
+            }
+        }
+        scrubPasses++;
+        cout << "Scrub pass: " << paths.size() << " objects, " << corrupt << " corrupt\n";
+        this_thread::sleep_for(chrono::seconds(scrubIntervalSec));
+    }
+}
+
+// Stats line: the scrubber's progress
+string scrubLine() {
+    return "scrub rate_mbps=" + to_string((long long)(scrubLimiter.bytesPerSecond() / (1024 * 1024))) +
+           " passes=" + to_string(scrubPasses.load()) + " objects=" + to_string(scrubObjects.load()) +
+           " bytes=" + to_string(scrubBytes.load()) + " corrupt=" + to_string(scrubCorrupt.load()) + "\n";
+}
+
+// Request statistics plus the object cache and storage, for a Prometheus scraper
+string prometheusStats() {
+    string out = requestStats.prometheus("dfs_node_");
+    prometheusMetric(out, "dfs_node_cache_hits_total", "counter", "Object cache hits.", objectCache->hits.load());
+    prometheusMetric(out, "dfs_node_cache_misses_total", "counter", "Object cache misses.", objectCache->misses.load());
+    prometheusMetric(out, "dfs_node_cache_evictions_total", "counter", "Objects evicted from the cache.", objectCache->evictions.load());
+    bufferPool().prometheus(out, "dfs_node_");
+    prometheusMetric(out, "dfs_node_scrub_passes_total", "counter", "Completed scrub passes.", scrubPasses.load());
+    prometheusMetric(out, "dfs_node_scrub_objects_total", "counter", "Objects verified by the scrubber.", scrubObjects.load());
+    prometheusMetric(out, "dfs_node_scrub_bytes_total", "counter", "Bytes read back by the scrubber.", scrubBytes.load());
+    prometheusMetric(out, "dfs_node_scrub_corrupt_total", "counter", "Objects the scrubber found damaged.", scrubCorrupt.load());
+    {
+        lock_guard<mutex> lock(blockMutex);
+        prometheusMetric(out, "dfs_node_dedup_blocks", "gauge", "Deduplicated blocks stored.", blockRefs.size());
+    }
+    return out;
+}
+
+// Commands that name a DFS path, and which token of the line holds it
+const map<string, int> PATH_ARGUMENTS = {{"STORE", 1}, {"GET", 1}, {"COMMIT", 2}, {"PULLPART", 3},
+                                         {"DELETE", 1}, {"STOREMANIFEST", 1}, {"SIGNATURE", 1}, {"PATCH", 1},
+                                         {"RANGESUM", 1}};
+
+// Whether a request's path, if it names one, is one validPath accepts
+bool pathAllowed(const string& command, const string& cmd) {
+    auto it = PATH_ARGUMENTS.find(command);
+    if (it == PATH_ARGUMENTS.end()) {
+        return true;
+    }
+    stringstream ss(cmd);
+    string token;
+    for (int i = 0; i <= it->second; i++) {
+        ss >> token;
+    }
+    return ss && validPath(token);
+}
+
+// Serve one request line. Returns true when the connection may carry the
+// next request: only GET replies are self-delimiting (a header with the
+// length, then exactly that many bytes), so only GET honours KEEPALIVE=1.
+bool serveRequest(int client, const string& cmd) {
+    stringstream ss(cmd);
+    string command;
+    ss >> command;
+    
+    // Time and count the request under its command, and trace it when the
+    // line carries a TRACE= token
+    auto start = chrono::steady_clock::now();
+    OpStats& op = requestStats.op(command);
+    requestTally() = RequestTally();
+    currentTrace() = parseTraceToken(cmd);
+    TraceSpan requestSpan(op.name.c_str());
+    
+    if (!pathAllowed(command, cmd)) {
+        sendError(client, "ERROR: Invalid path\n");
+    }
+    else if (command == "STORE") {
+        // STORE <path> <size> <checksum> [<version>] [CODEC=<codec>]
+        string dfsPath;
+        int fileSize = 0;
+        unsigned long checksum = 0;
+        int version = 0;
+        ss >> dfsPath >> fileSize >> checksum >> version;
+        handleStore(client, dfsPath, fileSize, checksum, version, parseCodecReply(cmd));
+    }
+    else if (command == "GET") {
+        // GET <path> [<offset> <length>] [CODECS=<codec>,...] [VERSION=<version>]
+        string dfsPath, version;
+        long long offset = 0;
+        long long length = -1;
+        int expectedVersion = findToken(cmd, "VERSION", version) ? atoi(version.c_str()) : 0;
+        ss >> dfsPath;
+        if (!(ss >> offset >> length)) {
+            offset = 0;
+            length = -1;
+            handleGet(client, dfsPath, offset, length, parseCodecOffer(cmd), expectedVersion);
+        } else if (length < 0) {
+            sendError(client, "ERROR: Invalid range\n");
+        } else {
+            handleGet(client, dfsPath, offset, length, parseCodecOffer(cmd), expectedVersion);
+        }
+    }
+    else if (command == "PUTPART") {
+        // PUTPART <uploadId> <offset> <size> <checksum> [CODEC=<codec>]
+        string uploadId;
+        long long offset = -1;
+        int partSize = 0;
+        unsigned long checksum = 0;
+        ss >> uploadId >> offset >> partSize >> checksum;
+        handlePutPart(client, uploadId, offset, partSize, checksum, parseCodecReply(cmd));
+    }
+    else if (command == "COMMIT") {
+        // COMMIT <uploadId> <dfsPath> <size> <checksum> <version> [IFVERSION=<version>]
+        string uploadId, dfsPath, replace;
+        long long size = -1;
+        unsigned long checksum = 0;
+        int version = 0;
+        ss >> uploadId >> dfsPath >> size >> checksum >> version;
+        int replaceVersion = findToken(cmd, "IFVERSION", replace) ? atoi(replace.c_str()) : 0;
+        handleCommit(client, uploadId, dfsPath, size, checksum, version, replaceVersion);
+    }
+    else if (command == "PULLPART") {
+        // PULLPART <uploadId> <srcNode> <dfsPath> <version> <offset> <size>
+        string uploadId, dfsPath;
+        int srcNode = 0, version = 0, partSize = 0;
+        long long offset = -1;
+        ss >> uploadId >> srcNode >> dfsPath >> version >> offset >> partSize;
+        handlePullPart(client, uploadId, srcNode, dfsPath, version, offset, partSize);
+    }
+    else if (command == "DELETE") {
+        // DELETE <dfsPath> [IFVERSION=<version>]
+        string dfsPath, only;
+        ss >> dfsPath;
+        handleDelete(client, dfsPath, findToken(cmd, "IFVERSION", only) ? atoi(only.c_str()) : 0);
+    }
+    else if (command == "ABORT") {
+        string uploadId;
+        ss >> uploadId;
+        handleAbort(client, uploadId);
+    }
+    else if (command == "HAVEBLOCKS") {
+        // HAVEBLOCKS <listSize> [CODEC=<codec>], then the block list
+        long long listSize = 0;
+        ss >> listSize;
+        handleHaveBlocks(client, listSize, parseCodecReply(cmd));
+    }
+    else if (command == "PUTBLOCK") {
+        // PUTBLOCK <hash> <size> [CODEC=<codec>], then the block data
+        string hash;
+        long long blockSize = 0;
+        ss >> hash >> blockSize;
+        handlePutBlock(client, hash, blockSize, parseCodecReply(cmd));
+    }
+    else if (command == "STOREMANIFEST") {
+        // STOREMANIFEST <path> <size> <checksum> <version> <listSize> [CODEC=<codec>], then the block list
+        string dfsPath;
+        long long size = 0, listSize = 0;
+        unsigned long checksum = 0;
+        int version = 0;
+        ss >> dfsPath >> size >> checksum >> version >> listSize;
+        handleStoreManifest(client, dfsPath, size, checksum, version, listSize, parseCodecReply(cmd));
+    }
+    else if (command == "SIGNATURE") {
+        string dfsPath;
+        ss >> dfsPath;
+        handleSignature(client, dfsPath);
+    }
+    else if (command == "RANGESUM") {
+        // RANGESUM <path> <offset> <length> [VERSION=<version>]
+        string dfsPath, version;
+        long long offset = -1, length = 0;
+        ss >> dfsPath >> offset >> length;
+        handleRangeSum(client, dfsPath, offset, length, findToken(cmd, "VERSION", version) ? atoi(version.c_str()) : 0);
+    }
+    else if (command == "PATCH") {
+        // PATCH <path> <baseVersion> <size> <checksum> <version> <deltaSize> [CODEC=<codec>], then the delta
+        string dfsPath;
+        int baseVersion = 0, version = 0;
+        long long size = 0, deltaSize = 0;
+        unsigned long checksum = 0;
+        ss >> dfsPath >> baseVersion >> size >> checksum >> version >> deltaSize;
+        handlePatch(client, dfsPath, baseVersion, size, checksum, version, deltaSize, parseCodecReply(cmd));
+    }
+    else if (command == "CACHESTATS") {
+        string stats = objectCache->statsLine();
+        send(client, stats.c_str(), stats.size(), 0);
+    }
+    else if (command == "TRACE") {
+        // TRACE <id>: this node's spans of one trace as Chrome trace events
+        string id;
+        ss >> id;
+        string events = chromeTraceEvents(parseTraceToken("TRACE=" + id), "node " + to_string(nodeId));
+        sendAll(client, events.data(), events.size());
+    }
+    else if (command == "STATS") {
+        // STATS [prometheus]
+        string format;
+        ss >> format;
+        string stats = (format == "prometheus") ? prometheusStats()
+                                                : requestStats.text() + "cache " + objectCache->statsLine() + "buffers " + bufferPool().statsLine() + scrubLine();
+        sendAll(client, stats.data(), stats.size());
+    }
+    else {
+        sendError(client, "ERROR: Unknown command\n");
+    }
+    
+    requestSpan.end();
+    requestStats.record(op, start, requestTally());
+    return command == "GET" && keepAliveRequested(cmd) && !requestTally().failed;
+}
+
+// Serve one connection; each runs on its own thread
+void handleClient(int client) {
+    string cmd = recvLine(client);
+    while (!cmd.empty() && serveRequest(client, cmd) && waitReadable(client, KEEPALIVE_IDLE_MS)) {
+        cmd = recvLine(client);
+    }
+    close(client);
 }
 
 int main(int argc, char* argv[]) {
+    // Clients read from nodes directly; one that disconnects mid-download
+    // must not take the node down
+    signal(SIGPIPE, SIG_IGN);
+    
     if (argc < 2) {
-        cerr << "Usage: ./node <nodeId>\n";
+        cerr << "Usage: ./node <nodeId> [--cache-mb <megabytes>] [--buffer-mb <megabytes>] [--compress <lz4|zstd|none>]\n"
+             << "              [--scrub-mbps <megabytes per second>] [--scrub-interval <seconds>]\n";
         return 1;
     }
     
@@ -165,16 +2025,66 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
+    // Hot-object cache budget (0 disables caching)
+    long cacheMb = 64;
+    for (int i = 2; i + 1 < argc; i++) {
+        if (string(argv[i]) == "--cache-mb") {
+            cacheMb = atol(argv[++i]);
+        }
+        else if (string(argv[i]) == "--buffer-mb") {
+            // Cap on payload buffers held by requests at once
+            long bufferMb = atol(argv[++i]);
+            if (bufferMb <= 0) {
+                cerr << "Invalid buffer size\n";
+                return 1;
+            }
+            bufferPool().setCapacity((size_t)bufferMb * 1024 * 1024);
+        }
+        else if (string(argv[i]) == "--compress") {
+            // Compression at rest for objects stored from now on
+            string codec = argv[++i];
+            if (!parseCodec(codec, storeCodec) || !codecAvailable(storeCodec)) {
+                cerr << "Codec not available in this build: " << codec << "\n";
+                return 1;
+            }
+        }
+        else if (string(argv[i]) == "--scrub-mbps") {
+            // Disk bandwidth the background scrubber may use
+            double mbps = atof(argv[++i]);
+            if (mbps < 0) {
+                cerr << "Invalid scrub rate\n";
+                return 1;
+            }
+            scrubLimiter.setRate(mbps * 1024 * 1024);
+        }
+        else if (string(argv[i]) == "--scrub-interval") {
+            scrubIntervalSec = atoi(argv[++i]);
+            if (scrubIntervalSec <= 0) {
+                cerr << "Invalid scrub interval\n";
+                return 1;
+            }
+        }
+    }
+    if (cacheMb < 0) {
+        cerr << "Invalid cache size\n";
+        return 1;
+    }
+    objectCache = new ObjectCache((size_t)cacheMb * 1024 * 1024);
+    
     storageFolder = "storage/node" + to_string(nodeId);
     fs::create_directories(storageFolder);
+    loadBlockRefs();
     
-    // Register with coordinator
-    if (!registerWithCoordinator()) {
-        cerr << "Failed to register with coordinator\n";
-        return 1;
+    // Register with every coordinator: each partition places its own files
+    partitions = requestPartitionMap("127.0.0.1", COORDINATOR_PORT);
+    for (int port : partitions.ports) {
+        if (!registerWithCoordinator(port)) {
+            cerr << "Failed to register with coordinator on port " << port << "\n";
+            return 1;
+        }
     }
     
-    cout << "Node " << nodeId << " registered with coordinator\n";
+    cout << "Node " << nodeId << " registered with " << (partitions.count() > 1 ? to_string(partitions.count()) + " coordinators" : "coordinator") << "\n";
     
     // Create server socket
     int server = socket(AF_INET, SOCK_STREAM, 0);
@@ -198,7 +2108,7 @@ int main(int argc, char* argv[]) {
         return 1;
     }
     
-    if (listen(server, 5) != 0) {
+    if (listen(server, SOMAXCONN) != 0) {
         cerr << "Listen failed\n";
         close(server);
         return 1;
@@ -206,6 +2116,11 @@ int main(int argc, char* argv[]) {
     
     cout << "Node " << nodeId << " running on port " << (NODE_BASE_PORT + nodeId) << "...\n";
     cout << "Storage folder: " << storageFolder << "\n";
+    cout << "Object cache: " << cacheMb << " MB\n";
+    if (scrubLimiter.bytesPerSecond() > 0) {
+        cout << "Scrubbing at " << scrubLimiter.bytesPerSecond() / (1024 * 1024) << " MB/s every " << scrubIntervalSec << " s\n";
+        thread(scrubLoop).detach();
+    }
     
     while (true) {
         sockaddr_in clientAddr;
@@ -215,35 +2130,7 @@ int main(int argc, char* argv[]) {
             continue;
         }
         
-        char buffer[1024] = {0};
-        int received = recv(client, buffer, sizeof(buffer) - 1, 0);
-        if (received <= 0) {
-            close(client);
-            continue;
-        }
-        
-        string cmd(buffer);
-        stringstream ss(cmd);
-        string command;
-        ss >> command;
-        
-        if (command == "STORE") {
-            string dfsPath;
-            int fileSize;
-            unsigned long checksum;
-            ss >> dfsPath >> fileSize >> checksum;
-            handleStore(client, dfsPath, fileSize, checksum);
-        }
-        else if (command == "GET") {
-            string dfsPath;
-            ss >> dfsPath;
-            handleGet(client, dfsPath);
-        }
-        else {
-            send(client, "ERROR: Unknown command\n", 24, 0);
-        }
-        
-        close(client);
+        thread(handleClient, client).detach();
     }
     
     close(server);
@@ -0,0 +1,204 @@
+#ifndef DFS_NODE_OBJECT_CACHE_H
+#define DFS_NODE_OBJECT_CACHE_H
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// An object held in memory. Readers share one immutable copy through
+// shared_ptr, so a cached buffer is never copied per request and stays valid
+// for a reader even if the cache evicts it mid-send.
+struct CachedObject {
+    std::vector<char> data;
+    unsigned long checksum;
+    int version;
+    std::vector<unsigned long> blockSums;
+};
+
+using CachedObjectPtr = std::shared_ptr<const CachedObject>;
+
+// Hot-object cache bounded by a hard byte budget, using the 2Q policy
+// (Johnson & Shasha): first-time objects enter a small FIFO (A1in) and are
+// only promoted to the main LRU (Am) if they are requested again after
+// falling out of it, which the ghost list A1out remembers. A one-off scan
+// therefore churns A1in only and cannot flush the hot set out of Am.
+class ObjectCache {
+public:
+    explicit ObjectCache(size_t capacityBytes)
+        : capacity(capacityBytes),
+          a1inLimit(capacityBytes / 4),
+          a1outLimit(capacityBytes / 2),
+          maxObjectBytes(capacityBytes / 4) {}
+    
+    bool enabled() const {
+        return capacity > 0;
+    }
+    
+    // Objects larger than a quarter of the budget would evict too much
+    bool admits(size_t size) const {
+        return enabled() && size <= maxObjectBytes;
+    }
+    
+    CachedObjectPtr get(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(key);
+        if (it == entries.end()) {
+            misses++;
+            return nullptr;
+        }
+        
+        // A1in is FIFO: hits there do not reorder, so a burst of accesses to a
+        // new object does not make it look hot. Am is plain LRU.
+        Entry& entry = it->second;
+        if (entry.inMain) {
+            mainLru.splice(mainLru.begin(), mainLru, entry.pos);
+        }
+        hits++;
+        return entry.object;
+    }
+    
+    // Snapshot of the invalidation epoch, taken before a miss reads from disk.
+    // put() refuses the object if anything was invalidated in between, so a
+    // read racing with a STORE can never reinstall stale data.
+    unsigned long epoch() const {
+        return invalidations.load();
+    }
+    
+    void put(const std::string& key, CachedObjectPtr object, unsigned long readEpoch) {
+        size_t size = object->data.size();
+        if (!admits(size)) {
+            return;
+        }
+        
+        std::lock_guard<std::mutex> lock(mtx);
+        if (invalidations.load() != readEpoch || entries.count(key)) {
+            return;
+        }
+        
+        // Objects seen recently enough to still be in the ghost list are
+        // re-references: admit them straight into Am
+        Entry entry;
+        entry.object = object;
+        auto ghost = ghostIndex.find(key);
+        if (ghost != ghostIndex.end()) {
+            ghostBytes -= ghost->second.size;
+            ghostFifo.erase(ghost->second.pos);
+            ghostIndex.erase(ghost);
+            mainLru.push_front(key);
+            entry.pos = mainLru.begin();
+            entry.inMain = true;
+            mainBytes += size;
+        } else {
+            a1inFifo.push_front(key);
+            entry.pos = a1inFifo.begin();
+            entry.inMain = false;
+            a1inBytes += size;
+        }
+        entries[key] = entry;
+        
+        reclaim();
+    }
+    
+    void invalidate(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mtx);
+        invalidations++;
+        auto it = entries.find(key);
+        if (it != entries.end()) {
+            removeResident(it);
+        }
+        auto ghost = ghostIndex.find(key);
+        if (ghost != ghostIndex.end()) {
+            ghostBytes -= ghost->second.size;
+            ghostFifo.erase(ghost->second.pos);
+            ghostIndex.erase(ghost);
+        }
+    }
+    
+    std::string statsLine() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return "hits=" + std::to_string(hits.load()) +
+               " misses=" + std::to_string(misses.load()) +
+               " evictions=" + std::to_string(evictions.load()) +
+               " entries=" + std::to_string(entries.size()) +
+               " bytes=" + std::to_string(a1inBytes + mainBytes) +
+               " capacity=" + std::to_string(capacity) + "\n";
+    }
+    
+    std::atomic<unsigned long> hits{0};
+    std::atomic<unsigned long> misses{0};
+    std::atomic<unsigned long> evictions{0};
+
+private:
+    struct Entry {
+        CachedObjectPtr object;
+        std::list<std::string>::iterator pos;
+        bool inMain;
+    };
+    
+    struct Ghost {
+        std::list<std::string>::iterator pos;
+        size_t size;
+    };
+    
+    void removeResident(std::unordered_map<std::string, Entry>::iterator it) {
+        size_t size = it->second.object->data.size();
+        if (it->second.inMain) {
+            mainLru.erase(it->second.pos);
+            mainBytes -= size;
+        } else {
+            a1inFifo.erase(it->second.pos);
+            a1inBytes -= size;
+        }
+        entries.erase(it);
+    }
+    
+    // Evict until resident bytes fit the budget. A1in is drained first while
+    // it is over its share; its victims are remembered in A1out (keys only).
+    void reclaim() {
+        while (a1inBytes + mainBytes > capacity) {
+            if (a1inBytes > a1inLimit || mainLru.empty()) {
+                std::string victim = a1inFifo.back();
+                auto it = entries.find(victim);
+                size_t size = it->second.object->data.size();
+                removeResident(it);
+                
+                ghostFifo.push_front(victim);
+                ghostIndex[victim] = Ghost{ghostFifo.begin(), size};
+                ghostBytes += size;
+                while (ghostBytes > a1outLimit && !ghostFifo.empty()) {
+                    auto old = ghostIndex.find(ghostFifo.back());
+                    ghostBytes -= old->second.size;
+                    ghostIndex.erase(old);
+                    ghostFifo.pop_back();
+                }
+            } else {
+                removeResident(entries.find(mainLru.back()));
+            }
+            evictions++;
+        }
+    }
+    
+    std::mutex mtx;
+    size_t capacity;
+    size_t a1inLimit;   // share of the budget for first-time objects
+    size_t a1outLimit;  // bytes of evicted objects the ghost list remembers
+    size_t maxObjectBytes;
+    
+    std::unordered_map<std::string, Entry> entries;
+    std::list<std::string> a1inFifo;  // front = newest
+    std::list<std::string> mainLru;   // front = most recently used
+    size_t a1inBytes = 0;
+    size_t mainBytes = 0;
+    
+    std::unordered_map<std::string, Ghost> ghostIndex;
+    std::list<std::string> ghostFifo;
+    size_t ghostBytes = 0;
+    
+    std::atomic<unsigned long> invalidations{0};
+};
+
+#endif